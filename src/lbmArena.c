@@ -0,0 +1,91 @@
+#include "lbmArena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LBM_ARENA_ALIGN(N) (((N) + 7) & ~(size_t)7)
+#define LBM_ARENA_HEADER LBM_ARENA_ALIGN(sizeof(lbmArenaChunk))
+
+void lbmArenaInit(lbmArena *arena, size_t chunkSize)
+{
+    memset(arena, 0, sizeof(lbmArena));
+    arena->chunkSize = LBM_ARENA_ALIGN(chunkSize);
+}
+
+void lbmArenaFree(lbmArena *arena)
+{
+    lbmArenaChunk *chunk = arena->first;
+    while (chunk)
+    {
+        lbmArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->used = 0;
+    arena->reserved = 0;
+}
+
+void lbmArenaReset(lbmArena *arena)
+{
+    // Later slabs are rewound lazily as lbmArenaAlloc() walks back into them
+    arena->current = arena->first;
+    if (arena->current)
+    {
+        arena->current->used = 0;
+    }
+    arena->used = 0;
+}
+
+void *lbmArenaAlloc(lbmArena *arena, size_t size)
+{
+    lbmArenaChunk *chunk = arena->current;
+    char *p;
+
+    size = LBM_ARENA_ALIGN(size);
+    while (!chunk || (chunk->size - chunk->used < size))
+    {
+        if (chunk && chunk->next)
+        {
+            // Reuse a slab left over from before the last reset
+            chunk = chunk->next;
+            chunk->used = 0;
+        }
+        else
+        {
+            size_t chunkSize = (size > arena->chunkSize) ? size : arena->chunkSize;
+            lbmArenaChunk *fresh = (lbmArenaChunk *)malloc(LBM_ARENA_HEADER + chunkSize);
+            fresh->size = chunkSize;
+            fresh->used = 0;
+            if (chunk)
+            {
+                // Splice in after the current slab so unused ones stay reachable
+                fresh->next = chunk->next;
+                chunk->next = fresh;
+            }
+            else
+            {
+                fresh->next = arena->first;
+                arena->first = fresh;
+            }
+            arena->reserved += chunkSize;
+            chunk = fresh;
+        }
+    }
+
+    arena->current = chunk;
+    p = (char *)chunk + LBM_ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+char *lbmArenaStrdup(lbmArena *arena, const char *s, size_t len)
+{
+    char *p = (char *)lbmArenaAlloc(arena, len + 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    return p;
+}
@@ -0,0 +1,32 @@
+#ifndef LBMARENA_H
+#define LBMARENA_H
+
+#include <stddef.h>
+
+// Bump allocator over a chain of chunked slabs. Individual allocations are
+// never freed; lbmArenaReset() rewinds the whole arena in O(1) and keeps the
+// slabs around for the next round.
+
+typedef struct lbmArenaChunk
+{
+    struct lbmArenaChunk *next;
+    size_t size; // usable bytes following this header
+    size_t used;
+} lbmArenaChunk;
+
+typedef struct lbmArena
+{
+    lbmArenaChunk *first;
+    lbmArenaChunk *current;
+    size_t chunkSize; // default slab size
+    size_t used;      // bytes handed out since the last reset
+    size_t reserved;  // bytes held in slabs
+} lbmArena;
+
+void lbmArenaInit(lbmArena *arena, size_t chunkSize);
+void lbmArenaFree(lbmArena *arena);
+void lbmArenaReset(lbmArena *arena);
+void *lbmArenaAlloc(lbmArena *arena, size_t size); // zeroed
+char *lbmArenaStrdup(lbmArena *arena, const char *s, size_t len); // always NUL terminated
+
+#endif
@@ -0,0 +1,256 @@
+#include "lbmArgs.h"
+
+#include "lua.h"
+#include "lauxlib.h"
+
+static int lbmArgFromIndex(lua_State *L, int index, lbmArg *out)
+{
+    out->index = index;
+    out->s = NULL;
+    out->len = 0;
+
+    switch (lua_type(L, index))
+    {
+        case LUA_TBOOLEAN:
+            out->type = V_BOOL;
+            out->b = lua_toboolean(L, index);
+            break;
+        case LUA_TNUMBER:
+            out->n = lua_tonumber(L, index);
+            out->type = lbmVariantNumberType(out->n, &out->i);
+            break;
+        case LUA_TSTRING:
+            out->type = V_STRING;
+            out->s = lua_tolstring(L, index, &out->len);
+            break;
+        case LUA_TTABLE:
+            out->type = V_TABLE;
+            break;
+        default:
+            out->type = V_NONE;
+            break;
+    };
+    return out->type;
+}
+
+void lbmArgsInit(lbmArgs *args, lua_State *L)
+{
+    args->L = L;
+    args->count = lua_gettop(L);
+}
+
+int lbmArgsGet(lbmArgs *args, int i, lbmArg *out)
+{
+    if ((i < 0) || (i >= args->count))
+    {
+        out->type = V_NONE;
+        out->index = 0;
+        out->s = NULL;
+        out->len = 0;
+        return V_NONE;
+    }
+    return lbmArgFromIndex(args->L, i + 1, out);
+}
+
+// Numbers coerce to strings like lua_tolstring does. That rewrites the stack
+// slot in place, which is safe for arguments and fetched fields but must
+// never happen to a key lua_next still needs.
+static const char *lbmArgCoerceString(lua_State *L, lbmArg *arg, size_t *len)
+{
+    if ((arg->type == V_NUMBER) || (arg->type == V_INTEGER))
+    {
+        arg->s = lua_tolstring(L, arg->index, &arg->len);
+    }
+    if (len)
+    {
+        *len = arg->len;
+    }
+    return arg->s;
+}
+
+const char *lbmArgsString(lbmArgs *args, int i, size_t *len)
+{
+    lbmArg arg;
+    lbmArgsGet(args, i, &arg);
+    return lbmArgCoerceString(args->L, &arg, len);
+}
+
+const char *lbmArgsCheckString(lbmArgs *args, int i, size_t *len)
+{
+    const char *s = lbmArgsString(args, i, len);
+    if (!s)
+    {
+        luaL_argerror(args->L, i + 1, "string expected");
+    }
+    return s;
+}
+
+double lbmArgsNumber(lbmArgs *args, int i, double def)
+{
+    lbmArg arg;
+    lbmArgsGet(args, i, &arg);
+    return lbmArgNumber(&arg, def);
+}
+
+long long lbmArgsInteger(lbmArgs *args, int i, long long def)
+{
+    lbmArg arg;
+    lbmArgsGet(args, i, &arg);
+    return lbmArgInteger(&arg, def);
+}
+
+int lbmArgsBool(lbmArgs *args, int i, int def)
+{
+    lbmArg arg;
+    lbmArgsGet(args, i, &arg);
+    return lbmArgBool(&arg, def);
+}
+
+int lbmArgsField(lbmArgs *args, lbmArg *table, const char *key, lbmArg *out)
+{
+    lua_State *L = args->L;
+    if (table->type != V_TABLE)
+    {
+        out->type = V_NONE;
+        out->index = 0;
+        out->s = NULL;
+        out->len = 0;
+        return V_NONE;
+    }
+
+    luaL_checkstack(L, 1, "too many table fields");
+    lua_getfield(L, table->index, key);
+    return lbmArgFromIndex(L, lua_gettop(L), out);
+}
+
+const char *lbmArgsFieldString(lbmArgs *args, lbmArg *table, const char *key, size_t *len)
+{
+    lbmArg field;
+    lbmArgsField(args, table, key, &field);
+    return lbmArgCoerceString(args->L, &field, len);
+}
+
+double lbmArgsFieldNumber(lbmArgs *args, lbmArg *table, const char *key, double def)
+{
+    lbmArg field;
+    lbmArgsField(args, table, key, &field);
+    return lbmArgNumber(&field, def);
+}
+
+long long lbmArgsFieldInteger(lbmArgs *args, lbmArg *table, const char *key, long long def)
+{
+    lbmArg field;
+    lbmArgsField(args, table, key, &field);
+    return lbmArgInteger(&field, def);
+}
+
+int lbmArgsFieldBool(lbmArgs *args, lbmArg *table, const char *key, int def)
+{
+    lbmArg field;
+    lbmArgsField(args, table, key, &field);
+    return lbmArgBool(&field, def);
+}
+
+int lbmArgsLength(lbmArgs *args, lbmArg *table)
+{
+    if (table->type != V_TABLE)
+    {
+        return 0;
+    }
+    return (int)lua_objlen(args->L, table->index);
+}
+
+int lbmArgsIndex(lbmArgs *args, lbmArg *table, int i, lbmArg *out)
+{
+    lua_State *L = args->L;
+    if (table->type != V_TABLE)
+    {
+        out->type = V_NONE;
+        out->index = 0;
+        out->s = NULL;
+        out->len = 0;
+        return V_NONE;
+    }
+
+    luaL_checkstack(L, 1, "too many table entries");
+    lua_rawgeti(L, table->index, i);
+    return lbmArgFromIndex(L, lua_gettop(L), out);
+}
+
+double lbmArgNumber(lbmArg *arg, double def)
+{
+    switch (arg->type)
+    {
+        case V_NUMBER:
+            return arg->n;
+        case V_INTEGER:
+            return (double)arg->i;
+    };
+    return def;
+}
+
+long long lbmArgInteger(lbmArg *arg, long long def)
+{
+    switch (arg->type)
+    {
+        case V_NUMBER:
+            return lbmVariantNumberFits(arg->n) ? (long long)arg->n : def;
+        case V_INTEGER:
+            return arg->i;
+    };
+    return def;
+}
+
+int lbmArgBool(lbmArg *arg, int def)
+{
+    if (arg->type == V_BOOL)
+    {
+        return arg->b;
+    }
+    return def;
+}
+
+void lbmArgCursorBegin(lbmArgs *args, lbmArg *table, lbmArgCursor *cursor)
+{
+    cursor->L = args->L;
+    cursor->table = (table->type == V_TABLE) ? table->index : 0;
+    cursor->pushed = 0;
+    if (cursor->table)
+    {
+        luaL_checkstack(cursor->L, 2, "table cursor");
+        lua_pushnil(cursor->L); /* first key */
+        cursor->pushed = 1;
+    }
+}
+
+int lbmArgCursorNext(lbmArgCursor *cursor, lbmArg *key, lbmArg *value)
+{
+    lua_State *L = cursor->L;
+    if (!cursor->table || !cursor->pushed)
+    {
+        return 0;
+    }
+
+    // Leave only the previous key on the stack for lua_next
+    lua_pop(L, cursor->pushed - 1);
+    cursor->pushed = 0;
+    if (!lua_next(L, cursor->table))
+    {
+        return 0;
+    }
+    cursor->pushed = 2;
+
+    // Numeric keys come back as V_INTEGER/V_NUMBER views, never formatted
+    lbmArgFromIndex(L, lua_gettop(L) - 1, key);
+    lbmArgFromIndex(L, lua_gettop(L), value);
+    return 1;
+}
+
+void lbmArgCursorEnd(lbmArgCursor *cursor)
+{
+    if (cursor->pushed)
+    {
+        lua_pop(cursor->L, cursor->pushed);
+        cursor->pushed = 0;
+    }
+}
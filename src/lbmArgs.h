@@ -0,0 +1,70 @@
+#ifndef LBMARGS_H
+#define LBMARGS_H
+
+#include "lbmVariant.h"
+
+#include <stddef.h>
+
+struct lua_State;
+
+// Borrowed views of the arguments passed to a builtin. Nothing here owns any
+// memory: strings point straight at Lua's own string data and tables are
+// walked in place, so they are only valid until the builtin returns.
+
+typedef struct lbmArg
+{
+    int type;      // V_NONE, V_STRING, V_TABLE, V_NUMBER, V_INTEGER or V_BOOL
+    int index;     // absolute Lua stack index of the value
+    const char *s; // V_STRING only
+    size_t len;    // V_STRING only
+    union
+    {
+        double n;    // V_NUMBER
+        long long i; // V_INTEGER
+        int b;       // V_BOOL
+    };
+} lbmArg;
+
+typedef struct lbmArgs
+{
+    struct lua_State *L;
+    int count;
+} lbmArgs;
+
+typedef struct lbmArgCursor
+{
+    struct lua_State *L;
+    int table;  // absolute stack index of the table being walked
+    int pushed; // stack slots left behind by the previous step
+} lbmArgCursor;
+
+void lbmArgsInit(lbmArgs *args, struct lua_State *L);
+int lbmArgsGet(lbmArgs *args, int i, lbmArg *out); // i is 0-based, returns out->type
+const char *lbmArgsString(lbmArgs *args, int i, size_t *len); // NULL if not a string (numbers coerce, as in Lua)
+const char *lbmArgsCheckString(lbmArgs *args, int i, size_t *len); // raises a Lua error if not a string
+double lbmArgsNumber(lbmArgs *args, int i, double def);
+long long lbmArgsInteger(lbmArgs *args, int i, long long def);
+int lbmArgsBool(lbmArgs *args, int i, int def);
+
+// Table access. Fetched values are left on the Lua stack so the borrowed
+// strings stay anchored for the rest of the call.
+int lbmArgsField(lbmArgs *args, lbmArg *table, const char *key, lbmArg *out);
+const char *lbmArgsFieldString(lbmArgs *args, lbmArg *table, const char *key, size_t *len);
+double lbmArgsFieldNumber(lbmArgs *args, lbmArg *table, const char *key, double def);
+long long lbmArgsFieldInteger(lbmArgs *args, lbmArg *table, const char *key, long long def);
+int lbmArgsFieldBool(lbmArgs *args, lbmArg *table, const char *key, int def);
+int lbmArgsLength(lbmArgs *args, lbmArg *table);
+int lbmArgsIndex(lbmArgs *args, lbmArg *table, int i, lbmArg *out); // i is 1-based, like Lua
+
+// Typed reads of any view; def is returned for other types
+double lbmArgNumber(lbmArg *arg, double def);
+long long lbmArgInteger(lbmArg *arg, long long def); // def too for NaN, inf and beyond long long
+int lbmArgBool(lbmArg *arg, int def);
+
+// Lazily walks every key/value pair of a table via lua_next. Views handed out
+// by lbmArgCursorNext() are only valid until the following call.
+void lbmArgCursorBegin(lbmArgs *args, lbmArg *table, lbmArgCursor *cursor);
+int lbmArgCursorNext(lbmArgCursor *cursor, lbmArg *key, lbmArg *value);
+void lbmArgCursorEnd(lbmArgCursor *cursor); // only needed when stopping early
+
+#endif
@@ -0,0 +1,676 @@
+#include "lbmBuild.h"
+
+#include "lbmThread.h"
+
+#include "dyn.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+#define LBM_BUILD_READ_SIZE 4096
+
+typedef struct lbmBuildSlot
+{
+    int rule;     // LBM_GRAPH_NONE while free
+#ifndef WIN32
+    pid_t pid;    // 0 once reaped
+    int fd;       // read end of the job's output pipe, -1 once it has ended
+    int status;   // exit status, once reaped
+#endif
+    char *output; // malloc'd, grown as the job writes
+    size_t len;
+    size_t capacity;
+    double start;
+} lbmBuildSlot;
+
+typedef struct lbmBuildState
+{
+    lbmGraph *g;
+    lbmBuildOptions *opts;
+    lbmBuildResult *result;
+    int *pending;      // per rule: planned dependencies still to finish, -1 if not planned
+    double *priority;  // per planned rule: expected seconds of the longest chain of planned rules from it
+    double *succeeded; // per rule: when it finished, 0 unless it succeeded
+    double *seconds;   // per rule: how long it ran
+    int *heap;         // ready rules, highest priority on top
+    int heapCount;
+    lbmBuildSlot *slots;
+    int jobs;
+    int running;
+    int total;
+    int stop;      // a rule failed and keepGoing is off
+#ifndef WIN32
+    struct sigaction oldChild; // SIGCHLD handling to put back
+#endif
+} lbmBuildState;
+
+static double lbmBuildNow()
+{
+#ifdef WIN32
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Ready heap
+
+static int lbmBuildBefore(lbmBuildState *state, int a, int b)
+{
+    if (state->priority[a] != state->priority[b])
+    {
+        return state->priority[a] > state->priority[b];
+    }
+    return a < b; // declaration order breaks ties, so runs repeat
+}
+
+static void lbmBuildHeapPush(lbmBuildState *state, int rule)
+{
+    int i = state->heapCount++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!lbmBuildBefore(state, rule, state->heap[parent]))
+        {
+            break;
+        }
+        state->heap[i] = state->heap[parent];
+        i = parent;
+    }
+    state->heap[i] = rule;
+}
+
+static int lbmBuildHeapPop(lbmBuildState *state)
+{
+    int top = state->heap[0];
+    int last = state->heap[--state->heapCount];
+    int i = 0;
+    for (;;)
+    {
+        int child = i * 2 + 1;
+        if (child >= state->heapCount)
+        {
+            break;
+        }
+        if ((child + 1 < state->heapCount) && lbmBuildBefore(state, state->heap[child + 1], state->heap[child]))
+        {
+            ++child;
+        }
+        if (!lbmBuildBefore(state, state->heap[child], last))
+        {
+            break;
+        }
+        state->heap[i] = state->heap[child];
+        i = child;
+    }
+    state->heap[i] = last;
+    return top;
+}
+
+// ---------------------------------------------------------------------------
+// Jobs
+
+static void lbmBuildAppend(lbmBuildSlot *slot, const char *data, size_t len)
+{
+    if (slot->len + len + 1 > slot->capacity)
+    {
+        size_t capacity = (slot->capacity) ? slot->capacity : LBM_BUILD_READ_SIZE;
+        while (capacity < slot->len + len + 1)
+        {
+            capacity *= 2;
+        }
+        slot->output = (char *)realloc(slot->output, capacity);
+        slot->capacity = capacity;
+    }
+    memcpy(slot->output + slot->len, data, len);
+    slot->len += len;
+    slot->output[slot->len] = 0;
+}
+
+// Reports the job in slot, frees the slot, and readies whatever was only
+// waiting on it
+static void lbmBuildFinish(lbmBuildState *state, lbmBuildSlot *slot, int status)
+{
+    lbmGraph *g = state->g;
+    lbmBuildJob job;
+    int rule = slot->rule;
+    int i;
+
+    job.rule = rule;
+    job.status = status;
+    job.output = (slot->output) ? slot->output : "";
+    job.outputLen = slot->len;
+    job.seconds = lbmBuildNow() - slot->start;
+    state->seconds[rule] = job.seconds;
+    if (state->opts->finished)
+    {
+        state->opts->finished(state->opts->userdata, &job);
+    }
+    slot->rule = LBM_GRAPH_NONE;
+    slot->len = 0;
+    --state->running;
+
+    if (status != 0)
+    {
+        ++state->result->failed;
+        if (!state->opts->keepGoing)
+        {
+            state->stop = 1;
+        }
+        return;
+    }
+    state->succeeded[rule] = slot->start + job.seconds;
+    for (i = g->useStart[rule]; i < g->useStart[rule + 1]; ++i)
+    {
+        int user = g->uses[i];
+        if ((state->pending[user] > 0) && (--state->pending[user] == 0))
+        {
+            lbmBuildHeapPush(state, user);
+        }
+    }
+}
+
+#ifdef WIN32
+
+// No pipes to wait on: the job runs to completion right here
+static void lbmBuildStart(lbmBuildState *state, lbmBuildSlot *slot)
+{
+    char *command = NULL;
+    char buffer[LBM_BUILD_READ_SIZE];
+    FILE *f;
+    size_t n;
+    int status = -1;
+
+    dsCopy(&command, state->g->commands[slot->rule]);
+    dsConcat(&command, " 2>&1");
+    f = _popen(command, "r");
+    dsDestroy(&command);
+    if (f)
+    {
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        {
+            lbmBuildAppend(slot, buffer, n);
+        }
+        status = _pclose(f);
+    }
+    else
+    {
+        const char *message = "couldn't start the command\n";
+        lbmBuildAppend(slot, message, strlen(message));
+    }
+    lbmBuildFinish(state, slot, status);
+}
+
+static void lbmBuildWait(lbmBuildState *state)
+{
+    (void)state;
+}
+
+static void lbmBuildWatchChildren(lbmBuildState *state)
+{
+    (void)state;
+}
+
+static void lbmBuildUnwatchChildren(lbmBuildState *state)
+{
+    (void)state;
+}
+
+#else
+
+// Self-pipe the SIGCHLD handler writes to, so a job exiting wakes the
+// poll() even when it closed its output long before
+static int sBuildWake[2] = { -1, -1 };
+
+static void lbmBuildOnChild(int sig)
+{
+    int saved = errno;
+    char c = 0;
+    (void)sig;
+    if (write(sBuildWake[1], &c, 1) < 0)
+    {
+        // Full already, which wakes the loop just the same
+    }
+    errno = saved;
+}
+
+static void lbmBuildWatchChildren(lbmBuildState *state)
+{
+    struct sigaction action;
+    int i;
+
+    if (pipe(sBuildWake) != 0)
+    {
+        sBuildWake[0] = sBuildWake[1] = -1;
+        return;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        fcntl(sBuildWake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(sBuildWake[i], F_SETFL, fcntl(sBuildWake[i], F_GETFL) | O_NONBLOCK);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lbmBuildOnChild;
+    action.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, &state->oldChild);
+}
+
+static void lbmBuildUnwatchChildren(lbmBuildState *state)
+{
+    if (sBuildWake[0] < 0)
+    {
+        return;
+    }
+    sigaction(SIGCHLD, &state->oldChild, NULL);
+    close(sBuildWake[0]);
+    close(sBuildWake[1]);
+    sBuildWake[0] = sBuildWake[1] = -1;
+}
+
+static void lbmBuildStart(lbmBuildState *state, lbmBuildSlot *slot)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[4];
+    int fds[2];
+    int rc;
+
+    if (pipe(fds) != 0)
+    {
+        const char *message = "couldn't create a pipe for the command\n";
+        lbmBuildAppend(slot, message, strlen(message));
+        lbmBuildFinish(state, slot, -1);
+        return;
+    }
+    // Later jobs mustn't inherit this pipe, or its end would wait for them
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = (char *)state->g->commands[slot->rule];
+    argv[3] = NULL;
+    slot->status = -1;
+    rc = posix_spawn(&slot->pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (rc != 0)
+    {
+        const char *message = "couldn't start /bin/sh: ";
+        close(fds[0]);
+        slot->pid = 0;
+        slot->fd = -1;
+        lbmBuildAppend(slot, message, strlen(message));
+        lbmBuildAppend(slot, strerror(rc), strlen(strerror(rc)));
+        lbmBuildAppend(slot, "\n", 1);
+        lbmBuildFinish(state, slot, -1);
+        return;
+    }
+    slot->fd = fds[0];
+}
+
+// A job is done once its process is reaped and its output pipe has ended,
+// in either order: a command can close its output and carry on, and a
+// background child it leaves behind can hold the pipe past its exit
+static void lbmBuildDone(lbmBuildState *state, lbmBuildSlot *slot)
+{
+    int status = slot->status;
+    if ((slot->pid != 0) || (slot->fd >= 0))
+    {
+        return;
+    }
+    if (status == -1)
+    {
+        lbmBuildFinish(state, slot, -1);
+    }
+    else if (WIFEXITED(status))
+    {
+        lbmBuildFinish(state, slot, WEXITSTATUS(status));
+    }
+    else
+    {
+        lbmBuildFinish(state, slot, 128 + WTERMSIG(status));
+    }
+}
+
+// One read from a job the poll said was ready
+static void lbmBuildRead(lbmBuildState *state, lbmBuildSlot *slot)
+{
+    char buffer[LBM_BUILD_READ_SIZE];
+    ssize_t n = read(slot->fd, buffer, sizeof(buffer));
+
+    if (n > 0)
+    {
+        lbmBuildAppend(slot, buffer, (size_t)n);
+        return;
+    }
+    if ((n < 0) && (errno == EINTR))
+    {
+        return;
+    }
+    close(slot->fd);
+    slot->fd = -1;
+    lbmBuildDone(state, slot);
+}
+
+// Reaps whichever running jobs have exited, without waiting on any
+static void lbmBuildReap(lbmBuildState *state)
+{
+    char drain[64];
+    int i;
+
+    while (read(sBuildWake[0], drain, sizeof(drain)) > 0)
+    {
+    }
+    for (i = 0; i < state->jobs; ++i)
+    {
+        lbmBuildSlot *slot = &state->slots[i];
+        pid_t pid;
+        if ((slot->rule == LBM_GRAPH_NONE) || (slot->pid == 0))
+        {
+            continue;
+        }
+        do
+        {
+            pid = waitpid(slot->pid, &slot->status, WNOHANG);
+        } while ((pid < 0) && (errno == EINTR));
+        if (pid == 0)
+        {
+            continue;
+        }
+        if (pid < 0)
+        {
+            slot->status = -1;
+        }
+        slot->pid = 0;
+        lbmBuildDone(state, slot);
+    }
+}
+
+// Blocks until at least one running job has output or has exited
+static void lbmBuildWait(lbmBuildState *state)
+{
+    lbmJobserver *js = state->opts->jobserver;
+    struct pollfd *fds = (struct pollfd *)malloc((state->jobs + 2) * sizeof(struct pollfd));
+    int *owners = (int *)malloc((state->jobs + 2) * sizeof(int)); // slot, -1 for the jobserver, -2 for SIGCHLD
+    int reap = 0;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < state->jobs; ++i)
+    {
+        if ((state->slots[i].rule != LBM_GRAPH_NONE) && (state->slots[i].fd >= 0))
+        {
+            fds[count].fd = state->slots[i].fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            owners[count++] = i;
+        }
+    }
+
+    // Ready work held back only by a token: wake when one may be free too
+    if (js && lbmJobserverActive(js) && !state->stop && state->heapCount && (state->running < state->jobs))
+    {
+        fds[count].fd = lbmJobserverFd(js);
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+        owners[count++] = -1;
+    }
+
+    if (sBuildWake[0] >= 0)
+    {
+        fds[count].fd = sBuildWake[0];
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+        owners[count++] = -2;
+    }
+
+    // Without the self-pipe, a job whose output has ended is polled for
+    if (poll(fds, count, (sBuildWake[0] >= 0) ? -1 : 10) < 0)
+    {
+        reap = 1;
+    }
+    else
+    {
+        for (i = 0; i < count; ++i)
+        {
+            if (fds[i].revents && (owners[i] >= 0))
+            {
+                lbmBuildRead(state, &state->slots[owners[i]]);
+            }
+            else if (fds[i].revents && (owners[i] == -2))
+            {
+                reap = 1;
+            }
+        }
+    }
+    if (reap || (sBuildWake[0] < 0))
+    {
+        lbmBuildReap(state);
+    }
+    free(owners);
+    free(fds);
+}
+
+#endif
+
+// Expected run time of each planned rule: its weight where one is known,
+// else the mean of the known ones, else a second
+static void lbmBuildWeights(lbmBuildState *state, lbmGraphPlan *plan, double *weights)
+{
+    const double *known = state->opts->weights;
+    double total = 0.0;
+    double fallback = 1.0;
+    int count = 0;
+    int i;
+
+    for (i = 0; known && (i < plan->count); ++i)
+    {
+        if (known[plan->rules[i]] >= 0.0)
+        {
+            total += known[plan->rules[i]];
+            ++count;
+        }
+    }
+    if (count)
+    {
+        fallback = total / count;
+    }
+    for (i = 0; i < plan->count; ++i)
+    {
+        int rule = plan->rules[i];
+        weights[rule] = (known && (known[rule] >= 0.0)) ? known[rule] : fallback;
+    }
+}
+
+// The chain of succeeded rules that ended last: from the final rule to
+// finish, back through whichever of its planned dependencies finished
+// latest, and so on. Stored dependencies first.
+static void lbmBuildCriticalPath(lbmBuildState *state, lbmGraphPlan *plan)
+{
+    lbmGraph *g = state->g;
+    lbmBuildResult *result = state->result;
+    int rule = LBM_GRAPH_NONE;
+    double latest = 0.0;
+    int i;
+
+    for (i = 0; i < plan->count; ++i)
+    {
+        if (state->succeeded[plan->rules[i]] > latest)
+        {
+            latest = state->succeeded[plan->rules[i]];
+            rule = plan->rules[i];
+        }
+    }
+    result->critical = (lbmBuildStep *)malloc((size_t)((plan->count > 0) ? plan->count : 1) * sizeof(lbmBuildStep));
+    while (rule != LBM_GRAPH_NONE)
+    {
+        int next = LBM_GRAPH_NONE;
+        result->critical[result->criticalCount].rule = rule;
+        result->critical[result->criticalCount].seconds = state->seconds[rule];
+        ++result->criticalCount;
+        result->criticalSeconds += state->seconds[rule];
+        latest = 0.0;
+        for (i = g->depStart[rule]; i < g->depStart[rule + 1]; ++i)
+        {
+            if (state->succeeded[g->deps[i]] > latest)
+            {
+                latest = state->succeeded[g->deps[i]];
+                next = g->deps[i];
+            }
+        }
+        rule = next;
+    }
+    for (i = 0; i < result->criticalCount / 2; ++i)
+    {
+        lbmBuildStep swap = result->critical[i];
+        result->critical[i] = result->critical[result->criticalCount - 1 - i];
+        result->critical[result->criticalCount - 1 - i] = swap;
+    }
+}
+
+void lbmBuildResultFree(lbmBuildResult *result)
+{
+    free(result->critical);
+    memset(result, 0, sizeof(lbmBuildResult));
+}
+
+void lbmBuildRun(lbmGraph *g, lbmGraphPlan *plan, lbmBuildOptions *opts, lbmBuildResult *result)
+{
+    lbmJobserver *js = (opts->jobserver && lbmJobserverActive(opts->jobserver)) ? opts->jobserver : NULL;
+    lbmBuildState state;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    memset(result, 0, sizeof(lbmBuildResult));
+    state.g = g;
+    state.opts = opts;
+    state.result = result;
+    state.total = plan->count;
+    state.jobs = (opts->jobs > 0) ? opts->jobs : lbmCpuCount();
+    state.pending = (int *)malloc((g->ruleCount ? g->ruleCount : 1) * sizeof(int));
+    state.priority = (double *)calloc(g->ruleCount ? g->ruleCount : 1, sizeof(double));
+    state.succeeded = (double *)calloc(g->ruleCount ? g->ruleCount : 1, sizeof(double));
+    state.seconds = (double *)calloc(g->ruleCount ? g->ruleCount : 1, sizeof(double));
+    state.heap = (int *)malloc((plan->count ? plan->count : 1) * sizeof(int));
+    state.slots = (lbmBuildSlot *)calloc(state.jobs, sizeof(lbmBuildSlot));
+    for (i = 0; i < state.jobs; ++i)
+    {
+        state.slots[i].rule = LBM_GRAPH_NONE;
+    }
+
+    // Plan rules are in dependency order, so walking them backwards sees
+    // every rule's users before the rule itself. A rule's priority starts
+    // as its own expected time and gains the longest of its users'.
+    for (i = 0; i < g->ruleCount; ++i)
+    {
+        state.pending[i] = -1;
+    }
+    for (i = 0; i < plan->count; ++i)
+    {
+        state.pending[plan->rules[i]] = 0;
+    }
+    lbmBuildWeights(&state, plan, state.priority);
+    for (i = plan->count - 1; i >= 0; --i)
+    {
+        int rule = plan->rules[i];
+        double longest = 0.0;
+        int j;
+        for (j = g->useStart[rule]; j < g->useStart[rule + 1]; ++j)
+        {
+            int user = g->uses[j];
+            if ((state.pending[user] >= 0) && (state.priority[user] > longest))
+            {
+                longest = state.priority[user];
+            }
+        }
+        state.priority[rule] += longest;
+        for (j = g->depStart[rule]; j < g->depStart[rule + 1]; ++j)
+        {
+            if (state.pending[g->deps[j]] >= 0)
+            {
+                ++state.pending[rule];
+            }
+        }
+    }
+    for (i = 0; i < plan->count; ++i)
+    {
+        if (state.pending[plan->rules[i]] == 0)
+        {
+            lbmBuildHeapPush(&state, plan->rules[i]);
+        }
+    }
+
+    lbmBuildWatchChildren(&state);
+    for (;;)
+    {
+        while (!state.stop && state.heapCount && (state.running < state.jobs))
+        {
+            lbmBuildSlot *slot = state.slots;
+            if (js && (state.running > js->held) && !lbmJobserverTryAcquire(js))
+            {
+                break;
+            }
+            while (slot->rule != LBM_GRAPH_NONE)
+            {
+                ++slot;
+            }
+            slot->rule = lbmBuildHeapPop(&state);
+            slot->start = lbmBuildNow();
+            ++state.running;
+            ++result->ran;
+            if (opts->started)
+            {
+                opts->started(opts->userdata, slot->rule, result->ran, state.total);
+            }
+            lbmBuildStart(&state, slot);
+        }
+        while (js && (js->held > ((state.running > 0) ? state.running - 1 : 0)))
+        {
+            lbmJobserverRelease(js);
+        }
+        if (!state.running)
+        {
+            break;
+        }
+        lbmBuildWait(&state);
+    }
+    lbmBuildUnwatchChildren(&state);
+    result->skipped = state.total - result->ran;
+    lbmBuildCriticalPath(&state, plan);
+
+    for (i = 0; i < state.jobs; ++i)
+    {
+        free(state.slots[i].output);
+    }
+    free(state.slots);
+    free(state.heap);
+    free(state.seconds);
+    free(state.succeeded);
+    free(state.priority);
+    free(state.pending);
+}
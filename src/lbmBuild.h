@@ -0,0 +1,75 @@
+#ifndef LBMBUILD_H
+#define LBMBUILD_H
+
+#include "lbmGraph.h"
+#include "lbmJobserver.h"
+
+#include <stddef.h>
+
+// Runs a plan's commands, up to opts->jobs at once. Each command is its own
+// process (/bin/sh -c, started with posix_spawn) whose stdout and stderr
+// share one pipe. A single poll() loop on the calling thread collects
+// output from every running job, and a SIGCHLD handler (installed for the
+// run) wakes it through a self-pipe to reap exited jobs without waiting on
+// any one of them, so nothing sleeps or wakes on a timer. A job is done
+// once it has exited and its pipe has ended. A rule becomes ready
+// once every planned rule it depends on has succeeded; the ready rule at
+// the head of the longest remaining chain of planned rules starts first,
+// chains measured in expected seconds (opts->weights), so long tails like
+// a link behind a slow compile get going early.
+//
+// With an active opts->jobserver, the first job runs on lbm's own implicit
+// slot and every other one waits for a token, which goes back to the pool
+// as soon as nothing here needs it; opts->jobs is then only an upper bound.
+//
+// On Win32 the commands run one at a time through _popen().
+
+typedef struct lbmBuildJob
+{
+    int rule;
+    int status;         // exit code, 128 + signal if killed, -1 if it couldn't start
+    const char *output; // everything it wrote, NUL terminated
+    size_t outputLen;
+    double seconds;     // wall time
+} lbmBuildJob;
+
+typedef void (*lbmBuildStartedFunc)(void *userdata, int rule, int index, int total);
+typedef void (*lbmBuildFinishedFunc)(void *userdata, lbmBuildJob *job);
+
+typedef struct lbmBuildOptions
+{
+    int jobs;                      // <= 0 means one per CPU
+    int keepGoing;                 // keep starting rules that don't need a failed one
+    lbmJobserver *jobserver;       // optional
+    lbmBuildStartedFunc started;   // optional; index is 1-based
+    lbmBuildFinishedFunc finished; // optional
+    void *userdata;
+    const double *weights;         // optional, per rule: expected seconds, < 0 if unknown
+} lbmBuildOptions;
+
+typedef struct lbmBuildStep
+{
+    int rule;
+    double seconds;
+} lbmBuildStep;
+
+typedef struct lbmBuildResult
+{
+    int ran;     // started, whatever the outcome
+    int failed;
+    int skipped; // never started: something they need failed
+
+    // The run's critical path, dependencies first: the last rule to
+    // succeed, the dependency of it that succeeded last, and so on
+    lbmBuildStep *critical;
+    int criticalCount;
+    double criticalSeconds; // their run times summed
+} lbmBuildResult;
+
+// g must be finalized and plan built from it. Callbacks run on the calling
+// thread. Unknown weights count as the mean of the known ones (or a second
+// if none are). Free result with lbmBuildResultFree().
+void lbmBuildRun(lbmGraph *g, lbmGraphPlan *plan, lbmBuildOptions *opts, lbmBuildResult *result);
+void lbmBuildResultFree(lbmBuildResult *result);
+
+#endif
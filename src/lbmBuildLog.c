@@ -0,0 +1,651 @@
+#include "lbmBuildLog.h"
+
+#include "lbmThread.h"
+
+#include "dyn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LBM_BUILD_LOG_MAGIC   0x424d424c // "LBMB"
+#define LBM_BUILD_LOG_VERSION 1
+#define LBM_BUILD_LOG_HEADER  8
+#define LBM_BUILD_LOG_RECORD_HEADER 8
+#define LBM_BUILD_LOG_FILE_PAYLOAD  32
+#define LBM_BUILD_LOG_RULE_PAYLOAD  40
+
+#define LBM_BUILD_LOG_TYPE_FILE 1
+#define LBM_BUILD_LOG_TYPE_RULE 2
+
+// Below this many records a log is never worth compacting
+#define LBM_BUILD_LOG_COMPACT_MIN 4096
+
+// A file hashed this close to its mtime may change again within the same
+// mtime tick, so its hash is used but not kept
+#define LBM_BUILD_LOG_RACY_NS (2 * 1000000000LL)
+
+#define LBM_BUILD_LOG_SEED 0x6c626d62
+
+// ---------------------------------------------------------------------------
+// Hashing
+//
+// MurmurHash3's x64 128-bit variant: two 64-bit lanes, 16 bytes a round.
+
+static unsigned long long lbmHashRotl(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long lbmHashMix(unsigned long long k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void lbmHash128(const void *data, size_t len, unsigned long long seed, unsigned long long out[2])
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned long long c1 = 0x87c37b91114253d5ULL;
+    const unsigned long long c2 = 0x4cf5ad432745937fULL;
+    unsigned long long h1 = seed;
+    unsigned long long h2 = seed;
+    unsigned long long k1;
+    unsigned long long k2;
+    size_t blocks = len / 16;
+    size_t i;
+
+    for (i = 0; i < blocks; ++i, p += 16)
+    {
+        memcpy(&k1, p, 8);
+        memcpy(&k2, p + 8, 8);
+
+        k1 *= c1;
+        k1 = lbmHashRotl(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = lbmHashRotl(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = lbmHashRotl(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = lbmHashRotl(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // The last 0-15 bytes, little-endian, as the reference does it
+    k1 = 0;
+    k2 = 0;
+    for (i = len & 15; i > 8; --i)
+    {
+        k2 = (k2 << 8) | p[i - 1];
+    }
+    for (; i > 0; --i)
+    {
+        k1 = (k1 << 8) | p[i - 1];
+    }
+    if ((len & 15) > 8)
+    {
+        k2 *= c2;
+        k2 = lbmHashRotl(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    if (len & 15)
+    {
+        k1 *= c1;
+        k1 = lbmHashRotl(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= (unsigned long long)len;
+    h2 ^= (unsigned long long)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = lbmHashMix(h1);
+    h2 = lbmHashMix(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+// ---------------------------------------------------------------------------
+// Entries
+
+void lbmBuildLogInit(lbmBuildLog *log)
+{
+    memset(log, 0, sizeof(lbmBuildLog));
+    daCreate(&log->entries, sizeof(lbmBuildLogEntry));
+}
+
+void lbmBuildLogFree(lbmBuildLog *log)
+{
+    dsDestroy(&log->filename);
+    daDestroy(&log->entries, NULL);
+    free(log->slots);
+    free(log->pending);
+    memset(log, 0, sizeof(lbmBuildLog));
+}
+
+lbmBuildLogEntry *lbmBuildLogFind(lbmBuildLog *log, int path)
+{
+    if ((path < 0) || (path >= log->slotCount) || !log->slots[path])
+    {
+        return NULL;
+    }
+    return &log->entries[log->slots[path] - 1];
+}
+
+// Entries never move while a parallel hash is running: everything that
+// might add one happens on the calling thread first
+static lbmBuildLogEntry *lbmBuildLogGet(lbmBuildLog *log, int path)
+{
+    lbmBuildLogEntry entry;
+    if (path >= log->slotCount)
+    {
+        int count = (log->slotCount) ? log->slotCount : 1024;
+        while (count <= path)
+        {
+            count *= 2;
+        }
+        log->slots = (int *)realloc(log->slots, count * sizeof(int));
+        memset(log->slots + log->slotCount, 0, (count - log->slotCount) * sizeof(int));
+        log->slotCount = count;
+    }
+    if (!log->slots[path])
+    {
+        memset(&entry, 0, sizeof(entry));
+        entry.path = path;
+        daPush(&log->entries, entry);
+        log->slots[path] = daSize(&log->entries);
+    }
+    return &log->entries[log->slots[path] - 1];
+}
+
+static void lbmBuildLogAppend(lbmBuildLog *log, int type, lbmPathEntry *path, const void *payload, size_t payloadLen)
+{
+    unsigned int header[2];
+    size_t len = LBM_BUILD_LOG_RECORD_HEADER + payloadLen + path->len + 1;
+    if (log->pendingLen + len > log->pendingCapacity)
+    {
+        size_t capacity = (log->pendingCapacity) ? log->pendingCapacity : 4096;
+        while (capacity < log->pendingLen + len)
+        {
+            capacity *= 2;
+        }
+        log->pending = (char *)realloc(log->pending, capacity);
+        log->pendingCapacity = capacity;
+    }
+    header[0] = (unsigned int)type;
+    header[1] = (unsigned int)path->len;
+    memcpy(log->pending + log->pendingLen, header, sizeof(header));
+    memcpy(log->pending + log->pendingLen + LBM_BUILD_LOG_RECORD_HEADER, payload, payloadLen);
+    memcpy(log->pending + log->pendingLen + LBM_BUILD_LOG_RECORD_HEADER + payloadLen, path->s, path->len + 1);
+    log->pendingLen += len;
+}
+
+static void lbmBuildLogAppendFile(lbmBuildLog *log, lbmBuildLogEntry *entry, lbmPathTable *pt)
+{
+    char payload[LBM_BUILD_LOG_FILE_PAYLOAD];
+    memcpy(payload, &entry->mtime, 8);
+    memcpy(payload + 8, &entry->size, 8);
+    memcpy(payload + 16, entry->hash, 16);
+    lbmBuildLogAppend(log, LBM_BUILD_LOG_TYPE_FILE, lbmPathGet(pt, entry->path), payload, sizeof(payload));
+}
+
+static void lbmBuildLogAppendRule(lbmBuildLog *log, lbmBuildLogEntry *entry, lbmPathTable *pt)
+{
+    char payload[LBM_BUILD_LOG_RULE_PAYLOAD];
+    memcpy(payload, entry->command, 16);
+    memcpy(payload + 16, entry->inputs, 16);
+    memcpy(payload + 32, &entry->seconds, 8);
+    lbmBuildLogAppend(log, LBM_BUILD_LOG_TYPE_RULE, lbmPathGet(pt, entry->path), payload, sizeof(payload));
+}
+
+// ---------------------------------------------------------------------------
+// Loading and writing
+
+static unsigned int lbmBuildLogRead32(const char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void lbmBuildLogLoad(lbmBuildLog *log, const char *filename, lbmPathTable *pt)
+{
+    lbmFileMap map;
+    const char *c;
+    const char *end;
+
+    dsCopy(&log->filename, filename);
+    if (!lbmFileMapOpen(&map, filename))
+    {
+        return;
+    }
+    if ((map.len < LBM_BUILD_LOG_HEADER)
+        || (lbmBuildLogRead32(map.data) != LBM_BUILD_LOG_MAGIC)
+        || (lbmBuildLogRead32(map.data + 4) != LBM_BUILD_LOG_VERSION))
+    {
+        // Someone else's file, or an older layout: start over
+        log->damaged = 1;
+        lbmFileMapClose(&map);
+        return;
+    }
+
+    log->exists = 1;
+    c = map.data + LBM_BUILD_LOG_HEADER;
+    end = map.data + map.len;
+    while (c < end)
+    {
+        lbmBuildLogEntry *entry;
+        unsigned int type;
+        size_t pathLen;
+        size_t payloadLen;
+        const char *path;
+
+        if ((size_t)(end - c) < LBM_BUILD_LOG_RECORD_HEADER)
+        {
+            log->damaged = 1;
+            break;
+        }
+        type = lbmBuildLogRead32(c);
+        pathLen = lbmBuildLogRead32(c + 4);
+        payloadLen = (type == LBM_BUILD_LOG_TYPE_FILE) ? LBM_BUILD_LOG_FILE_PAYLOAD : LBM_BUILD_LOG_RULE_PAYLOAD;
+        if (((type != LBM_BUILD_LOG_TYPE_FILE) && (type != LBM_BUILD_LOG_TYPE_RULE))
+            || ((size_t)(end - c) < LBM_BUILD_LOG_RECORD_HEADER + payloadLen + pathLen + 1)
+            || c[LBM_BUILD_LOG_RECORD_HEADER + payloadLen + pathLen])
+        {
+            // Cut short by a crash mid-append; keep what was good
+            log->damaged = 1;
+            break;
+        }
+
+        path = c + LBM_BUILD_LOG_RECORD_HEADER + payloadLen;
+        entry = lbmBuildLogGet(log, lbmPathIntern(pt, path, pathLen));
+        c += LBM_BUILD_LOG_RECORD_HEADER;
+        if (type == LBM_BUILD_LOG_TYPE_FILE)
+        {
+            memcpy(&entry->mtime, c, 8);
+            memcpy(&entry->size, c + 8, 8);
+            memcpy(entry->hash, c + 16, 16);
+            entry->flags |= LBM_BUILD_LOG_FILE;
+        }
+        else
+        {
+            memcpy(entry->command, c, 16);
+            memcpy(entry->inputs, c + 16, 16);
+            memcpy(&entry->seconds, c + 32, 8);
+            entry->flags |= LBM_BUILD_LOG_RULE;
+        }
+        c += payloadLen + pathLen + 1;
+        ++log->records;
+    }
+    lbmFileMapClose(&map);
+}
+
+static int lbmBuildLogCompact(lbmBuildLog *log, lbmPathTable *pt)
+{
+    unsigned int header[2];
+    int result;
+    int records = 0;
+    int i;
+
+    log->pendingLen = 0;
+    for (i = 0; i < daSize(&log->entries); ++i)
+    {
+        lbmBuildLogEntry *entry = &log->entries[i];
+        if ((entry->flags & LBM_BUILD_LOG_FILE) && !(entry->flags & LBM_BUILD_LOG_RACY))
+        {
+            lbmBuildLogAppendFile(log, entry, pt);
+            ++records;
+        }
+        if (entry->flags & LBM_BUILD_LOG_RULE)
+        {
+            lbmBuildLogAppendRule(log, entry, pt);
+            ++records;
+        }
+    }
+
+    header[0] = LBM_BUILD_LOG_MAGIC;
+    header[1] = LBM_BUILD_LOG_VERSION;
+    {
+        char *data = (char *)malloc(LBM_BUILD_LOG_HEADER + log->pendingLen);
+        memcpy(data, header, LBM_BUILD_LOG_HEADER);
+        if (log->pendingLen)
+        {
+            memcpy(data + LBM_BUILD_LOG_HEADER, log->pending, log->pendingLen);
+        }
+        result = lbmFileWrite(log->filename, data, LBM_BUILD_LOG_HEADER + log->pendingLen, LBM_WRITE_ATOMIC);
+        free(data);
+    }
+    log->pendingLen = 0;
+    if (result == LBM_WRITE_FAILED)
+    {
+        return 0;
+    }
+    log->records = records;
+    log->exists = 1;
+    log->damaged = 0;
+    ++log->compactions;
+    return 1;
+}
+
+int lbmBuildLogFlush(lbmBuildLog *log, lbmPathTable *pt)
+{
+    int live = 0;
+    FILE *f;
+    int i;
+
+    if (!log->filename)
+    {
+        return 0;
+    }
+    for (i = 0; i < daSize(&log->entries); ++i)
+    {
+        live += ((log->entries[i].flags & LBM_BUILD_LOG_FILE) != 0) + ((log->entries[i].flags & LBM_BUILD_LOG_RULE) != 0);
+    }
+    if (!log->exists || log->damaged || ((log->records >= LBM_BUILD_LOG_COMPACT_MIN) && (log->records > live * 2)))
+    {
+        return lbmBuildLogCompact(log, pt);
+    }
+    if (!log->pendingLen)
+    {
+        return 1;
+    }
+
+    f = fopen(log->filename, "ab");
+    if (!f)
+    {
+        return 0;
+    }
+    if (fwrite(log->pending, 1, log->pendingLen, f) != log->pendingLen)
+    {
+        fclose(f);
+        log->damaged = 1;
+        return 0;
+    }
+    fclose(f);
+    for (i = 0; (size_t)i < log->pendingLen; )
+    {
+        unsigned int type = lbmBuildLogRead32(log->pending + i);
+        unsigned int pathLen = lbmBuildLogRead32(log->pending + i + 4);
+        size_t payloadLen = (type == LBM_BUILD_LOG_TYPE_FILE) ? LBM_BUILD_LOG_FILE_PAYLOAD : LBM_BUILD_LOG_RULE_PAYLOAD;
+        i += (int)(LBM_BUILD_LOG_RECORD_HEADER + payloadLen + pathLen + 1);
+        ++log->records;
+    }
+    log->pendingLen = 0;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Verifying inputs
+
+typedef struct lbmBuildLogHashJob
+{
+    int entry;
+    const char *path;
+    lbmFileStat st;
+    int ok;
+} lbmBuildLogHashJob;
+
+typedef struct lbmBuildLogHashBatch
+{
+    lbmBuildLog *log;
+    lbmBuildLogHashJob *jobs;
+} lbmBuildLogHashBatch;
+
+static void lbmBuildLogHashRange(void *userdata, int begin, int end)
+{
+    lbmBuildLogHashBatch *batch = (lbmBuildLogHashBatch *)userdata;
+    int i;
+    for (i = begin; i < end; ++i)
+    {
+        lbmBuildLogHashJob *job = &batch->jobs[i];
+        lbmBuildLogEntry *entry = &batch->log->entries[job->entry];
+        lbmFileMap map;
+        job->ok = lbmFileMapOpen(&map, job->path);
+        if (job->ok)
+        {
+            lbmHash128((map.data) ? map.data : "", map.len, LBM_BUILD_LOG_SEED, entry->hash);
+            lbmFileMapClose(&map);
+        }
+    }
+}
+
+// Marks path's entry verified for this generation, queuing it for hashing
+// unless the logged hash was taken at the same mtime and size. Returns 0
+// for anything that can't be hashed.
+static int lbmBuildLogVerify(lbmBuildLog *log, lbmPathTable *pt, int path, lbmFileStat *st, lbmBuildLogHashJob **queue)
+{
+    lbmBuildLogEntry *entry;
+    lbmBuildLogHashJob job;
+
+    if (st->type != LBM_FILE_REGULAR)
+    {
+        return 0;
+    }
+    entry = lbmBuildLogGet(log, path);
+    if (entry->verified == log->generation)
+    {
+        return 1;
+    }
+    entry->verified = log->generation;
+    if ((entry->flags & LBM_BUILD_LOG_FILE) && (entry->mtime == st->mtime) && (entry->size == st->size))
+    {
+        return 1;
+    }
+
+    job.entry = log->slots[path] - 1;
+    job.path = lbmPathGet(pt, path)->s;
+    job.st = *st;
+    job.ok = 0;
+    daPush(queue, job);
+    return 1;
+}
+
+static void lbmBuildLogHashQueued(lbmBuildLog *log, lbmPathTable *pt, lbmBuildLogHashJob *queue, int threadCount)
+{
+    lbmBuildLogHashBatch batch;
+    long long racyAfter = (long long)time(NULL) * 1000000000LL - LBM_BUILD_LOG_RACY_NS;
+    int count = daSize(&queue);
+    int i;
+
+    if (!count)
+    {
+        return;
+    }
+    batch.log = log;
+    batch.jobs = queue;
+    lbmParallelFor(count, (count > 1) ? threadCount : 1, lbmBuildLogHashRange, &batch);
+
+    log->hashed += count;
+    for (i = 0; i < count; ++i)
+    {
+        lbmBuildLogEntry *entry = &log->entries[queue[i].entry];
+        if (!queue[i].ok)
+        {
+            entry->flags &= ~LBM_BUILD_LOG_FILE;
+            entry->verified = 0;
+            continue;
+        }
+        entry->mtime = queue[i].st.mtime;
+        entry->size = queue[i].st.size;
+        entry->flags |= LBM_BUILD_LOG_FILE;
+        if (entry->mtime > racyAfter)
+        {
+            entry->flags |= LBM_BUILD_LOG_RACY;
+        }
+        else
+        {
+            entry->flags &= ~LBM_BUILD_LOG_RACY;
+            lbmBuildLogAppendFile(log, entry, pt);
+        }
+    }
+}
+
+// Combined hash of a rule's input contents; 0 if one isn't verified
+static int lbmBuildLogInputsHash(lbmBuildLog *log, lbmGraph *g, int rule, unsigned long long out[2])
+{
+    int count = g->inputStart[rule + 1] - g->inputStart[rule];
+    unsigned long long *hashes = (unsigned long long *)malloc((count ? count : 1) * 2 * sizeof(unsigned long long));
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        lbmBuildLogEntry *entry = lbmBuildLogFind(log, g->nodePaths[g->inputs[g->inputStart[rule] + i]]);
+        if (!entry || !(entry->flags & LBM_BUILD_LOG_FILE) || (entry->verified != log->generation))
+        {
+            free(hashes);
+            return 0;
+        }
+        hashes[i * 2] = entry->hash[0];
+        hashes[i * 2 + 1] = entry->hash[1];
+    }
+    lbmHash128(hashes, count * 2 * sizeof(unsigned long long), LBM_BUILD_LOG_SEED, out);
+    free(hashes);
+    return 1;
+}
+
+static lbmBuildLogEntry *lbmBuildLogRuleEntry(lbmBuildLog *log, lbmGraph *g, int rule)
+{
+    if (g->outputStart[rule] == g->outputStart[rule + 1])
+    {
+        return NULL;
+    }
+    return lbmBuildLogFind(log, g->nodePaths[g->outputs[g->outputStart[rule]]]);
+}
+
+void lbmBuildLogRefresh(lbmBuildLog *log, lbmGraph *g, lbmPathTable *pt, lbmFileStat **stats, int threadCount)
+{
+    lbmBuildLogHashJob *queue = NULL;
+    int rule;
+    int i;
+
+    daCreate(&queue, sizeof(lbmBuildLogHashJob));
+    ++log->generation;
+    for (rule = 0; rule < g->ruleCount; ++rule)
+    {
+        lbmBuildLogEntry *entry = lbmBuildLogRuleEntry(log, g, rule);
+        if (!entry || !(entry->flags & LBM_BUILD_LOG_RULE))
+        {
+            continue;
+        }
+        for (i = g->inputStart[rule]; i < g->inputStart[rule + 1]; ++i)
+        {
+            int node = g->inputs[i];
+            lbmBuildLogVerify(log, pt, g->nodePaths[node], stats[node], &queue);
+        }
+    }
+    lbmBuildLogHashQueued(log, pt, queue, threadCount);
+    daDestroy(&queue, NULL);
+}
+
+double lbmBuildLogSeconds(lbmBuildLog *log, lbmGraph *g, int rule)
+{
+    lbmBuildLogEntry *entry = lbmBuildLogRuleEntry(log, g, rule);
+    return (entry && (entry->flags & LBM_BUILD_LOG_RULE)) ? entry->seconds : -1.0;
+}
+
+unsigned char lbmBuildLogCheck(void *userdata, lbmGraph *g, int rule, unsigned char reason)
+{
+    lbmBuildLog *log = (lbmBuildLog *)userdata;
+    lbmBuildLogEntry *entry = lbmBuildLogRuleEntry(log, g, rule);
+    unsigned long long hash[2];
+
+    if (!entry || !(entry->flags & LBM_BUILD_LOG_RULE))
+    {
+        return reason;
+    }
+    lbmHash128(g->commands[rule], strlen(g->commands[rule]), LBM_BUILD_LOG_SEED, hash);
+    if ((hash[0] != entry->command[0]) || (hash[1] != entry->command[1]))
+    {
+        return (reason == LBM_GRAPH_CLEAN) ? LBM_GRAPH_COMMAND_CHANGED : reason;
+    }
+    if ((reason == LBM_GRAPH_INPUT_NEWER)
+        && lbmBuildLogInputsHash(log, g, rule, hash)
+        && (hash[0] == entry->inputs[0]) && (hash[1] == entry->inputs[1]))
+    {
+        ++log->skipped;
+        return LBM_GRAPH_CLEAN;
+    }
+    return reason;
+}
+
+void lbmBuildLogRecord(lbmBuildLog *log, lbmGraph *g, lbmPathTable *pt, lbmStatCache *cache, const int *rules, const double *seconds, int count, int threadCount)
+{
+    lbmBuildLogHashJob *queue = NULL;
+    lbmFileStat **stats;
+    int *ids = NULL;
+    int *hashable;
+    int n;
+    int i;
+    int j;
+
+    // Everything the rules read, stat()ed together
+    daCreate(&ids, sizeof(int));
+    for (i = 0; i < count; ++i)
+    {
+        for (j = g->inputStart[rules[i]]; j < g->inputStart[rules[i] + 1]; ++j)
+        {
+            daPush(&ids, g->nodePaths[g->inputs[j]]);
+        }
+    }
+    stats = (lbmFileStat **)malloc((daSize(&ids) ? daSize(&ids) : 1) * sizeof(lbmFileStat *));
+    lbmStatCacheGetMany(cache, pt, ids, daSize(&ids), stats, threadCount);
+
+    daCreate(&queue, sizeof(lbmBuildLogHashJob));
+    hashable = (int *)malloc((count ? count : 1) * sizeof(int));
+    ++log->generation;
+    n = 0;
+    for (i = 0; i < count; ++i)
+    {
+        hashable[i] = 1;
+        for (j = g->inputStart[rules[i]]; j < g->inputStart[rules[i] + 1]; ++j, ++n)
+        {
+            if (!lbmBuildLogVerify(log, pt, ids[n], stats[n], &queue))
+            {
+                hashable[i] = 0;
+            }
+        }
+    }
+    lbmBuildLogHashQueued(log, pt, queue, threadCount);
+
+    for (i = 0; i < count; ++i)
+    {
+        lbmBuildLogEntry *entry;
+        int rule = rules[i];
+        if (g->outputStart[rule] == g->outputStart[rule + 1])
+        {
+            continue;
+        }
+        entry = lbmBuildLogGet(log, g->nodePaths[g->outputs[g->outputStart[rule]]]);
+        lbmHash128(g->commands[rule], strlen(g->commands[rule]), LBM_BUILD_LOG_SEED, entry->command);
+        if (!hashable[i] || !lbmBuildLogInputsHash(log, g, rule, entry->inputs))
+        {
+            // Logged anyway, for the command and the time, but with inputs
+            // that can never match
+            entry->inputs[0] = 0;
+            entry->inputs[1] = 0;
+        }
+        entry->seconds = seconds[i];
+        entry->flags |= LBM_BUILD_LOG_RULE;
+        lbmBuildLogAppendRule(log, entry, pt);
+    }
+
+    free(hashable);
+    free(stats);
+    daDestroy(&queue, NULL);
+    daDestroy(&ids, NULL);
+}
@@ -0,0 +1,94 @@
+#ifndef LBMBUILDLOG_H
+#define LBMBUILDLOG_H
+
+#include "lbmFile.h"
+#include "lbmGraph.h"
+#include "lbmPath.h"
+
+// Persistent build log. For every rule that has run it remembers, under
+// the rule's first output, a hash of its command, a hash of its inputs'
+// contents and how long it took; for every input it remembers the content
+// hash along with the mtime and size it was taken at, so a file is only
+// read again once it has been touched.
+//
+// That lets planning see past mtimes: a rule whose inputs are only newer
+// (a checkout, a touch, a rebuild that wrote the same bytes) is still
+// clean if its command and input contents match the log, and a rule whose
+// command has changed is dirty even though every mtime says otherwise.
+//
+// The file is append-only between compactions. It is loaded through
+// lbmFileMapOpen() (mapped once it is big enough to be worth it), later
+// records win, and it is rewritten from what is live once dead records
+// outnumber live ones.
+//
+// Layout, in native byte order (a log never leaves the machine):
+//   header:    magic, version                          (2 x 4 bytes)
+//   each:      type (4), path length (4), payload, path, NUL
+//   file:      mtime (8), size (8), content hash (16)
+//   rule:      command hash (16), inputs hash (16), seconds (8)
+
+#define LBM_BUILD_LOG_FILE    (1 << 0) // hash, mtime and size are set
+#define LBM_BUILD_LOG_RULE    (1 << 1) // command, inputs and seconds are set
+#define LBM_BUILD_LOG_RACY    (1 << 2) // hashed too close to its mtime to keep
+
+typedef struct lbmBuildLogEntry
+{
+    int path;
+    int flags;                     // LBM_BUILD_LOG_*
+    int verified;                  // generation the file hash was last checked in
+    long long mtime;
+    long long size;
+    unsigned long long hash[2];    // of the file's contents
+    unsigned long long command[2]; // of the command that made this output
+    unsigned long long inputs[2];  // of that rule's input hashes, in order
+    double seconds;                // wall time of that command
+} lbmBuildLogEntry;
+
+typedef struct lbmBuildLog
+{
+    char *filename;            // dynString; NULL until lbmBuildLogLoad()
+    lbmBuildLogEntry *entries; // dynArray
+    int *slots;                // path id -> entry index + 1 (0 is none)
+    int slotCount;
+    int generation;            // bumped by every refresh
+    int records;               // in the file, live or not
+    int exists;                // the file has a good header
+    int damaged;               // a bad tail was found; rewrite rather than append
+    char *pending;             // records not yet written
+    size_t pendingLen;
+    size_t pendingCapacity;
+
+    int hashed;      // files read and hashed
+    int skipped;     // rules found up to date by hash alone
+    int compactions;
+} lbmBuildLog;
+
+void lbmBuildLogInit(lbmBuildLog *log);
+void lbmBuildLogFree(lbmBuildLog *log);
+
+// Reads the log at filename (a missing file is an empty log) and interns
+// its paths into pt
+void lbmBuildLogLoad(lbmBuildLog *log, const char *filename, lbmPathTable *pt);
+
+// Entry for a path id, or NULL
+lbmBuildLogEntry *lbmBuildLogFind(lbmBuildLog *log, int path);
+
+// Hashes, across up to threadCount threads, every input of a logged rule
+// whose mtime or size no longer matches the log. stats is per node, as for
+// lbmGraphPlanBuild(). Must come before planning with lbmBuildLogCheck().
+void lbmBuildLogRefresh(lbmBuildLog *log, lbmGraph *g, lbmPathTable *pt, lbmFileStat **stats, int threadCount);
+
+// Wall time of the rule's last logged run, or -1 if there isn't one
+double lbmBuildLogSeconds(lbmBuildLog *log, lbmGraph *g, int rule);
+
+// An lbmGraphCheckFunc; userdata is the log
+unsigned char lbmBuildLogCheck(void *userdata, lbmGraph *g, int rule, unsigned char reason);
+
+// Logs rules that have just run successfully, with their wall times,
+// hashing their inputs (fresh stat()s through cache) where needed
+void lbmBuildLogRecord(lbmBuildLog *log, lbmGraph *g, lbmPathTable *pt, lbmStatCache *cache, const int *rules, const double *seconds, int count, int threadCount);
+
+// Appends new records to the file, or compacts it. Returns 0 on failure.
+int lbmBuildLogFlush(lbmBuildLog *log, lbmPathTable *pt);
+
+#endif
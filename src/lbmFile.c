@@ -0,0 +1,677 @@
+#include "lbmFile.h"
+
+#include "lbmThread.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Below this, mapping costs more in page faults and setup than one read()
+#define LBM_FILE_MAP_MIN (64 * 1024)
+
+static int lbmFileReadAll(lbmFileMap *map, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    long len;
+    if (!f)
+    {
+        return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len < 0)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    map->data = (char *)malloc(len + 1);
+    map->len = fread(map->data, 1, len, f);
+    map->data[map->len] = 0;
+    map->mapped = 0;
+    fclose(f);
+    return 1;
+}
+
+int lbmFileMapOpen(lbmFileMap *map, const char *filename)
+{
+#ifdef WIN32
+    HANDLE file;
+    HANDLE mapping;
+    LARGE_INTEGER size;
+#else
+    struct stat st;
+    int fd;
+#endif
+
+    memset(map, 0, sizeof(lbmFileMap));
+
+#ifdef WIN32
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+    if (!GetFileSizeEx(file, &size) || (size.QuadPart < LBM_FILE_MAP_MIN))
+    {
+        CloseHandle(file);
+        return lbmFileReadAll(map, filename);
+    }
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+    {
+        map->data = (char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    if (!map->data)
+    {
+        return lbmFileReadAll(map, filename);
+    }
+    map->len = (size_t)size.QuadPart;
+#else
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < LBM_FILE_MAP_MIN))
+    {
+        // Small files, and anything fstat can't size (pipes, /proc), get read
+        close(fd);
+        return lbmFileReadAll(map, filename);
+    }
+    map->data = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->data == MAP_FAILED)
+    {
+        map->data = NULL;
+        return lbmFileReadAll(map, filename);
+    }
+    map->len = (size_t)st.st_size;
+#endif
+    map->mapped = 1;
+    return 1;
+}
+
+void lbmFileMapClose(lbmFileMap *map)
+{
+    if (map->mapped)
+    {
+#ifdef WIN32
+        UnmapViewOfFile(map->data);
+#else
+        munmap(map->data, map->len);
+#endif
+    }
+    else
+    {
+        free(map->data);
+    }
+    memset(map, 0, sizeof(lbmFileMap));
+}
+
+const char *lbmFileFind(const char *s, size_t len, const char *needle, size_t needleLen)
+{
+    const char *end = s + len;
+    const char *c = s;
+
+    if (needleLen == 0)
+    {
+        return s;
+    }
+    while ((size_t)(end - c) >= needleLen)
+    {
+        c = (const char *)memchr(c, needle[0], (end - c) - needleLen + 1);
+        if (!c)
+        {
+            break;
+        }
+        if (!memcmp(c, needle, needleLen))
+        {
+            return c;
+        }
+        ++c;
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+
+// Size first, so most changed outputs never get opened; then the bytes
+static int lbmFileHolds(const char *filename, const char *data, size_t len)
+{
+    struct stat st;
+    lbmFileMap map;
+    int same;
+
+    if ((stat(filename, &st) != 0) || ((size_t)st.st_size != len))
+    {
+        return 0;
+    }
+    if (!lbmFileMapOpen(&map, filename))
+    {
+        return 0;
+    }
+    same = (map.len == len) && !memcmp(map.data, data, len);
+    lbmFileMapClose(&map);
+    return same;
+}
+
+#ifdef WIN32
+
+static FILE *lbmFileCreateTemp(const char *filename, char *temp)
+{
+    sprintf(temp, "%s.lbmtmp%lu.%lu", filename, (unsigned long)GetCurrentProcessId(), (unsigned long)GetCurrentThreadId());
+    return fopen(temp, "wb");
+}
+
+static int lbmFileReplace(const char *temp, const char *filename)
+{
+    return MoveFileExA(temp, filename, MOVEFILE_REPLACE_EXISTING) ? 1 : 0;
+}
+
+#else
+
+// Beside the target, so the rename never crosses filesystems, and named
+// for the writing thread, which lbm.write_async's workers need. The
+// target's mode carries over, so rewriting a script leaves it executable.
+static FILE *lbmFileCreateTemp(const char *filename, char *temp)
+{
+    struct stat st;
+    int haveMode = (stat(filename, &st) == 0);
+    int fd;
+
+    sprintf(temp, "%s.lbmtmp%ld.%lu", filename, (long)getpid(), (unsigned long)pthread_self());
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (haveMode)
+    {
+        fchmod(fd, st.st_mode & 07777);
+    }
+    return fdopen(fd, "wb");
+}
+
+static int lbmFileReplace(const char *temp, const char *filename)
+{
+    return rename(temp, filename) == 0;
+}
+
+#endif
+
+static int lbmFileWriteAll(FILE *f, const char *data, size_t len)
+{
+    int ok = (fwrite(data, 1, len, f) == len);
+    if (fclose(f) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+int lbmFileWrite(const char *filename, const char *data, size_t len, int flags)
+{
+    char *temp;
+    FILE *f;
+    int ok = 0;
+
+    if ((flags & LBM_WRITE_IF_CHANGED) && lbmFileHolds(filename, data, len))
+    {
+        return LBM_WRITE_UNCHANGED;
+    }
+    if (!(flags & LBM_WRITE_ATOMIC))
+    {
+        f = fopen(filename, "wb");
+        return (f && lbmFileWriteAll(f, data, len)) ? LBM_WRITE_WRITTEN : LBM_WRITE_FAILED;
+    }
+
+    temp = (char *)malloc(strlen(filename) + 48);
+    f = lbmFileCreateTemp(filename, temp);
+    if (f)
+    {
+        ok = lbmFileWriteAll(f, data, len);
+        if (ok)
+        {
+            ok = lbmFileReplace(temp, filename);
+        }
+        if (!ok)
+        {
+            remove(temp);
+        }
+    }
+    free(temp);
+    return ok ? LBM_WRITE_WRITTEN : LBM_WRITE_FAILED;
+}
+
+// ---------------------------------------------------------------------------
+// Directories
+
+#define LBM_MKDIR_OK        0
+#define LBM_MKDIR_EXISTS    1 // something is already there
+#define LBM_MKDIR_NO_PARENT 2
+#define LBM_MKDIR_FAILED    3
+
+static int lbmFileMkdir(const char *path)
+{
+#ifdef WIN32
+    if (CreateDirectoryA(path, NULL))
+    {
+        return LBM_MKDIR_OK;
+    }
+    switch (GetLastError())
+    {
+        case ERROR_ALREADY_EXISTS:
+            return LBM_MKDIR_EXISTS;
+        case ERROR_PATH_NOT_FOUND:
+            return LBM_MKDIR_NO_PARENT;
+    };
+#else
+    if (mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0)
+    {
+        return LBM_MKDIR_OK;
+    }
+    switch (errno)
+    {
+        case EEXIST:
+            return LBM_MKDIR_EXISTS;
+        case ENOENT:
+            return LBM_MKDIR_NO_PARENT;
+    };
+#endif
+    return LBM_MKDIR_FAILED;
+}
+
+static int lbmFileIsDir(const char *path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) && ((st.st_mode & S_IFMT) == S_IFDIR);
+}
+
+void lbmFileForgetDirs(lbmPathTable *pt, int id)
+{
+    lbmPathEntry *entry = lbmPathGet(pt, id);
+    while (entry)
+    {
+        entry->flags &= ~(LBM_PATH_DIR_EXISTS | LBM_PATH_STAT_CACHED);
+        entry = lbmPathGet(pt, entry->parent);
+    }
+}
+
+int lbmFileMakeDirs(lbmPathTable *pt, int id, int log)
+{
+    lbmPathEntry *entry = lbmPathGet(pt, id);
+    int created = 0;
+    int result;
+
+    if (!entry)
+    {
+        return -1;
+    }
+    if (entry->flags & LBM_PATH_DIR_EXISTS)
+    {
+        return 0;
+    }
+
+    result = lbmFileMkdir(entry->s);
+    if (result == LBM_MKDIR_NO_PARENT)
+    {
+        created = lbmFileMakeDirs(pt, entry->parent, log);
+        if (created < 0)
+        {
+            return -1;
+        }
+        result = lbmFileMkdir(entry->s);
+    }
+
+    switch (result)
+    {
+        case LBM_MKDIR_OK:
+            ++created;
+            lbmFileInvalidate(pt, id);
+            if (log)
+            {
+                printf("Creating directory: %s\n", entry->s);
+            }
+            break;
+        case LBM_MKDIR_EXISTS:
+            // Possibly made by someone else since; fine if it's a directory
+            if (!lbmFileIsDir(entry->s))
+            {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    };
+
+    entry->flags |= LBM_PATH_DIR_EXISTS;
+    return created;
+}
+
+int lbmFileRemakeDirs(lbmPathTable *pt, int id, int log)
+{
+    lbmPathEntry *entry = lbmPathGet(pt, id);
+    lbmPathEntry *parent = (entry) ? lbmPathGet(pt, entry->parent) : NULL;
+
+    if ((errno != ENOENT) || !parent || !(parent->flags & LBM_PATH_DIR_EXISTS))
+    {
+        return 0;
+    }
+    lbmFileForgetDirs(pt, entry->parent);
+    return lbmFileMakeDirs(pt, entry->parent, log) > 0;
+}
+
+// ---------------------------------------------------------------------------
+// Stat cache
+
+void lbmFileStatPath(const char *path, lbmFileStat *st)
+{
+#ifdef WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    memset(st, 0, sizeof(lbmFileStat));
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+    {
+        return;
+    }
+    st->type = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? LBM_FILE_DIR : LBM_FILE_REGULAR;
+    st->size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    // FILETIME counts 100ns ticks from 1601
+    st->mtime = ((((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime) - 116444736000000000LL) * 100;
+#else
+    struct stat sb;
+    memset(st, 0, sizeof(lbmFileStat));
+    if (stat(path, &sb) != 0)
+    {
+        return;
+    }
+    if (S_ISREG(sb.st_mode))
+    {
+        st->type = LBM_FILE_REGULAR;
+    }
+    else if (S_ISDIR(sb.st_mode))
+    {
+        st->type = LBM_FILE_DIR;
+    }
+    else
+    {
+        st->type = LBM_FILE_OTHER;
+    }
+    st->size = (long long)sb.st_size;
+#if defined(__APPLE__)
+    st->mtime = (long long)sb.st_mtimespec.tv_sec * 1000000000LL + sb.st_mtimespec.tv_nsec;
+#else
+    st->mtime = (long long)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+#endif
+    st->inode = (unsigned long long)sb.st_ino;
+#endif
+}
+
+void lbmStatCacheInit(lbmStatCache *cache)
+{
+    memset(cache, 0, sizeof(lbmStatCache));
+}
+
+void lbmStatCacheFree(lbmStatCache *cache)
+{
+    free(cache->stats);
+    memset(cache, 0, sizeof(lbmStatCache));
+}
+
+static void lbmStatCacheReserve(lbmStatCache *cache, int count)
+{
+    if (count > cache->capacity)
+    {
+        int capacity = (cache->capacity) ? cache->capacity : 1024;
+        while (capacity < count)
+        {
+            capacity *= 2;
+        }
+        cache->stats = (lbmFileStat *)realloc(cache->stats, capacity * sizeof(lbmFileStat));
+        cache->capacity = capacity;
+    }
+}
+
+static void lbmStatCacheStore(lbmStatCache *cache, lbmPathEntry *entry, int id)
+{
+    entry->flags |= LBM_PATH_STAT_CACHED;
+    if (cache->stats[id].type == LBM_FILE_DIR)
+    {
+        entry->flags |= LBM_PATH_DIR_EXISTS;
+    }
+    else
+    {
+        entry->flags &= ~LBM_PATH_DIR_EXISTS;
+    }
+}
+
+lbmFileStat *lbmStatCacheGet(lbmStatCache *cache, lbmPathTable *pt, int id)
+{
+    lbmPathEntry *entry = lbmPathGet(pt, id);
+    if (!entry)
+    {
+        return NULL;
+    }
+    lbmStatCacheReserve(cache, lbmPathCount(pt));
+    if (entry->flags & LBM_PATH_STAT_CACHED)
+    {
+        ++cache->hits;
+    }
+    else
+    {
+        ++cache->misses;
+        lbmFileStatPath(entry->s, &cache->stats[id]);
+        lbmStatCacheStore(cache, entry, id);
+    }
+    return &cache->stats[id];
+}
+
+typedef struct lbmStatBatch
+{
+    lbmStatCache *cache;
+    lbmPathTable *pt;
+    int *misses; // ids
+} lbmStatBatch;
+
+// Runs on worker threads: only reads entry text and writes distinct slots
+static void lbmStatBatchRange(void *userdata, int begin, int end)
+{
+    lbmStatBatch *batch = (lbmStatBatch *)userdata;
+    int i;
+    for (i = begin; i < end; ++i)
+    {
+        int id = batch->misses[i];
+        lbmFileStatPath(batch->pt->entries[id].s, &batch->cache->stats[id]);
+    }
+}
+
+void lbmStatCacheGetMany(lbmStatCache *cache, lbmPathTable *pt, const int *ids, int count, lbmFileStat **out, int threadCount)
+{
+    lbmStatBatch batch;
+    int missCount = 0;
+    int i;
+
+    lbmStatCacheReserve(cache, lbmPathCount(pt));
+    batch.cache = cache;
+    batch.pt = pt;
+    batch.misses = (int *)malloc(count * sizeof(int));
+    for (i = 0; i < count; ++i)
+    {
+        lbmPathEntry *entry = lbmPathGet(pt, ids[i]);
+        out[i] = (entry) ? &cache->stats[ids[i]] : NULL;
+        if (!entry)
+        {
+            continue;
+        }
+        if (entry->flags & LBM_PATH_STAT_CACHED)
+        {
+            ++cache->hits;
+        }
+        else
+        {
+            // Flagged now so a path listed twice is only stat()ed once
+            ++cache->misses;
+            entry->flags |= LBM_PATH_STAT_CACHED;
+            batch.misses[missCount++] = ids[i];
+        }
+    }
+
+    lbmParallelFor(missCount, threadCount, lbmStatBatchRange, &batch);
+    for (i = 0; i < missCount; ++i)
+    {
+        lbmStatCacheStore(cache, lbmPathGet(pt, batch.misses[i]), batch.misses[i]);
+    }
+    free(batch.misses);
+}
+
+void lbmFileInvalidate(lbmPathTable *pt, int id)
+{
+    lbmPathEntry *entry = lbmPathGet(pt, id);
+    if (entry)
+    {
+        entry->flags &= ~(LBM_PATH_STAT_CACHED | LBM_PATH_DIR_EXISTS);
+        entry = lbmPathGet(pt, entry->parent);
+        if (entry)
+        {
+            entry->flags &= ~LBM_PATH_STAT_CACHED;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Streaming
+
+int lbmFileReaderOpen(lbmFileReader *r, const char *filename, size_t chunkSize)
+{
+    FILE *f = fopen(filename, "rb");
+    memset(r, 0, sizeof(lbmFileReader));
+    if (!f)
+    {
+        return 0;
+    }
+
+    // The reader's own buffer is the only one; stdio's would just add a copy
+    setvbuf(f, NULL, _IONBF, 0);
+#if !defined(WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    r->f = f;
+    r->size = (chunkSize) ? chunkSize : LBM_FILE_CHUNK_DEFAULT;
+    r->buffer = (char *)malloc(r->size);
+    return 1;
+}
+
+void lbmFileReaderClose(lbmFileReader *r)
+{
+    if (r->f)
+    {
+        fclose((FILE *)r->f);
+    }
+    free(r->buffer);
+    memset(r, 0, sizeof(lbmFileReader));
+}
+
+// Moves the unread tail to the front (growing the buffer if the tail
+// already fills it) and reads as much as fits after it
+static void lbmFileReaderFill(lbmFileReader *r)
+{
+    size_t pending = r->end - r->start;
+    if (r->start > 0)
+    {
+        memmove(r->buffer, r->buffer + r->start, pending);
+        r->start = 0;
+        r->end = pending;
+    }
+    if (r->end == r->size)
+    {
+        r->size *= 2;
+        r->buffer = (char *)realloc(r->buffer, r->size);
+    }
+    r->end += fread(r->buffer + r->end, 1, r->size - r->end, (FILE *)r->f);
+    if (r->end < r->size)
+    {
+        r->eof = 1;
+    }
+}
+
+size_t lbmFileReaderChunk(lbmFileReader *r, const char **out)
+{
+    size_t len;
+    if (!r->f)
+    {
+        return 0;
+    }
+    if (r->start == r->end)
+    {
+        if (r->eof)
+        {
+            return 0;
+        }
+        r->start = r->end = 0;
+        lbmFileReaderFill(r);
+    }
+    *out = r->buffer + r->start;
+    len = r->end - r->start;
+    r->start = r->end;
+    r->scan = 0;
+    return len;
+}
+
+int lbmFileReaderLine(lbmFileReader *r, const char **out, size_t *len)
+{
+    const char *newline;
+    size_t lineLen;
+
+    if (!r->f)
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        newline = (const char *)memchr(r->buffer + r->start + r->scan, '\n', r->end - r->start - r->scan);
+        if (newline)
+        {
+            break;
+        }
+        r->scan = r->end - r->start;
+        if (r->eof)
+        {
+            if (r->start == r->end)
+            {
+                return 0;
+            }
+            newline = r->buffer + r->end; // last line has no terminator
+            break;
+        }
+        lbmFileReaderFill(r);
+    }
+
+    *out = r->buffer + r->start;
+    lineLen = newline - *out;
+    r->start += (newline < r->buffer + r->end) ? lineLen + 1 : lineLen;
+    r->scan = 0;
+    if (lineLen && ((*out)[lineLen - 1] == '\r'))
+    {
+        --lineLen;
+    }
+    *len = lineLen;
+    return 1;
+}
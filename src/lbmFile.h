@@ -0,0 +1,117 @@
+#ifndef LBMFILE_H
+#define LBMFILE_H
+
+#include "lbmPath.h"
+
+#include <stddef.h>
+
+// Read-only view of a whole file. Large files are memory-mapped; small ones
+// are cheaper to read into a heap copy, which is also NUL terminated.
+typedef struct lbmFileMap
+{
+    char *data;
+    size_t len;
+    int mapped; // data is a mapping rather than a heap copy
+} lbmFileMap;
+
+int lbmFileMapOpen(lbmFileMap *map, const char *filename); // 0 if it couldn't be opened
+void lbmFileMapClose(lbmFileMap *map);
+
+// lbmFileWrite() flags
+#define LBM_WRITE_IF_CHANGED (1 << 0) // leave the file (and its mtime) alone if it already holds data
+#define LBM_WRITE_ATOMIC     (1 << 1) // write a temp file beside it, then rename it over the target
+
+// lbmFileWrite() results
+#define LBM_WRITE_FAILED    (-1)
+#define LBM_WRITE_UNCHANGED 0
+#define LBM_WRITE_WRITTEN   1
+
+// Truncates and rewrites filename in place, so symlinks are written
+// through and hard links, ownership and extended attributes survive. With
+// LBM_WRITE_ATOMIC the data goes to a temp file beside it (same mode) that
+// is renamed over it instead: readers never see a partial file, and
+// mappings of the old contents (lbmFileMapOpen) stay valid.
+int lbmFileWrite(const char *filename, const char *data, size_t len, int flags);
+
+// Creates interned directory id and any missing ancestors, trying mkdir()
+// first and only climbing to the parent when that fails for want of one.
+// Directories created or found are flagged LBM_PATH_DIR_EXISTS, and asking
+// again for a flagged one is free: no stat(), no mkdir(). A directory
+// removed behind our back is only noticed when something written into it
+// fails; see lbmFileRemakeDirs. Returns the number of directories created,
+// or -1 on failure. If log is set, each new directory is printed.
+int lbmFileMakeDirs(lbmPathTable *pt, int id, int log);
+
+// Drops LBM_PATH_DIR_EXISTS (and any cached stat) from id and every
+// directory above it, so the next lbmFileMakeDirs checks them again.
+void lbmFileForgetDirs(lbmPathTable *pt, int id);
+
+// Recovery for a write into file id that just failed. If errno is ENOENT
+// and id's parent was flagged LBM_PATH_DIR_EXISTS, the flags are stale:
+// they are forgotten and the directories made again. Returns 1 if any were
+// created and the write is worth retrying once, 0 otherwise.
+int lbmFileRemakeDirs(lbmPathTable *pt, int id, int log);
+
+// ---------------------------------------------------------------------------
+// Stat cache
+
+#define LBM_FILE_MISSING 0
+#define LBM_FILE_REGULAR 1
+#define LBM_FILE_DIR     2
+#define LBM_FILE_OTHER   3
+
+typedef struct lbmFileStat
+{
+    int type;                 // LBM_FILE_*
+    long long size;
+    long long mtime;          // nanoseconds since the Unix epoch
+    unsigned long long inode; // 0 on Win32
+} lbmFileStat;
+
+void lbmFileStatPath(const char *path, lbmFileStat *st);
+
+// Results of stat() per interned path, for the life of the run. An entry is
+// current while its path has LBM_PATH_STAT_CACHED; lbmFileInvalidate() drops
+// it (and its parent directory's, whose mtime changes too).
+typedef struct lbmStatCache
+{
+    lbmFileStat *stats; // indexed by path id
+    int capacity;
+    int hits;
+    int misses;
+} lbmStatCache;
+
+void lbmStatCacheInit(lbmStatCache *cache);
+void lbmStatCacheFree(lbmStatCache *cache);
+lbmFileStat *lbmStatCacheGet(lbmStatCache *cache, lbmPathTable *pt, int id);
+
+// Fills out[i] for every ids[i], stat()ing all the misses across up to
+// threadCount threads (<= 0 means one per CPU)
+void lbmStatCacheGetMany(lbmStatCache *cache, lbmPathTable *pt, const int *ids, int count, lbmFileStat **out, int threadCount);
+
+void lbmFileInvalidate(lbmPathTable *pt, int id);
+
+// Sequential reader over one large reusable buffer, for files too big to
+// hold in memory. Spans handed out are only valid until the next call.
+#define LBM_FILE_CHUNK_DEFAULT (256 * 1024)
+
+typedef struct lbmFileReader
+{
+    void *f;      // FILE *
+    char *buffer;
+    size_t size;  // buffer capacity
+    size_t start; // first byte not yet handed out
+    size_t scan;  // bytes from start already searched for a newline
+    size_t end;   // one past the last byte read
+    int eof;
+} lbmFileReader;
+
+int lbmFileReaderOpen(lbmFileReader *r, const char *filename, size_t chunkSize); // 0 if it couldn't be opened
+void lbmFileReaderClose(lbmFileReader *r);
+size_t lbmFileReaderChunk(lbmFileReader *r, const char **out); // 0 at the end
+int lbmFileReaderLine(lbmFileReader *r, const char **out, size_t *len); // CR LF or LF stripped, 0 at the end
+
+// Plain (non-pattern) search for needle in [s, s + len). Returns NULL if absent.
+const char *lbmFileFind(const char *s, size_t len, const char *needle, size_t needleLen);
+
+#endif
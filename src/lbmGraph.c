@@ -0,0 +1,420 @@
+#include "lbmGraph.h"
+
+#include "dyn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LBM_GRAPH_ARENA_CHUNK (64 * 1024)
+
+void lbmGraphInit(lbmGraph *g)
+{
+    memset(g, 0, sizeof(lbmGraph));
+    daCreate(&g->inputStart, sizeof(int));
+    daCreate(&g->inputs, sizeof(int));
+    daCreate(&g->outputStart, sizeof(int));
+    daCreate(&g->outputs, sizeof(int));
+    daCreate(&g->commands, sizeof(const char *));
+    daCreate(&g->nodePaths, sizeof(int));
+    daCreate(&g->producers, sizeof(int));
+    daPush(&g->inputStart, 0);
+    daPush(&g->outputStart, 0);
+    lbmArenaInit(&g->strings, LBM_GRAPH_ARENA_CHUNK);
+}
+
+static void lbmGraphUnfinalize(lbmGraph *g)
+{
+    free(g->depStart);
+    free(g->deps);
+    free(g->useStart);
+    free(g->uses);
+    free(g->order);
+    g->depStart = g->deps = g->useStart = g->uses = g->order = NULL;
+    g->finalized = 0;
+}
+
+void lbmGraphFree(lbmGraph *g)
+{
+    lbmGraphUnfinalize(g);
+    daDestroy(&g->inputStart, NULL);
+    daDestroy(&g->inputs, NULL);
+    daDestroy(&g->outputStart, NULL);
+    daDestroy(&g->outputs, NULL);
+    daDestroy(&g->commands, NULL);
+    daDestroy(&g->nodePaths, NULL);
+    daDestroy(&g->producers, NULL);
+    free(g->pathNodes);
+    lbmArenaFree(&g->strings);
+    memset(g, 0, sizeof(lbmGraph));
+}
+
+int lbmGraphFindNode(lbmGraph *g, int pathId)
+{
+    if ((pathId < 0) || (pathId >= g->pathCapacity))
+    {
+        return LBM_GRAPH_NONE;
+    }
+    return g->pathNodes[pathId];
+}
+
+int lbmGraphNode(lbmGraph *g, int pathId)
+{
+    int node;
+    if (pathId >= g->pathCapacity)
+    {
+        int capacity = (g->pathCapacity) ? g->pathCapacity : 1024;
+        int i;
+        while (capacity <= pathId)
+        {
+            capacity *= 2;
+        }
+        g->pathNodes = (int *)realloc(g->pathNodes, capacity * sizeof(int));
+        for (i = g->pathCapacity; i < capacity; ++i)
+        {
+            g->pathNodes[i] = LBM_GRAPH_NONE;
+        }
+        g->pathCapacity = capacity;
+    }
+
+    node = g->pathNodes[pathId];
+    if (node == LBM_GRAPH_NONE)
+    {
+        node = g->nodeCount++;
+        g->pathNodes[pathId] = node;
+        daPush(&g->nodePaths, pathId);
+        daPush(&g->producers, LBM_GRAPH_NONE);
+    }
+    return node;
+}
+
+int lbmGraphAddRule(lbmGraph *g, const int *inputs, int inputCount, const int *outputs, int outputCount, const char *command, int *conflict)
+{
+    int rule = g->ruleCount;
+    int i;
+
+    // Check every output before touching anything, so a failed rule leaves
+    // no trace
+    for (i = 0; i < outputCount; ++i)
+    {
+        int node = lbmGraphFindNode(g, outputs[i]);
+        int j;
+        for (j = 0; j < i; ++j)
+        {
+            if (outputs[j] == outputs[i])
+            {
+                *conflict = outputs[i];
+                return LBM_GRAPH_NONE;
+            }
+        }
+        if ((node != LBM_GRAPH_NONE) && (g->producers[node] != LBM_GRAPH_NONE))
+        {
+            *conflict = outputs[i];
+            return LBM_GRAPH_NONE;
+        }
+    }
+
+    for (i = 0; i < inputCount; ++i)
+    {
+        daPush(&g->inputs, lbmGraphNode(g, inputs[i]));
+    }
+    daPush(&g->inputStart, daSize(&g->inputs));
+    for (i = 0; i < outputCount; ++i)
+    {
+        int node = lbmGraphNode(g, outputs[i]);
+        g->producers[node] = rule;
+        daPush(&g->outputs, node);
+    }
+    daPush(&g->outputStart, daSize(&g->outputs));
+    daPush(&g->commands, lbmArenaStrdup(&g->strings, command, strlen(command)));
+    ++g->ruleCount;
+
+    lbmGraphUnfinalize(g);
+    return rule;
+}
+
+// Follows unfinished dependencies from start until one repeats; every rule
+// Kahn's algorithm couldn't place still has at least one, so this ends on a
+// cycle
+static void lbmGraphFindCycle(lbmGraph *g, const int *pending, int start, int **cycle, int *cycleLength)
+{
+    int *step = (int *)malloc(g->ruleCount * sizeof(int)); // position on the walk, or -1
+    int *walk = (int *)malloc(g->ruleCount * sizeof(int));
+    int length = 0;
+    int rule = start;
+    int i;
+
+    for (i = 0; i < g->ruleCount; ++i)
+    {
+        step[i] = -1;
+    }
+    while (step[rule] < 0)
+    {
+        step[rule] = length;
+        walk[length++] = rule;
+        for (i = g->depStart[rule]; i < g->depStart[rule + 1]; ++i)
+        {
+            if (pending[g->deps[i]])
+            {
+                rule = g->deps[i];
+                break;
+            }
+        }
+    }
+
+    *cycleLength = length - step[rule];
+    *cycle = (int *)malloc(*cycleLength * sizeof(int));
+    memcpy(*cycle, walk + step[rule], *cycleLength * sizeof(int));
+    free(walk);
+    free(step);
+}
+
+int lbmGraphFinalize(lbmGraph *g, int **cycle, int *cycleLength)
+{
+    int ruleCount = g->ruleCount;
+    int *seen;    // last rule to record an edge from each producer
+    int *pending; // dependencies not yet placed in order
+    int *fill;
+    int edgeCount = 0;
+    int placed = 0;
+    int next = 0;
+    int r;
+    int i;
+
+    *cycle = NULL;
+    *cycleLength = 0;
+    if (g->finalized)
+    {
+        return 1;
+    }
+
+    // Rule edges, in two passes over the inputs: count, then fill
+    seen = (int *)malloc((ruleCount ? ruleCount : 1) * sizeof(int));
+    for (r = 0; r < ruleCount; ++r)
+    {
+        seen[r] = LBM_GRAPH_NONE;
+    }
+    g->depStart = (int *)malloc((ruleCount + 1) * sizeof(int));
+    for (r = 0; r < ruleCount; ++r)
+    {
+        g->depStart[r] = edgeCount;
+        for (i = g->inputStart[r]; i < g->inputStart[r + 1]; ++i)
+        {
+            int producer = g->producers[g->inputs[i]];
+            if ((producer != LBM_GRAPH_NONE) && (seen[producer] != r))
+            {
+                seen[producer] = r;
+                ++edgeCount;
+            }
+        }
+    }
+    g->depStart[ruleCount] = edgeCount;
+
+    g->deps = (int *)malloc((edgeCount ? edgeCount : 1) * sizeof(int));
+    g->useStart = (int *)calloc(ruleCount + 1, sizeof(int));
+    for (r = 0; r < ruleCount; ++r)
+    {
+        seen[r] = LBM_GRAPH_NONE;
+    }
+    edgeCount = 0;
+    for (r = 0; r < ruleCount; ++r)
+    {
+        for (i = g->inputStart[r]; i < g->inputStart[r + 1]; ++i)
+        {
+            int producer = g->producers[g->inputs[i]];
+            if ((producer != LBM_GRAPH_NONE) && (seen[producer] != r))
+            {
+                seen[producer] = r;
+                g->deps[edgeCount++] = producer;
+                ++g->useStart[producer + 1];
+            }
+        }
+    }
+
+    // Transpose
+    for (r = 0; r < ruleCount; ++r)
+    {
+        g->useStart[r + 1] += g->useStart[r];
+    }
+    g->uses = (int *)malloc((edgeCount ? edgeCount : 1) * sizeof(int));
+    fill = seen;
+    memcpy(fill, g->useStart, ruleCount * sizeof(int));
+    for (r = 0; r < ruleCount; ++r)
+    {
+        for (i = g->depStart[r]; i < g->depStart[r + 1]; ++i)
+        {
+            g->uses[fill[g->deps[i]]++] = r;
+        }
+    }
+    free(seen);
+
+    // Kahn's algorithm, with order doubling as the queue
+    g->order = (int *)malloc((ruleCount ? ruleCount : 1) * sizeof(int));
+    pending = (int *)malloc((ruleCount ? ruleCount : 1) * sizeof(int));
+    for (r = 0; r < ruleCount; ++r)
+    {
+        pending[r] = g->depStart[r + 1] - g->depStart[r];
+        if (!pending[r])
+        {
+            g->order[placed++] = r;
+        }
+    }
+    while (next < placed)
+    {
+        r = g->order[next++];
+        for (i = g->useStart[r]; i < g->useStart[r + 1]; ++i)
+        {
+            if (--pending[g->uses[i]] == 0)
+            {
+                g->order[placed++] = g->uses[i];
+            }
+        }
+    }
+
+    if (placed < ruleCount)
+    {
+        for (r = 0; r < ruleCount; ++r)
+        {
+            if (pending[r])
+            {
+                lbmGraphFindCycle(g, pending, r, cycle, cycleLength);
+                break;
+            }
+        }
+        free(pending);
+        lbmGraphUnfinalize(g);
+        return 0;
+    }
+    free(pending);
+    g->finalized = 1;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Plans
+
+static unsigned char lbmGraphStaleness(lbmGraph *g, int rule, lbmFileStat **stats, const unsigned char *reasons, int *missing)
+{
+    long long newestInput = 0;
+    long long oldestOutput = 0;
+    int i;
+
+    for (i = g->depStart[rule]; i < g->depStart[rule + 1]; ++i)
+    {
+        if (reasons[g->deps[i]] != LBM_GRAPH_CLEAN)
+        {
+            return LBM_GRAPH_DEPENDENCY;
+        }
+    }
+
+    for (i = g->inputStart[rule]; i < g->inputStart[rule + 1]; ++i)
+    {
+        int node = g->inputs[i];
+        lbmFileStat *st = stats[node];
+        if (st->type == LBM_FILE_MISSING)
+        {
+            // A produced input is only missing if its producer will run,
+            // which the dependency check above already caught
+            *missing = node;
+            return LBM_GRAPH_CLEAN;
+        }
+        if (st->mtime > newestInput)
+        {
+            newestInput = st->mtime;
+        }
+    }
+
+    if (g->outputStart[rule] == g->outputStart[rule + 1])
+    {
+        return LBM_GRAPH_NO_OUTPUTS;
+    }
+    for (i = g->outputStart[rule]; i < g->outputStart[rule + 1]; ++i)
+    {
+        lbmFileStat *st = stats[g->outputs[i]];
+        if (st->type == LBM_FILE_MISSING)
+        {
+            return LBM_GRAPH_OUTPUT_MISSING;
+        }
+        if ((i == g->outputStart[rule]) || (st->mtime < oldestOutput))
+        {
+            oldestOutput = st->mtime;
+        }
+    }
+    return (newestInput > oldestOutput) ? LBM_GRAPH_INPUT_NEWER : LBM_GRAPH_CLEAN;
+}
+
+int lbmGraphPlanBuild(lbmGraph *g, const int *goals, int goalCount, lbmFileStat **stats, lbmGraphCheckFunc check, void *userdata, lbmGraphPlan *plan)
+{
+    unsigned char *needed = (unsigned char *)calloc(g->ruleCount ? g->ruleCount : 1, 1);
+    int i;
+
+    plan->rules = (int *)malloc((g->ruleCount ? g->ruleCount : 1) * sizeof(int));
+    plan->count = 0;
+    plan->reasons = (unsigned char *)calloc(g->ruleCount ? g->ruleCount : 1, 1);
+    plan->missing = LBM_GRAPH_NONE;
+    plan->missingRule = LBM_GRAPH_NONE;
+
+    // Needed rules: the goals' producers and everything upstream of them.
+    // Walking the order backwards sees every consumer before its producers.
+    if (goalCount)
+    {
+        for (i = 0; i < goalCount; ++i)
+        {
+            int producer = g->producers[goals[i]];
+            if (producer != LBM_GRAPH_NONE)
+            {
+                needed[producer] = 1;
+            }
+        }
+        for (i = g->ruleCount - 1; i >= 0; --i)
+        {
+            int rule = g->order[i];
+            int j;
+            if (needed[rule])
+            {
+                for (j = g->depStart[rule]; j < g->depStart[rule + 1]; ++j)
+                {
+                    needed[g->deps[j]] = 1;
+                }
+            }
+        }
+    }
+    else
+    {
+        memset(needed, 1, g->ruleCount);
+    }
+
+    for (i = 0; i < g->ruleCount; ++i)
+    {
+        int rule = g->order[i];
+        unsigned char reason;
+        if (!needed[rule])
+        {
+            continue;
+        }
+        reason = lbmGraphStaleness(g, rule, stats, plan->reasons, &plan->missing);
+        if (plan->missing != LBM_GRAPH_NONE)
+        {
+            plan->missingRule = rule;
+            free(needed);
+            return 0;
+        }
+        if (check && ((reason == LBM_GRAPH_CLEAN) || (reason == LBM_GRAPH_INPUT_NEWER)))
+        {
+            reason = check(userdata, g, rule, reason);
+        }
+        plan->reasons[rule] = reason;
+        if (reason != LBM_GRAPH_CLEAN)
+        {
+            plan->rules[plan->count++] = rule;
+        }
+    }
+    free(needed);
+    return 1;
+}
+
+void lbmGraphPlanFree(lbmGraphPlan *plan)
+{
+    free(plan->rules);
+    free(plan->reasons);
+    memset(plan, 0, sizeof(lbmGraphPlan));
+}
@@ -0,0 +1,95 @@
+#ifndef LBMGRAPH_H
+#define LBMGRAPH_H
+
+#include "lbmArena.h"
+#include "lbmFile.h"
+
+// Build graph. Nodes are files (interned path ids, renumbered densely) and
+// rules turn input nodes into output nodes with a command. Everything is kept
+// in flat CSR arrays: a rule's inputs are inputs[inputStart[r],
+// inputStart[r + 1]), and lbmGraphFinalize() derives the rule-to-rule edges
+// the same way, so walking the graph never chases a pointer.
+
+#define LBM_GRAPH_NONE (-1)
+
+// Why a rule needs to run; lbmGraphPlan.reasons
+#define LBM_GRAPH_CLEAN           0
+#define LBM_GRAPH_NO_OUTPUTS      1 // nothing to compare against, so always
+#define LBM_GRAPH_OUTPUT_MISSING  2
+#define LBM_GRAPH_INPUT_NEWER     3 // an input is newer than the oldest output
+#define LBM_GRAPH_DEPENDENCY      4 // a rule producing one of its inputs will run
+#define LBM_GRAPH_COMMAND_CHANGED 5 // last built by a different command (see lbmBuildLog.h)
+
+typedef struct lbmGraph
+{
+    // Per rule, appended by lbmGraphAddRule()
+    int *inputStart;       // ruleCount + 1 entries
+    int *inputs;           // dynArray of nodes
+    int *outputStart;      // ruleCount + 1 entries
+    int *outputs;          // dynArray of nodes
+    const char **commands; // dynArray, in strings
+    int ruleCount;
+    lbmArena strings;
+
+    // Per node
+    int *nodePaths;  // dynArray of path ids
+    int *producers;  // rule with the node as an output, or LBM_GRAPH_NONE
+    int nodeCount;
+    int nodeCapacity;
+    int *pathNodes;  // path id -> node, or LBM_GRAPH_NONE
+    int pathCapacity;
+
+    // Built by lbmGraphFinalize(); dropped by the next lbmGraphAddRule()
+    int finalized;
+    int *depStart; // ruleCount + 1 entries
+    int *deps;     // rules producing each rule's inputs, without repeats
+    int *useStart; // ruleCount + 1 entries
+    int *uses;     // the same edges reversed: rules consuming each rule's outputs
+    int *order;    // every rule, dependencies first
+} lbmGraph;
+
+void lbmGraphInit(lbmGraph *g);
+void lbmGraphFree(lbmGraph *g);
+
+// Node for a path id, adding it if it is new
+int lbmGraphNode(lbmGraph *g, int pathId);
+
+// Node for a path id, or LBM_GRAPH_NONE if no rule mentions it
+int lbmGraphFindNode(lbmGraph *g, int pathId);
+
+// Adds a rule over path ids and returns its index. Fails with
+// LBM_GRAPH_NONE, leaving the graph as it was, if one of the outputs
+// already has a producer (or is listed twice); *conflict is then that
+// output's path id.
+int lbmGraphAddRule(lbmGraph *g, const int *inputs, int inputCount, const int *outputs, int outputCount, const char *command, int *conflict);
+
+// Builds the rule edges and a topological order. Returns 0 if the rules
+// form a cycle, with *cycle a malloc'd list of the rules on it (each needs
+// the next, and the last needs the first) and *cycleLength its length.
+int lbmGraphFinalize(lbmGraph *g, int **cycle, int *cycleLength);
+
+// ---------------------------------------------------------------------------
+// Plans
+
+typedef struct lbmGraphPlan
+{
+    int *rules;             // the rules to run, dependencies first
+    int count;
+    unsigned char *reasons; // per rule in the graph, LBM_GRAPH_*
+    int missing;            // input that is missing with no rule to make it
+    int missingRule;        // the rule that needed it
+} lbmGraphPlan;
+
+// A second opinion on a rule that mtimes alone call LBM_GRAPH_CLEAN or
+// LBM_GRAPH_INPUT_NEWER: returns the reason to go with
+typedef unsigned char (*lbmGraphCheckFunc)(void *userdata, lbmGraph *g, int rule, unsigned char reason);
+
+// Works out which rules the goal nodes need (all of them if goalCount is 0)
+// and which of those are out of date, in one pass over the finalized order.
+// stats holds the current lbmFileStat of every node; check is optional.
+// Returns 0 if an input is missing and nothing produces it; plan->missing
+// is then that node.
+int lbmGraphPlanBuild(lbmGraph *g, const int *goals, int goalCount, lbmFileStat **stats, lbmGraphCheckFunc check, void *userdata, lbmGraphPlan *plan);
+void lbmGraphPlanFree(lbmGraphPlan *plan);
+
+#endif
@@ -0,0 +1,212 @@
+#include "lbmGrep.h"
+
+#include "lbmFile.h"
+#include "lbmThread.h"
+
+#include "dyn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LBM_GREP_ARENA_CHUNK (64 * 1024)
+
+typedef struct lbmGrepWorker
+{
+    lbmRegexScratch scratch;
+    lbmGrepHit *hits;         // dynArray
+    lbmGrepFailure *failures; // dynArray
+} lbmGrepWorker;
+
+typedef struct lbmGrepState
+{
+    lbmRegex *re;
+    const char **paths;
+    lbmGrepOptions *opts;
+    lbmArena *arenas;
+    lbmGrepWorker *workers;
+} lbmGrepState;
+
+static void lbmGrepFail(lbmGrepWorker *w, int file, int error)
+{
+    lbmGrepFailure failure;
+    failure.file = file;
+    failure.error = error;
+    daPush(&w->failures, failure);
+}
+
+static void lbmGrepTask(lbmTaskPool *pool, int worker, void *task, void *userdata)
+{
+    lbmGrepState *state = (lbmGrepState *)userdata;
+    lbmGrepWorker *w = &state->workers[worker];
+    lbmRegex *re = state->re;
+    int file = *(int *)task;
+    lbmFileMap map;
+    const char *data;
+    size_t pos = 0;
+    size_t counted = 0;   // newlines before this offset are in line
+    size_t lineStart = 0;
+    int afterEmpty = 0;
+    int line = 1;
+
+    (void)pool;
+    if (!lbmFileMapOpen(&map, state->paths[file]))
+    {
+        lbmGrepFail(w, file, 0);
+        return;
+    }
+    data = (map.data) ? map.data : "";
+
+    for (;;)
+    {
+        lbmGrepHit hit;
+        const char *newline;
+        int *ov;
+        size_t start;
+        int rc = lbmRegexNext(re, &w->scratch, data, map.len, &pos, &afterEmpty);
+        if (rc <= 0)
+        {
+            if (rc < 0)
+            {
+                lbmGrepFail(w, file, rc);
+            }
+            break;
+        }
+
+        ov = w->scratch.ovector;
+        start = (size_t)ov[0];
+        while ((newline = (const char *)memchr(data + counted, '\n', start - counted)) != NULL)
+        {
+            ++line;
+            counted = lineStart = (size_t)(newline - data) + 1;
+        }
+        counted = start;
+
+        hit.file = file;
+        hit.line = line;
+        hit.col = (int)(start - lineStart) + 1;
+        hit.offset = start;
+        hit.capture = NULL;
+        hit.captureLen = 0;
+        if (!re->captureCount)
+        {
+            hit.captureLen = (size_t)(ov[1] - ov[0]);
+            hit.capture = lbmArenaStrdup(&state->arenas[worker], data + ov[0], hit.captureLen);
+        }
+        else if ((rc > 1) && (ov[2] >= 0))
+        {
+            hit.captureLen = (size_t)(ov[3] - ov[2]);
+            hit.capture = lbmArenaStrdup(&state->arenas[worker], data + ov[2], hit.captureLen);
+        }
+        daPush(&w->hits, hit);
+
+        if (state->opts->first)
+        {
+            break;
+        }
+    }
+    lbmFileMapClose(&map);
+}
+
+static int lbmGrepHitCompare(const void *a, const void *b)
+{
+    const lbmGrepHit *ha = (const lbmGrepHit *)a;
+    const lbmGrepHit *hb = (const lbmGrepHit *)b;
+    if (ha->file != hb->file)
+    {
+        return (ha->file < hb->file) ? -1 : 1;
+    }
+    if (ha->offset != hb->offset)
+    {
+        return (ha->offset < hb->offset) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int lbmGrepFailureCompare(const void *a, const void *b)
+{
+    return ((const lbmGrepFailure *)a)->file - ((const lbmGrepFailure *)b)->file;
+}
+
+void lbmGrep(lbmRegex *re, const char **paths, int count, lbmGrepOptions *opts, lbmGrepResult *result)
+{
+    lbmGrepState state;
+    int threadCount = (opts->threads > 0) ? opts->threads : lbmCpuCount();
+    int *files;
+    void **tasks;
+    int hitCount = 0;
+    int failureCount = 0;
+    int i;
+
+    if (threadCount > count)
+    {
+        threadCount = (count > 0) ? count : 1;
+    }
+
+    state.re = re;
+    state.paths = paths;
+    state.opts = opts;
+    state.arenas = (lbmArena *)malloc(threadCount * sizeof(lbmArena));
+    state.workers = (lbmGrepWorker *)calloc(threadCount, sizeof(lbmGrepWorker));
+    for (i = 0; i < threadCount; ++i)
+    {
+        lbmArenaInit(&state.arenas[i], LBM_GREP_ARENA_CHUNK);
+        lbmRegexScratchInit(&state.workers[i].scratch);
+        daCreate(&state.workers[i].hits, sizeof(lbmGrepHit));
+        daCreate(&state.workers[i].failures, sizeof(lbmGrepFailure));
+    }
+
+    files = (int *)malloc((count ? count : 1) * sizeof(int));
+    tasks = (void **)malloc((count ? count : 1) * sizeof(void *));
+    for (i = 0; i < count; ++i)
+    {
+        files[i] = i;
+        tasks[i] = &files[i];
+    }
+    lbmTaskPoolRun(threadCount, lbmGrepTask, &state, tasks, count);
+    free(tasks);
+    free(files);
+
+    for (i = 0; i < threadCount; ++i)
+    {
+        hitCount += daSize(&state.workers[i].hits);
+        failureCount += daSize(&state.workers[i].failures);
+    }
+    result->hits = (lbmGrepHit *)malloc((hitCount ? hitCount : 1) * sizeof(lbmGrepHit));
+    result->failures = (lbmGrepFailure *)malloc((failureCount ? failureCount : 1) * sizeof(lbmGrepFailure));
+    result->count = 0;
+    result->failureCount = 0;
+    for (i = 0; i < threadCount; ++i)
+    {
+        lbmGrepWorker *w = &state.workers[i];
+        int n = daSize(&w->hits);
+        memcpy(result->hits + result->count, w->hits, n * sizeof(lbmGrepHit));
+        result->count += n;
+        n = daSize(&w->failures);
+        memcpy(result->failures + result->failureCount, w->failures, n * sizeof(lbmGrepFailure));
+        result->failureCount += n;
+        daDestroy(&w->hits, NULL);
+        daDestroy(&w->failures, NULL);
+        lbmRegexScratchFree(&w->scratch);
+    }
+    free(state.workers);
+
+    // Hits within a file are already in order; files finished in whatever
+    // order stealing made
+    qsort(result->hits, result->count, sizeof(lbmGrepHit), lbmGrepHitCompare);
+    qsort(result->failures, result->failureCount, sizeof(lbmGrepFailure), lbmGrepFailureCompare);
+    result->arenas = state.arenas;
+    result->arenaCount = threadCount;
+}
+
+void lbmGrepResultFree(lbmGrepResult *result)
+{
+    int i;
+    for (i = 0; i < result->arenaCount; ++i)
+    {
+        lbmArenaFree(&result->arenas[i]);
+    }
+    free(result->arenas);
+    free(result->hits);
+    free(result->failures);
+    memset(result, 0, sizeof(lbmGrepResult));
+}
@@ -0,0 +1,50 @@
+#ifndef LBMGREP_H
+#define LBMGREP_H
+
+#include "lbmArena.h"
+#include "lbmRegex.h"
+
+#include <stddef.h>
+
+// Searches many files for one compiled pattern at once. Files are tasks on
+// an lbmTaskPool and every worker matches with its own lbmRegexScratch. Each
+// file is mapped and scanned whole with lbmRegexNext() rather than line by
+// line, so the JIT runs over the buffer in one go; lines and columns come
+// from counting newlines as the scan moves forward.
+
+typedef struct lbmGrepOptions
+{
+    int first;   // stop at the first hit in each file
+    int threads; // <= 0 means one per CPU
+} lbmGrepOptions;
+
+typedef struct lbmGrepHit
+{
+    int file;            // index into the paths searched
+    int line;            // 1-based, of the start of the match
+    int col;             // 1-based, in bytes
+    size_t offset;       // of the match in the file
+    const char *capture; // first capture (the whole match if there are none), NUL terminated; NULL if unset
+    size_t captureLen;
+} lbmGrepHit;
+
+typedef struct lbmGrepFailure
+{
+    int file;
+    int error; // 0 if the file couldn't be read, else a pcre error code
+} lbmGrepFailure;
+
+typedef struct lbmGrepResult
+{
+    lbmGrepHit *hits; // ordered by file, then offset
+    int count;
+    lbmGrepFailure *failures; // ordered by file
+    int failureCount;
+    lbmArena *arenas; // one per worker, holding the captures
+    int arenaCount;
+} lbmGrepResult;
+
+void lbmGrep(lbmRegex *re, const char **paths, int count, lbmGrepOptions *opts, lbmGrepResult *result);
+void lbmGrepResultFree(lbmGrepResult *result);
+
+#endif
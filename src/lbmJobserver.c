@@ -0,0 +1,348 @@
+#include "lbmJobserver.h"
+
+#include "dyn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+static void lbmJobserverReset(lbmJobserver *js)
+{
+    memset(js, 0, sizeof(lbmJobserver));
+    js->readFd = -1;
+    js->writeFd = -1;
+    js->created[0] = -1;
+    js->created[1] = -1;
+}
+
+int lbmJobserverActive(lbmJobserver *js)
+{
+    return js->readFd >= 0;
+}
+
+int lbmJobserverFd(lbmJobserver *js)
+{
+    return js->readFd;
+}
+
+#ifdef WIN32
+
+int lbmJobserverConnect(lbmJobserver *js, const char *makeflags)
+{
+    (void)makeflags;
+    lbmJobserverReset(js);
+    return 0;
+}
+
+int lbmJobserverCreate(lbmJobserver *js, int slots)
+{
+    (void)slots;
+    lbmJobserverReset(js);
+    return 0;
+}
+
+void lbmJobserverFree(lbmJobserver *js)
+{
+    lbmJobserverReset(js);
+}
+
+int lbmJobserverTryAcquire(lbmJobserver *js)
+{
+    (void)js;
+    return 0;
+}
+
+void lbmJobserverRelease(lbmJobserver *js)
+{
+    (void)js;
+}
+
+#else
+
+// Finds the value of the last name= option in makeflags (later ones win, as
+// in make) and copies it into value. Returns 0 if it isn't there.
+static int lbmJobserverOption(const char *makeflags, const char *name, char *value, size_t valueSize)
+{
+    const char *found = NULL;
+    const char *p = makeflags;
+    size_t nameLen = strlen(name);
+    size_t len = 0;
+
+    while ((p = strstr(p, name)) != NULL)
+    {
+        found = p + nameLen;
+        p = found;
+    }
+    if (!found)
+    {
+        return 0;
+    }
+    while (found[len] && (found[len] != ' ') && (found[len] != '\t'))
+    {
+        ++len;
+    }
+    if (len >= valueSize)
+    {
+        return 0;
+    }
+    memcpy(value, found, len);
+    value[len] = 0;
+    return 1;
+}
+
+// A pipe's descriptors are shared with every other client, so marking them
+// non-blocking would change them under make's feet. On Linux, reopening
+// through /proc gives a private description of the same pipe instead; where
+// that fails, readFd stays blocking and lbmJobserverTryAcquire() polls
+// before each read.
+static void lbmJobserverOpenPipe(lbmJobserver *js, int readFd, int writeFd)
+{
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", readFd);
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd >= 0)
+    {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        js->readFd = fd;
+        js->pollable = 1;
+        js->opened = 1;
+    }
+    else
+    {
+        js->readFd = readFd;
+    }
+    js->writeFd = writeFd;
+}
+
+int lbmJobserverConnect(lbmJobserver *js, const char *makeflags)
+{
+    char value[4096];
+    int readFd;
+    int writeFd;
+
+    lbmJobserverReset(js);
+    if (!makeflags)
+    {
+        return 0;
+    }
+    if (!lbmJobserverOption(makeflags, "--jobserver-auth=", value, sizeof(value))
+        && !lbmJobserverOption(makeflags, "--jobserver-fds=", value, sizeof(value)))
+    {
+        return 0;
+    }
+
+    if (!strncmp(value, "fifo:", 5))
+    {
+        int fd = open(value + 5, O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+        {
+            return 0;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        js->readFd = js->writeFd = fd;
+        js->pollable = 1;
+        js->opened = 1;
+        return 1;
+    }
+
+    // make passes negative descriptors, or closes them, when a command isn't
+    // meant to share its slots (no '+' on the recipe line)
+    if ((sscanf(value, "%d,%d", &readFd, &writeFd) != 2) || (readFd < 0) || (writeFd < 0)
+        || (fcntl(readFd, F_GETFD) < 0) || (fcntl(writeFd, F_GETFD) < 0))
+    {
+        return 0;
+    }
+    lbmJobserverOpenPipe(js, readFd, writeFd);
+    return 1;
+}
+
+// Where the " -- VAR=value" section of a MAKEFLAGS value starts (options
+// must go before it), or its end if there is none
+static size_t lbmJobserverOptionsEnd(const char *makeflags)
+{
+    const char *c = makeflags;
+    while ((c = strstr(c, "--")) != NULL)
+    {
+        if (((c == makeflags) || (c[-1] == ' ')) && ((c[2] == ' ') || (c[2] == 0)))
+        {
+            while ((c > makeflags) && (c[-1] == ' '))
+            {
+                --c;
+            }
+            return c - makeflags;
+        }
+        c += 2;
+    }
+    return strlen(makeflags);
+}
+
+// Puts count tokens in the new pipe without blocking: nothing reads it yet,
+// so a write that didn't fit would never return
+static int lbmJobserverFill(int fd, int count)
+{
+    char tokens[LBM_JOBSERVER_MAX_TOKENS];
+    int fl = fcntl(fd, F_GETFL);
+    int written = 0;
+
+    if ((fl < 0) || (fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0))
+    {
+        return 0;
+    }
+    memset(tokens, '+', count);
+    while (written < count)
+    {
+        ssize_t n = write(fd, tokens + written, count - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break; // EAGAIN: the pipe is full
+        }
+        written += (int)n;
+    }
+
+    // Children share this descriptor and expect it to block
+    fcntl(fd, F_SETFL, fl);
+    return written == count;
+}
+
+int lbmJobserverCreate(lbmJobserver *js, int slots)
+{
+    char flags[64];
+    const char *makeflags = getenv("MAKEFLAGS");
+    char *newMakeflags = NULL;
+    size_t optionsEnd;
+    int fds[2];
+
+    lbmJobserverReset(js);
+
+    // No more tokens than one process could ever hold
+    if (slots > LBM_JOBSERVER_MAX_TOKENS + 1)
+    {
+        slots = LBM_JOBSERVER_MAX_TOKENS + 1;
+    }
+    if (pipe(fds) != 0)
+    {
+        return 0;
+    }
+    if ((slots > 1) && !lbmJobserverFill(fds[1], slots - 1))
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    // Both ends stay inheritable, for the children
+    js->created[0] = fds[0];
+    js->created[1] = fds[1];
+    lbmJobserverOpenPipe(js, fds[0], fds[1]);
+
+    js->hadMakeflags = (makeflags != NULL);
+    dsCopy(&js->oldMakeflags, (makeflags) ? makeflags : "");
+    optionsEnd = lbmJobserverOptionsEnd(js->oldMakeflags);
+    dsCopy(&newMakeflags, js->oldMakeflags);
+    newMakeflags[optionsEnd] = 0;
+    dsCalcLength(&newMakeflags);
+    snprintf(flags, sizeof(flags), " -j%d --jobserver-auth=%d,%d", slots, fds[0], fds[1]);
+    dsConcat(&newMakeflags, flags);
+    if ((optionsEnd == 0) && js->oldMakeflags[0])
+    {
+        dsConcat(&newMakeflags, " ");
+    }
+    dsConcat(&newMakeflags, js->oldMakeflags + optionsEnd);
+    setenv("MAKEFLAGS", newMakeflags, 1);
+    dsDestroy(&newMakeflags);
+    return 1;
+}
+
+void lbmJobserverFree(lbmJobserver *js)
+{
+    while (js->held > 0)
+    {
+        lbmJobserverRelease(js);
+    }
+    if (js->oldMakeflags)
+    {
+        if (js->hadMakeflags)
+        {
+            setenv("MAKEFLAGS", js->oldMakeflags, 1);
+        }
+        else
+        {
+            unsetenv("MAKEFLAGS");
+        }
+        dsDestroy(&js->oldMakeflags);
+    }
+    if (js->opened)
+    {
+        close(js->readFd);
+    }
+    if (js->created[0] >= 0)
+    {
+        close(js->created[0]);
+        close(js->created[1]);
+    }
+    lbmJobserverReset(js);
+}
+
+int lbmJobserverTryAcquire(lbmJobserver *js)
+{
+    char token;
+    ssize_t n;
+
+    if ((js->readFd < 0) || (js->held >= LBM_JOBSERVER_MAX_TOKENS))
+    {
+        return 0;
+    }
+    if (!js->pollable)
+    {
+        struct pollfd pfd;
+        pfd.fd = js->readFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0)
+        {
+            return 0;
+        }
+    }
+    do
+    {
+        n = read(js->readFd, &token, 1);
+    } while ((n < 0) && (errno == EINTR));
+    if (n != 1)
+    {
+        return 0;
+    }
+    js->tokens[js->held++] = token;
+    return 1;
+}
+
+// Tokens go back as they came: newer makes give them meaning
+void lbmJobserverRelease(lbmJobserver *js)
+{
+    char token;
+    ssize_t n;
+
+    if (js->held <= 0)
+    {
+        return;
+    }
+    token = js->tokens[--js->held];
+    do
+    {
+        n = write(js->writeFd, &token, 1);
+    } while ((n < 0) && (errno == EINTR));
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef LBMJOBSERVER_H
+#define LBMJOBSERVER_H
+
+// GNU make jobserver. Every process in a build starts with one implicit job
+// slot; each job beyond that needs a token, a byte read from a shared pipe
+// (or named fifo) and written back when the job ends. lbm either joins the
+// pool make advertises in MAKEFLAGS, or, when nobody does, creates one
+// itself and advertises it to the commands it runs, so nested make, ninja
+// and lbm builds all draw on the same slots. Not available on Win32.
+
+#define LBM_JOBSERVER_MAX_TOKENS 1024
+
+typedef struct lbmJobserver
+{
+    int readFd;     // -1 if there is no jobserver
+    int writeFd;
+    int pollable;   // readFd is our own non-blocking descriptor
+    int opened;     // readFd was opened here
+    int created[2]; // the pipe lbmJobserverCreate() made, or -1
+    int held;       // tokens taken and not yet returned
+    char tokens[LBM_JOBSERVER_MAX_TOKENS];
+    char *oldMakeflags; // dynString; what MAKEFLAGS was before lbmJobserverCreate()
+    int hadMakeflags;
+} lbmJobserver;
+
+// Joins the jobserver named by a MAKEFLAGS value (--jobserver-auth=R,W,
+// --jobserver-auth=fifo:PATH, or make 4.1's --jobserver-fds=R,W). Returns
+// 0, leaving js inactive, if there is none or its descriptors weren't
+// passed down to us.
+int lbmJobserverConnect(lbmJobserver *js, const char *makeflags);
+
+// Creates a pool of slots - 1 tokens (at most LBM_JOBSERVER_MAX_TOKENS) and
+// adds it to MAKEFLAGS, ahead of any " -- VAR=value" part, for child
+// processes until lbmJobserverFree(). Returns 0, leaving js inactive, on
+// failure.
+int lbmJobserverCreate(lbmJobserver *js, int slots);
+
+// Returns any held tokens, and undoes lbmJobserverCreate()
+void lbmJobserverFree(lbmJobserver *js);
+
+int lbmJobserverActive(lbmJobserver *js);
+
+// Takes a token if one is free right now; never blocks
+int lbmJobserverTryAcquire(lbmJobserver *js);
+void lbmJobserverRelease(lbmJobserver *js);
+
+// Descriptor to poll for readability while waiting for a token
+int lbmJobserverFd(lbmJobserver *js);
+
+#endif
@@ -0,0 +1,474 @@
+#include "lbmPath.h"
+
+#include "dyn.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LBM_IS_SLASH(C) (((C) == '/') || ((C) == '\\'))
+
+int lbmPathIsAbsolute(const char *s, size_t len)
+{
+#ifdef WIN32
+    if ((len >= 3) && (s[1] == ':') && LBM_IS_SLASH(s[2]))
+    {
+        char driveLetter = tolower(s[0]);
+        if ((driveLetter >= 'a') && (driveLetter <= 'z'))
+        {
+            return 1;
+        }
+    }
+#endif
+    if ((len > 0) && (s[0] == PROPER_SLASH))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Canonicalization
+
+typedef struct lbmPathWriter
+{
+    char *out;
+    size_t size;
+    size_t len;
+    size_t rootLen; // "/" or "C:\" prefix that ".." can never pop
+    int relative;
+    int overflow;
+} lbmPathWriter;
+
+static void lbmPathAppend(lbmPathWriter *w, const char *seg, size_t segLen)
+{
+    size_t need = segLen + ((w->len > w->rootLen) ? 1 : 0);
+    if (w->len + need >= w->size)
+    {
+        w->overflow = 1;
+        return;
+    }
+    if (w->len > w->rootLen)
+    {
+        w->out[w->len++] = PROPER_SLASH;
+    }
+    memcpy(w->out + w->len, seg, segLen);
+    w->len += segLen;
+}
+
+static void lbmPathPushSegment(lbmPathWriter *w, const char *seg, size_t segLen)
+{
+    if (segLen == 0)
+    {
+        // Duplicate, leading or trailing slash
+        return;
+    }
+
+    if ((segLen == 1) && (seg[0] == '.'))
+    {
+        if (w->relative && (w->len == 0))
+        {
+            lbmPathAppend(w, seg, segLen);
+        }
+        return;
+    }
+
+    if ((segLen == 2) && (seg[0] == '.') && (seg[1] == '.'))
+    {
+        if (w->len > w->rootLen)
+        {
+            size_t lastStart = w->len;
+            size_t lastLen;
+            while ((lastStart > w->rootLen) && (w->out[lastStart - 1] != PROPER_SLASH))
+            {
+                --lastStart;
+            }
+            lastLen = w->len - lastStart;
+
+            // Never pop another "..", nor the leading "." of a relative path
+            if (!((lastLen == 2) && (w->out[lastStart] == '.') && (w->out[lastStart + 1] == '.'))
+                && !(w->relative && (lastStart == 0) && (lastLen == 1) && (w->out[0] == '.')))
+            {
+                w->len = (lastStart > w->rootLen) ? lastStart - 1 : w->rootLen;
+                return;
+            }
+        }
+        else if (!w->relative)
+        {
+            // Already at the root
+            return;
+        }
+    }
+
+    lbmPathAppend(w, seg, segLen);
+}
+
+static void lbmPathPushAll(lbmPathWriter *w, const char *s, size_t len)
+{
+    const char *end = s + len;
+    const char *seg = s;
+    const char *c;
+    for (c = s; c < end; ++c)
+    {
+        if (LBM_IS_SLASH(*c))
+        {
+            lbmPathPushSegment(w, seg, c - seg);
+            seg = c + 1;
+        }
+    }
+    lbmPathPushSegment(w, seg, end - seg);
+}
+
+static void lbmPathStart(lbmPathWriter *w, const char **s, size_t *len)
+{
+    // A leading slash of either kind roots the result, even where it
+    // wouldn't make path itself absolute (e.g. a curDir of "\\a" on POSIX)
+    if (!lbmPathIsAbsolute(*s, *len) && !((*len > 0) && LBM_IS_SLASH((*s)[0])))
+    {
+        w->relative = 1;
+        return;
+    }
+
+    if (w->size < 4)
+    {
+        w->overflow = 1;
+        return;
+    }
+#ifdef WIN32
+    if ((*len >= 3) && ((*s)[1] == ':'))
+    {
+        // Drive root, e.g. "C:\"
+        w->out[w->len++] = (*s)[0];
+        w->out[w->len++] = ':';
+        *s += 2;
+        *len -= 2;
+    }
+#endif
+    w->out[w->len++] = PROPER_SLASH;
+    w->rootLen = w->len;
+}
+
+size_t lbmPathCanonicalize(char *out, size_t outSize, const char *path, size_t pathLen, const char *curDir, size_t curDirLen)
+{
+    lbmPathWriter w;
+    w.out = out;
+    w.size = outSize;
+    w.len = 0;
+    w.rootLen = 0;
+    w.relative = 0;
+    w.overflow = (outSize < 2) ? 1 : 0;
+
+    if (!curDir || !curDirLen)
+    {
+        curDir = ".";
+        curDirLen = 1;
+    }
+
+    if (!w.overflow)
+    {
+        if (lbmPathIsAbsolute(path, pathLen))
+        {
+            lbmPathStart(&w, &path, &pathLen);
+        }
+        else
+        {
+            lbmPathStart(&w, &curDir, &curDirLen);
+            lbmPathPushAll(&w, curDir, curDirLen);
+        }
+        lbmPathPushAll(&w, path, pathLen);
+    }
+
+    if (w.overflow)
+    {
+        if (outSize > 0)
+        {
+            out[0] = 0;
+        }
+        return LBM_PATH_TOO_LONG;
+    }
+
+    if (w.len == 0)
+    {
+        // Everything popped off a relative path
+        out[w.len++] = '.';
+    }
+    out[w.len] = 0;
+    return w.len;
+}
+
+void lbmCanonicalizePath(char **dspath, const char *curDir)
+{
+    char stackBuffer[512];
+    char *buffer = stackBuffer;
+    size_t pathLen = strlen(*dspath);
+    size_t curDirLen = (curDir) ? strlen(curDir) : 0;
+    size_t size = lbmPathCanonicalSize(pathLen, curDirLen);
+
+    if (size > sizeof(stackBuffer))
+    {
+        buffer = (char *)malloc(size);
+    }
+    lbmPathCanonicalize(buffer, size, *dspath, pathLen, curDir, curDirLen);
+    dsCopy(dspath, buffer);
+    if (buffer != stackBuffer)
+    {
+        free(buffer);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Interning
+
+#define LBM_PATH_HASH_SEED 2166136261u
+#define LBM_PATH_MIN_SLOTS 256
+#define LBM_PATH_MEMO_SLOTS 16384 // the memo starts over at half full
+#define LBM_PATH_ARENA_CHUNK (64 * 1024)
+
+typedef struct lbmPathMemo
+{
+    unsigned int hash;
+    int id;
+    size_t pathLen;
+    size_t curDirLen;
+    char key[1]; // path immediately followed by curDir
+} lbmPathMemo;
+
+// FNV-1a, chained through h so several spans can make up one key
+static unsigned int lbmPathHash(const char *s, size_t len, unsigned int h)
+{
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void lbmPathTableInit(lbmPathTable *pt)
+{
+    memset(pt, 0, sizeof(lbmPathTable));
+    lbmArenaInit(&pt->strings, LBM_PATH_ARENA_CHUNK);
+    lbmArenaInit(&pt->memoStrings, LBM_PATH_ARENA_CHUNK);
+    daCreate(&pt->entries, sizeof(lbmPathEntry));
+}
+
+void lbmPathTableFree(lbmPathTable *pt)
+{
+    daDestroy(&pt->entries, NULL);
+    free(pt->slots);
+    free(pt->memoSlots);
+    lbmArenaFree(&pt->strings);
+    lbmArenaFree(&pt->memoStrings);
+    memset(pt, 0, sizeof(lbmPathTable));
+}
+
+// Returns the id of s, or LBM_PATH_NONE with *empty pointing at the slot it
+// would go in
+static int lbmPathFind(lbmPathTable *pt, const char *s, size_t len, unsigned int hash, int **empty)
+{
+    int mask = pt->slotCount - 1;
+    int i = (int)(hash & mask);
+    for (;;)
+    {
+        int slot = pt->slots[i];
+        lbmPathEntry *entry;
+        if (!slot)
+        {
+            *empty = &pt->slots[i];
+            return LBM_PATH_NONE;
+        }
+        entry = &pt->entries[slot - 1];
+        if ((entry->hash == hash) && (entry->len == (int)len) && !memcmp(entry->s, s, len))
+        {
+            return slot - 1;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void lbmPathGrow(lbmPathTable *pt)
+{
+    int count = daSize(&pt->entries);
+    int id;
+
+    free(pt->slots);
+    pt->slotCount = (pt->slotCount) ? pt->slotCount * 2 : LBM_PATH_MIN_SLOTS;
+    pt->slots = (int *)calloc(pt->slotCount, sizeof(int));
+    for (id = 0; id < count; ++id)
+    {
+        int i = (int)(pt->entries[id].hash & (pt->slotCount - 1));
+        while (pt->slots[i])
+        {
+            i = (i + 1) & (pt->slotCount - 1);
+        }
+        pt->slots[i] = id + 1;
+    }
+}
+
+int lbmPathIntern(lbmPathTable *pt, const char *s, size_t len)
+{
+    unsigned int hash = lbmPathHash(s, len, LBM_PATH_HASH_SEED);
+    lbmPathEntry entry;
+    int rootLen = 0;
+    int parentLen = 0;
+    int slash = -1;
+    int *empty;
+    int id;
+    int i;
+
+    if ((daSize(&pt->entries) + 1) * 2 > pt->slotCount)
+    {
+        lbmPathGrow(pt);
+    }
+    id = lbmPathFind(pt, s, len, hash, &empty);
+    if (id != LBM_PATH_NONE)
+    {
+        return id;
+    }
+
+    if (lbmPathIsAbsolute(s, len))
+    {
+        rootLen = (s[0] == PROPER_SLASH) ? 1 : 3; // "/" or "C:\"
+    }
+    for (i = (int)len - 1; i >= rootLen; --i)
+    {
+        if (s[i] == PROPER_SLASH)
+        {
+            slash = i;
+            break;
+        }
+    }
+
+    entry.len = (int)len;
+    entry.hash = hash;
+    entry.flags = 0;
+    entry.views = 0;
+    entry.parent = LBM_PATH_NONE;
+    entry.basename = (slash >= 0) ? slash + 1 : rootLen;
+    entry.extension = entry.len;
+    for (i = entry.len - 1; i > entry.basename; --i)
+    {
+        if (s[i] == '.')
+        {
+            entry.extension = i + 1;
+            break;
+        }
+    }
+
+    if (slash >= 0)
+    {
+        parentLen = (slash > rootLen) ? slash : rootLen;
+    }
+    else if ((rootLen > 0) && ((int)len > rootLen))
+    {
+        parentLen = rootLen;
+    }
+    if (parentLen > 0)
+    {
+        // Parents always get the lower id. Interning one may have grown the
+        // slot array, so look for this entry's slot again afterwards.
+        entry.parent = lbmPathIntern(pt, s, parentLen);
+        lbmPathFind(pt, s, len, hash, &empty);
+    }
+
+    entry.s = lbmArenaStrdup(&pt->strings, s, len);
+    id = daSize(&pt->entries);
+    daPush(&pt->entries, entry);
+    *empty = id + 1;
+    return id;
+}
+
+static void lbmPathMemoClear(lbmPathTable *pt)
+{
+    if (!pt->memoSlots)
+    {
+        pt->memoSlotCount = LBM_PATH_MEMO_SLOTS;
+        pt->memoSlots = (lbmPathMemo **)calloc(pt->memoSlotCount, sizeof(lbmPathMemo *));
+    }
+    else
+    {
+        memset(pt->memoSlots, 0, pt->memoSlotCount * sizeof(lbmPathMemo *));
+    }
+    lbmArenaReset(&pt->memoStrings);
+    pt->memoCount = 0;
+}
+
+int lbmPathInternPair(lbmPathTable *pt, const char *path, size_t pathLen, const char *curDir, size_t curDirLen)
+{
+    char stackBuffer[512];
+    char *buffer = stackBuffer;
+    lbmPathMemo *memo;
+    unsigned int hash;
+    size_t size;
+    size_t len;
+    int mask;
+    int i;
+    int id;
+
+    if (!curDir || lbmPathIsAbsolute(path, pathLen))
+    {
+        // curDir can't change the answer, so don't let it split the memo
+        curDir = "";
+        curDirLen = 0;
+    }
+    if (!pt->memoSlots || (pt->memoCount * 2 >= pt->memoSlotCount))
+    {
+        lbmPathMemoClear(pt);
+    }
+
+    hash = lbmPathHash(path, pathLen, LBM_PATH_HASH_SEED);
+    hash = lbmPathHash("", 1, hash);
+    hash = lbmPathHash(curDir, curDirLen, hash);
+    mask = pt->memoSlotCount - 1;
+    for (i = (int)(hash & mask); pt->memoSlots[i]; i = (i + 1) & mask)
+    {
+        memo = pt->memoSlots[i];
+        if ((memo->hash == hash)
+            && (memo->pathLen == pathLen) && (memo->curDirLen == curDirLen)
+            && !memcmp(memo->key, path, pathLen)
+            && !memcmp(memo->key + pathLen, curDir, curDirLen))
+        {
+            ++pt->hits;
+            return memo->id;
+        }
+    }
+    ++pt->misses;
+
+    size = lbmPathCanonicalSize(pathLen, curDirLen);
+    if (size > sizeof(stackBuffer))
+    {
+        buffer = (char *)malloc(size);
+    }
+    len = lbmPathCanonicalize(buffer, size, path, pathLen, curDir, curDirLen);
+    id = (len != LBM_PATH_TOO_LONG) ? lbmPathIntern(pt, buffer, len) : LBM_PATH_NONE;
+    if (buffer != stackBuffer)
+    {
+        free(buffer);
+    }
+
+    memo = (lbmPathMemo *)lbmArenaAlloc(&pt->memoStrings, sizeof(lbmPathMemo) + pathLen + curDirLen);
+    memo->hash = hash;
+    memo->id = id;
+    memo->pathLen = pathLen;
+    memo->curDirLen = curDirLen;
+    memcpy(memo->key, path, pathLen);
+    memcpy(memo->key + pathLen, curDir, curDirLen);
+    pt->memoSlots[i] = memo;
+    ++pt->memoCount;
+    return id;
+}
+
+int lbmPathCount(lbmPathTable *pt)
+{
+    return daSize(&pt->entries);
+}
+
+lbmPathEntry *lbmPathGet(lbmPathTable *pt, int id)
+{
+    if ((id < 0) || (id >= daSize(&pt->entries)))
+    {
+        return NULL;
+    }
+    return &pt->entries[id];
+}
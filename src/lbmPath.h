@@ -0,0 +1,89 @@
+#ifndef LBMPATH_H
+#define LBMPATH_H
+
+#include "lbmArena.h"
+
+#include <stddef.h>
+
+#ifdef WIN32
+#define PROPER_SLASH '\\'
+#else
+#define PROPER_SLASH '/'
+#endif
+
+#define LBM_PATH_TOO_LONG ((size_t)-1)
+
+int lbmPathIsAbsolute(const char *s, size_t len);
+
+// Worst-case output size (including the terminator) of lbmPathCanonicalize()
+#define lbmPathCanonicalSize(PATHLEN, CURDIRLEN) ((PATHLEN) + (CURDIRLEN) + 3)
+
+// Single left-to-right pass over curDir (when path is relative) and path:
+// either slash is accepted, runs of slashes collapse, trailing slashes go,
+// "." segments are dropped (a leading one on a relative path is kept) and
+// ".." pops the previous segment. ".." never climbs above an absolute root
+// and is kept as-is when a relative path has nothing left to pop. Writes
+// a NUL terminated result into out and returns its length, or
+// LBM_PATH_TOO_LONG if outSize is too small. No allocations.
+size_t lbmPathCanonicalize(char *out, size_t outSize, const char *path, size_t pathLen, const char *curDir, size_t curDirLen);
+
+// dynString convenience wrapper: replaces *dspath with its canonical form
+void lbmCanonicalizePath(char **dspath, const char *curDir);
+
+// ---------------------------------------------------------------------------
+// Interned canonical paths
+//
+// Every canonical path is stored once, in an arena, under a stable id. Each
+// entry links to the id of its parent directory (interned on the way in), so
+// walking up a path never touches a string. Ids are never reused or freed.
+
+#define LBM_PATH_NONE (-1)
+
+// lbmPathEntry flags: facts about the file system cached per path
+#define LBM_PATH_DIR_EXISTS  (1 << 0) // was a directory when last created or seen; cleared by lbmFileInvalidate
+#define LBM_PATH_STAT_CACHED (1 << 1) // lbmStatCache holds a current lbmFileStat for it
+
+typedef struct lbmPathEntry
+{
+    const char *s;     // canonical form, NUL terminated
+    int len;
+    int parent;        // LBM_PATH_NONE for a root or a lone relative segment
+    int basename;      // offset of the last segment
+    int extension;     // offset just past the last dot of that segment, or len
+    int flags;         // LBM_PATH_*
+    int views;         // live lbm.read() mappings of it, which lbm.write() must not truncate
+    unsigned int hash;
+} lbmPathEntry;
+
+typedef struct lbmPathTable
+{
+    lbmArena strings;      // entry text, lives as long as the table
+    lbmPathEntry *entries; // dynArray, indexed by id
+    int *slots;            // open addressing over entries, id + 1 (0 is empty)
+    int slotCount;         // power of two
+
+    // (path, curDir) -> id memo, so canonicalizing the same pair again is a
+    // single hash probe. Dropped wholesale when it fills up.
+    lbmArena memoStrings;
+    struct lbmPathMemo **memoSlots;
+    int memoSlotCount;
+    int memoCount;
+
+    int hits;   // lbmPathInternPair() answered from the memo
+    int misses; // lbmPathInternPair() had to canonicalize
+} lbmPathTable;
+
+void lbmPathTableInit(lbmPathTable *pt);
+void lbmPathTableFree(lbmPathTable *pt);
+
+// s must already be canonical. Returns its id, adding it if it is new.
+int lbmPathIntern(lbmPathTable *pt, const char *s, size_t len);
+
+// Canonicalizes path against curDir (see lbmPathCanonicalize) and interns
+// the result. Returns LBM_PATH_NONE if the result would be too long.
+int lbmPathInternPair(lbmPathTable *pt, const char *path, size_t pathLen, const char *curDir, size_t curDirLen);
+
+int lbmPathCount(lbmPathTable *pt);
+lbmPathEntry *lbmPathGet(lbmPathTable *pt, int id); // NULL for a bad id
+
+#endif
@@ -0,0 +1,447 @@
+#include "lbmRegex.h"
+
+#include "dyn.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LBM_REGEX_JIT_STACK_START (32 * 1024)
+#define LBM_REGEX_JIT_STACK_MAX   (1024 * 1024)
+#define LBM_REGEX_OVECTOR_MIN     30
+
+#ifdef _MSC_VER
+#define LBM_THREAD_LOCAL __declspec(thread)
+#else
+#define LBM_THREAD_LOCAL __thread
+#endif
+
+// pcre_assign_jit_stack() writes into the compiled pattern, which threads
+// share, so every pattern gets the same callback and the stack itself comes
+// from whichever scratch this thread is matching with
+static LBM_THREAD_LOCAL pcre_jit_stack *sJitStack = NULL;
+
+static pcre_jit_stack *lbmRegexJitStack(void *userdata)
+{
+    (void)userdata;
+    return sJitStack;
+}
+
+int lbmRegexParseFlags(const char *s, int *flags)
+{
+    *flags = 0;
+    for (; s && *s; ++s)
+    {
+        switch (*s)
+        {
+            case 'i':
+                *flags |= LBM_REGEX_CASELESS;
+                break;
+            case 'm':
+                *flags |= LBM_REGEX_MULTILINE;
+                break;
+            case 's':
+                *flags |= LBM_REGEX_DOTALL;
+                break;
+            case 'x':
+                *flags |= LBM_REGEX_EXTENDED;
+                break;
+            case 'U':
+                *flags |= LBM_REGEX_UNGREEDY;
+                break;
+            default:
+                return 0;
+        };
+    }
+    return 1;
+}
+
+static int lbmRegexOptions(int flags)
+{
+    int options = 0;
+    if (flags & LBM_REGEX_CASELESS)
+    {
+        options |= PCRE_CASELESS;
+    }
+    if (flags & LBM_REGEX_MULTILINE)
+    {
+        options |= PCRE_MULTILINE;
+    }
+    if (flags & LBM_REGEX_DOTALL)
+    {
+        options |= PCRE_DOTALL;
+    }
+    if (flags & LBM_REGEX_EXTENDED)
+    {
+        options |= PCRE_EXTENDED;
+    }
+    if (flags & LBM_REGEX_UNGREEDY)
+    {
+        options |= PCRE_UNGREEDY;
+    }
+    return options;
+}
+
+lbmRegex *lbmRegexCompile(const char *pattern, int flags, const char **error, int *errorOffset)
+{
+    lbmRegex *re;
+    pcre *code;
+    const char *studyError = NULL;
+    int jit = 0;
+
+    code = pcre_compile(pattern, lbmRegexOptions(flags), error, errorOffset, NULL);
+    if (!code)
+    {
+        return NULL;
+    }
+
+    re = (lbmRegex *)calloc(1, sizeof(lbmRegex));
+    re->code = code;
+    re->flags = flags;
+    re->refs = 1;
+    re->extra = pcre_study(code, PCRE_STUDY_JIT_COMPILE, &studyError);
+    if (re->extra)
+    {
+        pcre_fullinfo(code, re->extra, PCRE_INFO_JIT, &jit);
+        if (jit)
+        {
+            pcre_assign_jit_stack(re->extra, lbmRegexJitStack, NULL);
+        }
+    }
+    re->jit = jit;
+    pcre_fullinfo(code, re->extra, PCRE_INFO_CAPTURECOUNT, &re->captureCount);
+    return re;
+}
+
+void lbmRegexRetain(lbmRegex *re)
+{
+    ++re->refs;
+}
+
+void lbmRegexRelease(lbmRegex *re)
+{
+    if (--re->refs > 0)
+    {
+        return;
+    }
+    if (re->extra)
+    {
+        pcre_free_study(re->extra);
+    }
+    pcre_free(re->code);
+    free(re);
+}
+
+void lbmRegexScratchInit(lbmRegexScratch *scratch)
+{
+    memset(scratch, 0, sizeof(lbmRegexScratch));
+}
+
+void lbmRegexScratchFree(lbmRegexScratch *scratch)
+{
+    if (scratch->stack)
+    {
+        pcre_jit_stack_free(scratch->stack);
+    }
+    free(scratch->ovector);
+    memset(scratch, 0, sizeof(lbmRegexScratch));
+}
+
+int lbmRegexExec(lbmRegex *re, lbmRegexScratch *scratch, const char *subject, size_t len, size_t offset, int options)
+{
+    int needed = (re->captureCount + 1) * 3;
+    int rc;
+
+    if ((len > INT_MAX) || (offset > len))
+    {
+        return PCRE_ERROR_BADOFFSET;
+    }
+    if (needed > scratch->ovectorSize)
+    {
+        scratch->ovectorSize = (needed > LBM_REGEX_OVECTOR_MIN) ? needed : LBM_REGEX_OVECTOR_MIN;
+        scratch->ovector = (int *)realloc(scratch->ovector, scratch->ovectorSize * sizeof(int));
+    }
+    if (re->jit && !scratch->stack)
+    {
+        // Only allocated once a JIT pattern actually runs on this scratch
+        scratch->stack = pcre_jit_stack_alloc(LBM_REGEX_JIT_STACK_START, LBM_REGEX_JIT_STACK_MAX);
+    }
+
+    sJitStack = scratch->stack;
+    rc = pcre_exec(re->code, re->extra, subject, (int)len, (int)offset, options, scratch->ovector, scratch->ovectorSize);
+    if (rc == PCRE_ERROR_NOMATCH)
+    {
+        return 0;
+    }
+    if (rc == 0)
+    {
+        // Can't happen with an ovector sized from the capture count
+        rc = scratch->ovectorSize / 3;
+    }
+    return rc;
+}
+
+int lbmRegexNext(lbmRegex *re, lbmRegexScratch *scratch, const char *subject, size_t len, size_t *pos, int *afterEmpty)
+{
+    for (;;)
+    {
+        int rc;
+        if (*pos > len)
+        {
+            return 0;
+        }
+        if (*afterEmpty)
+        {
+            // The last match was empty and ended here: first look for a
+            // non-empty one starting at the same place, then move on a byte
+            rc = lbmRegexExec(re, scratch, subject, len, *pos, PCRE_NOTEMPTY_ATSTART | PCRE_ANCHORED);
+            if (rc == 0)
+            {
+                *afterEmpty = 0;
+                ++*pos;
+                continue;
+            }
+        }
+        else
+        {
+            rc = lbmRegexExec(re, scratch, subject, len, *pos, 0);
+        }
+        if (rc > 0)
+        {
+            *afterEmpty = (scratch->ovector[0] == scratch->ovector[1]);
+            *pos = (size_t)scratch->ovector[1];
+        }
+        return rc;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Pattern sets
+
+lbmRegexSet *lbmRegexSetCompile(const char **patterns, int count, int flags, const char **error, int *errorOffset, int *errorIndex)
+{
+    lbmRegexSet *set;
+    char *combined = NULL;
+    int group = 1;
+    int i;
+
+    set = (lbmRegexSet *)calloc(1, sizeof(lbmRegexSet));
+    set->count = count;
+    set->groups = (int *)malloc((count ? count : 1) * sizeof(int));
+    set->captures = (int *)malloc((count ? count : 1) * sizeof(int));
+
+    for (i = 0; i < count; ++i)
+    {
+        // Each member compiles alone first, for its error and its group count
+        pcre *code = pcre_compile(patterns[i], lbmRegexOptions(flags), error, errorOffset, NULL);
+        if (!code)
+        {
+            *errorIndex = i;
+            dsDestroy(&combined);
+            lbmRegexSetDestroy(set);
+            return NULL;
+        }
+        pcre_fullinfo(code, NULL, PCRE_INFO_CAPTURECOUNT, &set->captures[i]);
+        pcre_free(code);
+
+        set->groups[i] = group;
+        group += 1 + set->captures[i];
+        dsConcat(&combined, (i) ? "|(" : "(");
+        dsConcat(&combined, patterns[i]);
+        dsConcat(&combined, ")");
+    }
+
+    set->combined = lbmRegexCompile((combined) ? combined : "(?!)", flags, error, errorOffset);
+    dsDestroy(&combined);
+    if (!set->combined)
+    {
+        // Every member compiled alone, so they don't combine (a numeric
+        // backreference, or an unbalanced group once wrapped)
+        *errorIndex = -1;
+        lbmRegexSetDestroy(set);
+        return NULL;
+    }
+    return set;
+}
+
+void lbmRegexSetDestroy(lbmRegexSet *set)
+{
+    if (set->combined)
+    {
+        lbmRegexRelease(set->combined);
+    }
+    free(set->groups);
+    free(set->captures);
+    free(set);
+}
+
+int lbmRegexSetWhich(lbmRegexSet *set, int rc)
+{
+    // The highest group set belongs to the member that matched, since no
+    // other member's groups can be; find the last member starting at or
+    // before it
+    int highest = rc - 1;
+    int lo = 0;
+    int hi = set->count - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (set->groups[mid] <= highest)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// ---------------------------------------------------------------------------
+// Compiled pattern cache
+
+typedef struct lbmRegexCacheEntry
+{
+    char *pattern; // NUL terminated copy
+    size_t len;
+    int flags;
+    unsigned int hash;
+    lbmRegex *re;  // the cache's reference
+    struct lbmRegexCacheEntry *chain; // next in the same bucket
+    struct lbmRegexCacheEntry *newer;
+    struct lbmRegexCacheEntry *older;
+} lbmRegexCacheEntry;
+
+static unsigned int lbmRegexHash(const char *s, size_t len, int flags)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)flags;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void lbmRegexCacheInit(lbmRegexCache *cache, int capacity)
+{
+    memset(cache, 0, sizeof(lbmRegexCache));
+    cache->capacity = (capacity > 0) ? capacity : LBM_REGEX_CACHE_DEFAULT;
+    cache->bucketCount = 16;
+    while (cache->bucketCount < cache->capacity * 2)
+    {
+        cache->bucketCount *= 2;
+    }
+    cache->buckets = (lbmRegexCacheEntry **)calloc(cache->bucketCount, sizeof(lbmRegexCacheEntry *));
+}
+
+static void lbmRegexCacheUnlink(lbmRegexCache *cache, lbmRegexCacheEntry *entry)
+{
+    if (entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        cache->newest = entry->older;
+    }
+    if (entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+static void lbmRegexCachePushNewest(lbmRegexCache *cache, lbmRegexCacheEntry *entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest)
+    {
+        cache->newest->newer = entry;
+    }
+    cache->newest = entry;
+    if (!cache->oldest)
+    {
+        cache->oldest = entry;
+    }
+}
+
+static void lbmRegexCacheEvict(lbmRegexCache *cache, lbmRegexCacheEntry *entry)
+{
+    lbmRegexCacheEntry **link = &cache->buckets[entry->hash & (cache->bucketCount - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    lbmRegexCacheUnlink(cache, entry);
+    lbmRegexRelease(entry->re);
+    free(entry->pattern);
+    free(entry);
+    --cache->count;
+}
+
+void lbmRegexCacheFree(lbmRegexCache *cache)
+{
+    while (cache->oldest)
+    {
+        lbmRegexCacheEvict(cache, cache->oldest);
+    }
+    free(cache->buckets);
+    memset(cache, 0, sizeof(lbmRegexCache));
+}
+
+lbmRegex *lbmRegexCacheGet(lbmRegexCache *cache, const char *pattern, size_t len, int flags, const char **error, int *errorOffset)
+{
+    unsigned int hash = lbmRegexHash(pattern, len, flags);
+    lbmRegexCacheEntry **bucket = &cache->buckets[hash & (cache->bucketCount - 1)];
+    lbmRegexCacheEntry *entry;
+    lbmRegex *re;
+
+    for (entry = *bucket; entry; entry = entry->chain)
+    {
+        if ((entry->hash == hash) && (entry->flags == flags) && (entry->len == len) && !memcmp(entry->pattern, pattern, len))
+        {
+            ++cache->hits;
+            if (entry != cache->newest)
+            {
+                lbmRegexCacheUnlink(cache, entry);
+                lbmRegexCachePushNewest(cache, entry);
+            }
+            return entry->re;
+        }
+    }
+
+    ++cache->misses;
+    re = lbmRegexCompile(pattern, flags, error, errorOffset);
+    if (!re)
+    {
+        return NULL;
+    }
+    if (cache->count >= cache->capacity)
+    {
+        ++cache->evictions;
+        lbmRegexCacheEvict(cache, cache->oldest);
+    }
+
+    entry = (lbmRegexCacheEntry *)calloc(1, sizeof(lbmRegexCacheEntry));
+    entry->pattern = (char *)malloc(len + 1);
+    memcpy(entry->pattern, pattern, len);
+    entry->pattern[len] = 0;
+    entry->len = len;
+    entry->flags = flags;
+    entry->hash = hash;
+    entry->re = re;
+    entry->chain = *bucket;
+    *bucket = entry;
+    lbmRegexCachePushNewest(cache, entry);
+    ++cache->count;
+    return re;
+}
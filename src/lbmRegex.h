@@ -0,0 +1,120 @@
+#ifndef LBMREGEX_H
+#define LBMREGEX_H
+
+#include "pcre.h"
+
+#include <stddef.h>
+
+// Compiled PCRE patterns. Every pattern is studied with the JIT wherever pcre
+// was built with it (see ext/pcre/CMakeLists.txt); pcre_exec() quietly falls
+// back to the interpreter when it wasn't, or for options the JIT can't take.
+
+// lbmRegexCompile() flags, spelled as letters from Lua
+#define LBM_REGEX_CASELESS  (1 << 0) // i
+#define LBM_REGEX_MULTILINE (1 << 1) // m: ^ and $ also match at newlines
+#define LBM_REGEX_DOTALL    (1 << 2) // s: . also matches newline
+#define LBM_REGEX_EXTENDED  (1 << 3) // x: whitespace and # comments ignored
+#define LBM_REGEX_UNGREEDY  (1 << 4) // U: quantifiers lazy by default
+
+// Parses a string of flag letters. Returns 0 on an unknown letter.
+int lbmRegexParseFlags(const char *s, int *flags);
+
+typedef struct lbmRegex
+{
+    pcre *code;
+    pcre_extra *extra; // NULL if studying found nothing worth keeping
+    int captureCount;
+    int flags;         // LBM_REGEX_*
+    int jit;           // the JIT compiled it
+    int refs;          // see lbmRegexRetain()
+} lbmRegex;
+
+// Returns NULL and sets *error (static text) and *errorOffset on a bad
+// pattern. The result holds one reference.
+lbmRegex *lbmRegexCompile(const char *pattern, int flags, const char **error, int *errorOffset);
+
+// Compiled patterns are shared between the cache and whatever is using them
+// (Lua objects, grep workers); the last release frees it. Not atomic: only
+// the Lua thread retains or releases.
+void lbmRegexRetain(lbmRegex *re);
+void lbmRegexRelease(lbmRegex *re);
+
+// Matching state for one thread: a JIT stack and an ovector buffer, reused
+// across every match. Never share one between threads.
+typedef struct lbmRegexScratch
+{
+    pcre_jit_stack *stack;
+    int *ovector;
+    int ovectorSize; // in ints, always a multiple of 3
+} lbmRegexScratch;
+
+void lbmRegexScratchInit(lbmRegexScratch *scratch);
+void lbmRegexScratchFree(lbmRegexScratch *scratch);
+
+// Matches re against subject from offset, with pcre_exec() options. On a
+// match scratch->ovector holds the offsets and the result is the number of
+// pairs set (>= 1). 0 is no match, < 0 a pcre error code.
+int lbmRegexExec(lbmRegex *re, lbmRegexScratch *scratch, const char *subject, size_t len, size_t offset, int options);
+
+// Global matching, the way Perl steps past empty matches: call with *pos 0
+// and *afterEmpty 0, then repeatedly; each match leaves *pos at its end.
+// Same results as lbmRegexExec().
+int lbmRegexNext(lbmRegex *re, lbmRegexScratch *scratch, const char *subject, size_t len, size_t *pos, int *afterEmpty);
+
+// ---------------------------------------------------------------------------
+// Pattern sets
+//
+// Several patterns scanned for in a single pass: the members are wrapped in
+// groups and joined into one alternation, so each position of the subject
+// is tried against all of them at once (the first listed wins a tie).
+// Numeric backreferences inside a member would point at the wrong groups
+// once combined; use named ones.
+
+typedef struct lbmRegexSet
+{
+    lbmRegex *combined; // match with this, then ask lbmRegexSetWhich()
+    int count;
+    int *groups;        // each member's wrapping group
+    int *captures;      // each member's own group count; its groups follow its wrapper
+} lbmRegexSet;
+
+// Returns NULL on failure, with *errorIndex the member that didn't compile
+// (-1 if they only failed together)
+lbmRegexSet *lbmRegexSetCompile(const char **patterns, int count, int flags, const char **error, int *errorOffset, int *errorIndex);
+void lbmRegexSetDestroy(lbmRegexSet *set);
+
+// Which member a match of set->combined (rc from lbmRegexExec()) came from
+int lbmRegexSetWhich(lbmRegexSet *set, int rc);
+
+// ---------------------------------------------------------------------------
+// Compiled pattern cache
+//
+// Compiling and JIT compiling a pattern costs far more than matching it
+// against a short line, so patterns passed around as strings are compiled
+// once per (pattern, flags) and kept, least recently used first out.
+
+#define LBM_REGEX_CACHE_DEFAULT 256
+
+typedef struct lbmRegexCache
+{
+    struct lbmRegexCacheEntry **buckets;
+    int bucketCount;                   // power of two
+    struct lbmRegexCacheEntry *newest; // LRU list, newest to oldest
+    struct lbmRegexCacheEntry *oldest;
+    int count;
+    int capacity;
+    int hits;
+    int misses;
+    int evictions;
+} lbmRegexCache;
+
+void lbmRegexCacheInit(lbmRegexCache *cache, int capacity);
+void lbmRegexCacheFree(lbmRegexCache *cache);
+
+// Returns the compiled pattern, compiling it on a miss; NULL with *error and
+// *errorOffset set if it doesn't compile (failures aren't cached). The
+// result is borrowed: it can be evicted by the next lbmRegexCacheGet(), so
+// retain it to hold on longer.
+lbmRegex *lbmRegexCacheGet(lbmRegexCache *cache, const char *pattern, size_t len, int flags, const char **error, int *errorOffset);
+
+#endif
@@ -0,0 +1,248 @@
+#include "lbmTemplate.h"
+
+#include "dyn.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest variable name a {..{..}..} construct can build at evaluation time
+#define LBM_TEMPLATE_MAX_NAME 256
+
+static const char *sTemplateVarNames[LBM_TEMPLATE_VAR_COUNT] =
+{
+    "BASENAME"
+};
+
+static int lbmTemplateLookupVar(const char *name, size_t len)
+{
+    int i;
+    for (i = 0; i < LBM_TEMPLATE_VAR_COUNT; ++i)
+    {
+        if ((strlen(sTemplateVarNames[i]) == len) && !memcmp(sTemplateVarNames[i], name, len))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Compiling
+
+static void lbmTemplatePushLiteral(lbmTemplate *t, lbmTemplateOp **ops, const char *start, const char *end)
+{
+    lbmTemplateOp op;
+    if (end > start)
+    {
+        op.type = LBM_TOP_LITERAL;
+        op.mods = 0;
+        op.a = (int)(start - t->text);
+        op.b = (int)(end - start);
+        daPush(ops, op);
+    }
+}
+
+// Mirrors the grammar of the old recursive interpreter: "{mods:NAME}" where
+// NAME may itself contain {...} references.
+static const char *lbmTemplateCompileRange(lbmTemplate *t, lbmTemplateOp **ops, const char *c, char end)
+{
+    const char *literal = c;
+    for (; *c && *c != end; ++c)
+    {
+        if (*c == '{')
+        {
+            lbmTemplateOp op;
+            lbmTemplateOp *name = NULL;
+            const char *colon;
+            const char *nextBackslash;
+            const char *nextOpenBrace;
+            const char *nextCloseBrace;
+            int i;
+
+            lbmTemplatePushLiteral(t, ops, literal, c);
+            ++c;
+
+            op.mods = 0;
+            colon = strchr(c, ':');
+            nextBackslash = strchr(c, '\\');
+            nextOpenBrace = strchr(c, '{');
+            nextCloseBrace = strchr(c, '}');
+            if (colon
+                && (!nextBackslash  || colon < nextBackslash)
+                && (!nextOpenBrace  || colon < nextOpenBrace)
+                && (!nextCloseBrace || colon < nextCloseBrace))
+            {
+                for (; c != colon; ++c)
+                {
+                    switch (*c)
+                    {
+                        case 'u':
+                            op.mods |= LBM_TEMPLATE_MOD_UPPER;
+                            break;
+                    }
+                }
+                ++c;
+            }
+
+            daCreate(&name, sizeof(lbmTemplateOp));
+            c = lbmTemplateCompileRange(t, &name, c, '}');
+            if ((daSize(&name) == 1) && (name[0].type == LBM_TOP_LITERAL))
+            {
+                // Plain {NAME}: resolve now, and drop it entirely if nothing can ever match
+                op.type = LBM_TOP_VAR;
+                op.a = lbmTemplateLookupVar(t->text + name[0].a, name[0].b);
+                op.b = 0;
+                if (op.a >= 0)
+                {
+                    daPush(ops, op);
+                }
+            }
+            else if (daSize(&name) > 0)
+            {
+                op.type = LBM_TOP_DYNVAR;
+                op.a = 0;
+                op.b = daSize(&name);
+                daPush(ops, op);
+                for (i = 0; i < daSize(&name); ++i)
+                {
+                    daPush(ops, name[i]);
+                }
+            }
+            daDestroy(&name, NULL);
+
+            if (!*c)
+            {
+                // Unterminated brace
+                return c;
+            }
+            literal = c + 1;
+        }
+    }
+
+    lbmTemplatePushLiteral(t, ops, literal, c);
+    return c;
+}
+
+lbmTemplate *lbmTemplateCompile(const char *text)
+{
+    lbmTemplate *t = (lbmTemplate *)calloc(1, sizeof(lbmTemplate));
+    dsCopy(&t->text, text);
+    daCreate(&t->ops, sizeof(lbmTemplateOp));
+    lbmTemplateCompileRange(t, &t->ops, t->text, 0);
+    return t;
+}
+
+void lbmTemplateDestroy(lbmTemplate *t)
+{
+    dsDestroy(&t->text);
+    daDestroy(&t->ops, NULL);
+    free(t);
+}
+
+// ---------------------------------------------------------------------------
+// Evaluation
+
+// Runs ops [first, first+count). With out == NULL this only measures.
+static size_t lbmTemplateRun(lbmTemplate *t, int first, int count, lbmTemplateVars *vars, char *out)
+{
+    size_t total = 0;
+    int i;
+    for (i = first; i < first + count; ++i)
+    {
+        lbmTemplateOp *op = &t->ops[i];
+        const char *value = NULL;
+        size_t len = 0;
+        int var = -1;
+
+        switch (op->type)
+        {
+            case LBM_TOP_LITERAL:
+                value = t->text + op->a;
+                len = op->b;
+                break;
+            case LBM_TOP_VAR:
+                var = op->a;
+                break;
+            case LBM_TOP_DYNVAR:
+            {
+                char name[LBM_TEMPLATE_MAX_NAME];
+                size_t nameLen = lbmTemplateRun(t, i + 1, op->b, vars, NULL);
+                if (nameLen <= sizeof(name))
+                {
+                    lbmTemplateRun(t, i + 1, op->b, vars, name);
+                    var = lbmTemplateLookupVar(name, nameLen);
+                }
+                i += op->b;
+                break;
+            }
+        };
+
+        if (var >= 0)
+        {
+            value = vars->value[var];
+            len = vars->len[var];
+        }
+        if (!value)
+        {
+            continue;
+        }
+
+        if (out)
+        {
+            if (op->mods & LBM_TEMPLATE_MOD_UPPER)
+            {
+                size_t c;
+                for (c = 0; c < len; ++c)
+                {
+                    out[total + c] = (char)toupper((unsigned char)value[c]);
+                }
+            }
+            else
+            {
+                memcpy(out + total, value, len);
+            }
+        }
+        total += len;
+    }
+    return total;
+}
+
+size_t lbmTemplateLength(lbmTemplate *t, lbmTemplateVars *vars)
+{
+    return lbmTemplateRun(t, 0, daSize(&t->ops), vars, NULL);
+}
+
+size_t lbmTemplateWrite(lbmTemplate *t, lbmTemplateVars *vars, char *out)
+{
+    return lbmTemplateRun(t, 0, daSize(&t->ops), vars, out);
+}
+
+void lbmTemplateVarsFromPath(lbmTemplateVars *vars, const char *path, size_t len)
+{
+    const char *end = path + len;
+    const char *start = path;
+    const char *dot = NULL;
+    const char *c;
+
+    // Basename runs from the last slash of either kind to the last dot after it
+    for (c = path; c < end; ++c)
+    {
+        if ((*c == '/') || (*c == '\\'))
+        {
+            start = c + 1;
+            dot = NULL;
+        }
+        else if (*c == '.')
+        {
+            dot = c;
+        }
+    }
+    if (dot)
+    {
+        end = dot;
+    }
+
+    vars->value[LBM_TEMPLATE_VAR_BASENAME] = start;
+    vars->len[LBM_TEMPLATE_VAR_BASENAME] = end - start;
+}
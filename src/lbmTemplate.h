@@ -0,0 +1,56 @@
+#ifndef LBMTEMPLATE_H
+#define LBMTEMPLATE_H
+
+#include <stddef.h>
+
+// Compiled form of an lbm.interp template such as "obj/{u:BASENAME}.o".
+// Compiling turns the text into a flat op list once; evaluating it first
+// measures the output and then writes it into a single caller buffer.
+
+enum
+{
+    LBM_TEMPLATE_VAR_BASENAME = 0,
+    LBM_TEMPLATE_VAR_COUNT
+};
+
+enum
+{
+    LBM_TEMPLATE_MOD_UPPER = (1 << 0) // 'u'
+};
+
+enum
+{
+    LBM_TOP_LITERAL = 0, // a/b: offset/length into the template text
+    LBM_TOP_VAR,         // a: LBM_TEMPLATE_VAR_*
+    LBM_TOP_DYNVAR       // b: number of following ops that build the name
+};
+
+typedef struct lbmTemplateOp
+{
+    int type;
+    int mods; // LBM_TEMPLATE_MOD_* (vars only)
+    int a;
+    int b;
+} lbmTemplateOp;
+
+typedef struct lbmTemplate
+{
+    char *text;         // private copy, literal ops point into it
+    lbmTemplateOp *ops; // dynArray
+} lbmTemplate;
+
+typedef struct lbmTemplateVars
+{
+    const char *value[LBM_TEMPLATE_VAR_COUNT]; // NULL when unset
+    size_t len[LBM_TEMPLATE_VAR_COUNT];
+} lbmTemplateVars;
+
+lbmTemplate *lbmTemplateCompile(const char *text);
+void lbmTemplateDestroy(lbmTemplate *t);
+size_t lbmTemplateLength(lbmTemplate *t, lbmTemplateVars *vars);
+size_t lbmTemplateWrite(lbmTemplate *t, lbmTemplateVars *vars, char *out); // out needs lbmTemplateLength() bytes
+
+// Fills LBM_TEMPLATE_VAR_BASENAME from a path without copying it
+void lbmTemplateVarsFromPath(lbmTemplateVars *vars, const char *path, size_t len);
+
+#endif
@@ -0,0 +1,446 @@
+#include "lbmThread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define LBM_MAX_THREADS 64
+
+struct lbmThread
+{
+#ifdef WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    lbmThreadFunc func;
+    void *userdata;
+};
+
+#ifdef WIN32
+static DWORD WINAPI lbmThreadMain(LPVOID param)
+#else
+static void *lbmThreadMain(void *param)
+#endif
+{
+    lbmThread *thread = (lbmThread *)param;
+    thread->func(thread->userdata);
+    return 0;
+}
+
+lbmThread *lbmThreadCreate(lbmThreadFunc func, void *userdata)
+{
+    lbmThread *thread = (lbmThread *)calloc(1, sizeof(lbmThread));
+    thread->func = func;
+    thread->userdata = userdata;
+#ifdef WIN32
+    thread->handle = CreateThread(NULL, 0, lbmThreadMain, thread, 0, NULL);
+    if (!thread->handle)
+#else
+    if (pthread_create(&thread->handle, NULL, lbmThreadMain, thread) != 0)
+#endif
+    {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void lbmThreadJoin(lbmThread *thread)
+{
+#ifdef WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    free(thread);
+}
+
+int lbmCpuCount()
+{
+    int count;
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = (int)info.dwNumberOfProcessors;
+#else
+    count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > LBM_MAX_THREADS)
+    {
+        count = LBM_MAX_THREADS;
+    }
+    return count;
+}
+
+// ---------------------------------------------------------------------------
+// Locks
+
+struct lbmMutex
+{
+#ifdef WIN32
+    CRITICAL_SECTION cs;
+#else
+    pthread_mutex_t m;
+#endif
+};
+
+struct lbmCond
+{
+#ifdef WIN32
+    CONDITION_VARIABLE cv;
+#else
+    pthread_cond_t c;
+#endif
+};
+
+lbmMutex *lbmMutexCreate()
+{
+    lbmMutex *mutex = (lbmMutex *)calloc(1, sizeof(lbmMutex));
+#ifdef WIN32
+    InitializeCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_init(&mutex->m, NULL);
+#endif
+    return mutex;
+}
+
+void lbmMutexDestroy(lbmMutex *mutex)
+{
+#ifdef WIN32
+    DeleteCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_destroy(&mutex->m);
+#endif
+    free(mutex);
+}
+
+void lbmMutexLock(lbmMutex *mutex)
+{
+#ifdef WIN32
+    EnterCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_lock(&mutex->m);
+#endif
+}
+
+void lbmMutexUnlock(lbmMutex *mutex)
+{
+#ifdef WIN32
+    LeaveCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_unlock(&mutex->m);
+#endif
+}
+
+lbmCond *lbmCondCreate()
+{
+    lbmCond *cond = (lbmCond *)calloc(1, sizeof(lbmCond));
+#ifdef WIN32
+    InitializeConditionVariable(&cond->cv);
+#else
+    pthread_cond_init(&cond->c, NULL);
+#endif
+    return cond;
+}
+
+void lbmCondDestroy(lbmCond *cond)
+{
+#ifndef WIN32
+    pthread_cond_destroy(&cond->c);
+#endif
+    free(cond);
+}
+
+void lbmCondWait(lbmCond *cond, lbmMutex *mutex)
+{
+#ifdef WIN32
+    SleepConditionVariableCS(&cond->cv, &mutex->cs, INFINITE);
+#else
+    pthread_cond_wait(&cond->c, &mutex->m);
+#endif
+}
+
+void lbmCondSignal(lbmCond *cond)
+{
+#ifdef WIN32
+    WakeConditionVariable(&cond->cv);
+#else
+    pthread_cond_signal(&cond->c);
+#endif
+}
+
+void lbmCondBroadcast(lbmCond *cond)
+{
+#ifdef WIN32
+    WakeAllConditionVariable(&cond->cv);
+#else
+    pthread_cond_broadcast(&cond->c);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Parallel for
+
+typedef struct lbmRange
+{
+    lbmRangeFunc func;
+    void *userdata;
+    int begin;
+    int end;
+} lbmRange;
+
+static void lbmRangeMain(void *userdata)
+{
+    lbmRange *range = (lbmRange *)userdata;
+    range->func(range->userdata, range->begin, range->end);
+}
+
+void lbmParallelFor(int count, int threadCount, lbmRangeFunc func, void *userdata)
+{
+    lbmRange ranges[LBM_MAX_THREADS];
+    lbmThread *threads[LBM_MAX_THREADS];
+    int i;
+
+    if (threadCount <= 0)
+    {
+        threadCount = lbmCpuCount();
+    }
+    if (threadCount > LBM_MAX_THREADS)
+    {
+        threadCount = LBM_MAX_THREADS;
+    }
+    if (threadCount > count)
+    {
+        threadCount = count;
+    }
+    if (threadCount <= 1)
+    {
+        if (count > 0)
+        {
+            func(userdata, 0, count);
+        }
+        return;
+    }
+
+    for (i = 0; i < threadCount; ++i)
+    {
+        ranges[i].func = func;
+        ranges[i].userdata = userdata;
+        ranges[i].begin = (int)(((long long)count * i) / threadCount);
+        ranges[i].end = (int)(((long long)count * (i + 1)) / threadCount);
+    }
+
+    for (i = 1; i < threadCount; ++i)
+    {
+        threads[i] = lbmThreadCreate(lbmRangeMain, &ranges[i]);
+        if (!threads[i])
+        {
+            // Couldn't get a thread; do the work here instead
+            lbmRangeMain(&ranges[i]);
+        }
+    }
+    lbmRangeMain(&ranges[0]);
+    for (i = 1; i < threadCount; ++i)
+    {
+        if (threads[i])
+        {
+            lbmThreadJoin(threads[i]);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Work-stealing task pool
+
+typedef struct lbmTaskDeque
+{
+    lbmMutex *mutex;
+    void **tasks;
+    int top;    // thieves take from here
+    int bottom; // the owner pushes and pops here
+    int capacity;
+} lbmTaskDeque;
+
+struct lbmTaskPool
+{
+    lbmTaskFunc func;
+    void *userdata;
+    int threadCount;
+    lbmTaskDeque deques[LBM_MAX_THREADS];
+
+    lbmMutex *mutex;     // guards everything below
+    lbmCond *wake;       // work was pushed, or everything finished
+    int pending;         // pushed but not yet finished
+    unsigned generation; // bumped on every push, so sleepers can't miss one
+};
+
+typedef struct lbmTaskWorker
+{
+    lbmTaskPool *pool;
+    int index;
+} lbmTaskWorker;
+
+static void lbmTaskDequePush(lbmTaskDeque *deque, void *task)
+{
+    lbmMutexLock(deque->mutex);
+    if (deque->bottom == deque->capacity)
+    {
+        if (deque->top > 0)
+        {
+            // Slide the live range down over what thieves have taken
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(void *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity)
+        {
+            deque->capacity = (deque->capacity) ? deque->capacity * 2 : 64;
+            deque->tasks = (void **)realloc(deque->tasks, deque->capacity * sizeof(void *));
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    lbmMutexUnlock(deque->mutex);
+}
+
+static void *lbmTaskDequeTake(lbmTaskDeque *deque, int steal)
+{
+    void *task = NULL;
+    lbmMutexLock(deque->mutex);
+    if (deque->top < deque->bottom)
+    {
+        task = (steal) ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+        if (deque->top == deque->bottom)
+        {
+            deque->top = deque->bottom = 0;
+        }
+    }
+    lbmMutexUnlock(deque->mutex);
+    return task;
+}
+
+void lbmTaskPoolPush(lbmTaskPool *pool, int worker, void *task)
+{
+    lbmTaskDequePush(&pool->deques[worker], task);
+    lbmMutexLock(pool->mutex);
+    ++pool->pending;
+    ++pool->generation;
+    lbmCondSignal(pool->wake);
+    lbmMutexUnlock(pool->mutex);
+}
+
+static void lbmTaskWorkerMain(void *userdata)
+{
+    lbmTaskWorker *worker = (lbmTaskWorker *)userdata;
+    lbmTaskPool *pool = worker->pool;
+    for (;;)
+    {
+        unsigned generation;
+        void *task;
+        int i;
+
+        lbmMutexLock(pool->mutex);
+        generation = pool->generation;
+        lbmMutexUnlock(pool->mutex);
+
+        task = lbmTaskDequeTake(&pool->deques[worker->index], 0);
+        for (i = 1; !task && (i < pool->threadCount); ++i)
+        {
+            task = lbmTaskDequeTake(&pool->deques[(worker->index + i) % pool->threadCount], 1);
+        }
+
+        if (task)
+        {
+            pool->func(pool, worker->index, task, pool->userdata);
+            lbmMutexLock(pool->mutex);
+            if (--pool->pending == 0)
+            {
+                lbmCondBroadcast(pool->wake);
+            }
+            lbmMutexUnlock(pool->mutex);
+            continue;
+        }
+
+        lbmMutexLock(pool->mutex);
+        if (pool->pending == 0)
+        {
+            lbmMutexUnlock(pool->mutex);
+            break;
+        }
+        if (pool->generation == generation)
+        {
+            // Nothing to steal, but running tasks may still push more
+            lbmCondWait(pool->wake, pool->mutex);
+        }
+        lbmMutexUnlock(pool->mutex);
+    }
+}
+
+void lbmTaskPoolRun(int threadCount, lbmTaskFunc func, void *userdata, void **tasks, int count)
+{
+    lbmTaskPool pool;
+    lbmTaskWorker workers[LBM_MAX_THREADS];
+    lbmThread *threads[LBM_MAX_THREADS];
+    int i;
+
+    if (threadCount <= 0)
+    {
+        threadCount = lbmCpuCount();
+    }
+    if (threadCount > LBM_MAX_THREADS)
+    {
+        threadCount = LBM_MAX_THREADS;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.func = func;
+    pool.userdata = userdata;
+    pool.threadCount = threadCount;
+    pool.mutex = lbmMutexCreate();
+    pool.wake = lbmCondCreate();
+    for (i = 0; i < threadCount; ++i)
+    {
+        pool.deques[i].mutex = lbmMutexCreate();
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
+
+    // Deal the initial tasks out round-robin
+    for (i = 0; i < count; ++i)
+    {
+        lbmTaskDequePush(&pool.deques[i % threadCount], tasks[i]);
+    }
+    pool.pending = count;
+
+    for (i = 1; i < threadCount; ++i)
+    {
+        threads[i] = lbmThreadCreate(lbmTaskWorkerMain, &workers[i]);
+    }
+    lbmTaskWorkerMain(&workers[0]);
+    for (i = 1; i < threadCount; ++i)
+    {
+        if (threads[i])
+        {
+            lbmThreadJoin(threads[i]);
+        }
+    }
+
+    for (i = 0; i < threadCount; ++i)
+    {
+        lbmMutexDestroy(pool.deques[i].mutex);
+        free(pool.deques[i].tasks);
+    }
+    lbmCondDestroy(pool.wake);
+    lbmMutexDestroy(pool.mutex);
+}
@@ -0,0 +1,50 @@
+#ifndef LBMTHREAD_H
+#define LBMTHREAD_H
+
+// Thin portability layer over pthreads / Win32 threads. None of this may
+// touch the lua_State; workers only ever see plain C data.
+
+typedef void (*lbmThreadFunc)(void *userdata);
+typedef void (*lbmRangeFunc)(void *userdata, int begin, int end);
+
+typedef struct lbmThread lbmThread;
+
+lbmThread *lbmThreadCreate(lbmThreadFunc func, void *userdata);
+void lbmThreadJoin(lbmThread *thread); // also frees it
+
+int lbmCpuCount();
+
+typedef struct lbmMutex lbmMutex;
+typedef struct lbmCond lbmCond;
+
+lbmMutex *lbmMutexCreate();
+void lbmMutexDestroy(lbmMutex *mutex);
+void lbmMutexLock(lbmMutex *mutex);
+void lbmMutexUnlock(lbmMutex *mutex);
+
+lbmCond *lbmCondCreate();
+void lbmCondDestroy(lbmCond *cond);
+void lbmCondWait(lbmCond *cond, lbmMutex *mutex); // mutex must be held
+void lbmCondSignal(lbmCond *cond);
+void lbmCondBroadcast(lbmCond *cond);
+
+// Work-stealing task pool. Each worker keeps its own stack of tasks: it
+// pushes and pops at one end (so related work stays hot) and idle workers
+// steal from the other end of someone else's. Tasks are opaque pointers.
+typedef struct lbmTaskPool lbmTaskPool;
+typedef void (*lbmTaskFunc)(lbmTaskPool *pool, int worker, void *task, void *userdata);
+
+// Runs func on every task in tasks[0, count), plus anything those push, on
+// up to threadCount threads (<= 0 means one per CPU). Returns once all of
+// it is done.
+void lbmTaskPoolRun(int threadCount, lbmTaskFunc func, void *userdata, void **tasks, int count);
+
+// Only valid from inside a running task; worker is the one it was given
+void lbmTaskPoolPush(lbmTaskPool *pool, int worker, void *task);
+
+// Splits [0, count) into contiguous ranges and runs them on up to
+// threadCount threads (the calling thread takes the first range). Returns
+// once every range is done. threadCount <= 0 means one per CPU.
+void lbmParallelFor(int count, int threadCount, lbmRangeFunc func, void *userdata);
+
+#endif
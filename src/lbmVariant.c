@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 int lua_absindex (lua_State *L, int idx)
 {
@@ -43,9 +44,56 @@ void lbmVariantClear(lbmVariant *arg)
         case V_MAP:
             dmDestroy(arg->m, lbmVariantDestroy);
             break;
+        case V_TABLE:
+        {
+            // Children live inside the block, so only their contents need freeing
+            int i;
+            for (i = 0; i < arg->t->arrayCount; ++i)
+            {
+                lbmVariantClear(&arg->t->array[i]);
+            }
+            for (i = 0; i < arg->t->hashCount; ++i)
+            {
+                lbmVariantClear(&arg->t->hash[i].key);
+                lbmVariantClear(&arg->t->hash[i].value);
+            }
+            free(arg->t);
+            break;
+        }
     };
 }
 
+int lbmVariantNumberFits(double n)
+{
+    // NaN fails both comparisons
+    return (n > -9.2e18) && (n < 9.2e18);
+}
+
+int lbmVariantNumberType(double n, long long *i)
+{
+    // Range check first; casting an out-of-range double is undefined
+    if (lbmVariantNumberFits(n) && ((double)(long long)n == n))
+    {
+        *i = (long long)n;
+        return V_INTEGER;
+    }
+    return V_NUMBER;
+}
+
+static void lbmVariantSetNumber(lbmVariant *v, double n)
+{
+    long long i;
+    v->type = lbmVariantNumberType(n, &i);
+    if (v->type == V_INTEGER)
+    {
+        v->i = i;
+    }
+    else
+    {
+        v->n = n;
+    }
+}
+
 #define PRINTDEPTH(DEPTH) { int d; for(d = 0; d < (DEPTH); ++d) printf("  "); }
 
 static int lbmVariantPrintMap(dynMap *dm, dynMapEntry *e, void *userData)
@@ -71,125 +119,309 @@ void lbmVariantPrint(lbmVariant *v, int depth)
             PRINTDEPTH(depth);
             printf("* string: %s\n", v->s);
             break;
+        case V_NUMBER:
+            PRINTDEPTH(depth);
+            printf("* number: %.14g\n", v->n);
+            break;
+        case V_INTEGER:
+            PRINTDEPTH(depth);
+            printf("* integer: %lld\n", v->i);
+            break;
+        case V_BOOL:
+            PRINTDEPTH(depth);
+            printf("* bool: %s\n", (v->b) ? "true" : "false");
+            break;
         case V_ARRAY:
             PRINTDEPTH(depth);
-            printf("* array: %d element(s)\n", (int)daSize(&v->a));
-            for(i = 0; i < daSize(&v->a); ++i)
+            printf("* array: %d element(s)\n", lbmVariantCount(v));
+            for(i = 0; i < lbmVariantCount(v); ++i)
             {
                 lbmVariantPrint(v->a[i], depth + 1);
             }
             break;
         case V_MAP:
             PRINTDEPTH(depth);
-            printf("* map: %d element(s)\n", v->m->count);
+            printf("* map: %d element(s)\n", lbmVariantCount(v));
             dmIterate(v->m, lbmVariantPrintMap, &depth);
             break;
+        case V_TABLE:
+            PRINTDEPTH(depth);
+            printf("* table: %d element(s), %d key(s)\n", v->t->arrayCount, v->t->hashCount);
+            for(i = 0; i < v->t->arrayCount; ++i)
+            {
+                lbmVariantPrint(&v->t->array[i], depth + 1);
+            }
+            for(i = 0; i < v->t->hashCount; ++i)
+            {
+                lbmVariant *key = &v->t->hash[i].key;
+                PRINTDEPTH(depth + 1);
+                switch (key->type)
+                {
+                    case V_STRING:
+                        printf("* key: %s\n", key->s);
+                        break;
+                    case V_INTEGER:
+                        printf("* key: %lld\n", key->i);
+                        break;
+                    case V_NUMBER:
+                        printf("* key: %.14g\n", key->n);
+                        break;
+                    case V_BOOL:
+                        printf("* key: %s\n", (key->b) ? "true" : "false");
+                        break;
+                };
+                lbmVariantPrint(&v->t->hash[i].value, depth + 2);
+            }
+            break;
     };
 }
 
+// Fills v in place from the Lua value at index
+static void lbmVariantFill(lbmVariant *v, lua_State *L, int index);
+
 lbmVariant *lbmVariantFromIndex(lua_State *L, int index)
 {
-    lbmVariant *ret = NULL;
+    lbmVariant *ret = lbmVariantCreate(V_NONE);
+    lbmVariantFill(ret, L, index);
+    return ret;
+}
+
+lbmVariant *lbmVariantFromArgs(lua_State *L)
+{
+    int argCount = lua_gettop(L);
+    int i;
+    lbmVariant *ret = lbmVariantCreate(V_ARRAY);
     lbmVariant *child;
-    const char *s = NULL;
-    size_t l;
-    char temp[16];
 
-    int type = lua_type(L, index);
+    for (i=1; i <= argCount; ++i)
+    {
+        child = lbmVariantFromIndex(L, i);
+        daPush(&ret->a, child);
+    }
+    return ret;
+}
 
-    switch (type)
+// ---------------------------------------------------------------------------
+// Building
+
+// Whether the key at keyIndex belongs in the hash part: strings and
+// booleans always, numbers unless the array part already holds them
+static int lbmVariantHashKey(lua_State *L, int keyIndex, int arrayCount)
+{
+    switch (lua_type(L, keyIndex))
+    {
+        case LUA_TSTRING:
+        case LUA_TBOOLEAN:
+            return 1;
+        case LUA_TNUMBER:
+        {
+            lua_Number n = lua_tonumber(L, keyIndex);
+            return !((n >= 1) && (n <= arrayCount) && ((lua_Number)(int)n == n));
+        }
+    };
+    return 0;
+}
+
+// Reallocates the table block so its hash tail holds hashCapacity pairs,
+// moving the array part along with it
+static lbmVariantTable *lbmVariantTableResize(lbmVariantTable *t, size_t headerSize, int hashCapacity)
+{
+    t = (lbmVariantTable *)realloc(t, headerSize + (t->arrayCount * sizeof(lbmVariant)) + (hashCapacity * sizeof(lbmVariantPair)));
+    t->array = (lbmVariant *)((char *)t + headerSize);
+    t->hash = (lbmVariantPair *)(t->array + t->arrayCount);
+    return t;
+}
+
+static void lbmVariantFillTable(lbmVariant *v, lua_State *L, int index)
+{
+    int arrayCount = (int)lua_objlen(L, index);
+    size_t headerSize = (sizeof(lbmVariantTable) + 7) & ~(size_t)7;
+    int hashCapacity = 0;
+    lbmVariantTable *t;
+
+    // The sequence part is sized up front; the hash tail grows as pairs turn
+    // up, so the table is walked only once
+    t = (lbmVariantTable *)calloc(1, headerSize + (arrayCount * sizeof(lbmVariant)));
+    t->arrayCount = arrayCount;
+    t = lbmVariantTableResize(t, headerSize, hashCapacity);
+
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        // Keys are filled from the stack slot without coercion, so the
+        // key lua_next needs next is left intact
+        if (lbmVariantHashKey(L, -2, arrayCount))
+        {
+            lbmVariantPair *pair;
+            if (t->hashCount == hashCapacity)
+            {
+                hashCapacity = (hashCapacity) ? hashCapacity * 2 : 4;
+                t = lbmVariantTableResize(t, headerSize, hashCapacity);
+            }
+            pair = &t->hash[t->hashCount++];
+            lbmVariantFill(&pair->key, L, lua_gettop(L) - 1);
+            lbmVariantFill(&pair->value, L, lua_gettop(L));
+        }
+        else if (lua_type(L, -2) == LUA_TNUMBER)
+        {
+            lbmVariantFill(&t->array[(int)lua_tonumber(L, -2) - 1], L, lua_gettop(L));
+        }
+        lua_pop(L, 1);
+    }
+
+    // Give back whatever the last doubling overshot
+    if (t->hashCount < hashCapacity)
+    {
+        t = lbmVariantTableResize(t, headerSize, t->hashCount);
+    }
+    v->type = V_TABLE;
+    v->t = t;
+}
+
+static void lbmVariantFill(lbmVariant *v, lua_State *L, int index)
+{
+    const char *s;
+
+    v->type = V_NONE;
+
+    switch (lua_type(L, index))
     {
         // Unimplemented:
         // LUA_TNIL
         // LUA_TLIGHTUSERDATA
-        // LUA_TTABLE
         // LUA_TFUNCTION
         // LUA_TUSERDATA
         // LUA_TTHREAD
 
         case LUA_TBOOLEAN:
-            ret = lbmVariantCreate(V_STRING);
-            s = (lua_toboolean(L, index)) ? "true" : "false";
-            dsCopy(&ret->s, s);
+            v->type = V_BOOL;
+            v->b = lua_toboolean(L, index);
             break;
         case LUA_TNUMBER:
-            ret = lbmVariantCreate(V_STRING);
-            sprintf(temp, "%d", (int)lua_tonumber(L, index));
-            dsCopy(&ret->s, temp);
+            lbmVariantSetNumber(v, lua_tonumber(L, index));
             break;
         case LUA_TSTRING:
-            ret = lbmVariantCreate(V_STRING);
-            s = lua_tolstring(L, index, &l);
-            dsCopy(&ret->s, s);
+            v->type = V_STRING;
+            s = lua_tostring(L, index);
+            v->s = NULL;
+            dsCopy(&v->s, s);
             break;
         case LUA_TTABLE:
-            lua_pushnil(L);  /* first key */
-            while (lua_next(L, index))
+            // Each nesting level holds a key and a value on the stack
+            if (lua_checkstack(L, 3))
             {
-                // uses 'key' (at index -2) and 'value' (at index -1)
-
-                if(ret == NULL)
-                {
-                    // Lazily create this so a table can either be a map or an array
-                    if(lua_type(L, -2) == LUA_TSTRING)
-                    {
-                        ret = lbmVariantCreate(V_MAP);
-                    }
-                    else
-                    {
-                        ret = lbmVariantCreate(V_ARRAY);
-                    }
-                }
-
-                if(ret->type == V_MAP)
-                {
-                    if(lua_type(L, -2) == LUA_TSTRING)
-                    {
-                        s = lua_tolstring(L, -2, &l);
-                    }
-                    else if(lua_type(L, -2) == LUA_TNUMBER)
-                    {
-                        sprintf(temp, "%d", (int)lua_tonumber(L, -2));
-                        s = temp;
-                    }
-
-                    if(s != NULL)
-                    {
-                        child = lbmVariantFromIndex(L, lua_absindex(L, -1));
-                        dmGetS2P(ret->m, s) = child;
-                    }
-                }
-                else
-                {
-                    child = lbmVariantFromIndex(L, lua_absindex(L, -1));
-                    daPush(&ret->a, child);
-                }
-
-                // removes 'value'; keeps 'key' for next iteration
-                lua_pop(L, 1);
+                lbmVariantFillTable(v, L, index);
             }
-
             break;
     };
+}
+
+// ---------------------------------------------------------------------------
+// Accessors
 
-    if(!ret)
+int lbmVariantCount(lbmVariant *v)
+{
+    if (!v)
     {
-        ret = lbmVariantCreate(V_NONE);
+        return 0;
     }
-    return ret;
+    if (v->type == V_TABLE)
+    {
+        return v->t->arrayCount;
+    }
+    switch (v->type)
+    {
+        case V_ARRAY:
+            return daSize(&v->a);
+        case V_MAP:
+            return v->m->count;
+    };
+    return 0;
 }
 
-lbmVariant *lbmVariantFromArgs(lua_State *L)
+lbmVariant *lbmVariantAt(lbmVariant *v, int i)
+{
+    if (!v || ((v->type != V_ARRAY) && (v->type != V_TABLE)) || (i < 0) || (i >= lbmVariantCount(v)))
+    {
+        return NULL;
+    }
+    if (v->type == V_TABLE)
+    {
+        return &v->t->array[i];
+    }
+    return v->a[i];
+}
+
+lbmVariant *lbmVariantGet(lbmVariant *v, const char *key)
 {
-    int argCount = lua_gettop(L);
     int i;
-    lbmVariant *ret = lbmVariantCreate(V_ARRAY);
-    lbmVariant *child;
+    if (v && (v->type == V_TABLE))
+    {
+        for (i = 0; i < v->t->hashCount; ++i)
+        {
+            lbmVariantPair *pair = &v->t->hash[i];
+            if ((pair->key.type == V_STRING) && !strcmp(pair->key.s, key))
+            {
+                return &pair->value;
+            }
+        }
+        return NULL;
+    }
+    if (!v || (v->type != V_MAP))
+    {
+        return NULL;
+    }
+    if (!dmHasS(v->m, key))
+    {
+        return NULL;
+    }
+    return (lbmVariant *)dmGetS2P(v->m, key);
+}
 
-    for (i=1; i <= argCount; ++i)
+const char *lbmVariantToString(lbmVariant *v)
+{
+    if (!v || (v->type != V_STRING))
     {
-        child = lbmVariantFromIndex(L, i);
-        daPush(&ret->a, child);
+        return NULL;
     }
-    return ret;
+    return v->s;
+}
+
+double lbmVariantToNumber(lbmVariant *v, double def)
+{
+    if (v)
+    {
+        switch (v->type)
+        {
+            case V_NUMBER:
+                return v->n;
+            case V_INTEGER:
+                return (double)v->i;
+        };
+    }
+    return def;
+}
+
+long long lbmVariantToInteger(lbmVariant *v, long long def)
+{
+    if (v)
+    {
+        switch (v->type)
+        {
+            case V_NUMBER:
+                return lbmVariantNumberFits(v->n) ? (long long)v->n : def;
+            case V_INTEGER:
+                return v->i;
+        };
+    }
+    return def;
+}
+
+int lbmVariantToBool(lbmVariant *v, int def)
+{
+    if (v && (v->type == V_BOOL))
+    {
+        return v->b;
+    }
+    return def;
 }
@@ -10,10 +10,15 @@ enum
     V_NONE = 0, // 'n': nil / absent
     V_STRING,   // 's': must be a basic string
     V_ARRAY,    // 'a'
-    V_MAP       // 'm'
+    V_MAP,      // 'm'
+    V_TABLE,    // 't': any Lua table (array part + hash part)
+    V_NUMBER,   // 'd': non-integral Lua number
+    V_INTEGER,  // 'i': Lua number with no fractional part
+    V_BOOL      // 'b'
 };
 
 struct lbmVariant;
+struct lbmVariantTable;
 
 typedef struct lbmVariant
 {
@@ -23,9 +28,29 @@ typedef struct lbmVariant
         char *s;
         struct lbmVariant **a;
         dynMap *m;
+        struct lbmVariantTable *t;    // V_TABLE
+        double n;                     // V_NUMBER
+        long long i;                  // V_INTEGER
+        int b;                        // V_BOOL
     };
 } lbmVariant;
 
+typedef struct lbmVariantPair
+{
+    lbmVariant key; // V_STRING, V_INTEGER, V_NUMBER or V_BOOL
+    lbmVariant value;
+} lbmVariantPair;
+
+// A Lua table as one contiguous block: this header, then the sequence 1..n
+// (stored by value), then every remaining key/value pair.
+typedef struct lbmVariantTable
+{
+    int arrayCount;
+    int hashCount;
+    lbmVariant *array;
+    lbmVariantPair *hash;
+} lbmVariantTable;
+
 lbmVariant *lbmVariantCreate(int type);
 void lbmVariantDestroy(lbmVariant *arg);
 void lbmVariantClear(lbmVariant *arg);
@@ -33,4 +58,21 @@ void lbmVariantPrint(lbmVariant *v, int depth); // for debugging
 lbmVariant *lbmVariantFromArgs(struct lua_State *L);
 lbmVariant *lbmVariantFromIndex(struct lua_State *L, int index);
 
+// NULL-safe, so lookups can chain.
+// For V_TABLE, Count/At cover the array part and Get searches the hash part.
+int lbmVariantCount(lbmVariant *v);
+lbmVariant *lbmVariantAt(lbmVariant *v, int i); // i is 0-based
+lbmVariant *lbmVariantGet(lbmVariant *v, const char *key);
+
+// Typed accessors; def is returned when v is missing or of another type
+const char *lbmVariantToString(lbmVariant *v); // NULL unless V_STRING
+double lbmVariantToNumber(lbmVariant *v, double def);
+long long lbmVariantToInteger(lbmVariant *v, long long def); // def too for NaN, inf and beyond long long
+int lbmVariantToBool(lbmVariant *v, int def);
+
+int lbmVariantNumberFits(double n); // whether casting n to long long is defined (NaN and inf aren't)
+int lbmVariantNumberType(double n, long long *i); // V_INTEGER (filling *i) or V_NUMBER
+
+int lua_absindex(struct lua_State *L, int idx); // missing from Lua 5.1
+
 #endif
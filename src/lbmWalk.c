@@ -0,0 +1,934 @@
+#include "lbmWalk.h"
+
+#include "lbmFile.h"
+#include "lbmPath.h"
+#include "lbmThread.h"
+
+#include "dyn.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#define LBM_WALK_MAX_THREADS 64
+#define LBM_WALK_ARENA_CHUNK (64 * 1024)
+#define LBM_WALK_STACK_PATH 1024
+
+#define LBM_WALK_UNKNOWN 0
+#define LBM_WALK_FILE    1
+#define LBM_WALK_DIR     2
+
+#define LBM_IS_SLASH(C) (((C) == '/') || ((C) == '\\'))
+
+// ---------------------------------------------------------------------------
+// Matching
+
+// Matches s[0] against the single-character pattern element at p[pi] ('?',
+// a [set] or a literal) and sets *next past it
+static int lbmWalkMatchOne(const char *p, size_t pl, size_t pi, char c, size_t *next)
+{
+    size_t i;
+    size_t first;
+    int negate = 0;
+    int matched = 0;
+
+    if (p[pi] == '?')
+    {
+        *next = pi + 1;
+        return 1;
+    }
+    if (p[pi] != '[')
+    {
+        *next = pi + 1;
+        return p[pi] == c;
+    }
+
+    i = pi + 1;
+    if ((i < pl) && ((p[i] == '!') || (p[i] == '^')))
+    {
+        negate = 1;
+        ++i;
+    }
+    first = i;
+    while ((i < pl) && ((p[i] != ']') || (i == first)))
+    {
+        if ((i + 2 < pl) && (p[i + 1] == '-') && (p[i + 2] != ']'))
+        {
+            if ((c >= p[i]) && (c <= p[i + 2]))
+            {
+                matched = 1;
+            }
+            i += 3;
+        }
+        else
+        {
+            if (c == p[i])
+            {
+                matched = 1;
+            }
+            ++i;
+        }
+    }
+    if (i >= pl)
+    {
+        // No closing bracket: it was just a '['
+        *next = pi + 1;
+        return c == '[';
+    }
+    *next = i + 1;
+    return matched != negate;
+}
+
+int lbmWalkMatch(const char *pattern, size_t patternLen, const char *s, size_t len)
+{
+    size_t pi = 0;
+    size_t si = 0;
+    size_t starP = (size_t)-1;
+    size_t starS = 0;
+    size_t next;
+
+    while (si < len)
+    {
+        if ((pi < patternLen) && (pattern[pi] == '*'))
+        {
+            starP = pi++;
+            starS = si;
+            continue;
+        }
+        if ((pi < patternLen) && lbmWalkMatchOne(pattern, patternLen, pi, s[si], &next))
+        {
+            pi = next;
+            ++si;
+            continue;
+        }
+        if (starP != (size_t)-1)
+        {
+            // Let the last '*' swallow one more character and retry
+            pi = starP + 1;
+            si = ++starS;
+            continue;
+        }
+        return 0;
+    }
+    while ((pi < patternLen) && (pattern[pi] == '*'))
+    {
+        ++pi;
+    }
+    return pi == patternLen;
+}
+
+static const char *lbmGlobSegmentEnd(const char *s, const char *end)
+{
+    while ((s < end) && !LBM_IS_SLASH(*s))
+    {
+        ++s;
+    }
+    return s;
+}
+
+static const char *lbmGlobNextSegment(const char *segEnd, const char *end)
+{
+    return (segEnd < end) ? segEnd + 1 : end;
+}
+
+static int lbmGlobIsDoubleStar(const char *seg, const char *segEnd)
+{
+    return ((segEnd - seg) == 2) && (seg[0] == '*') && (seg[1] == '*');
+}
+
+static int lbmGlobMatchRange(const char *p, const char *pend, const char *s, const char *send)
+{
+    for (;;)
+    {
+        const char *pSegEnd;
+        const char *sSegEnd;
+
+        if (p == pend)
+        {
+            return s == send;
+        }
+        pSegEnd = lbmGlobSegmentEnd(p, pend);
+        if (lbmGlobIsDoubleStar(p, pSegEnd))
+        {
+            const char *rest = lbmGlobNextSegment(pSegEnd, pend);
+            if (rest == pend)
+            {
+                return 1;
+            }
+            for (;;)
+            {
+                if (lbmGlobMatchRange(rest, pend, s, send))
+                {
+                    return 1;
+                }
+                if (s == send)
+                {
+                    return 0;
+                }
+                s = lbmGlobNextSegment(lbmGlobSegmentEnd(s, send), send);
+            }
+        }
+
+        if (s == send)
+        {
+            return 0;
+        }
+        sSegEnd = lbmGlobSegmentEnd(s, send);
+        if (!lbmWalkMatch(p, pSegEnd - p, s, sSegEnd - s))
+        {
+            return 0;
+        }
+        p = lbmGlobNextSegment(pSegEnd, pend);
+        s = lbmGlobNextSegment(sSegEnd, send);
+    }
+}
+
+int lbmGlobMatch(const char *pattern, const char *path, size_t len)
+{
+    return lbmGlobMatchRange(pattern, pattern + strlen(pattern), path, path + len);
+}
+
+// Whether anything below the directory at relative path s could still match
+static int lbmGlobCouldMatchUnder(const char *p, const char *pend, const char *s, const char *send)
+{
+    for (;;)
+    {
+        const char *pSegEnd;
+        const char *sSegEnd;
+
+        if (s == send)
+        {
+            return p != pend;
+        }
+        if (p == pend)
+        {
+            return 0;
+        }
+        pSegEnd = lbmGlobSegmentEnd(p, pend);
+        if (lbmGlobIsDoubleStar(p, pSegEnd))
+        {
+            return 1;
+        }
+        sSegEnd = lbmGlobSegmentEnd(s, send);
+        if (!lbmWalkMatch(p, pSegEnd - p, s, sSegEnd - s))
+        {
+            return 0;
+        }
+        p = lbmGlobNextSegment(pSegEnd, pend);
+        s = lbmGlobNextSegment(sSegEnd, send);
+    }
+}
+
+size_t lbmGlobRootLength(const char *pattern)
+{
+    size_t lastSlash = 0;
+    int sawSlash = 0;
+    size_t i;
+    for (i = 0; pattern[i]; ++i)
+    {
+        char c = pattern[i];
+        if ((c == '*') || (c == '?') || (c == '['))
+        {
+            break;
+        }
+        if (LBM_IS_SLASH(c))
+        {
+            lastSlash = i;
+            sawSlash = 1;
+        }
+    }
+    if (!sawSlash)
+    {
+        return 0;
+    }
+    // Keep a lone leading slash, so "/*" walks "/"
+    return (lastSlash == 0) ? 1 : lastSlash;
+}
+
+// ---------------------------------------------------------------------------
+// Snapshots
+//
+// A snapshot file remembers, per directory, its mtime and raw listing (every
+// name with its type, before any filtering). Adding, removing or renaming an
+// entry bumps a directory's mtime, so while it still matches the listing can
+// be replayed without opening the directory at all.
+//
+// Layout, in native byte order (a snapshot never leaves the machine):
+//   header:   magic, version, directory count          (3 x 4 bytes)
+//   each dir: mtime (8), path length (4), listing size (4),
+//             path, NUL, listing
+// A listing is a run of entries: type byte, link byte, name, NUL.
+
+#define LBM_WALK_SNAPSHOT_MAGIC   0x574d424c // "LBMW"
+#define LBM_WALK_SNAPSHOT_VERSION 1
+#define LBM_WALK_SNAPSHOT_HEADER  12
+#define LBM_WALK_RECORD_HEADER    16
+
+// A directory changed this close to the walk may change again within the
+// same mtime tick, so its listing isn't kept
+#define LBM_WALK_RACY_NS (2 * 1000000000LL)
+
+typedef struct lbmWalkListing
+{
+    const char *path;    // NUL terminated
+    size_t pathLen;
+    long long mtime;
+    const char *entries; // packed, see above
+    size_t entriesLen;
+    int visited;         // seen again by this walk
+} lbmWalkListing;
+
+typedef struct lbmWalkSnapshot
+{
+    lbmFileMap map;
+    lbmWalkListing *listings; // dynArray
+    int *slots;               // open addressing over listings, index + 1 (0 is empty)
+    int slotCount;            // power of two
+} lbmWalkSnapshot;
+
+static unsigned int lbmWalkHash(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int lbmWalkRead32(const char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void lbmWalkSnapshotLoad(lbmWalkSnapshot *snap, const char *filename)
+{
+    const char *c;
+    const char *end;
+    unsigned int count;
+    unsigned int i;
+
+    memset(snap, 0, sizeof(lbmWalkSnapshot));
+    daCreate(&snap->listings, sizeof(lbmWalkListing));
+    if (!lbmFileMapOpen(&snap->map, filename))
+    {
+        return;
+    }
+    if ((snap->map.len < LBM_WALK_SNAPSHOT_HEADER)
+        || (lbmWalkRead32(snap->map.data) != LBM_WALK_SNAPSHOT_MAGIC)
+        || (lbmWalkRead32(snap->map.data + 4) != LBM_WALK_SNAPSHOT_VERSION))
+    {
+        return;
+    }
+
+    count = lbmWalkRead32(snap->map.data + 8);
+    c = snap->map.data + LBM_WALK_SNAPSHOT_HEADER;
+    end = snap->map.data + snap->map.len;
+    for (i = 0; i < count; ++i)
+    {
+        lbmWalkListing listing;
+        if ((size_t)(end - c) < LBM_WALK_RECORD_HEADER)
+        {
+            break;
+        }
+        memcpy(&listing.mtime, c, sizeof(long long));
+        listing.pathLen = lbmWalkRead32(c + 8);
+        listing.entriesLen = lbmWalkRead32(c + 12);
+        c += LBM_WALK_RECORD_HEADER;
+        if (((size_t)(end - c) < listing.pathLen + 1 + listing.entriesLen)
+            || c[listing.pathLen]
+            || (listing.entriesLen && c[listing.pathLen + listing.entriesLen]))
+        {
+            // Truncated or damaged; keep what was good
+            break;
+        }
+        listing.path = c;
+        listing.entries = c + listing.pathLen + 1;
+        listing.visited = 0;
+        daPush(&snap->listings, listing);
+        c += listing.pathLen + 1 + listing.entriesLen;
+    }
+
+    // Index by path; never touched again once the workers start
+    snap->slotCount = 16;
+    while (snap->slotCount < daSize(&snap->listings) * 2)
+    {
+        snap->slotCount *= 2;
+    }
+    snap->slots = (int *)calloc(snap->slotCount, sizeof(int));
+    for (i = 0; i < (unsigned int)daSize(&snap->listings); ++i)
+    {
+        lbmWalkListing *listing = &snap->listings[i];
+        unsigned int slot = lbmWalkHash(listing->path, listing->pathLen) & (snap->slotCount - 1);
+        while (snap->slots[slot])
+        {
+            slot = (slot + 1) & (snap->slotCount - 1);
+        }
+        snap->slots[slot] = i + 1;
+    }
+}
+
+static lbmWalkListing *lbmWalkSnapshotFind(lbmWalkSnapshot *snap, const char *path, size_t len)
+{
+    unsigned int slot;
+    if (!snap->slots)
+    {
+        return NULL;
+    }
+    slot = lbmWalkHash(path, len) & (snap->slotCount - 1);
+    while (snap->slots[slot])
+    {
+        lbmWalkListing *listing = &snap->listings[snap->slots[slot] - 1];
+        if ((listing->pathLen == len) && !memcmp(listing->path, path, len))
+        {
+            return listing;
+        }
+        slot = (slot + 1) & (snap->slotCount - 1);
+    }
+    return NULL;
+}
+
+static void lbmWalkSnapshotFree(lbmWalkSnapshot *snap)
+{
+    free(snap->slots);
+    daDestroy(&snap->listings, NULL);
+    lbmFileMapClose(&snap->map);
+}
+
+static int lbmWalkListingCompare(const void *a, const void *b)
+{
+    const lbmWalkListing *la = *(const lbmWalkListing **)a;
+    const lbmWalkListing *lb = *(const lbmWalkListing **)b;
+    return strcmp(la->path, lb->path);
+}
+
+// Serializes listings (sorted, so an unchanged tree gives identical bytes).
+// Returns a malloc'd buffer.
+static char *lbmWalkSnapshotBuild(lbmWalkListing **listings, int count, size_t *outLen)
+{
+    unsigned int header[3];
+    size_t len = LBM_WALK_SNAPSHOT_HEADER;
+    char *data;
+    char *c;
+    int i;
+
+    qsort(listings, count, sizeof(lbmWalkListing *), lbmWalkListingCompare);
+    for (i = 0; i < count; ++i)
+    {
+        len += LBM_WALK_RECORD_HEADER + listings[i]->pathLen + 1 + listings[i]->entriesLen;
+    }
+
+    data = (char *)malloc(len);
+    header[0] = LBM_WALK_SNAPSHOT_MAGIC;
+    header[1] = LBM_WALK_SNAPSHOT_VERSION;
+    header[2] = (unsigned int)count;
+    memcpy(data, header, sizeof(header));
+    c = data + LBM_WALK_SNAPSHOT_HEADER;
+    for (i = 0; i < count; ++i)
+    {
+        lbmWalkListing *listing = listings[i];
+        unsigned int sizes[2];
+        sizes[0] = (unsigned int)listing->pathLen;
+        sizes[1] = (unsigned int)listing->entriesLen;
+        memcpy(c, &listing->mtime, sizeof(long long));
+        memcpy(c + 8, sizes, sizeof(sizes));
+        c += LBM_WALK_RECORD_HEADER;
+        memcpy(c, listing->path, listing->pathLen + 1);
+        c += listing->pathLen + 1;
+        memcpy(c, listing->entries, listing->entriesLen);
+        c += listing->entriesLen;
+    }
+    *outLen = len;
+    return data;
+}
+
+// ---------------------------------------------------------------------------
+// Walking
+
+typedef struct lbmWalkDir
+{
+    int depth;
+    size_t len;
+    char path[1];
+} lbmWalkDir;
+
+typedef struct lbmWalkWorker
+{
+    const char **paths;       // dynArray of results, strings in the matching arena
+    char *scratch;            // listing being read
+    size_t scratchLen;
+    size_t scratchSize;
+    lbmArena listingArena;    // listings kept for the next snapshot
+    lbmWalkListing *listings; // dynArray
+    int dirsCached;
+    int dirsRead;
+} lbmWalkWorker;
+
+typedef struct lbmWalkState
+{
+    lbmWalkOptions *opts;
+    size_t relOffset; // where the root-relative part of every path starts
+    size_t globLen;
+    lbmArena *arenas;
+    lbmWalkWorker *workers;
+    lbmWalkSnapshot snapshot; // previous run's, when opts->snapshot is set
+    long long racyAfter;      // directory mtimes past this aren't trusted
+} lbmWalkState;
+
+void lbmWalkOptionsInit(lbmWalkOptions *opts)
+{
+    memset(opts, 0, sizeof(lbmWalkOptions));
+    opts->files = 1;
+    opts->hidden = 1;
+    opts->maxDepth = -1;
+}
+
+static lbmWalkDir *lbmWalkDirCreate(const char *path, size_t len, int depth)
+{
+    lbmWalkDir *dir = (lbmWalkDir *)malloc(sizeof(lbmWalkDir) + len);
+    memcpy(dir->path, path, len);
+    dir->path[len] = 0;
+    dir->len = len;
+    dir->depth = depth;
+    return dir;
+}
+
+static int lbmWalkIgnored(lbmWalkOptions *opts, const char *name, size_t nameLen, const char *rel, size_t relLen)
+{
+    int i;
+    for (i = 0; i < opts->ignoreCount; ++i)
+    {
+        const char *pattern = opts->ignore[i];
+        int hasSlash = (strchr(pattern, '/') != NULL) || (strchr(pattern, '\\') != NULL);
+        if (hasSlash ? lbmGlobMatch(pattern, rel, relLen) : lbmWalkMatch(pattern, strlen(pattern), name, nameLen))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void lbmWalkEmit(lbmWalkState *state, int worker, const char *path, size_t len)
+{
+    const char *out = path;
+    char *copy;
+    if (state->opts->relative)
+    {
+        out += state->relOffset;
+        len -= state->relOffset;
+    }
+    copy = lbmArenaStrdup(&state->arenas[worker], out, len);
+    daPush(&state->workers[worker].paths, (const char *)copy);
+}
+
+static int lbmWalkStatType(const char *path)
+{
+#ifdef WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    if (attributes == INVALID_FILE_ATTRIBUTES)
+    {
+        return LBM_WALK_UNKNOWN;
+    }
+    return (attributes & FILE_ATTRIBUTE_DIRECTORY) ? LBM_WALK_DIR : LBM_WALK_FILE;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return LBM_WALK_UNKNOWN;
+    }
+    return S_ISDIR(st.st_mode) ? LBM_WALK_DIR : LBM_WALK_FILE;
+#endif
+}
+
+// One directory entry. type is LBM_WALK_UNKNOWN when the listing couldn't
+// say; isLink marks symlinks (reparse points on Win32).
+static void lbmWalkEntry(lbmTaskPool *pool, int worker, lbmWalkState *state, lbmWalkDir *dir, const char *name, int type, int isLink)
+{
+    lbmWalkOptions *opts = state->opts;
+    char stackPath[LBM_WALK_STACK_PATH];
+    char *path = stackPath;
+    size_t nameLen = strlen(name);
+    size_t len;
+    const char *rel;
+    size_t relLen;
+
+    if ((name[0] == '.') && (!name[1] || ((name[1] == '.') && !name[2])))
+    {
+        return;
+    }
+    if (!opts->hidden && (name[0] == '.'))
+    {
+        return;
+    }
+
+    len = dir->len + nameLen + 1;
+    if (len + 1 > sizeof(stackPath))
+    {
+        path = (char *)malloc(len + 1);
+    }
+    memcpy(path, dir->path, dir->len);
+    len = dir->len;
+    if (!len || !LBM_IS_SLASH(path[len - 1]))
+    {
+        path[len++] = PROPER_SLASH;
+    }
+    memcpy(path + len, name, nameLen);
+    len += nameLen;
+    path[len] = 0;
+    rel = path + state->relOffset;
+    relLen = len - state->relOffset;
+
+    if (!lbmWalkIgnored(opts, name, nameLen, rel, relLen))
+    {
+        if ((type == LBM_WALK_UNKNOWN) || (isLink && opts->follow))
+        {
+            type = lbmWalkStatType(path);
+        }
+
+        if (type == LBM_WALK_DIR)
+        {
+            if (opts->dirs && (!opts->glob || lbmGlobMatch(opts->glob, rel, relLen)))
+            {
+                lbmWalkEmit(state, worker, path, len);
+            }
+            if ((!isLink || opts->follow)
+                && ((opts->maxDepth < 0) || (dir->depth < opts->maxDepth))
+                && (!opts->glob || lbmGlobCouldMatchUnder(opts->glob, opts->glob + state->globLen, rel, rel + relLen)))
+            {
+                lbmTaskPoolPush(pool, worker, lbmWalkDirCreate(path, len, dir->depth + 1));
+            }
+        }
+        else if ((type == LBM_WALK_FILE) && opts->files && (!opts->glob || lbmGlobMatch(opts->glob, rel, relLen)))
+        {
+            lbmWalkEmit(state, worker, path, len);
+        }
+    }
+
+    if (path != stackPath)
+    {
+        free(path);
+    }
+}
+
+static void lbmWalkListAdd(lbmWalkWorker *w, const char *name, int type, int isLink)
+{
+    size_t nameLen = strlen(name);
+    size_t needed = w->scratchLen + nameLen + 3;
+    if ((name[0] == '.') && (!name[1] || ((name[1] == '.') && !name[2])))
+    {
+        return;
+    }
+    if (needed > w->scratchSize)
+    {
+        w->scratchSize = (w->scratchSize) ? w->scratchSize * 2 : 4096;
+        if (w->scratchSize < needed)
+        {
+            w->scratchSize = needed;
+        }
+        w->scratch = (char *)realloc(w->scratch, w->scratchSize);
+    }
+    w->scratch[w->scratchLen++] = (char)type;
+    w->scratch[w->scratchLen++] = (char)isLink;
+    memcpy(w->scratch + w->scratchLen, name, nameLen + 1);
+    w->scratchLen += nameLen + 1;
+}
+
+// Reads dir's raw listing into w->scratch. Returns 0 if the directory could
+// not be read in full (EACCES, EMFILE, ...), leaving whatever was read.
+static int lbmWalkList(lbmWalkWorker *w, lbmWalkDir *dir)
+{
+    int ok = 1;
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find;
+    char *pattern = (char *)malloc(dir->len + 3);
+    memcpy(pattern, dir->path, dir->len);
+    strcpy(pattern + dir->len, (dir->len && LBM_IS_SLASH(dir->path[dir->len - 1])) ? "*" : "\\*");
+    find = FindFirstFileA(pattern, &data);
+    free(pattern);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            int type = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? LBM_WALK_DIR : LBM_WALK_FILE;
+            int isLink = (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? 1 : 0;
+            lbmWalkListAdd(w, data.cFileName, type, isLink);
+        } while (FindNextFileA(find, &data));
+        ok = (GetLastError() == ERROR_NO_MORE_FILES);
+        FindClose(find);
+    }
+    else
+    {
+        ok = 0;
+    }
+#else
+    // readdir() fills from getdents64 in large batches; d_type spares a
+    // stat() per entry on every file system that reports it
+    DIR *d = opendir(dir->path);
+    if (d)
+    {
+        struct dirent *e;
+        // readdir() returns NULL both at the end and on error; only errno
+        // tells them apart
+        errno = 0;
+        while ((e = readdir(d)) != NULL)
+        {
+            int type = LBM_WALK_UNKNOWN;
+            int isLink = 0;
+#ifdef DT_DIR
+            switch (e->d_type)
+            {
+                case DT_DIR:
+                    type = LBM_WALK_DIR;
+                    break;
+                case DT_REG:
+                    type = LBM_WALK_FILE;
+                    break;
+                case DT_LNK:
+                    // Reported as a file unless following, when stat() decides
+                    type = LBM_WALK_FILE;
+                    isLink = 1;
+                    break;
+                case DT_UNKNOWN:
+                    break;
+                default:
+                    type = LBM_WALK_FILE; // fifos, sockets, devices
+                    break;
+            };
+#endif
+            lbmWalkListAdd(w, e->d_name, type, isLink);
+            errno = 0;
+        }
+        ok = (errno == 0);
+        closedir(d);
+    }
+    else
+    {
+        ok = 0;
+    }
+#endif
+    return ok;
+}
+
+static void lbmWalkTask(lbmTaskPool *pool, int worker, void *task, void *userdata)
+{
+    lbmWalkState *state = (lbmWalkState *)userdata;
+    lbmWalkDir *dir = (lbmWalkDir *)task;
+    lbmWalkWorker *w = &state->workers[worker];
+    const char *entries = NULL;
+    const char *end;
+    size_t entriesLen = 0;
+    int listed = 1;
+    lbmFileStat st;
+
+    st.type = LBM_FILE_MISSING;
+    if (state->opts->snapshot)
+    {
+        lbmWalkListing *previous = lbmWalkSnapshotFind(&state->snapshot, dir->path, dir->len);
+        lbmFileStatPath(dir->path, &st);
+        if (previous)
+        {
+            // Only this walk's task for dir touches it
+            previous->visited = 1;
+            if ((st.type == LBM_FILE_DIR) && (previous->mtime == st.mtime) && (st.mtime <= state->racyAfter))
+            {
+                entries = previous->entries;
+                entriesLen = previous->entriesLen;
+                ++w->dirsCached;
+            }
+        }
+    }
+
+    if (!entries)
+    {
+        w->scratchLen = 0;
+        listed = lbmWalkList(w, dir);
+        entries = w->scratch;
+        entriesLen = w->scratchLen;
+        ++w->dirsRead;
+    }
+
+    // A listing that could not be read is walked as far as it goes but never
+    // saved, or the snapshot would keep serving it once the error is gone
+    if (listed && (st.type == LBM_FILE_DIR) && (st.mtime <= state->racyAfter))
+    {
+        lbmWalkListing listing;
+        listing.path = lbmArenaStrdup(&w->listingArena, dir->path, dir->len);
+        listing.pathLen = dir->len;
+        listing.mtime = st.mtime;
+        if (entries == w->scratch)
+        {
+            char *copy = (char *)lbmArenaAlloc(&w->listingArena, entriesLen ? entriesLen : 1);
+            memcpy(copy, entries, entriesLen);
+            entries = copy;
+        }
+        listing.entries = entries;
+        listing.entriesLen = entriesLen;
+        listing.visited = 1;
+        daPush(&w->listings, listing);
+    }
+
+    // Replay the listing, whichever way it came
+    end = entries + entriesLen;
+    while (entries + 2 < end)
+    {
+        const char *name = entries + 2;
+        lbmWalkEntry(pool, worker, state, dir, name, entries[0], entries[1]);
+        entries = name + strlen(name) + 1;
+    }
+
+    free(dir);
+}
+
+// Writes the new snapshot: every listing this walk made, plus those from the
+// old one for directories outside root, so walks of different trees can
+// share a file
+static void lbmWalkSnapshotSave(lbmWalkState *state, int threadCount, const char *root, size_t rootLen)
+{
+    lbmWalkListing **all = NULL;
+    lbmWalkSnapshot *snap = &state->snapshot;
+    size_t len;
+    char *data;
+    int i;
+    int j;
+
+    daCreate(&all, sizeof(lbmWalkListing *));
+    for (i = 0; i < threadCount; ++i)
+    {
+        for (j = 0; j < daSize(&state->workers[i].listings); ++j)
+        {
+            lbmWalkListing *listing = &state->workers[i].listings[j];
+            daPush(&all, listing);
+        }
+    }
+    for (i = 0; i < daSize(&snap->listings); ++i)
+    {
+        lbmWalkListing *listing = &snap->listings[i];
+        int under = (listing->pathLen >= rootLen)
+            && !memcmp(listing->path, root, rootLen)
+            && ((listing->pathLen == rootLen) || LBM_IS_SLASH(listing->path[rootLen]) || LBM_IS_SLASH(root[rootLen - 1]));
+        if (!listing->visited && !under)
+        {
+            daPush(&all, listing);
+        }
+    }
+
+    data = lbmWalkSnapshotBuild(all, daSize(&all), &len);
+    daDestroy(&all, NULL);
+
+    // The old mapping goes first, so the rename can replace it on Win32
+    lbmWalkSnapshotFree(snap);
+    lbmFileWrite(state->opts->snapshot, data, len, LBM_WRITE_IF_CHANGED | LBM_WRITE_ATOMIC);
+    free(data);
+}
+
+static int lbmWalkCompare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+void lbmWalk(const char *root, lbmWalkOptions *opts, lbmWalkResult *result)
+{
+    lbmWalkState state;
+    void *task;
+    size_t rootLen = strlen(root);
+    int threadCount = (opts->threads > 0) ? opts->threads : lbmCpuCount();
+    int total = 0;
+    int i;
+
+    if (threadCount > LBM_WALK_MAX_THREADS)
+    {
+        threadCount = LBM_WALK_MAX_THREADS;
+    }
+
+    // Trailing slashes would double up when joining, except on a bare root
+    while ((rootLen > 1) && LBM_IS_SLASH(root[rootLen - 1]))
+    {
+        --rootLen;
+    }
+    if (!rootLen)
+    {
+        root = ".";
+        rootLen = 1;
+    }
+
+    state.opts = opts;
+    state.relOffset = rootLen + (LBM_IS_SLASH(root[rootLen - 1]) ? 0 : 1);
+    state.globLen = (opts->glob) ? strlen(opts->glob) : 0;
+    state.arenas = (lbmArena *)malloc(threadCount * sizeof(lbmArena));
+    state.workers = (lbmWalkWorker *)calloc(threadCount, sizeof(lbmWalkWorker));
+    for (i = 0; i < threadCount; ++i)
+    {
+        lbmArenaInit(&state.arenas[i], LBM_WALK_ARENA_CHUNK);
+        daCreate(&state.workers[i].paths, sizeof(const char *));
+        lbmArenaInit(&state.workers[i].listingArena, LBM_WALK_ARENA_CHUNK);
+        daCreate(&state.workers[i].listings, sizeof(lbmWalkListing));
+    }
+
+    state.racyAfter = (long long)time(NULL) * 1000000000LL - LBM_WALK_RACY_NS;
+    if (opts->snapshot)
+    {
+        lbmWalkSnapshotLoad(&state.snapshot, opts->snapshot);
+    }
+
+    task = lbmWalkDirCreate(root, rootLen, 0);
+    lbmTaskPoolRun(threadCount, lbmWalkTask, &state, &task, 1);
+
+    if (opts->snapshot)
+    {
+        lbmWalkSnapshotSave(&state, threadCount, root, rootLen);
+    }
+
+    result->dirsCached = 0;
+    result->dirsRead = 0;
+    for (i = 0; i < threadCount; ++i)
+    {
+        total += daSize(&state.workers[i].paths);
+    }
+    result->paths = (const char **)malloc((total ? total : 1) * sizeof(const char *));
+    result->count = 0;
+    for (i = 0; i < threadCount; ++i)
+    {
+        lbmWalkWorker *w = &state.workers[i];
+        int count = daSize(&w->paths);
+        memcpy(result->paths + result->count, w->paths, count * sizeof(const char *));
+        result->count += count;
+        result->dirsCached += w->dirsCached;
+        result->dirsRead += w->dirsRead;
+        daDestroy(&w->paths, NULL);
+        daDestroy(&w->listings, NULL);
+        lbmArenaFree(&w->listingArena);
+        free(w->scratch);
+    }
+    free(state.workers);
+
+    // Workers finish in whatever order stealing made; sorting makes the
+    // result the same every run
+    qsort(result->paths, result->count, sizeof(const char *), lbmWalkCompare);
+    result->arenas = state.arenas;
+    result->arenaCount = threadCount;
+}
+
+void lbmWalkResultFree(lbmWalkResult *result)
+{
+    int i;
+    for (i = 0; i < result->arenaCount; ++i)
+    {
+        lbmArenaFree(&result->arenas[i]);
+    }
+    free(result->arenas);
+    free(result->paths);
+    memset(result, 0, sizeof(lbmWalkResult));
+}
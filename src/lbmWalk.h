@@ -0,0 +1,60 @@
+#ifndef LBMWALK_H
+#define LBMWALK_H
+
+#include "lbmArena.h"
+
+#include <stddef.h>
+
+// Parallel directory walker. Each directory is a task on an lbmTaskPool, so
+// big subtrees get spread across idle threads by stealing. Entry types come
+// from the directory listing itself wherever the platform provides them;
+// stat() is only needed for the leftovers.
+//
+// With opts.snapshot set, each directory's raw listing is saved alongside its
+// mtime, and the next walk replays any directory whose mtime still matches
+// instead of reading it: one stat() per directory rather than a listing.
+// The file is rewritten (atomically, and only when something changed) at
+// the end of every walk; its directory must already exist.
+
+typedef struct lbmWalkOptions
+{
+    const char **ignore; // patterns for lbmWalkMatch() against entry names, or
+    int ignoreCount;     // lbmGlobMatch() against relative paths if they have a slash
+    const char *glob;    // if set, only relative paths matching this are returned
+    int files;           // return files (default 1)
+    int dirs;            // return directories (default 0)
+    int hidden;          // include names starting with '.' (default 1)
+    int follow;          // descend into symlinked directories (default 0)
+    int maxDepth;        // 0 is just root's own entries; < 0 is unlimited (default)
+    int relative;        // return paths relative to root rather than joined to it
+    int threads;         // <= 0 means one per CPU
+    const char *snapshot; // file remembering directory listings between runs (see below)
+} lbmWalkOptions;
+
+typedef struct lbmWalkResult
+{
+    const char **paths; // sorted
+    int count;
+    lbmArena *arenas;   // one per worker, holding the strings
+    int arenaCount;
+    int dirsCached;     // listings replayed from the snapshot
+    int dirsRead;       // directories actually opened
+} lbmWalkResult;
+
+void lbmWalkOptionsInit(lbmWalkOptions *opts);
+void lbmWalk(const char *root, lbmWalkOptions *opts, lbmWalkResult *result);
+void lbmWalkResultFree(lbmWalkResult *result);
+
+// One name against one pattern segment: '*', '?', and [abc] / [!a-z] sets
+int lbmWalkMatch(const char *pattern, size_t patternLen, const char *s, size_t len);
+
+// A relative path against a slash separated pattern where a "**" segment
+// matches any number of directories (including none)
+int lbmGlobMatch(const char *pattern, const char *path, size_t len);
+
+// Splits a glob like "src/**/*.c" at the last slash before its first
+// wildcard: returns the length of the literal directory part ("src"), 0 if
+// the pattern starts with a wildcard
+size_t lbmGlobRootLength(const char *pattern);
+
+#endif
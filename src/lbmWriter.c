@@ -0,0 +1,253 @@
+#include "lbmWriter.h"
+
+#include "lbmFile.h"
+#include "lbmPath.h"
+
+#include "dyn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct lbmWriteJob
+{
+    lbmWriteJob *next;
+    char *path;
+    char *data;
+    size_t len;
+    int flags;
+};
+
+// Works through worker's queue. With drain set it returns once the queue is
+// empty; otherwise it sleeps until there is more or the writer is quitting.
+static void lbmWriterRun(lbmWriterWorker *worker, int drain)
+{
+    lbmWriter *w = worker->writer;
+
+    lbmMutexLock(w->mutex);
+    for (;;)
+    {
+        lbmWriteJob *job;
+        int result;
+
+        while (!worker->head && !w->quit && !drain)
+        {
+            lbmCondWait(worker->wake, w->mutex);
+        }
+        job = worker->head;
+        if (!job)
+        {
+            break; // quitting or draining, and nothing left
+        }
+        worker->head = job->next;
+        if (!worker->head)
+        {
+            worker->tail = NULL;
+        }
+        lbmMutexUnlock(w->mutex);
+
+        result = lbmFileWrite(job->path, job->data, job->len, job->flags);
+
+        lbmMutexLock(w->mutex);
+        switch (result)
+        {
+            case LBM_WRITE_WRITTEN:
+                ++w->written;
+                break;
+            case LBM_WRITE_UNCHANGED:
+                ++w->unchanged;
+                break;
+            default:
+                ++w->failed;
+                ++w->errorCount;
+                dsConcat(&w->errors, "cannot write ");
+                dsConcat(&w->errors, job->path);
+                dsConcat(&w->errors, "\n");
+                break;
+        };
+        --w->pending;
+        w->pendingBytes -= job->len;
+        lbmCondBroadcast(w->done);
+        free(job);
+    }
+    lbmMutexUnlock(w->mutex);
+}
+
+static void lbmWriterMain(void *userdata)
+{
+    lbmWriterRun((lbmWriterWorker *)userdata, 0);
+}
+
+void lbmWriterInit(lbmWriter *w)
+{
+    memset(w, 0, sizeof(lbmWriter));
+    w->maxBytes = LBM_WRITER_MAX_BYTES;
+}
+
+// Threads and locks only get made once something is actually queued
+static void lbmWriterStart(lbmWriter *w)
+{
+    int i;
+    w->mutex = lbmMutexCreate();
+    w->done = lbmCondCreate();
+    for (i = 0; i < LBM_WRITER_THREADS; ++i)
+    {
+        lbmWriterWorker *worker = &w->workers[i];
+        worker->writer = w;
+        worker->wake = lbmCondCreate();
+        worker->thread = lbmThreadCreate(lbmWriterMain, worker);
+    }
+    w->started = 1;
+}
+
+void lbmWriterFree(lbmWriter *w)
+{
+    int i;
+    if (!w->started)
+    {
+        return;
+    }
+
+    lbmWriterFlush(w, NULL);
+    lbmMutexLock(w->mutex);
+    w->quit = 1;
+    for (i = 0; i < LBM_WRITER_THREADS; ++i)
+    {
+        lbmCondSignal(w->workers[i].wake);
+    }
+    lbmMutexUnlock(w->mutex);
+
+    for (i = 0; i < LBM_WRITER_THREADS; ++i)
+    {
+        if (w->workers[i].thread)
+        {
+            lbmThreadJoin(w->workers[i].thread);
+        }
+        lbmCondDestroy(w->workers[i].wake);
+    }
+    lbmCondDestroy(w->done);
+    lbmMutexDestroy(w->mutex);
+    memset(w, 0, sizeof(lbmWriter));
+}
+
+// Picks the worker from the canonical form, so "a/b" and "./a//b" queue
+// behind each other
+static int lbmWriterPick(const char *path, size_t pathLen)
+{
+    char stackBuffer[512];
+    char *buffer = stackBuffer;
+    size_t size = lbmPathCanonicalSize(pathLen, 0);
+    size_t len;
+    size_t i;
+    unsigned int h = 2166136261u;
+
+    if (size > sizeof(stackBuffer))
+    {
+        buffer = (char *)malloc(size);
+    }
+    len = lbmPathCanonicalize(buffer, size, path, pathLen, NULL, 0);
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)buffer[i];
+        h *= 16777619u;
+    }
+    if (buffer != stackBuffer)
+    {
+        free(buffer);
+    }
+    return (int)(h % LBM_WRITER_THREADS);
+}
+
+void lbmWriterEnqueue(lbmWriter *w, const char *path, size_t pathLen, const char *data, size_t len, int flags)
+{
+    lbmWriteJob *job = (lbmWriteJob *)malloc(sizeof(lbmWriteJob) + pathLen + 1 + len);
+    lbmWriterWorker *worker;
+
+    if (!w->started)
+    {
+        lbmWriterStart(w);
+    }
+    worker = &w->workers[lbmWriterPick(path, pathLen)];
+
+    job->next = NULL;
+    job->path = (char *)(job + 1);
+    job->data = job->path + pathLen + 1;
+    job->len = len;
+    job->flags = flags;
+    memcpy(job->path, path, pathLen);
+    job->path[pathLen] = 0;
+    memcpy(job->data, data, len);
+
+    lbmMutexLock(w->mutex);
+    while ((w->pending > 0) && (w->pendingBytes + len > w->maxBytes))
+    {
+        // Back-pressure: let the disk catch up before taking on more
+        lbmCondWait(w->done, w->mutex);
+    }
+    if (worker->tail)
+    {
+        worker->tail->next = job;
+    }
+    else
+    {
+        worker->head = job;
+    }
+    worker->tail = job;
+    ++w->pending;
+    w->pendingBytes += len;
+    lbmCondSignal(worker->wake);
+    lbmMutexUnlock(w->mutex);
+
+    if (!worker->thread)
+    {
+        // Couldn't get this worker's thread; write it out right here
+        lbmWriterRun(worker, 1);
+    }
+}
+
+int lbmWriterFlush(lbmWriter *w, char **errors)
+{
+    int errorCount;
+    if (errors)
+    {
+        *errors = NULL;
+    }
+    if (!w->started)
+    {
+        return 0;
+    }
+
+    lbmMutexLock(w->mutex);
+    while (w->pending > 0)
+    {
+        lbmCondWait(w->done, w->mutex);
+    }
+    errorCount = w->errorCount;
+    if (errors)
+    {
+        *errors = w->errors;
+    }
+    else
+    {
+        dsDestroy(&w->errors);
+    }
+    w->errors = NULL;
+    w->errorCount = 0;
+    lbmMutexUnlock(w->mutex);
+    return errorCount;
+}
+
+void lbmWriterGetCounts(lbmWriter *w, lbmWriterCounts *counts)
+{
+    if (w->started)
+    {
+        lbmMutexLock(w->mutex);
+    }
+    counts->written = w->written;
+    counts->unchanged = w->unchanged;
+    counts->failed = w->failed;
+    counts->pending = w->pending;
+    if (w->started)
+    {
+        lbmMutexUnlock(w->mutex);
+    }
+}
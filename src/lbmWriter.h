@@ -0,0 +1,68 @@
+#ifndef LBMWRITER_H
+#define LBMWRITER_H
+
+#include "lbmThread.h"
+
+#include <stddef.h>
+
+// Write-behind queue. Writes are copied and handed to a small pool of
+// threads running lbmFileWrite(). Every path hashes to one worker, so
+// writes to the same file always land in the order they were queued.
+// Failures are collected and handed back by lbmWriterFlush().
+
+#define LBM_WRITER_THREADS 4
+#define LBM_WRITER_MAX_BYTES (64 * 1024 * 1024) // enqueue blocks beyond this much pending data
+
+typedef struct lbmWriteJob lbmWriteJob;
+typedef struct lbmWriter lbmWriter;
+
+typedef struct lbmWriterWorker
+{
+    lbmWriter *writer;
+    lbmThread *thread;
+    lbmCond *wake;
+    lbmWriteJob *head;
+    lbmWriteJob *tail;
+} lbmWriterWorker;
+
+struct lbmWriter
+{
+    lbmMutex *mutex;
+    lbmCond *done; // a job finished
+    lbmWriterWorker workers[LBM_WRITER_THREADS];
+    int started;
+    int quit;
+    int pending;         // queued or being written
+    size_t pendingBytes;
+    size_t maxBytes;
+    char *errors;        // dynString, one line per failure since the last flush
+    int errorCount;
+
+    // Totals
+    int written;
+    int unchanged;
+    int failed;
+};
+
+typedef struct lbmWriterCounts
+{
+    int written;
+    int unchanged;
+    int failed;
+    int pending;
+} lbmWriterCounts;
+
+void lbmWriterInit(lbmWriter *w);
+void lbmWriterFree(lbmWriter *w); // flushes first; errors are dropped
+
+// Copies path and data. flags are lbmFileWrite()'s.
+void lbmWriterEnqueue(lbmWriter *w, const char *path, size_t pathLen, const char *data, size_t len, int flags);
+
+// Waits for every queued write, then returns how many failed since the last
+// flush. If errors is not NULL it takes ownership of a dynString describing
+// them (or NULL when there were none).
+int lbmWriterFlush(lbmWriter *w, char **errors);
+
+void lbmWriterGetCounts(lbmWriter *w, lbmWriterCounts *counts);
+
+#endif
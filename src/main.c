@@ -1,6 +1,18 @@
 #include "dyn.h"
+#include "lbmArgs.h"
+#include "lbmBuild.h"
+#include "lbmBuildLog.h"
+#include "lbmFile.h"
+#include "lbmGraph.h"
+#include "lbmGrep.h"
+#include "lbmPath.h"
+#include "lbmRegex.h"
 #include "lbmVariant.h"
 #include "lbmRenderer.h"
+#include "lbmTemplate.h"
+#include "lbmThread.h"
+#include "lbmWalk.h"
+#include "lbmWriter.h"
 #include "lbmBaseLua.h"
 
 #include "lua.h"
@@ -16,9 +28,6 @@
 #include <windows.h>   // for GetCurrentDirectory()
 #else
 #include <unistd.h>    // for getcwd()
-#include <sys/types.h> // for S_* defines
-#include <sys/stat.h>  // for mkdir()
-#include <dirent.h>    // for opendir()
 #endif
 
 // ---------------------------------------------------------------------------
@@ -36,80 +45,6 @@ const char * lbmWorkingDir()
 #endif
 }
 
-int lbmDirExists(const char * path)
-{
-    int ret = 0;
-
-#ifdef WIN32
-    DWORD dwAttrib = GetFileAttributes(path);
-    if (dwAttrib != INVALID_FILE_ATTRIBUTES && (dwAttrib & FILE_ATTRIBUTE_DIRECTORY))
-    {
-        ret = 1;
-    }
-#else
-    DIR * p = opendir(path);
-    if (p != NULL)
-    {
-        ret = 1;
-        closedir(p);
-    }
-#endif
-
-    return ret;
-}
-
-void lbmMkdir(const char * path)
-{
-    if (!lbmDirExists(path))
-    {
-        printf("Creating directory: %s\n", path);
-
-#ifdef WIN32
-        CreateDirectory(path, NULL);
-#else
-        mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-#endif
-
-    }
-}
-
-// ---------------------------------------------------------------------------
-// File reading
-
-char * lbmFileAlloc(const char * filename, int * outputLen)
-{
-    char * data;
-    int len;
-    int bytesRead;
-
-    FILE * f = fopen(filename, "rb");
-    if (!f)
-    {
-        return NULL;
-    }
-
-    fseek(f, 0, SEEK_END);
-    len = (int)ftell(f);
-    if (len < 1)
-    {
-        fclose(f);
-        return NULL;
-    }
-
-    fseek(f, 0, SEEK_SET);
-    data = (char *)calloc(1, len + 1);
-    bytesRead = fread(data, 1, len, f);
-    if (bytesRead != len)
-    {
-        free(data);
-        data = NULL;
-    }
-
-    fclose(f);
-    *outputLen = len;
-    return data;
-}
-
 // ---------------------------------------------------------------------------
 // Script loading
 
@@ -162,391 +97,2854 @@ static int lbmLoadScript(lua_State * L, const char * name, const char * script,
 }
 
 // ---------------------------------------------------------------------------
+// Lua lbm functions
 
-#ifdef WIN32
-#define PROPER_SLASH '\\'
-#define PROPER_CURRENT "\\."
-#define PROPER_PARENT "\\.."
-#else
-#define PROPER_SLASH '/'
-#define PROPER_CURRENT "/."
-#define PROPER_PARENT "/.."
-#endif
-
-static int isAbsolutePath(const char * s)
+// luaL_checkudata() without the error: NULL unless index holds a userdata
+// with the named metatable
+static void * lbmTestUData(lua_State * L, int index, const char * meta)
 {
-#ifdef WIN32
-    if ((strlen(s) >= 3) && (s[1] == ':') && (s[2] == PROPER_SLASH))
+    void * p = lua_touserdata(L, index);
+    if (p && lua_getmetatable(L, index))
     {
-        char driveLetter = tolower(s[0]);
-        if ((driveLetter >= 'a') && (driveLetter <= 'z'))
+        luaL_getmetatable(L, meta);
+        if (!lua_rawequal(L, -1, -2))
         {
-            return 1;
+            p = NULL;
         }
+        lua_pop(L, 2);
+        return p;
     }
-#endif
-    if (s[0] == PROPER_SLASH)
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Interned paths
+
+#define LBM_PATH_META "lbm.path"
+#define LBM_PATH_OBJECTS "lbm.paths"
+
+// Every canonical path this process has seen, for the life of the process
+static lbmPathTable sPaths;
+
+static lbmPathEntry * lbmPathFromLua(lua_State * L, int index)
+{
+    int * id = (int *)lbmTestUData(L, index, LBM_PATH_META);
+    return (id) ? lbmPathGet(&sPaths, *id) : NULL;
+}
+
+// String view of an argument or field that may be a string or an lbm.path
+static const char * lbmPathView(lua_State * L, lbmArg * arg, size_t * len)
+{
+    lbmPathEntry * entry;
+    *len = 0;
+    switch (arg->type)
     {
-        return 1;
+        case V_STRING:
+        case V_NUMBER:
+        case V_INTEGER:
+            return lua_tolstring(L, arg->index, len);
+        case V_NONE:
+            entry = (arg->index) ? lbmPathFromLua(L, arg->index) : NULL;
+            if (entry)
+            {
+                *len = entry->len;
+                return entry->s;
+            }
+            break;
+    };
+    return NULL;
+}
+
+// Pushes the single live lbm.path object for id. Objects are kept in a
+// weak-valued registry table, so two handles on the same path are always the
+// same userdata and comparing them in Lua is a pointer comparison.
+static void lbmPathPush(lua_State * L, int id)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, LBM_PATH_OBJECTS);
+    lua_rawgeti(L, -1, id + 1);
+    if (lua_isnil(L, -1))
+    {
+        int * ud;
+        lua_pop(L, 1);
+        ud = (int *)lua_newuserdata(L, sizeof(int));
+        *ud = id;
+        luaL_getmetatable(L, LBM_PATH_META);
+        lua_setmetatable(L, -2);
+        lua_newtable(L); // per-object cache of derived strings
+        lua_setfenv(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, id + 1);
     }
-    return 0;
+    lua_remove(L, -2);
 }
 
-static void dsCleanupSlashes(char ** ds)
+static int lbmPathJoin(lua_State * L)
 {
-    char * c;
-    char * head;
-    char * tail;
-    int wasSlash = 0;
-    if (!dsLength(ds))
+    lbmArgs args;
+    lbmArg arg;
+    lbmPathEntry * self = lbmPathFromLua(L, 1);
+    const char * path;
+    size_t pathLen;
+    int id;
+
+    luaL_argcheck(L, self != NULL, 1, "lbm.path expected");
+    lbmArgsInit(&args, L);
+    lbmArgsGet(&args, 1, &arg);
+    path = lbmPathView(L, &arg, &pathLen);
+    luaL_argcheck(L, path != NULL, 2, "string expected");
+    id = lbmPathInternPair(&sPaths, path, pathLen, self->s, self->len);
+    if (id == LBM_PATH_NONE)
     {
-        return;
+        return luaL_error(L, "path too long");
     }
+    lbmPathPush(L, id);
+    return 1;
+}
+
+// self.path, .basename, .dirname and .extension are built once per object
+// and kept in its environment table; .parent and .id are computed each time.
+// Anything else is looked up in the methods table (upvalue 1).
+static int lbmPathIndex(lua_State * L)
+{
+    lbmPathEntry * entry = lbmPathFromLua(L, 1);
+    lbmPathEntry * parent;
+    const char * key = lua_tostring(L, 2);
 
-    // Remove all trailing slashes
-    c = *ds + (dsLength(ds) - 1);
-    for (; c >= *ds; --c)
+    if (!entry || !key)
     {
-        if ((*c == '/') || (*c == '\\'))
-        {
-            *c = 0;
-        }
-        else
-        {
-            break;
-        }
+        return 0;
     }
 
-    // Remove all duplicate slashes, fix slash direction
-    head = *ds;
-    tail = *ds;
-    for (; *tail; ++tail)
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1))
     {
-        int isSlash = ((*tail == '/') || (*tail == '\\')) ? 1 : 0;
-        if (isSlash)
-        {
-            if (!wasSlash)
-            {
-                *head = PROPER_SLASH;
-                ++head;
-            }
-        }
-        else
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    if (!strcmp(key, "path"))
+    {
+        lua_pushlstring(L, entry->s, entry->len);
+    }
+    else if (!strcmp(key, "basename"))
+    {
+        lua_pushlstring(L, entry->s + entry->basename, entry->len - entry->basename);
+    }
+    else if (!strcmp(key, "extension"))
+    {
+        lua_pushlstring(L, entry->s + entry->extension, entry->len - entry->extension);
+    }
+    else if (!strcmp(key, "dirname"))
+    {
+        parent = lbmPathGet(&sPaths, entry->parent);
+        lua_pushlstring(L, (parent) ? parent->s : "", (parent) ? parent->len : 0);
+    }
+    else if (!strcmp(key, "parent"))
+    {
+        if (entry->parent == LBM_PATH_NONE)
         {
-            *head = *tail;
-            ++head;
+            return 0;
         }
-        wasSlash = isSlash;
+        lbmPathPush(L, entry->parent);
+        return 1;
+    }
+    else if (!strcmp(key, "id"))
+    {
+        lua_pushinteger(L, *(int *)lua_touserdata(L, 1));
+        return 1;
+    }
+    else
+    {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
     }
-    *head = 0;
 
-    // Clue in the dynString that it was manually altered
-    dsCalcLength(ds);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    return 1;
+}
+
+static int lbmPathToString(lua_State * L)
+{
+    lbmPathEntry * entry = lbmPathFromLua(L, 1);
+    lua_pushlstring(L, (entry) ? entry->s : "", (entry) ? entry->len : 0);
+    return 1;
 }
 
-static void dsSquashDotDirs(char ** ds)
+// Lets scripts that still build paths by hand write dir .. "/file.c"
+static int lbmPathConcat(lua_State * L)
 {
-    char * dot;
-    char * prevSlash;
-    while ((dot = strstr(*ds, PROPER_PARENT)) != NULL)
+    int i;
+    for (i = 1; i <= 2; ++i)
     {
-        if (dot == *ds)
+        lbmPathEntry * entry = lbmPathFromLua(L, i);
+        if (entry)
         {
-            // bad path
-            return;
+            lua_pushlstring(L, entry->s, entry->len);
         }
-        prevSlash = dot - 1;
-        dot += strlen(PROPER_PARENT);
-        while ((prevSlash != *ds) && (*prevSlash != PROPER_SLASH))
+        else if (lua_isstring(L, i))
         {
-            --prevSlash;
+            lua_pushvalue(L, i);
         }
-        if (prevSlash != *ds)
+        else
         {
-            memmove(prevSlash, dot, strlen(dot)+1);
+            return luaL_error(L, "attempt to concatenate a %s value", luaL_typename(L, i));
         }
     }
-    while ((dot = strstr(*ds, PROPER_CURRENT)) != NULL)
+    lua_concat(L, 2);
+    return 1;
+}
+
+static const luaL_Reg lbmPathMethods[] =
+{
+    { "join", lbmPathJoin },
+    { NULL, NULL }
+};
+
+static void lbmPathStartup(lua_State * L)
+{
+    lbmPathTableInit(&sPaths);
+
+    luaL_newmetatable(L, LBM_PATH_META);
+    lua_newtable(L);
+    luaL_register(L, NULL, lbmPathMethods);
+    lua_pushcclosure(L, lbmPathIndex, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lbmPathToString);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, lbmPathConcat);
+    lua_setfield(L, -2, "__concat");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, LBM_PATH_OBJECTS);
+}
+
+// Canonicalizes args[0] against args[1] through the interner; LBM_PATH_NONE
+// if the result was too long
+static int lbmPathInternArgs(lua_State * L, lbmArgs * args)
+{
+    lbmArg arg;
+    const char * path;
+    const char * curDir;
+    size_t pathLen;
+    size_t curDirLen;
+
+    lbmArgsGet(args, 0, &arg);
+    path = lbmPathView(L, &arg, &pathLen);
+    luaL_argcheck(L, path != NULL, 1, "string expected");
+    lbmArgsGet(args, 1, &arg);
+    curDir = lbmPathView(L, &arg, &curDirLen);
+    return lbmPathInternPair(&sPaths, path, pathLen, curDir, curDirLen);
+}
+
+int lbm_canonicalize(lua_State * L, lbmArgs * args)
+{
+    lbmPathEntry * entry = lbmPathGet(&sPaths, lbmPathInternArgs(L, args));
+    lua_pushlstring(L, (entry) ? entry->s : "", (entry) ? entry->len : 0);
+    return 1;
+}
+
+int lbm_path(lua_State * L, lbmArgs * args)
+{
+    int id;
+    if ((args->count == 1) && lbmPathFromLua(L, 1))
+    {
+        lua_settop(L, 1);
+        return 1;
+    }
+    id = lbmPathInternArgs(L, args);
+    if (id == LBM_PATH_NONE)
     {
-        if (dot == *ds)
-        {
-            // bad path
-            return;
-        }
-        prevSlash = dot;
-        dot += strlen(PROPER_CURRENT);
-        if (prevSlash != *ds)
-        {
-            memmove(prevSlash, dot, strlen(dot)+1);
-        }
+        return luaL_error(L, "path too long");
+    }
+    lbmPathPush(L, id);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Compiled templates
+
+#define LBM_TEMPLATE_META "lbm.template"
+#define LBM_TEMPLATE_CACHE "lbm.templates"
+#define LBM_TEMPLATE_CACHE_MAX 1024
+#define LBM_TEMPLATE_STACK_BUFFER 512
+
+static int sTemplateCacheCount = 0;
+
+static int lbmTemplateGC(lua_State * L)
+{
+    lbmTemplate ** t = (lbmTemplate **)luaL_checkudata(L, 1, LBM_TEMPLATE_META);
+    if (*t)
+    {
+        lbmTemplateDestroy(*t);
+        *t = NULL;
     }
-    dsCalcLength(ds);
+    return 0;
 }
 
-void lbmCanonicalizePath(char ** dspath, const char * curDir)
+// Returns the compiled form of the template string at index, compiling it on
+// first sight. The cache table is keyed by the Lua string itself, so a hit is
+// a lookup on the interned string pointer and the key keeps it alive. The
+// template's userdata is left on top of the stack.
+static lbmTemplate * lbmTemplateFromLua(lua_State * L, int index)
 {
-    char * temp = NULL;
-    if (!curDir || !strlen(curDir))
+    lbmTemplate ** t;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LBM_TEMPLATE_CACHE);
+    if (lua_isnil(L, -1) || (sTemplateCacheCount >= LBM_TEMPLATE_CACHE_MAX))
     {
-        curDir = ".";
+        // Start over rather than grow without bound on generated templates
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LBM_TEMPLATE_CACHE);
+        sTemplateCacheCount = 0;
     }
 
-    if (isAbsolutePath(*dspath))
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
     {
-        dsCopy(&temp, *dspath);
+        lua_pop(L, 1);
+        t = (lbmTemplate **)lua_newuserdata(L, sizeof(lbmTemplate *));
+        *t = lbmTemplateCompile(lua_tostring(L, index));
+        luaL_getmetatable(L, LBM_TEMPLATE_META);
+        lua_setmetatable(L, -2);
+
+        lua_pushvalue(L, index);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        ++sTemplateCacheCount;
     }
     else
     {
-        dsPrintf(&temp, "%s/%s", curDir, *dspath);
+        t = (lbmTemplate **)lua_touserdata(L, -1);
     }
 
-    dsCleanupSlashes(&temp);
-    dsSquashDotDirs(&temp);
-
-    dsCopy(dspath, temp);
-    dsDestroy(&temp);
+    lua_remove(L, -2); // cache table
+    return *t;
 }
 
-static const char * product(dynMap * vars, const char * in, char ** out, char end)
+// Evaluates t with the {path=..., root=...} table in opts and pushes the
+// result. A root result goes through the path interner.
+static int lbmTemplateInterp(lua_State * L, lbmArgs * args, lbmTemplate * t, lbmArg * opts)
 {
-    char * leftovers = NULL;
-    char * varname = NULL;
-    const char * c = in;
-    const char * varval;
-
-    int uppercase;
-    const char * colon;
-    const char * nextBackslash;
-    const char * nextOpenBrace;
-    const char * nextCloseBrace;
-
-    dsCopy(&leftovers, "");
-    for (; *c && *c != end; ++c)
+    lbmTemplateVars vars;
+    char stackBuffer[LBM_TEMPLATE_STACK_BUFFER];
+    char * buffer = stackBuffer;
+    lbmArg rootArg;
+    const char * path;
+    const char * root;
+    size_t pathLen;
+    size_t rootLen;
+    size_t len;
+
+    memset(&vars, 0, sizeof(vars));
+    path = lbmArgsFieldString(args, opts, "path", &pathLen);
+    if (path)
     {
-        if (*c == '{')
-        {
-            // Append any additional text we've seen to each entry in list we have so far
-            dsConcat(out, leftovers);
-            dsCopy(&leftovers, "");
-
-            ++c;
+        lbmTemplateVarsFromPath(&vars, path, pathLen);
+    }
 
-            uppercase = 0;
-            colon = strchr(c, ':');
-            nextBackslash = strchr(c, '\\');
-            nextOpenBrace = strchr(c, '{');
-            nextCloseBrace = strchr(c, '}');
-            if (colon
-                && (!nextBackslash  || colon < nextBackslash)
-                && (!nextOpenBrace  || colon < nextOpenBrace)
-                && (!nextCloseBrace || colon < nextCloseBrace))
-            {
-                for (; c != colon; ++c)
-                {
-                    switch (*c)
-                    {
-                        case 'u':
-                            uppercase = 1;
-                            break;
-                    }
-                }
-                ++c;
-            }
+    lbmArgsField(args, opts, "root", &rootArg);
+    root = lbmPathView(L, &rootArg, &rootLen);
+    len = lbmTemplateLength(t, &vars);
+    if (len + 1 > sizeof(stackBuffer))
+    {
+        buffer = (char *)malloc(len + 1);
+    }
+    lbmTemplateWrite(t, &vars, buffer);
 
-            // Now look up all variables contained in the {}
-            c = product(vars, c, &varname, '}');
-            varval = dmGetS2P(vars, varname);
-            if (varval)
-            {
-                dsConcat(out, varval);
-            }
+    if (root)
+    {
+        lbmPathEntry * entry = lbmPathGet(&sPaths, lbmPathInternPair(&sPaths, buffer, len, root, rootLen));
+        lua_pushlstring(L, (entry) ? entry->s : "", (entry) ? entry->len : 0);
+    }
+    else
+    {
+        lua_pushlstring(L, buffer, len);
+    }
 
-            dsDestroy(&varname);
-        }
-        else
-        {
-            // Just append
-            dsConcatLen(&leftovers, c, 1);
-        }
+    if (buffer != stackBuffer)
+    {
+        free(buffer);
     }
+    return 1;
+}
 
-    // If there was stuff trailing at the end, be sure to grab it
-    dsConcat(out, leftovers);
-    dsDestroy(&leftovers);
-    return c;
+static int lbmTemplateCall(lua_State * L)
+{
+    lbmArgs args;
+    lbmArg opts;
+    lbmTemplate ** t = (lbmTemplate **)luaL_checkudata(L, 1, LBM_TEMPLATE_META);
+    lbmArgsInit(&args, L);
+    lbmArgsGet(&args, 1, &opts);
+    return lbmTemplateInterp(L, &args, *t, &opts);
 }
 
-// ---------------------------------------------------------------------------
-// Lua lbm functions
+static void lbmTemplateStartup(lua_State * L)
+{
+    luaL_newmetatable(L, LBM_TEMPLATE_META);
+    lua_pushcfunction(L, lbmTemplateCall);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, lbmTemplateGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
 
-int lbm_canonicalize(lua_State * L, struct lbmVariant * args)
+int lbm_interp(lua_State * L, lbmArgs * args)
 {
-    char * temp = NULL;
-    dsCopy(&temp, args->a[0]->s);
-    lbmCanonicalizePath(&temp, args->a[1]->s);
-    lua_pushstring(L, temp);
-    dsDestroy(&temp);
+    lbmArg opts;
+    lbmTemplate * t;
+    lbmArgsCheckString(args, 0, NULL);
+    t = lbmTemplateFromLua(L, 1);
+    lbmArgsGet(args, 1, &opts);
+    return lbmTemplateInterp(L, args, t, &opts);
+}
+
+int lbm_template(lua_State * L, lbmArgs * args)
+{
+    lbmArgsCheckString(args, 0, NULL);
+    lbmTemplateFromLua(L, 1);
     return 1;
 }
 
-int lbm_interp(lua_State * L, struct lbmVariant * args)
+// Batches at least this long are split across threads unless opts.threads says otherwise
+#define LBM_INTERP_PARALLEL_MIN 4096
+
+typedef struct lbmInterpBatch
 {
-    // TODO: error checking of any kind
-    const char * template = args->a[0]->s;
-    char * out = NULL;
-    char * basename = NULL;
-    dynMap * argMap = args->a[1]->m;
-    dynMap * vars = dmCreate(DKF_STRING, 0);
+    lbmTemplate * t;
+    const char * root;
+    size_t rootLen;
+    const char ** paths;
+    size_t * pathLens;
+    size_t * lens;    // measured, then final output lengths
+    size_t * offsets; // into buffer
+    char * buffer;
+} lbmInterpBatch;
+
+static void lbmInterpBatchMeasure(void * userdata, int begin, int end)
+{
+    lbmInterpBatch * batch = (lbmInterpBatch *)userdata;
+    lbmTemplateVars vars;
+    int i;
+    memset(&vars, 0, sizeof(vars));
+    for (i = begin; i < end; ++i)
+    {
+        lbmTemplateVarsFromPath(&vars, batch->paths[i], batch->pathLens[i]);
+        batch->lens[i] = lbmTemplateLength(batch->t, &vars);
+    }
+}
 
-    if (dmHasS(argMap, "path"))
+static void lbmInterpBatchWrite(void * userdata, int begin, int end)
+{
+    lbmInterpBatch * batch = (lbmInterpBatch *)userdata;
+    lbmTemplateVars vars;
+    char * scratch = NULL;
+    size_t scratchSize = 0;
+    int i;
+
+    memset(&vars, 0, sizeof(vars));
+    if (batch->root)
     {
-        lbmVariant * variant = dmGetS2P(argMap, "path");
-        const char * path = variant->s;
-        if (path)
+        // One scratch buffer per worker, big enough for any entry in the range
+        for (i = begin; i < end; ++i)
         {
-            char * dotLoc;
-            char * slashLoc1;
-            char * slashLoc2;
-            char * basenameLoc;
-            dsCopy(&basename, path);
-            dotLoc = strrchr(basename, '.');
-            slashLoc1 = strrchr(basename, '/');
-            slashLoc2 = strrchr(basename, '\\');
-            if (!slashLoc1)
-            {
-                slashLoc1 = slashLoc2;
-            }
-            if (slashLoc2)
-            {
-                if (slashLoc1 < slashLoc2)
-                {
-                    slashLoc1 = slashLoc2;
-                }
-            }
-            if (dotLoc)
-            {
-                *dotLoc = 0;
-            }
-            if (slashLoc1)
-            {
-                basenameLoc = slashLoc1 + 1;
-            }
-            else
+            if (scratchSize < batch->lens[i] + 1)
             {
-                basenameLoc = basename;
+                scratchSize = batch->lens[i] + 1;
             }
-            dmGetS2P(vars, "BASENAME") = basenameLoc;
         }
+        scratch = (char *)malloc(scratchSize);
     }
 
-    product(vars, template, &out, 0);
+    for (i = begin; i < end; ++i)
+    {
+        char * out = batch->buffer + batch->offsets[i];
+        lbmTemplateVarsFromPath(&vars, batch->paths[i], batch->pathLens[i]);
+        if (batch->root)
+        {
+            size_t len = lbmTemplateWrite(batch->t, &vars, scratch);
+            batch->lens[i] = lbmPathCanonicalize(out, lbmPathCanonicalSize(len, batch->rootLen), scratch, len, batch->root, batch->rootLen);
+        }
+        else
+        {
+            lbmTemplateWrite(batch->t, &vars, out);
+        }
+    }
+    free(scratch);
+}
 
-    if (dmHasS(argMap, "root"))
+int lbm_interp_many(lua_State * L, lbmArgs * args)
+{
+    lbmInterpBatch batch;
+    lbmArg paths;
+    lbmArg opts;
+    lbmArg root;
+    size_t total = 0;
+    int threadCount;
+    int count;
+    int i;
+
+    lbmArgsCheckString(args, 0, NULL);
+    batch.t = lbmTemplateFromLua(L, 1);
+    lbmArgsGet(args, 1, &paths);
+    if (paths.type != V_TABLE)
+    {
+        return luaL_argerror(L, 2, "table expected");
+    }
+    lbmArgsGet(args, 2, &opts);
+    lbmArgsField(args, &opts, "root", &root);
+    batch.root = lbmPathView(L, &root, &batch.rootLen);
+    threadCount = (int)lbmArgsFieldInteger(args, &opts, "threads", 0);
+
+    count = lbmArgsLength(args, &paths);
+    batch.paths = (const char **)malloc(count * sizeof(const char *));
+    batch.pathLens = (size_t *)malloc(count * sizeof(size_t));
+    batch.lens = (size_t *)malloc(count * sizeof(size_t));
+    batch.offsets = (size_t *)malloc(count * sizeof(size_t));
+    for (i = 0; i < count; ++i)
     {
-        lbmVariant * variant = dmGetS2P(argMap, "root");
-        const char * root = variant->s;
-        if (root)
+        // Popped straight away: the paths table itself keeps every string
+        // alive. Numbers are refused since coercing them makes a new string
+        // only the stack would anchor.
+        lua_rawgeti(L, paths.index, i + 1);
+        batch.paths[i] = (lua_type(L, -1) == LUA_TSTRING) ? lua_tolstring(L, -1, &batch.pathLens[i]) : NULL;
+        lua_pop(L, 1);
+        if (!batch.paths[i])
         {
-            lbmCanonicalizePath(&out, root);
+            free(batch.paths);
+            free(batch.pathLens);
+            free(batch.lens);
+            free(batch.offsets);
+            return luaL_error(L, "interp_many: paths[%d] is not a string", i + 1);
         }
     }
 
-    lua_pushstring(L, out);
-    dsDestroy(&out);
-    dsDestroy(&basename);
+    if (threadCount == 0)
+    {
+        threadCount = (count >= LBM_INTERP_PARALLEL_MIN) ? lbmCpuCount() : 1;
+    }
+
+    lbmParallelFor(count, threadCount, lbmInterpBatchMeasure, &batch);
+    for (i = 0; i < count; ++i)
+    {
+        batch.offsets[i] = total;
+        total += (batch.root) ? lbmPathCanonicalSize(batch.lens[i], batch.rootLen) : batch.lens[i];
+    }
+    batch.buffer = (char *)malloc(total + 1);
+    lbmParallelFor(count, threadCount, lbmInterpBatchWrite, &batch);
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; ++i)
+    {
+        lua_pushlstring(L, batch.buffer + batch.offsets[i], batch.lens[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    free(batch.buffer);
+    free(batch.paths);
+    free(batch.pathLens);
+    free(batch.lens);
+    free(batch.offsets);
     return 1;
 }
 
-int lbm_die(lua_State * L, struct lbmVariant * args)
+int lbm_die(lua_State * L, lbmArgs * args)
 {
-    const char * error = "<unknown>";
-    if (args->a[0]->s)
+    const char * error = lbmArgsString(args, 0, NULL);
+    if (!error)
     {
-        error = args->a[0]->s;
+        error = "<unknown>";
     }
-    luaL_error(L, error);
+    luaL_error(L, "%s", error);
     exit(-1);
     return 0;
 }
 
-int lbm_read(lua_State * L, struct lbmVariant * args)
+// ---------------------------------------------------------------------------
+// File status
+
+// stat() results per interned path for the whole run. lbm.write,
+// lbm.flush and lbm.mkdir_for_file invalidate what they touch.
+static lbmStatCache sStats;
+
+// Stat batches with at least this many entries go wide unless opts.threads says otherwise
+#define LBM_STAT_PARALLEL_MIN 256
+
+// Pushes {type=, size=, mtime=, inode=}, or false for a missing file.
+// mtime is in nanoseconds; as a Lua number it is exact to within a few
+// hundred nanoseconds, which is plenty for ordering.
+static void lbmStatPush(lua_State * L, lbmFileStat * st)
 {
-    int ret = 0;
-    int len = 0;
-    char * text = lbmFileAlloc(args->a[0]->s, &len);
-    if (text)
+    static const char * typeNames[] = { "missing", "file", "dir", "other" };
+    if (!st || (st->type == LBM_FILE_MISSING))
     {
-        if (len)
-        {
-            lua_pushstring(L, text);
-            ++ret;
-        }
-        free(text);
+        lua_pushboolean(L, 0);
+        return;
     }
-    return ret;
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, typeNames[st->type]);
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, (lua_Number)st->size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, (lua_Number)st->mtime);
+    lua_setfield(L, -2, "mtime");
+    lua_pushnumber(L, (lua_Number)st->inode);
+    lua_setfield(L, -2, "inode");
 }
 
-int lbm_write(lua_State * L, struct lbmVariant * args)
+// lbm.stat(path [, curDir]): a table as above, or nil if nothing is there
+int lbm_stat(lua_State * L, lbmArgs * args)
 {
-    char * err = NULL;
-    const char * filename = args->a[0]->s;
-    const char * text = args->a[1]->s;
-    FILE * f = fopen(filename, "wb");
-    dsCopy(&err, "");
-    if (f)
+    lbmFileStat * st = lbmStatCacheGet(&sStats, &sPaths, lbmPathInternArgs(L, args));
+    if (!st || (st->type == LBM_FILE_MISSING))
     {
-        int len = strlen(text);
-        fwrite(text, 1, len, f);
-        fclose(f);
+        return 0;
     }
-    lua_pushstring(L, err);
-    dsDestroy(&err);
+    lbmStatPush(L, st);
     return 1;
 }
 
-int lbm_mkdir_for_file(lua_State * L, struct lbmVariant * args)
+// lbm.stat_many(paths [, {threads=N}]): one result per path, in order, with
+// false for missing files. Cache misses are stat()ed in parallel.
+int lbm_stat_many(lua_State * L, lbmArgs * args)
 {
-    const char * path = args->a[0]->s;
-    char * dirpath = NULL;
-    char * slashLoc1;
-    char * slashLoc2;
-    dsCopy(&dirpath, path);
-    slashLoc1 = strrchr(dirpath, '/');
-    slashLoc2 = strrchr(dirpath, '\\');
-    if (!slashLoc1)
+    lbmArg paths;
+    lbmArg opts;
+    lbmArg arg;
+    lbmFileStat ** out;
+    int * ids;
+    int threadCount;
+    int count;
+    int i;
+
+    lbmArgsGet(args, 0, &paths);
+    if (paths.type != V_TABLE)
     {
-        slashLoc1 = slashLoc2;
+        return luaL_argerror(L, 1, "table expected");
     }
-    if (slashLoc2)
+    lbmArgsGet(args, 1, &opts);
+    threadCount = (int)lbmArgsFieldInteger(args, &opts, "threads", 0);
+
+    count = lbmArgsLength(args, &paths);
+    ids = (int *)malloc(count * sizeof(int));
+    out = (lbmFileStat **)malloc(count * sizeof(lbmFileStat *));
+    for (i = 0; i < count; ++i)
     {
-        if (slashLoc1 < slashLoc2)
-        {
-            slashLoc1 = slashLoc2;
-        }
+        const char * path;
+        size_t pathLen;
+        lbmArgsIndex(args, &paths, i + 1, &arg);
+        path = lbmPathView(L, &arg, &pathLen);
+        ids[i] = (path) ? lbmPathInternPair(&sPaths, path, pathLen, NULL, 0) : LBM_PATH_NONE;
+        lua_pop(L, 1);
     }
-    if (slashLoc1)
+
+    if (threadCount == 0)
     {
-        *slashLoc1 = 0;
-        lbmMkdir(dirpath);
+        threadCount = (count >= LBM_STAT_PARALLEL_MIN) ? lbmCpuCount() : 1;
     }
-    dsDestroy(&dirpath);
-    return 0;
+    lbmStatCacheGetMany(&sStats, &sPaths, ids, count, out, threadCount);
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; ++i)
+    {
+        lbmStatPush(L, out[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    free(ids);
+    free(out);
+    return 1;
 }
 
 // ---------------------------------------------------------------------------
-// Lua lbm function hooks
+// Directory walking
 
-static int unimplemented(lua_State * L)
+static int sWalkDirsCached = 0;
+static int sWalkDirsRead = 0;
+
+// Reads the lbm.walk/lbm.glob options table. Strings in opts.ignore stay
+// anchored by the table; the pointer array is malloc'd into *ignore.
+static void lbmWalkArgs(lua_State * L, lbmArgs * args, lbmArg * opts, lbmWalkOptions * walkOpts, const char *** ignore)
 {
-    lbmVariant * variant = lbmVariantFromArgs(L);
-    printf("UNIMPLEMENTED func called. Args:\n");
-    lbmVariantPrint(variant, 1);
-    lbmVariantDestroy(variant);
-    return 0;
+    lbmArg list;
+    int i;
+
+    walkOpts->files = lbmArgsFieldBool(args, opts, "files", walkOpts->files);
+    walkOpts->dirs = lbmArgsFieldBool(args, opts, "dirs", walkOpts->dirs);
+    walkOpts->hidden = lbmArgsFieldBool(args, opts, "hidden", walkOpts->hidden);
+    walkOpts->follow = lbmArgsFieldBool(args, opts, "follow", walkOpts->follow);
+    walkOpts->relative = lbmArgsFieldBool(args, opts, "relative", walkOpts->relative);
+    walkOpts->maxDepth = (int)lbmArgsFieldInteger(args, opts, "depth", walkOpts->maxDepth);
+    walkOpts->threads = (int)lbmArgsFieldInteger(args, opts, "threads", walkOpts->threads);
+    walkOpts->snapshot = lbmArgsFieldString(args, opts, "snapshot", NULL);
+
+    *ignore = NULL;
+    if (lbmArgsField(args, opts, "ignore", &list) == V_TABLE)
+    {
+        int count = lbmArgsLength(args, &list);
+        *ignore = (const char **)malloc((count ? count : 1) * sizeof(const char *));
+        for (i = 0; i < count; ++i)
+        {
+            lua_rawgeti(L, list.index, i + 1);
+            if (lua_type(L, -1) == LUA_TSTRING)
+            {
+                (*ignore)[walkOpts->ignoreCount++] = lua_tostring(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+        walkOpts->ignore = *ignore;
+    }
 }
 
-#define LUA_CONTEXT_DECLARE_STUB(NAME) { #NAME, unimplemented }
+static int lbmWalkPushResult(lua_State * L, lbmWalkResult * result)
+{
+    int i;
+    sWalkDirsCached += result->dirsCached;
+    sWalkDirsRead += result->dirsRead;
+    lua_createtable(L, result->count, 0);
+    for (i = 0; i < result->count; ++i)
+    {
+        lua_pushstring(L, result->paths[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lbmWalkResultFree(result);
+    return 1;
+}
+
+// lbm.walk(root [, opts]): every file under root as one sorted array.
+// opts: ignore={patterns}, files, dirs, hidden, follow, depth, relative,
+// threads, glob (matched against root-relative paths) and snapshot (a file,
+// typically under the build directory, that lets the next run skip reading
+// directories whose mtime hasn't moved).
+int lbm_walk(lua_State * L, lbmArgs * args)
+{
+    lbmWalkOptions walkOpts;
+    lbmWalkResult result;
+    lbmArg arg;
+    lbmArg opts;
+    const char ** ignore;
+    const char * root;
+    size_t rootLen;
+
+    lbmArgsGet(args, 0, &arg);
+    root = lbmPathView(L, &arg, &rootLen);
+    luaL_argcheck(L, root != NULL, 1, "string expected");
+    lbmArgsGet(args, 1, &opts);
+
+    lbmWalkOptionsInit(&walkOpts);
+    lbmWalkArgs(L, args, &opts, &walkOpts, &ignore);
+    walkOpts.glob = lbmArgsFieldString(args, &opts, "glob", NULL);
+    lbmWalk(root, &walkOpts, &result);
+    free(ignore);
+    return lbmWalkPushResult(L, &result);
+}
+
+// lbm.glob("src/**/*.c" [, opts]): walks from the pattern's literal
+// directory prefix, pruning directories the rest of the pattern can never
+// reach. Same opts as lbm.walk, except hidden defaults to false as in a
+// shell.
+int lbm_glob(lua_State * L, lbmArgs * args)
+{
+    lbmWalkOptions walkOpts;
+    lbmWalkResult result;
+    lbmArg opts;
+    const char ** ignore;
+    const char * pattern = lbmArgsCheckString(args, 0, NULL);
+    size_t rootLen = lbmGlobRootLength(pattern);
+    char * root = NULL;
+
+    lbmArgsGet(args, 1, &opts);
+    lbmWalkOptionsInit(&walkOpts);
+    walkOpts.hidden = 0;
+    lbmWalkArgs(L, args, &opts, &walkOpts, &ignore);
+
+    if (rootLen)
+    {
+        root = (char *)malloc(rootLen + 1);
+        memcpy(root, pattern, rootLen);
+        root[rootLen] = 0;
+        walkOpts.glob = pattern + rootLen + ((rootLen == 1) && (pattern[0] == '/') ? 0 : 1);
+    }
+    else
+    {
+        // No directory part: results come back relative, like the pattern
+        walkOpts.glob = pattern;
+        walkOpts.relative = 1;
+    }
+    lbmWalk((root) ? root : ".", &walkOpts, &result);
+    free(root);
+    free(ignore);
+    return lbmWalkPushResult(L, &result);
+}
+
+// ---------------------------------------------------------------------------
+// Byte views
+
+#define LBM_BYTES_META "lbm.bytes"
+
+// A read-only span of file contents handed to Lua without ever becoming a
+// Lua string. The view lbm.read() returns owns the mapping; views made with
+// :sub() borrow it and pin their parent through their environment table.
+//
+// A mapped view counts itself in its path's entry (views) while it lives,
+// and lbm.write() replaces such a path by rename instead of truncating it,
+// so the view keeps the contents it was made from. Nothing protects it
+// from a file truncated or rewritten in place by another process, though,
+// build commands included: touching the lost pages raises SIGBUS. Turn
+// views of such files into strings (:tostring()) before they change.
+typedef struct lbmBytes
+{
+    const char * data;
+    size_t len;
+    int owner;
+    lbmFileMap map; // owner only
+    int path;       // owner of a mapping only: the path id counting it, or LBM_PATH_NONE
+} lbmBytes;
+
+static lbmBytes * lbmBytesPush(lua_State * L, const char * data, size_t len, int parentIndex)
+{
+    lbmBytes * bytes = (lbmBytes *)lua_newuserdata(L, sizeof(lbmBytes));
+    memset(bytes, 0, sizeof(lbmBytes));
+    bytes->data = data;
+    bytes->len = len;
+    bytes->path = LBM_PATH_NONE;
+    luaL_getmetatable(L, LBM_BYTES_META);
+    lua_setmetatable(L, -2);
+    if (parentIndex)
+    {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, parentIndex);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, -2);
+    }
+    return bytes;
+}
+
+// Same rules as string.sub/string.find: negative positions count from the end
+static lua_Integer lbmBytesPos(lua_Integer pos, size_t len)
+{
+    return (pos >= 0) ? pos : (lua_Integer)len + pos + 1;
+}
+
+static int lbmBytesGC(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    if (bytes->owner)
+    {
+        if (bytes->path != LBM_PATH_NONE)
+        {
+            --lbmPathGet(&sPaths, bytes->path)->views;
+        }
+        lbmFileMapClose(&bytes->map);
+        bytes->owner = 0;
+    }
+    return 0;
+}
+
+static int lbmBytesLen(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    lua_pushinteger(L, (lua_Integer)bytes->len);
+    return 1;
+}
+
+static int lbmBytesToString(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    lua_pushlstring(L, bytes->data, bytes->len);
+    return 1;
+}
+
+static int lbmBytesSub(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    lua_Integer i = lbmBytesPos(luaL_optinteger(L, 2, 1), bytes->len);
+    lua_Integer j = lbmBytesPos(luaL_optinteger(L, 3, -1), bytes->len);
+    if (i < 1)
+    {
+        i = 1;
+    }
+    if (j > (lua_Integer)bytes->len)
+    {
+        j = (lua_Integer)bytes->len;
+    }
+    if (i > j)
+    {
+        lbmBytesPush(L, bytes->data, 0, 1);
+    }
+    else
+    {
+        lbmBytesPush(L, bytes->data + i - 1, (size_t)(j - i + 1), 1);
+    }
+    return 1;
+}
+
+// view:find(needle [, init]) is always a plain search; Lua patterns need a
+// real string, so use view:tostring():find() for those
+static int lbmBytesFind(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    size_t needleLen;
+    const char * needle = luaL_checklstring(L, 2, &needleLen);
+    lua_Integer init = lbmBytesPos(luaL_optinteger(L, 3, 1), bytes->len);
+    const char * found;
+
+    if (init < 1)
+    {
+        init = 1;
+    }
+    if (init > (lua_Integer)bytes->len + 1)
+    {
+        return 0;
+    }
+    found = lbmFileFind(bytes->data + init - 1, bytes->len - (size_t)(init - 1), needle, needleLen);
+    if (!found)
+    {
+        return 0;
+    }
+    lua_pushinteger(L, (lua_Integer)(found - bytes->data) + 1);
+    lua_pushinteger(L, (lua_Integer)(found - bytes->data + needleLen));
+    return 2;
+}
+
+// Upvalues: the view and the offset of the next line
+static int lbmBytesLinesNext(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)lua_touserdata(L, lua_upvalueindex(1));
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+    const char * start;
+    const char * newline;
+    size_t len;
+
+    if (pos >= bytes->len)
+    {
+        return 0;
+    }
+    start = bytes->data + pos;
+    newline = (const char *)memchr(start, '\n', bytes->len - pos);
+    len = (newline) ? (size_t)(newline - start) : bytes->len - pos;
+    lua_pushinteger(L, (lua_Integer)(pos + len + 1));
+    lua_replace(L, lua_upvalueindex(2));
+
+    if (len && (start[len - 1] == '\r'))
+    {
+        --len;
+    }
+    lua_pushlstring(L, start, len);
+    return 1;
+}
+
+static int lbmBytesLines(lua_State * L)
+{
+    luaL_checkudata(L, 1, LBM_BYTES_META);
+    lua_settop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, lbmBytesLinesNext, 2);
+    return 1;
+}
+
+static int lbmBytesConcat(lua_State * L)
+{
+    int i;
+    for (i = 1; i <= 2; ++i)
+    {
+        lbmBytes * bytes = (lbmBytes *)lbmTestUData(L, i, LBM_BYTES_META);
+        if (bytes)
+        {
+            lua_pushlstring(L, bytes->data, bytes->len);
+        }
+        else if (lua_isstring(L, i))
+        {
+            lua_pushvalue(L, i);
+        }
+        else
+        {
+            return luaL_error(L, "attempt to concatenate a %s value", luaL_typename(L, i));
+        }
+    }
+    lua_concat(L, 2);
+    return 1;
+}
+
+// Upvalue: a string library function. Materializes the view and forwards,
+// so scripts that treated lbm.read()'s result as a string keep working.
+static int lbmBytesStringMethod(lua_State * L)
+{
+    lbmBytes * bytes = (lbmBytes *)luaL_checkudata(L, 1, LBM_BYTES_META);
+    int top = lua_gettop(L);
+    lua_pushlstring(L, bytes->data, bytes->len);
+    lua_replace(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, top, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+// Upvalues: the methods table and the string library
+static int lbmBytesIndex(lua_State * L)
+{
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1))
+    {
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(2));
+    if (lua_isfunction(L, -1))
+    {
+        lua_pushcclosure(L, lbmBytesStringMethod, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static const luaL_Reg lbmBytesMethods[] =
+{
+    { "len", lbmBytesLen },
+    { "sub", lbmBytesSub },
+    { "find", lbmBytesFind },
+    { "lines", lbmBytesLines },
+    { "tostring", lbmBytesToString },
+    { NULL, NULL }
+};
+
+static void lbmBytesStartup(lua_State * L)
+{
+    luaL_newmetatable(L, LBM_BYTES_META);
+    lua_newtable(L);
+    luaL_register(L, NULL, lbmBytesMethods);
+    lua_getglobal(L, "string");
+    lua_pushcclosure(L, lbmBytesIndex, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lbmBytesGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, lbmBytesLen);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, lbmBytesToString);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, lbmBytesConcat);
+    lua_setfield(L, -2, "__concat");
+    lua_pop(L, 1);
+}
+
+int lbm_read(lua_State * L, lbmArgs * args)
+{
+    lbmArg arg;
+    lbmFileMap map;
+    lbmBytes * bytes;
+    size_t filenameLen;
+    const char * filename;
+
+    lbmArgsGet(args, 0, &arg);
+    filename = lbmPathView(L, &arg, &filenameLen);
+    luaL_argcheck(L, filename != NULL, 1, "string expected");
+    if (!lbmFileMapOpen(&map, filename))
+    {
+        return 0;
+    }
+    if (!map.len)
+    {
+        // Empty files read as nil, as they always have
+        lbmFileMapClose(&map);
+        return 0;
+    }
+
+    bytes = lbmBytesPush(L, map.data, map.len, 0);
+    bytes->owner = 1;
+    bytes->map = map;
+    if (map.mapped)
+    {
+        bytes->path = lbmPathInternPair(&sPaths, filename, filenameLen, NULL, 0);
+        if (bytes->path != LBM_PATH_NONE)
+        {
+            ++lbmPathGet(&sPaths, bytes->path)->views;
+        }
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Streaming reads
+
+#define LBM_READER_META "lbm.reader"
+
+static int lbmReaderGC(lua_State * L)
+{
+    lbmFileReader * r = (lbmFileReader *)luaL_checkudata(L, 1, LBM_READER_META);
+    lbmFileReaderClose(r);
+    return 0;
+}
+
+// Opens the file named by args[0], with opts.chunk from args[optsIndex] as
+// the buffer size, and leaves the reader userdata on top of the stack
+static lbmFileReader * lbmReaderOpen(lua_State * L, lbmArgs * args, int optsIndex)
+{
+    lbmArg arg;
+    lbmArg opts;
+    lbmFileReader * r;
+    const char * filename;
+    size_t filenameLen;
+    long long chunk;
+
+    lbmArgsGet(args, 0, &arg);
+    filename = lbmPathView(L, &arg, &filenameLen);
+    luaL_argcheck(L, filename != NULL, 1, "string expected");
+    lbmArgsGet(args, optsIndex, &opts);
+    chunk = lbmArgsFieldInteger(args, &opts, "chunk", 0);
+    luaL_argcheck(L, chunk >= 0, optsIndex + 1, "chunk must not be negative");
+
+    r = (lbmFileReader *)lua_newuserdata(L, sizeof(lbmFileReader));
+    memset(r, 0, sizeof(lbmFileReader));
+    luaL_getmetatable(L, LBM_READER_META);
+    lua_setmetatable(L, -2);
+    if (!lbmFileReaderOpen(r, filename, (size_t)chunk))
+    {
+        luaL_error(L, "cannot open %s", filename);
+    }
+    return r;
+}
+
+// Iterators below keep the reader as upvalue 1 and close it as soon as they
+// run dry rather than waiting for the collector
+
+static int lbmReaderLinesNext(lua_State * L)
+{
+    lbmFileReader * r = (lbmFileReader *)lua_touserdata(L, lua_upvalueindex(1));
+    const char * line;
+    size_t len;
+    if (!lbmFileReaderLine(r, &line, &len))
+    {
+        lbmFileReaderClose(r);
+        return 0;
+    }
+    lua_pushlstring(L, line, len);
+    return 1;
+}
+
+static int lbmReaderChunksNext(lua_State * L)
+{
+    lbmFileReader * r = (lbmFileReader *)lua_touserdata(L, lua_upvalueindex(1));
+    const char * chunk;
+    size_t len = lbmFileReaderChunk(r, &chunk);
+    if (!len)
+    {
+        lbmFileReaderClose(r);
+        return 0;
+    }
+    lua_pushlstring(L, chunk, len);
+    return 1;
+}
+
+// Upvalues 2 and 3: the needle and the number of the last line read
+static int lbmReaderScanNext(lua_State * L)
+{
+    lbmFileReader * r = (lbmFileReader *)lua_touserdata(L, lua_upvalueindex(1));
+    size_t needleLen;
+    const char * needle = lua_tolstring(L, lua_upvalueindex(2), &needleLen);
+    lua_Integer lineNumber = lua_tointeger(L, lua_upvalueindex(3));
+    const char * line;
+    size_t len;
+
+    while (lbmFileReaderLine(r, &line, &len))
+    {
+        ++lineNumber;
+        if (lbmFileFind(line, len, needle, needleLen))
+        {
+            lua_pushinteger(L, lineNumber);
+            lua_replace(L, lua_upvalueindex(3));
+            lua_pushinteger(L, lineNumber);
+            lua_pushlstring(L, line, len);
+            return 2;
+        }
+    }
+    lbmFileReaderClose(r);
+    return 0;
+}
+
+static void lbmReaderStartup(lua_State * L)
+{
+    luaL_newmetatable(L, LBM_READER_META);
+    lua_pushcfunction(L, lbmReaderGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
+// for line in lbm.lines(path [, {chunk=N}]) do ... end
+int lbm_lines(lua_State * L, lbmArgs * args)
+{
+    lbmReaderOpen(L, args, 1);
+    lua_pushcclosure(L, lbmReaderLinesNext, 1);
+    return 1;
+}
+
+// for chunk in lbm.chunks(path [, {chunk=N}]) do ... end
+int lbm_chunks(lua_State * L, lbmArgs * args)
+{
+    lbmReaderOpen(L, args, 1);
+    lua_pushcclosure(L, lbmReaderChunksNext, 1);
+    return 1;
+}
+
+// for number, line in lbm.scan(path, needle [, {chunk=N}]) do ... end
+// Only lines containing needle (a plain substring) ever reach Lua.
+int lbm_scan(lua_State * L, lbmArgs * args)
+{
+    lbmArg needle;
+    if (lbmArgsGet(args, 1, &needle) != V_STRING)
+    {
+        return luaL_argerror(L, 2, "string expected");
+    }
+    lbmReaderOpen(L, args, 2);
+    lua_pushvalue(L, needle.index);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, lbmReaderScanNext, 3);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Regular expressions
+
+#define LBM_REGEX_META "lbm.regex"
+
+// JIT stack and ovector for every match made on the Lua thread
+static lbmRegexScratch sRegexScratch;
+
+// Every pattern the script has used, compiled
+static lbmRegexCache sRegexCache;
+
+// Subject of a match: a string, or an lbm.bytes view matched in place
+static const char * lbmRegexSubject(lua_State * L, int index, size_t * len)
+{
+    lbmBytes * bytes = (lbmBytes *)lbmTestUData(L, index, LBM_BYTES_META);
+    if (bytes)
+    {
+        *len = bytes->len;
+        return bytes->data;
+    }
+    return luaL_checklstring(L, index, len);
+}
+
+static lbmRegex * lbmRegexCheck(lua_State * L, int index)
+{
+    return *(lbmRegex **)luaL_checkudata(L, index, LBM_REGEX_META);
+}
+
+// Looks up the pattern string at index (compiling it on a cache miss) with
+// the flags in flagString. The result is borrowed from the cache. On
+// failure pushes nil and a message instead, and returns NULL.
+static lbmRegex * lbmRegexLookup(lua_State * L, int index, const char * flagString)
+{
+    size_t len;
+    const char * pattern = luaL_checklstring(L, index, &len);
+    lbmRegex * re;
+    const char * error;
+    int errorOffset;
+    int flags;
+
+    if (!lbmRegexParseFlags(flagString, &flags))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unknown regex flags '%s'", flagString);
+        return NULL;
+    }
+    re = lbmRegexCacheGet(&sRegexCache, pattern, len, flags, &error, &errorOffset);
+    if (!re)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "bad regex '%s' at offset %d: %s", pattern, errorOffset, error);
+        return NULL;
+    }
+    return re;
+}
+
+// Pushes an lbm.regex holding its own reference to re
+static void lbmRegexPush(lua_State * L, lbmRegex * re)
+{
+    lbmRegex ** ud = (lbmRegex **)lua_newuserdata(L, sizeof(lbmRegex *));
+    *ud = re;
+    lbmRegexRetain(re);
+    luaL_getmetatable(L, LBM_REGEX_META);
+    lua_setmetatable(L, -2);
+}
+
+// Anything that can call back into Lua must hold a reference first, or the
+// callback could evict a borrowed re from the cache. The lbm.regex goes at
+// index 1, where the method forms already have theirs.
+static void lbmRegexAnchor(lua_State * L, lbmRegex * re)
+{
+    if (!lbmTestUData(L, 1, LBM_REGEX_META))
+    {
+        lbmRegexPush(L, re);
+        lua_replace(L, 1);
+    }
+}
+
+static int lbmRegexExecOrError(lua_State * L, int rc)
+{
+    if (rc < 0)
+    {
+        return luaL_error(L, "regex match failed (pcre error %d)", rc);
+    }
+    return rc;
+}
+
+// Pushes groups [first, first + count) of the match in sRegexScratch (rc
+// pairs set), or the whole match if count is 0 and wholeIfNone is set.
+// Unset groups come back as false.
+static int lbmRegexPushGroups(lua_State * L, const char * s, int rc, int first, int count, int wholeIfNone)
+{
+    int * ov = sRegexScratch.ovector;
+    int i;
+
+    if (!count)
+    {
+        if (!wholeIfNone)
+        {
+            return 0;
+        }
+        lua_pushlstring(L, s + ov[0], ov[1] - ov[0]);
+        return 1;
+    }
+    luaL_checkstack(L, count, "too many captures");
+    for (i = first; i < first + count; ++i)
+    {
+        if ((i < rc) && (ov[2 * i] >= 0))
+        {
+            lua_pushlstring(L, s + ov[2 * i], ov[2 * i + 1] - ov[2 * i]);
+        }
+        else
+        {
+            lua_pushboolean(L, 0);
+        }
+    }
+    return count;
+}
+
+static int lbmRegexPushCaptures(lua_State * L, lbmRegex * re, const char * s, int rc, int wholeIfNone)
+{
+    return lbmRegexPushGroups(L, s, rc, 1, re->captureCount, wholeIfNone);
+}
+
+// Same rules as string.find's init: 1-based, negative counts from the end.
+// Returns 0 if init is past the end.
+static int lbmRegexInit(lua_State * L, int index, size_t len, size_t * offset)
+{
+    lua_Integer init = lbmBytesPos(luaL_optinteger(L, index, 1), len);
+    if (init < 1)
+    {
+        init = 1;
+    }
+    if (init > (lua_Integer)len + 1)
+    {
+        return 0;
+    }
+    *offset = (size_t)(init - 1);
+    return 1;
+}
+
+// The cores below take the subject at index 2 and their other arguments
+// after it; index 1 is the lbm.regex in the method forms
+static int lbmRegexMatchOrFind(lua_State * L, lbmRegex * re, int find)
+{
+    size_t len;
+    const char * s = lbmRegexSubject(L, 2, &len);
+    size_t offset;
+    int rc;
+
+    if (!lbmRegexInit(L, 3, len, &offset))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    rc = lbmRegexExecOrError(L, lbmRegexExec(re, &sRegexScratch, s, len, offset, 0));
+    if (!rc)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (find)
+    {
+        lua_pushinteger(L, sRegexScratch.ovector[0] + 1);
+        lua_pushinteger(L, sRegexScratch.ovector[1]);
+        return 2 + lbmRegexPushCaptures(L, re, s, rc, 0);
+    }
+    return lbmRegexPushCaptures(L, re, s, rc, 1);
+}
+
+// re:match(s [, init]): the captures, or the whole match if there are none
+static int lbmRegexMatchCore(lua_State * L, lbmRegex * re)
+{
+    return lbmRegexMatchOrFind(L, re, 0);
+}
+
+// re:find(s [, init]): start, end and any captures
+static int lbmRegexFindCore(lua_State * L, lbmRegex * re)
+{
+    return lbmRegexMatchOrFind(L, re, 1);
+}
+
+// Upvalues: the regex, the subject, the next offset and whether the last
+// match was empty
+static int lbmRegexGmatchNext(lua_State * L)
+{
+    lbmRegex * re = lbmRegexCheck(L, lua_upvalueindex(1));
+    size_t len;
+    const char * s = lbmRegexSubject(L, lua_upvalueindex(2), &len);
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+    int afterEmpty = lua_toboolean(L, lua_upvalueindex(4));
+    int rc = lbmRegexExecOrError(L, lbmRegexNext(re, &sRegexScratch, s, len, &pos, &afterEmpty));
+
+    if (!rc)
+    {
+        return 0;
+    }
+    lua_pushinteger(L, (lua_Integer)pos);
+    lua_replace(L, lua_upvalueindex(3));
+    lua_pushboolean(L, afterEmpty);
+    lua_replace(L, lua_upvalueindex(4));
+    return lbmRegexPushCaptures(L, re, s, rc, 1);
+}
+
+// for a, b in re:gmatch(s) do ... end
+static int lbmRegexGmatchCore(lua_State * L, lbmRegex * re)
+{
+    size_t len;
+    lbmRegexSubject(L, 2, &len);
+    lbmRegexAnchor(L, re);
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    lua_pushboolean(L, 0);
+    lua_pushcclosure(L, lbmRegexGmatchNext, 4);
+    return 1;
+}
+
+// Appends repl with %0-%9 expanded from the current match
+static void lbmRegexAddReplacement(lua_State * L, luaL_Buffer * b, lbmRegex * re, const char * s, int rc, const char * repl, size_t replLen)
+{
+    int * ov = sRegexScratch.ovector;
+    size_t i;
+    for (i = 0; i < replLen; ++i)
+    {
+        int group;
+        if (repl[i] != '%')
+        {
+            luaL_addchar(b, repl[i]);
+            continue;
+        }
+        if (++i == replLen)
+        {
+            luaL_error(L, "invalid use of '%%' in replacement string");
+        }
+        if (repl[i] == '%')
+        {
+            luaL_addchar(b, '%');
+            continue;
+        }
+        if ((repl[i] < '0') || (repl[i] > '9'))
+        {
+            luaL_error(L, "invalid use of '%%' in replacement string");
+        }
+        group = repl[i] - '0';
+        if ((group == 1) && !re->captureCount)
+        {
+            group = 0; // like string.gsub, %1 is the whole match without captures
+        }
+        if (group > re->captureCount)
+        {
+            luaL_error(L, "invalid capture index %%%d", group);
+        }
+        if ((group < rc) && (ov[2 * group] >= 0))
+        {
+            luaL_addlstring(b, s + ov[2 * group], ov[2 * group + 1] - ov[2 * group]);
+        }
+    }
+}
+
+// re:gsub(s, repl [, n]): repl is a string with %0-%9, a table indexed by
+// the first capture, or a function of the captures; like string.gsub, a
+// false or nil lookup keeps the original match. Returns the result and the
+// number of matches replaced.
+static int lbmRegexGsubCore(lua_State * L, lbmRegex * re)
+{
+    size_t len;
+    const char * s = lbmRegexSubject(L, 2, &len);
+    int replType = lua_type(L, 3);
+    lua_Integer maxCount = luaL_optinteger(L, 4, -1);
+    lua_Integer count = 0;
+    size_t pos = 0;
+    size_t last = 0;
+    int afterEmpty = 0;
+    luaL_Buffer b;
+
+    luaL_argcheck(L, (replType == LUA_TSTRING) || (replType == LUA_TNUMBER) || (replType == LUA_TTABLE) || (replType == LUA_TFUNCTION), 3,
+        "string/function/table expected");
+
+    if ((replType == LUA_TTABLE) || (replType == LUA_TFUNCTION))
+    {
+        lbmRegexAnchor(L, re);
+    }
+
+    luaL_buffinit(L, &b);
+    while ((maxCount < 0) || (count < maxCount))
+    {
+        int rc = lbmRegexExecOrError(L, lbmRegexNext(re, &sRegexScratch, s, len, &pos, &afterEmpty));
+        int * ov = sRegexScratch.ovector;
+        if (!rc)
+        {
+            break;
+        }
+        ++count;
+        luaL_addlstring(&b, s + last, ov[0] - last);
+        if ((replType == LUA_TSTRING) || (replType == LUA_TNUMBER))
+        {
+            size_t replLen;
+            const char * repl = lua_tolstring(L, 3, &replLen);
+            lbmRegexAddReplacement(L, &b, re, s, rc, repl, replLen);
+        }
+        else
+        {
+            int start = ov[0];
+            int end = ov[1];
+            if (replType == LUA_TTABLE)
+            {
+                int top = lua_gettop(L);
+                lbmRegexPushCaptures(L, re, s, rc, 1);
+                lua_settop(L, top + 1); // just the first
+                lua_gettable(L, 3);
+            }
+            else
+            {
+                int n;
+                lua_pushvalue(L, 3);
+                n = lbmRegexPushCaptures(L, re, s, rc, 1);
+                lua_call(L, n, 1);
+            }
+            // The call may have matched other regexes; only start and end are still needed
+            if (!lua_toboolean(L, -1))
+            {
+                lua_pop(L, 1);
+                lua_pushlstring(L, s + start, end - start);
+            }
+            else if (!lua_isstring(L, -1))
+            {
+                return luaL_error(L, "invalid replacement value (a %s)", luaL_typename(L, -1));
+            }
+            luaL_addvalue(&b);
+        }
+        last = pos;
+    }
+    luaL_addlstring(&b, s + last, len - last);
+    luaL_pushresult(&b);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+// re:split(s [, max]): the pieces between matches, at most max of them
+static int lbmRegexSplitCore(lua_State * L, lbmRegex * re)
+{
+    size_t len;
+    const char * s = lbmRegexSubject(L, 2, &len);
+    lua_Integer maxPieces = luaL_optinteger(L, 3, -1);
+    int pieces = 0;
+    size_t pos = 0;
+    size_t last = 0;
+    int afterEmpty = 0;
+
+    lua_newtable(L);
+    while ((maxPieces < 0) || (pieces + 1 < maxPieces))
+    {
+        int rc = lbmRegexExecOrError(L, lbmRegexNext(re, &sRegexScratch, s, len, &pos, &afterEmpty));
+        int * ov = sRegexScratch.ovector;
+        if (!rc)
+        {
+            break;
+        }
+        lua_pushlstring(L, s + last, ov[0] - last);
+        lua_rawseti(L, -2, ++pieces);
+        last = pos;
+    }
+    lua_pushlstring(L, s + last, len - last);
+    lua_rawseti(L, -2, ++pieces);
+    return 1;
+}
+
+static int lbmRegexGC(lua_State * L)
+{
+    lbmRegex ** ud = (lbmRegex **)luaL_checkudata(L, 1, LBM_REGEX_META);
+    if (*ud)
+    {
+        lbmRegexRelease(*ud);
+        *ud = NULL;
+    }
+    return 0;
+}
+
+// lbm.regex.compile(pattern [, flags]): flags is a string of letters, i m s
+// x U (see lbmRegex.h). Returns the regex, or nil and a message.
+static int lbmRegexCompileFunc(lua_State * L)
+{
+    lbmRegex * re = lbmRegexLookup(L, 1, luaL_optstring(L, 2, NULL));
+    if (!re)
+    {
+        return 2;
+    }
+    lbmRegexPush(L, re);
+    return 1;
+}
+
+typedef int (*lbmRegexCore)(lua_State * L, lbmRegex * re);
+
+// lbm.regex.X(s, pattern, ...) is re:X(s, ...), where pattern may also be a
+// string, found in the cache with the flags at flagsIndex. Swaps the subject
+// and the pattern so the core sees the method's argument layout.
+static int lbmRegexForward(lua_State * L, int flagsIndex, lbmRegexCore core)
+{
+    lbmRegex * re;
+    if (lbmTestUData(L, 2, LBM_REGEX_META))
+    {
+        re = lbmRegexCheck(L, 2);
+    }
+    else
+    {
+        re = lbmRegexLookup(L, 2, luaL_optstring(L, flagsIndex, NULL));
+        if (!re)
+        {
+            return luaL_error(L, "%s", lua_tostring(L, -1));
+        }
+    }
+    lua_settop(L, flagsIndex - 1);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_replace(L, 1);
+    lua_replace(L, 2);
+    return core(L, re);
+}
+
+static int lbmRegexMatchFunc(lua_State * L)
+{
+    return lbmRegexForward(L, 4, lbmRegexMatchCore);
+}
+
+static int lbmRegexFindFunc(lua_State * L)
+{
+    return lbmRegexForward(L, 4, lbmRegexFindCore);
+}
+
+static int lbmRegexGmatchFunc(lua_State * L)
+{
+    return lbmRegexForward(L, 3, lbmRegexGmatchCore);
+}
+
+static int lbmRegexGsubFunc(lua_State * L)
+{
+    return lbmRegexForward(L, 5, lbmRegexGsubCore);
+}
+
+static int lbmRegexSplitFunc(lua_State * L)
+{
+    return lbmRegexForward(L, 4, lbmRegexSplitCore);
+}
+
+static int lbmRegexMatch(lua_State * L)
+{
+    return lbmRegexMatchCore(L, lbmRegexCheck(L, 1));
+}
+
+static int lbmRegexFind(lua_State * L)
+{
+    return lbmRegexFindCore(L, lbmRegexCheck(L, 1));
+}
+
+static int lbmRegexGmatch(lua_State * L)
+{
+    return lbmRegexGmatchCore(L, lbmRegexCheck(L, 1));
+}
+
+static int lbmRegexGsub(lua_State * L)
+{
+    return lbmRegexGsubCore(L, lbmRegexCheck(L, 1));
+}
+
+static int lbmRegexSplit(lua_State * L)
+{
+    return lbmRegexSplitCore(L, lbmRegexCheck(L, 1));
+}
+
+#define LBM_REGEX_SET_META "lbm.regex.set"
+
+static lbmRegexSet * lbmRegexSetCheck(lua_State * L, int index)
+{
+    return *(lbmRegexSet **)luaL_checkudata(L, index, LBM_REGEX_SET_META);
+}
+
+// Pushes the 1-based index of the member that made the match in
+// sRegexScratch, its start and end if positions is set, then its captures
+static int lbmRegexSetPushHit(lua_State * L, lbmRegexSet * set, const char * s, int rc, int positions)
+{
+    int member = lbmRegexSetWhich(set, rc);
+    int n = 1;
+    lua_pushinteger(L, member + 1);
+    if (positions)
+    {
+        lua_pushinteger(L, sRegexScratch.ovector[0] + 1);
+        lua_pushinteger(L, sRegexScratch.ovector[1]);
+        n += 2;
+    }
+    return n + lbmRegexPushGroups(L, s, rc, set->groups[member] + 1, set->captures[member], !positions);
+}
+
+static int lbmRegexSetMatchOrFind(lua_State * L, int find)
+{
+    lbmRegexSet * set = lbmRegexSetCheck(L, 1);
+    size_t len;
+    const char * s = lbmRegexSubject(L, 2, &len);
+    size_t offset;
+    int rc;
+
+    if (!lbmRegexInit(L, 3, len, &offset))
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    rc = lbmRegexExecOrError(L, lbmRegexExec(set->combined, &sRegexScratch, s, len, offset, 0));
+    if (!rc)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    return lbmRegexSetPushHit(L, set, s, rc, find);
+}
+
+// set:match(s [, init]): which member matched first, then its captures (or
+// the whole match if it has none)
+static int lbmRegexSetMatch(lua_State * L)
+{
+    return lbmRegexSetMatchOrFind(L, 0);
+}
+
+// set:find(s [, init]): which member matched first, start, end, captures
+static int lbmRegexSetFind(lua_State * L)
+{
+    return lbmRegexSetMatchOrFind(L, 1);
+}
+
+// Upvalues: the set, the subject, the next offset and whether the last
+// match was empty
+static int lbmRegexSetGmatchNext(lua_State * L)
+{
+    lbmRegexSet * set = lbmRegexSetCheck(L, lua_upvalueindex(1));
+    size_t len;
+    const char * s = lbmRegexSubject(L, lua_upvalueindex(2), &len);
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+    int afterEmpty = lua_toboolean(L, lua_upvalueindex(4));
+    int rc = lbmRegexExecOrError(L, lbmRegexNext(set->combined, &sRegexScratch, s, len, &pos, &afterEmpty));
+
+    if (!rc)
+    {
+        return 0;
+    }
+    lua_pushinteger(L, (lua_Integer)pos);
+    lua_replace(L, lua_upvalueindex(3));
+    lua_pushboolean(L, afterEmpty);
+    lua_replace(L, lua_upvalueindex(4));
+    return lbmRegexSetPushHit(L, set, s, rc, 1);
+}
+
+// for index, start, end, ... in set:gmatch(s) do ... end: every hit of any
+// member, in one pass over s
+static int lbmRegexSetGmatch(lua_State * L)
+{
+    size_t len;
+    lbmRegexSetCheck(L, 1);
+    lbmRegexSubject(L, 2, &len);
+    lua_settop(L, 2);
+    lua_pushinteger(L, 0);
+    lua_pushboolean(L, 0);
+    lua_pushcclosure(L, lbmRegexSetGmatchNext, 4);
+    return 1;
+}
+
+static int lbmRegexSetGC(lua_State * L)
+{
+    lbmRegexSet ** ud = (lbmRegexSet **)luaL_checkudata(L, 1, LBM_REGEX_SET_META);
+    if (*ud)
+    {
+        lbmRegexSetDestroy(*ud);
+        *ud = NULL;
+    }
+    return 0;
+}
+
+// lbm.regex.set({patterns} [, flags]): one scanner for all of them. Returns
+// the set, or nil and a message.
+static int lbmRegexSetFunc(lua_State * L)
+{
+    const char * flagString = luaL_optstring(L, 2, NULL);
+    lbmRegexSet ** ud;
+    lbmRegexSet * set;
+    const char ** patterns;
+    const char * error;
+    int errorOffset;
+    int errorIndex;
+    int flags;
+    int count;
+    int i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lbmRegexParseFlags(flagString, &flags))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unknown regex flags '%s'", flagString);
+        return 2;
+    }
+
+    // The strings stay anchored by the table while the set compiles
+    count = (int)lua_objlen(L, 1);
+    patterns = (const char **)malloc((count ? count : 1) * sizeof(const char *));
+    for (i = 0; i < count; ++i)
+    {
+        lua_rawgeti(L, 1, i + 1);
+        patterns[i] = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        if (!patterns[i])
+        {
+            free(patterns);
+            return luaL_argerror(L, 1, "array of pattern strings expected");
+        }
+    }
+
+    set = lbmRegexSetCompile(patterns, count, flags, &error, &errorOffset, &errorIndex);
+    if (!set)
+    {
+        lua_pushnil(L);
+        if (errorIndex >= 0)
+        {
+            lua_pushfstring(L, "bad regex #%d '%s' at offset %d: %s", errorIndex + 1, patterns[errorIndex], errorOffset, error);
+        }
+        else
+        {
+            lua_pushfstring(L, "regex set patterns don't combine: %s", error);
+        }
+        free(patterns);
+        return 2;
+    }
+    free(patterns);
+
+    ud = (lbmRegexSet **)lua_newuserdata(L, sizeof(lbmRegexSet *));
+    *ud = set;
+    luaL_getmetatable(L, LBM_REGEX_SET_META);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const luaL_Reg lbmRegexSetMethods[] =
+{
+    { "match", lbmRegexSetMatch },
+    { "find", lbmRegexSetFind },
+    { "gmatch", lbmRegexSetGmatch },
+    { NULL, NULL }
+};
+
+static const luaL_Reg lbmRegexMethods[] =
+{
+    { "match", lbmRegexMatch },
+    { "find", lbmRegexFind },
+    { "gmatch", lbmRegexGmatch },
+    { "gsub", lbmRegexGsub },
+    { "split", lbmRegexSplit },
+    { NULL, NULL }
+};
+
+// lbm.regex: compile(), set() and a function per method taking (s, pattern, ...)
+static const luaL_Reg lbmRegexFuncs[] =
+{
+    { "compile", lbmRegexCompileFunc },
+    { "match", lbmRegexMatchFunc },
+    { "find", lbmRegexFindFunc },
+    { "gmatch", lbmRegexGmatchFunc },
+    { "gsub", lbmRegexGsubFunc },
+    { "split", lbmRegexSplitFunc },
+    { "set", lbmRegexSetFunc },
+    { NULL, NULL }
+};
+
+static void lbmRegexStartup(lua_State * L)
+{
+    lbmRegexScratchInit(&sRegexScratch);
+    lbmRegexCacheInit(&sRegexCache, LBM_REGEX_CACHE_DEFAULT);
+    luaL_newmetatable(L, LBM_REGEX_META);
+    lua_newtable(L);
+    luaL_register(L, NULL, lbmRegexMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lbmRegexGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, LBM_REGEX_SET_META);
+    lua_newtable(L);
+    luaL_register(L, NULL, lbmRegexSetMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lbmRegexSetGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
+// Adds lbm.regex to the lbm table on top of the stack
+static void lbmRegexRegister(lua_State * L)
+{
+    int jit = 0;
+    lua_newtable(L);
+    luaL_register(L, NULL, lbmRegexFuncs);
+    pcre_config(PCRE_CONFIG_JIT, &jit);
+    lua_pushboolean(L, jit);
+    lua_setfield(L, -2, "jit");
+    lua_setfield(L, -2, "regex");
+}
+
+// ---------------------------------------------------------------------------
+// Grep
+
+// lbm.grep(paths, pattern [, opts]): searches every file in paths at once
+// and returns one array of {path=, line=, col=, capture=} records, ordered by
+// file and then position. path is the value from paths; capture is the first
+// group, the whole match if the pattern has none, or false if the group
+// didn't take part. pattern is a string or an lbm.regex. opts: flags
+// (default "m", so ^ and $ work per line), first (stop at the first hit in
+// each file) and threads. Files that can't be read are listed in a second
+// result rather than failing the search.
+int lbm_grep(lua_State * L, lbmArgs * args)
+{
+    lbmArg paths;
+    lbmArg pattern;
+    lbmArg opts;
+    lbmArg arg;
+    lbmGrepOptions grepOpts;
+    lbmGrepResult result;
+    lbmRegex ** ud;
+    lbmRegex * re;
+    const char ** files;
+    int count;
+    int i;
+
+    lbmArgsGet(args, 0, &paths);
+    if (paths.type != V_TABLE)
+    {
+        return luaL_argerror(L, 1, "table expected");
+    }
+    lbmArgsGet(args, 1, &pattern);
+    lbmArgsGet(args, 2, &opts);
+    ud = (lbmRegex **)lbmTestUData(L, 2, LBM_REGEX_META);
+    if (ud)
+    {
+        re = *ud;
+    }
+    else
+    {
+        const char * flagString = lbmArgsFieldString(args, &opts, "flags", NULL);
+        re = lbmRegexLookup(L, 2, (flagString) ? flagString : "m");
+        if (!re)
+        {
+            return 2;
+        }
+    }
+    grepOpts.first = lbmArgsFieldBool(args, &opts, "first", 0);
+    grepOpts.threads = (int)lbmArgsFieldInteger(args, &opts, "threads", 0);
+
+    // Interned strings outlive the search, unlike anything on the Lua stack
+    count = lbmArgsLength(args, &paths);
+    files = (const char **)malloc((count ? count : 1) * sizeof(const char *));
+    for (i = 0; i < count; ++i)
+    {
+        const char * path;
+        size_t pathLen;
+        lbmArgsIndex(args, &paths, i + 1, &arg);
+        path = lbmPathView(L, &arg, &pathLen);
+        lua_pop(L, 1);
+        if (!path)
+        {
+            free(files);
+            return luaL_argerror(L, 1, lua_pushfstring(L, "path expected at index %d", i + 1));
+        }
+        files[i] = lbmPathGet(&sPaths, lbmPathInternPair(&sPaths, path, pathLen, NULL, 0))->s;
+    }
+
+    lbmGrep(re, files, count, &grepOpts, &result);
+
+    lua_createtable(L, result.count, 0);
+    for (i = 0; i < result.count; ++i)
+    {
+        lbmGrepHit * hit = &result.hits[i];
+        lua_createtable(L, 0, 4);
+        lua_rawgeti(L, paths.index, hit->file + 1);
+        lua_setfield(L, -2, "path");
+        lua_pushinteger(L, hit->line);
+        lua_setfield(L, -2, "line");
+        lua_pushinteger(L, hit->col);
+        lua_setfield(L, -2, "col");
+        if (hit->capture)
+        {
+            lua_pushlstring(L, hit->capture, hit->captureLen);
+        }
+        else
+        {
+            lua_pushboolean(L, 0);
+        }
+        lua_setfield(L, -2, "capture");
+        lua_rawseti(L, -2, i + 1);
+    }
+    if (!result.failureCount)
+    {
+        lbmGrepResultFree(&result);
+        free(files);
+        return 1;
+    }
+
+    lua_createtable(L, result.failureCount, 0);
+    for (i = 0; i < result.failureCount; ++i)
+    {
+        lbmGrepFailure * failure = &result.failures[i];
+        if (failure->error)
+        {
+            lua_pushfstring(L, "%s: regex match failed (pcre error %d)", files[failure->file], failure->error);
+        }
+        else
+        {
+            lua_pushfstring(L, "%s: can't read file", files[failure->file]);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    lbmGrepResultFree(&result);
+    free(files);
+    return 2;
+}
+
+// ---------------------------------------------------------------------------
+// Build graph
+
+// Every rule the script has declared
+static lbmGraph sGraph;
+
+// Path ids lbm.target has named: what lbm.plan aims at by default
+static int * sTargets = NULL; // dynArray
+
+// Hashes and timings behind opts.log; loaded on first use, and again
+// whenever a different file is named
+static lbmBuildLog sBuildLog;
+
+static const char * sGraphReasons[] =
+{
+    "clean",
+    "no outputs",
+    "output missing",
+    "input newer",
+    "dependency",
+    "command changed"
+};
+
+// Appends the path ids in arg (a string, an lbm.path or an array of either)
+// to *ids. Returns 0, with *bad the offending array index (0 for arg
+// itself), if something isn't a path.
+static int lbmGraphPathIds(lua_State * L, lbmArgs * args, lbmArg * arg, int ** ids, int * bad)
+{
+    lbmArg item;
+    const char * path;
+    size_t pathLen;
+    int count;
+    int i;
+
+    *bad = 0;
+    if (arg->type != V_TABLE)
+    {
+        path = lbmPathView(L, arg, &pathLen);
+        if (!path)
+        {
+            return 0;
+        }
+        daPush(ids, lbmPathInternPair(&sPaths, path, pathLen, NULL, 0));
+        return 1;
+    }
+
+    count = lbmArgsLength(args, arg);
+    for (i = 0; i < count; ++i)
+    {
+        lbmArgsIndex(args, arg, i + 1, &item);
+        path = lbmPathView(L, &item, &pathLen);
+        lua_pop(L, 1);
+        if (!path)
+        {
+            *bad = i + 1;
+            return 0;
+        }
+        daPush(ids, lbmPathInternPair(&sPaths, path, pathLen, NULL, 0));
+    }
+    return 1;
+}
+
+// Reads field key of the rule table into *ids. Returns 0, with *bad as for
+// lbmGraphPathIds, on anything that isn't a path.
+static int lbmGraphRuleField(lua_State * L, lbmArgs * args, lbmArg * rule, const char * key, int ** ids, int * bad)
+{
+    lbmArg field;
+    lbmArgsField(args, rule, key, &field);
+    if (lua_isnil(L, field.index))
+    {
+        return 1;
+    }
+    return lbmGraphPathIds(L, args, &field, ids, bad);
+}
+
+// lbm.rule{inputs=, outputs=, command=}: declares that command makes the
+// outputs from the inputs, and returns the rule's number. inputs and outputs
+// are paths or arrays of them; relative ones stay relative, as in
+// lbm.stat. Each output can only have one rule.
+int lbm_rule(lua_State * L, lbmArgs * args)
+{
+    lbmArg rule;
+    const char * command;
+    int * inputs = NULL;
+    int * outputs = NULL;
+    const char * key;
+    int conflict;
+    int bad;
+    int ok;
+    int id;
+
+    lbmArgsGet(args, 0, &rule);
+    if (rule.type != V_TABLE)
+    {
+        return luaL_argerror(L, 1, "table expected");
+    }
+    command = lbmArgsFieldString(args, &rule, "command", NULL);
+    if (!command)
+    {
+        return luaL_argerror(L, 1, "command expected");
+    }
+
+    daCreate(&inputs, sizeof(int));
+    daCreate(&outputs, sizeof(int));
+    key = "inputs";
+    ok = lbmGraphRuleField(L, args, &rule, key, &inputs, &bad);
+    if (ok)
+    {
+        key = "outputs";
+        ok = lbmGraphRuleField(L, args, &rule, key, &outputs, &bad);
+    }
+    if (!ok)
+    {
+        // Both go before the error unwinds past them
+        daDestroy(&inputs, NULL);
+        daDestroy(&outputs, NULL);
+        if (bad)
+        {
+            return luaL_error(L, "rule: %s[%d] is not a path", key, bad);
+        }
+        return luaL_error(L, "rule: %s is not a path or a table of paths", key);
+    }
+    id = lbmGraphAddRule(&sGraph, inputs, daSize(&inputs), outputs, daSize(&outputs), command, &conflict);
+    daDestroy(&inputs, NULL);
+    daDestroy(&outputs, NULL);
+    if (id == LBM_GRAPH_NONE)
+    {
+        return luaL_error(L, "rule: '%s' already has a rule making it", lbmPathGet(&sPaths, conflict)->s);
+    }
+    lua_pushinteger(L, id + 1);
+    return 1;
+}
+
+// lbm.target(paths): adds paths (one or an array) to what lbm.plan builds
+// when it isn't given targets of its own
+int lbm_target(lua_State * L, lbmArgs * args)
+{
+    lbmArg arg;
+    int bad;
+    if (!sTargets)
+    {
+        daCreate(&sTargets, sizeof(int));
+    }
+    lbmArgsGet(args, 0, &arg);
+    if (!lbmGraphPathIds(L, args, &arg, &sTargets, &bad))
+    {
+        return luaL_argerror(L, 1, "path or table of paths expected");
+    }
+    return 0;
+}
+
+// Finalizes sGraph, or pushes nil and a message naming the rules on a
+// cycle and returns 0
+static int lbmGraphReady(lua_State * L)
+{
+    luaL_Buffer b;
+    int * cycle;
+    int cycleLength;
+    int i;
+
+    if (lbmGraphFinalize(&sGraph, &cycle, &cycleLength))
+    {
+        return 1;
+    }
+
+    lua_pushnil(L);
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "dependency cycle: ");
+    for (i = 0; i <= cycleLength; ++i)
+    {
+        int rule = cycle[i % cycleLength];
+        if (i)
+        {
+            luaL_addstring(&b, " -> ");
+        }
+        if (sGraph.outputStart[rule] < sGraph.outputStart[rule + 1])
+        {
+            int node = sGraph.outputs[sGraph.outputStart[rule]];
+            luaL_addstring(&b, lbmPathGet(&sPaths, sGraph.nodePaths[node])->s);
+        }
+        else
+        {
+            lua_pushfstring(L, "rule %d", rule + 1);
+            luaL_addvalue(&b);
+        }
+    }
+    luaL_pushresult(&b);
+    free(cycle);
+    return 0;
+}
+
+// Pushes {id=, command=, outputs={lbm.path...}, reason=} for a rule
+static void lbmGraphPushRule(lua_State * L, int rule, unsigned char reason)
+{
+    int i;
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, rule + 1);
+    lua_setfield(L, -2, "id");
+    lua_pushstring(L, sGraph.commands[rule]);
+    lua_setfield(L, -2, "command");
+    lua_createtable(L, sGraph.outputStart[rule + 1] - sGraph.outputStart[rule], 0);
+    for (i = sGraph.outputStart[rule]; i < sGraph.outputStart[rule + 1]; ++i)
+    {
+        lbmPathPush(L, sGraph.nodePaths[sGraph.outputs[i]]);
+        lua_rawseti(L, -2, i - sGraph.outputStart[rule] + 1);
+    }
+    lua_setfield(L, -2, "outputs");
+    lua_pushstring(L, sGraphReasons[reason]);
+    lua_setfield(L, -2, "reason");
+}
+
+// Plans for the targets in args[0] (default: everything lbm.target named,
+// or else every rule) with opts.threads from args[1] for the stat() calls
+// and hashing. With opts.log, *log is set to the loaded build log, which
+// has had a say in the plan; otherwise it is NULL. Returns 0 after pushing
+// nil and a message on a dependency cycle, an unknown target, or a missing
+// input nothing makes.
+static int lbmGraphPlanArgs(lua_State * L, lbmArgs * args, lbmGraphPlan * plan, lbmBuildLog ** log)
+{
+    lbmArg targets;
+    lbmArg opts;
+    lbmArg logArg;
+    lbmFileStat ** stats;
+    const char * logFilename;
+    size_t logFilenameLen;
+    int * goals;
+    int * ids = NULL;
+    int threadCount;
+    int bad;
+    int ok;
+    int i;
+
+    lbmArgsGet(args, 0, &targets);
+    lbmArgsGet(args, 1, &opts);
+    threadCount = (int)lbmArgsFieldInteger(args, &opts, "threads", 0);
+    *log = NULL;
+    if (!lbmGraphReady(L))
+    {
+        return 0;
+    }
+
+    lbmArgsField(args, &opts, "log", &logArg);
+    logFilename = lbmPathView(L, &logArg, &logFilenameLen);
+    if (logFilename)
+    {
+        if (!sBuildLog.filename || strcmp(sBuildLog.filename, logFilename))
+        {
+            lbmBuildLogFree(&sBuildLog);
+            lbmBuildLogInit(&sBuildLog);
+            lbmBuildLogLoad(&sBuildLog, logFilename, &sPaths);
+        }
+        *log = &sBuildLog;
+    }
+
+    daCreate(&ids, sizeof(int));
+    if (!lua_isnoneornil(L, 1) && !lbmGraphPathIds(L, args, &targets, &ids, &bad))
+    {
+        daDestroy(&ids, NULL);
+        return luaL_argerror(L, 1, "path or table of paths expected");
+    }
+    if (lua_isnoneornil(L, 1) && sTargets)
+    {
+        for (i = 0; i < daSize(&sTargets); ++i)
+        {
+            daPush(&ids, sTargets[i]);
+        }
+    }
+    goals = (int *)malloc((daSize(&ids) ? daSize(&ids) : 1) * sizeof(int));
+    for (i = 0; i < daSize(&ids); ++i)
+    {
+        goals[i] = lbmGraphFindNode(&sGraph, ids[i]);
+        if (goals[i] == LBM_GRAPH_NONE)
+        {
+            lua_pushnil(L);
+            lua_pushfstring(L, "unknown target '%s'", lbmPathGet(&sPaths, ids[i])->s);
+            free(goals);
+            daDestroy(&ids, NULL);
+            return 0;
+        }
+    }
+
+    stats = (lbmFileStat **)malloc((sGraph.nodeCount ? sGraph.nodeCount : 1) * sizeof(lbmFileStat *));
+    lbmStatCacheGetMany(&sStats, &sPaths, sGraph.nodePaths, sGraph.nodeCount, stats, threadCount);
+    if (*log)
+    {
+        lbmBuildLogRefresh(*log, &sGraph, &sPaths, stats, threadCount);
+        ok = lbmGraphPlanBuild(&sGraph, goals, daSize(&ids), stats, lbmBuildLogCheck, *log, plan);
+        lbmBuildLogFlush(*log, &sPaths);
+    }
+    else
+    {
+        ok = lbmGraphPlanBuild(&sGraph, goals, daSize(&ids), stats, NULL, NULL, plan);
+    }
+    if (!ok)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "'%s', needed by rule %d, is missing and no rule makes it",
+            lbmPathGet(&sPaths, sGraph.nodePaths[plan->missing])->s, plan->missingRule + 1);
+        lbmGraphPlanFree(plan);
+    }
+    free(stats);
+    free(goals);
+    daDestroy(&ids, NULL);
+    return ok;
+}
+
+// lbm.plan([targets] [, opts]): the rules that have to run to bring targets
+// up to date, dependencies first, as records like {id=, command=, outputs=,
+// reason=}. Staleness is by mtime: a rule runs if an output is missing, an
+// input is newer than its oldest output, or a rule it depends on runs.
+// With opts.log (a path), a build log kept by lbm.build refines that: a
+// rule whose inputs are newer but hash the same as when it last ran is
+// clean, and one whose command has changed since is not. Returns nil and a
+// message if there is no plan (see lbmGraphPlanArgs).
+int lbm_plan(lua_State * L, lbmArgs * args)
+{
+    lbmGraphPlan plan;
+    lbmBuildLog * log;
+    int i;
+
+    if (!lbmGraphPlanArgs(L, args, &plan, &log))
+    {
+        return 2;
+    }
+    lua_createtable(L, plan.count, 0);
+    for (i = 0; i < plan.count; ++i)
+    {
+        lbmGraphPushRule(L, plan.rules[i], plan.reasons[plan.rules[i]]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lbmGraphPlanFree(&plan);
+    return 1;
+}
+
+typedef struct lbmBuildReport
+{
+    lua_State * L;
+    int failures;     // stack index of the failures table
+    int quiet;
+    int * succeeded;  // dynArray of rules, for the build log
+    double * seconds; // dynArray, parallel to succeeded
+} lbmBuildReport;
+
+static void lbmBuildStarted(void * userdata, int rule, int index, int total)
+{
+    lbmBuildReport * report = (lbmBuildReport *)userdata;
+    if (!report->quiet)
+    {
+        printf("[%d/%d] %s\n", index, total, sGraph.commands[rule]);
+        fflush(stdout);
+    }
+}
+
+// Outputs have just been rewritten (or half written), so their cached
+// stat()s are stale either way
+static void lbmBuildFinished(void * userdata, lbmBuildJob * job)
+{
+    lbmBuildReport * report = (lbmBuildReport *)userdata;
+    lua_State * L = report->L;
+    int i;
+
+    for (i = sGraph.outputStart[job->rule]; i < sGraph.outputStart[job->rule + 1]; ++i)
+    {
+        lbmFileInvalidate(&sPaths, sGraph.nodePaths[sGraph.outputs[i]]);
+    }
+    if (job->outputLen)
+    {
+        fwrite(job->output, 1, job->outputLen, stdout);
+    }
+    if (job->status != 0)
+    {
+        printf("FAILED (%d): %s\n", job->status, sGraph.commands[job->rule]);
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, job->rule + 1);
+        lua_setfield(L, -2, "id");
+        lua_pushstring(L, sGraph.commands[job->rule]);
+        lua_setfield(L, -2, "command");
+        lua_pushinteger(L, job->status);
+        lua_setfield(L, -2, "status");
+        lua_pushlstring(L, job->output, job->outputLen);
+        lua_setfield(L, -2, "output");
+        lua_rawseti(L, report->failures, (int)lua_objlen(L, report->failures) + 1);
+    }
+    else
+    {
+        daPush(&report->succeeded, job->rule);
+        daPush(&report->seconds, job->seconds);
+    }
+    fflush(stdout);
+}
+
+// lbm.build([targets] [, opts]): runs lbm.plan's rules, opts.jobs (default
+// one per CPU) at a time, printing each command and its output. Returns
+// {ok=, ran=, failed=, skipped=, failures={{id=, command=, status=,
+// output=}...}, jobserver=}, or nil and a message if there is no plan.
+// opts: jobs, keep_going (start everything that doesn't need a failed
+// rule), quiet (don't echo commands), threads, and jobserver (default
+// true): share job slots with make through MAKEFLAGS, joining the
+// jobserver lbm was started under or else serving one to the commands it
+// runs. The result's jobserver says which: "client", "server" or false.
+// With opts.log, planning goes through the build log as for lbm.plan, and
+// every rule that succeeds is logged with its input hashes and run time;
+// those times then order the ready rules, longest remaining chain first.
+// The result's critical_path lists the chain that ended the run,
+// dependencies first, as {id=, command=, seconds=} records, with their
+// total in critical_seconds; unless quiet, it is printed as well.
+int lbm_build(lua_State * L, lbmArgs * args)
+{
+    lbmArg opts;
+    lbmGraphPlan plan;
+    lbmBuildOptions buildOpts;
+    lbmBuildResult result;
+    lbmBuildReport report;
+    lbmBuildLog * log;
+    lbmJobserver jobserver;
+    const char * role = NULL;
+    double * weights = NULL;
+    int threadCount;
+    int i;
+
+    lbmArgsGet(args, 1, &opts);
+    memset(&buildOpts, 0, sizeof(buildOpts));
+    buildOpts.jobs = (int)lbmArgsFieldInteger(args, &opts, "jobs", 0);
+    buildOpts.keepGoing = lbmArgsFieldBool(args, &opts, "keep_going", 0);
+    report.quiet = lbmArgsFieldBool(args, &opts, "quiet", 0);
+    threadCount = (int)lbmArgsFieldInteger(args, &opts, "threads", 0);
+    if (!lbmGraphPlanArgs(L, args, &plan, &log))
+    {
+        return 2;
+    }
+
+    if (lbmArgsFieldBool(args, &opts, "jobserver", 1))
+    {
+        int slots = (buildOpts.jobs > 0) ? buildOpts.jobs : lbmCpuCount();
+        if (lbmJobserverConnect(&jobserver, getenv("MAKEFLAGS")))
+        {
+            role = "client";
+        }
+        else if ((slots > 1) && lbmJobserverCreate(&jobserver, slots))
+        {
+            role = "server";
+        }
+        buildOpts.jobserver = &jobserver;
+    }
+
+    if (log)
+    {
+        weights = (double *)malloc((sGraph.ruleCount ? sGraph.ruleCount : 1) * sizeof(double));
+        for (i = 0; i < sGraph.ruleCount; ++i)
+        {
+            weights[i] = lbmBuildLogSeconds(log, &sGraph, i);
+        }
+        buildOpts.weights = weights;
+    }
+
+    lua_createtable(L, 0, 8);
+    lua_newtable(L);
+    report.L = L;
+    report.failures = lua_gettop(L);
+    report.succeeded = NULL;
+    report.seconds = NULL;
+    daCreate(&report.succeeded, sizeof(int));
+    daCreate(&report.seconds, sizeof(double));
+    buildOpts.started = lbmBuildStarted;
+    buildOpts.finished = lbmBuildFinished;
+    buildOpts.userdata = &report;
+    lbmBuildRun(&sGraph, &plan, &buildOpts, &result);
+    lbmGraphPlanFree(&plan);
+    free(weights);
+    if (buildOpts.jobserver)
+    {
+        lbmJobserverFree(&jobserver);
+    }
+    if (log)
+    {
+        lbmBuildLogRecord(log, &sGraph, &sPaths, &sStats, report.succeeded, report.seconds, daSize(&report.succeeded), threadCount);
+        lbmBuildLogFlush(log, &sPaths);
+    }
+    daDestroy(&report.succeeded, NULL);
+    daDestroy(&report.seconds, NULL);
+
+    lua_setfield(L, -2, "failures");
+    lua_pushboolean(L, (result.failed == 0) && (result.skipped == 0));
+    lua_setfield(L, -2, "ok");
+    lua_pushinteger(L, result.ran);
+    lua_setfield(L, -2, "ran");
+    lua_pushinteger(L, result.failed);
+    lua_setfield(L, -2, "failed");
+    lua_pushinteger(L, result.skipped);
+    lua_setfield(L, -2, "skipped");
+    if (role)
+    {
+        lua_pushstring(L, role);
+    }
+    else
+    {
+        lua_pushboolean(L, 0);
+    }
+    lua_setfield(L, -2, "jobserver");
+
+    if (!report.quiet && result.criticalCount)
+    {
+        printf("critical path: %d rules, %.2fs\n", result.criticalCount, result.criticalSeconds);
+    }
+    lua_createtable(L, result.criticalCount, 0);
+    for (i = 0; i < result.criticalCount; ++i)
+    {
+        lbmBuildStep * step = &result.critical[i];
+        if (!report.quiet)
+        {
+            printf("  %8.2fs  %s\n", step->seconds, sGraph.commands[step->rule]);
+        }
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, step->rule + 1);
+        lua_setfield(L, -2, "id");
+        lua_pushstring(L, sGraph.commands[step->rule]);
+        lua_setfield(L, -2, "command");
+        lua_pushnumber(L, step->seconds);
+        lua_setfield(L, -2, "seconds");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "critical_path");
+    lua_pushnumber(L, result.criticalSeconds);
+    lua_setfield(L, -2, "critical_seconds");
+    fflush(stdout);
+    lbmBuildResultFree(&result);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Writes
+
+static int sWritesWritten = 0;
+static int sWritesUnchanged = 0;
+
+// Queue behind lbm.write_async(); drained at lbm.flush() and at exit
+static lbmWriter sWriter;
+
+// Paths queued since the last lbm.flush(), whose stat entries it drops
+static int * sAsyncIds = NULL;
+
+// Reads the (path, data [, opts]) arguments shared by lbm.write and
+// lbm.write_async. data is a string or an lbm.bytes view. Returns the
+// lbmFileWrite() flags: atomic if asked for, or if path has live mapped
+// views that truncating it would fault.
+static int lbmWriteArgs(lua_State * L, lbmArgs * args, const char ** filename, size_t * filenameLen, const char ** data, size_t * len)
+{
+    lbmArg arg;
+    lbmArg opts;
+    lbmBytes * bytes;
+    int flags = 0;
+
+    lbmArgsGet(args, 0, &arg);
+    *filename = lbmPathView(L, &arg, filenameLen);
+    luaL_argcheck(L, *filename != NULL, 1, "string expected");
+    bytes = (lbmBytes *)lbmTestUData(L, 2, LBM_BYTES_META);
+    if (bytes)
+    {
+        *data = bytes->data;
+        *len = bytes->len;
+    }
+    else
+    {
+        *data = lbmArgsCheckString(args, 1, len);
+    }
+
+    lbmArgsGet(args, 2, &opts);
+    if (lbmArgsFieldBool(args, &opts, "if_changed", 0))
+    {
+        flags |= LBM_WRITE_IF_CHANGED;
+    }
+    if (lbmArgsFieldBool(args, &opts, "atomic", 0))
+    {
+        flags |= LBM_WRITE_ATOMIC;
+    }
+    else
+    {
+        int id = lbmPathInternPair(&sPaths, *filename, *filenameLen, NULL, 0);
+        if ((id != LBM_PATH_NONE) && lbmPathGet(&sPaths, id)->views)
+        {
+            flags |= LBM_WRITE_ATOMIC;
+        }
+    }
+    return flags;
+}
+
+// lbm.write(path, data [, {if_changed=true, atomic=true}]). Returns true if
+// the file was written, false if if_changed found it already up to date, or
+// nil and a message. The file is rewritten in place unless atomic is set or
+// an lbm.read() view of it is alive; then the data goes to a temp file that
+// is renamed over path, so it may even be a view of path itself.
+int lbm_write(lua_State * L, lbmArgs * args)
+{
+    const char * filename;
+    const char * data;
+    size_t filenameLen;
+    size_t len;
+    int flags = lbmWriteArgs(L, args, &filename, &filenameLen, &data, &len);
+    int result = lbmFileWrite(filename, data, len, flags);
+    int id = lbmPathInternPair(&sPaths, filename, filenameLen, NULL, 0);
+
+    // lbm.mkdir_for_file trusts directories it made before; if one has gone
+    // since, make it again and give the write a second chance
+    if ((result == LBM_WRITE_FAILED) && lbmFileRemakeDirs(&sPaths, id, 1))
+    {
+        result = lbmFileWrite(filename, data, len, flags);
+    }
+
+    if (result == LBM_WRITE_WRITTEN)
+    {
+        lbmFileInvalidate(&sPaths, id);
+    }
+
+    if (result == LBM_WRITE_FAILED)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot write %s", filename);
+        return 2;
+    }
+    if (result == LBM_WRITE_UNCHANGED)
+    {
+        ++sWritesUnchanged;
+    }
+    else
+    {
+        ++sWritesWritten;
+    }
+    lua_pushboolean(L, result == LBM_WRITE_WRITTEN);
+    return 1;
+}
+
+// lbm.write_async(path, data [, opts]): same options as lbm.write, but the
+// data is copied and written in the background. Writes to one path keep
+// their order; lbm.read and lbm.write don't wait for them, lbm.flush does.
+int lbm_write_async(lua_State * L, lbmArgs * args)
+{
+    const char * filename;
+    const char * data;
+    size_t filenameLen;
+    size_t len;
+    int flags = lbmWriteArgs(L, args, &filename, &filenameLen, &data, &len);
+    int id;
+    lbmWriterEnqueue(&sWriter, filename, filenameLen, data, len, flags);
+
+    // The file may change any time until lbm.flush, so stop trusting it now
+    // and again once it has certainly landed
+    id = lbmPathInternPair(&sPaths, filename, filenameLen, NULL, 0);
+    lbmFileInvalidate(&sPaths, id);
+    daPush(&sAsyncIds, id);
+    return 0;
+}
+
+// Waits for every lbm.write_async so far. Returns true, or nil and one line
+// per failed write.
+int lbm_flush(lua_State * L, lbmArgs * args)
+{
+    char * errors = NULL;
+    int errorCount = lbmWriterFlush(&sWriter, &errors);
+    int i;
+
+    for (i = 0; i < daSize(&sAsyncIds); ++i)
+    {
+        lbmFileInvalidate(&sPaths, sAsyncIds[i]);
+        if (errorCount > 0)
+        {
+            // A failed write may mean a directory lbm.mkdir_for_file
+            // trusts has gone; have it check again next time
+            lbmPathEntry * entry = lbmPathGet(&sPaths, sAsyncIds[i]);
+            if (entry)
+            {
+                lbmFileForgetDirs(&sPaths, entry->parent);
+            }
+        }
+    }
+    daClear(&sAsyncIds, NULL);
+
+    if (errorCount > 0)
+    {
+        lua_pushnil(L);
+        lua_pushlstring(L, errors, strlen(errors) - 1); // drop the last newline
+        dsDestroy(&errors);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Anything still queued when the script is done gets written before exit
+static void lbmWriterShutdown()
+{
+    char * errors = NULL;
+    if (lbmWriterFlush(&sWriter, &errors) > 0)
+    {
+        printf("ERROR: %s", errors);
+        dsDestroy(&errors);
+    }
+    lbmWriterFree(&sWriter);
+}
+
+// Creates every missing directory above path. Returns true, or nil and a
+// message.
+int lbm_mkdir_for_file(lua_State * L, lbmArgs * args)
+{
+    lbmPathEntry * entry = lbmPathGet(&sPaths, lbmPathInternArgs(L, args));
+    if (entry && (entry->parent != LBM_PATH_NONE) && (lbmFileMakeDirs(&sPaths, entry->parent, 1) < 0))
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot create the directory for %s", entry->s);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int lbm_stats(lua_State * L, lbmArgs * args)
+{
+    lua_newtable(L);
+
+    lua_newtable(L);
+    lua_pushinteger(L, lbmPathCount(&sPaths));
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number)sPaths.strings.used);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, sPaths.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, sPaths.misses);
+    lua_setfield(L, -2, "misses");
+    lua_setfield(L, -2, "path");
+
+    lua_newtable(L);
+    lua_pushinteger(L, sStats.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, sStats.misses);
+    lua_setfield(L, -2, "misses");
+    lua_setfield(L, -2, "stat");
+
+    lua_newtable(L);
+    lua_pushinteger(L, sWalkDirsCached);
+    lua_setfield(L, -2, "cached");
+    lua_pushinteger(L, sWalkDirsRead);
+    lua_setfield(L, -2, "read");
+    lua_setfield(L, -2, "walk");
+
+    lua_newtable(L);
+    lua_pushinteger(L, sRegexCache.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, sRegexCache.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, sRegexCache.evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, sRegexCache.count);
+    lua_setfield(L, -2, "cached");
+    lua_setfield(L, -2, "regex");
+
+    lua_newtable(L);
+    lua_pushinteger(L, sGraph.ruleCount);
+    lua_setfield(L, -2, "rules");
+    lua_pushinteger(L, sGraph.nodeCount);
+    lua_setfield(L, -2, "nodes");
+    lua_pushinteger(L, (sGraph.finalized) ? sGraph.depStart[sGraph.ruleCount] : 0);
+    lua_setfield(L, -2, "edges");
+    lua_setfield(L, -2, "graph");
+
+    lua_newtable(L);
+    lua_pushinteger(L, daSize(&sBuildLog.entries));
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, sBuildLog.records);
+    lua_setfield(L, -2, "records");
+    lua_pushinteger(L, sBuildLog.hashed);
+    lua_setfield(L, -2, "hashed");
+    lua_pushinteger(L, sBuildLog.skipped);
+    lua_setfield(L, -2, "skipped");
+    lua_pushinteger(L, sBuildLog.compactions);
+    lua_setfield(L, -2, "compactions");
+    lua_setfield(L, -2, "log");
+
+    lua_newtable(L);
+    lua_pushinteger(L, sWritesWritten);
+    lua_setfield(L, -2, "written");
+    lua_pushinteger(L, sWritesUnchanged);
+    lua_setfield(L, -2, "unchanged");
+    {
+        lbmWriterCounts counts;
+        lbmWriterGetCounts(&sWriter, &counts);
+        lua_newtable(L);
+        lua_pushinteger(L, counts.written);
+        lua_setfield(L, -2, "written");
+        lua_pushinteger(L, counts.unchanged);
+        lua_setfield(L, -2, "unchanged");
+        lua_pushinteger(L, counts.failed);
+        lua_setfield(L, -2, "failed");
+        lua_pushinteger(L, counts.pending);
+        lua_setfield(L, -2, "pending");
+        lua_setfield(L, -2, "async");
+    }
+    lua_setfield(L, -2, "write");
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Lua lbm function hooks
+
+static int unimplemented(lua_State * L)
+{
+    lbmVariant * variant = lbmVariantFromArgs(L);
+    printf("UNIMPLEMENTED func called. Args:\n");
+    lbmVariantPrint(variant, 1);
+    lbmVariantDestroy(variant);
+    return 0;
+}
+
+#define LUA_CONTEXT_DECLARE_STUB(NAME) { #NAME, unimplemented }
 #define LUA_CONTEXT_DECLARE_FUNC(NAME) { #NAME, LuaFunc_ ## NAME }
+
+// Builtins that want a fully copied lbmVariant tree of their arguments
 #define LUA_CONTEXT_IMPLEMENT_FUNC(NAME, CONTEXTFUNC) \
     static int LuaFunc_ ## NAME (lua_State *L) \
     { \
@@ -557,21 +2955,66 @@ static int unimplemented(lua_State * L)
         return ret; \
     }
 
-LUA_CONTEXT_IMPLEMENT_FUNC(interp, lbm_interp);
-LUA_CONTEXT_IMPLEMENT_FUNC(canonicalize, lbm_canonicalize);
-LUA_CONTEXT_IMPLEMENT_FUNC(die, lbm_die);
-LUA_CONTEXT_IMPLEMENT_FUNC(read, lbm_read);
-LUA_CONTEXT_IMPLEMENT_FUNC(write, lbm_write);
-LUA_CONTEXT_IMPLEMENT_FUNC(mkdir_for_file, lbm_mkdir_for_file);
+// Builtins that read borrowed lbmArg views in place (no heap traffic)
+#define LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(NAME, CONTEXTFUNC) \
+    static int LuaFunc_ ## NAME (lua_State *L) \
+    { \
+        lbmArgs args; \
+        lbmArgsInit(&args, L); \
+        return CONTEXTFUNC(L, &args); \
+    }
+
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(interp, lbm_interp);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(template, lbm_template);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(interp_many, lbm_interp_many);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(canonicalize, lbm_canonicalize);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(path, lbm_path);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(die, lbm_die);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(stat, lbm_stat);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(stat_many, lbm_stat_many);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(walk, lbm_walk);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(glob, lbm_glob);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(read, lbm_read);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(lines, lbm_lines);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(chunks, lbm_chunks);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(scan, lbm_scan);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(grep, lbm_grep);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(rule, lbm_rule);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(target, lbm_target);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(plan, lbm_plan);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(build, lbm_build);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(write, lbm_write);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(write_async, lbm_write_async);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(flush, lbm_flush);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(mkdir_for_file, lbm_mkdir_for_file);
+LUA_CONTEXT_IMPLEMENT_VIEW_FUNC(stats, lbm_stats);
 
 static const luaL_Reg lbmFuncs[] =
 {
     LUA_CONTEXT_DECLARE_FUNC(interp),
+    LUA_CONTEXT_DECLARE_FUNC(template),
+    LUA_CONTEXT_DECLARE_FUNC(interp_many),
     LUA_CONTEXT_DECLARE_FUNC(canonicalize),
+    LUA_CONTEXT_DECLARE_FUNC(path),
     LUA_CONTEXT_DECLARE_FUNC(die),
+    LUA_CONTEXT_DECLARE_FUNC(stat),
+    LUA_CONTEXT_DECLARE_FUNC(stat_many),
+    LUA_CONTEXT_DECLARE_FUNC(walk),
+    LUA_CONTEXT_DECLARE_FUNC(glob),
     LUA_CONTEXT_DECLARE_FUNC(read),
+    LUA_CONTEXT_DECLARE_FUNC(lines),
+    LUA_CONTEXT_DECLARE_FUNC(chunks),
+    LUA_CONTEXT_DECLARE_FUNC(scan),
+    LUA_CONTEXT_DECLARE_FUNC(grep),
+    LUA_CONTEXT_DECLARE_FUNC(rule),
+    LUA_CONTEXT_DECLARE_FUNC(target),
+    LUA_CONTEXT_DECLARE_FUNC(plan),
+    LUA_CONTEXT_DECLARE_FUNC(build),
     LUA_CONTEXT_DECLARE_FUNC(write),
+    LUA_CONTEXT_DECLARE_FUNC(write_async),
+    LUA_CONTEXT_DECLARE_FUNC(flush),
     LUA_CONTEXT_DECLARE_FUNC(mkdir_for_file),
+    LUA_CONTEXT_DECLARE_FUNC(stats),
     {NULL, NULL}
 };
 
@@ -588,9 +3031,20 @@ static void lbmPrepareLua(lua_State * L, int argc, char ** argv)
     isWIN32 = 1;
 #endif
 
+    lbmWriterInit(&sWriter);
+    daCreate(&sAsyncIds, sizeof(int));
+    lbmStatCacheInit(&sStats);
+    lbmGraphInit(&sGraph);
+    lbmBuildLogInit(&sBuildLog);
     luaL_openlibs(L);
+    lbmTemplateStartup(L);
+    lbmPathStartup(L);
+    lbmBytesStartup(L);
+    lbmReaderStartup(L);
+    lbmRegexStartup(L);
 
     luaL_register(L, "lbm", lbmFuncs);
+    lbmRegexRegister(L);
 
     lua_pushboolean(L, isUNIX);
     lua_setfield(L, -2, "unix");
@@ -630,5 +3084,6 @@ int main(int argc, char ** argv)
     renderer = lbmRendererCreate();
     lbmPump();
     lbmRendererShutdown();
+    lbmWriterShutdown();
     return 0;
 }
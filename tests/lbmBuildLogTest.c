@@ -0,0 +1,175 @@
+// Regression test of the build log against real files in a scratch
+// directory: records surviving a reload, touched-but-identical inputs
+// planning clean, changed contents and commands planning dirty, and a
+// damaged tail being dropped and rewritten.
+
+#include "lbmBuildLog.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define SCRATCH  "lbmBuildLogTest.tmp"
+#define LOG_FILE SCRATCH "/build.log"
+#define SOURCE   SCRATCH "/in.c"
+#define HEADER   SCRATCH "/in.h"
+#define OBJECT   SCRATCH "/in.o"
+
+typedef struct TestState
+{
+    lbmPathTable paths;
+    lbmStatCache cache;
+    lbmGraph graph;   // compiles SOURCE and HEADER into OBJECT
+    lbmGraph changed; // the same with another command
+    lbmFileStat *stats[3];
+} TestState;
+
+// Files are backdated well past the log's racy window, which would
+// otherwise refuse to trust their hashes
+static void writeFile(TestState *t, const char *filename, const char *contents, int secondsAgo)
+{
+    FILE *f = fopen(filename, "wb");
+    struct utimbuf times;
+    if (f)
+    {
+        fputs(contents, f);
+        fclose(f);
+    }
+    times.actime = time(NULL) - secondsAgo;
+    times.modtime = times.actime;
+    utime(filename, &times);
+    lbmFileInvalidate(&t->paths, lbmPathIntern(&t->paths, filename, strlen(filename)));
+}
+
+static void makeGraph(TestState *t, lbmGraph *g, const char *command)
+{
+    int inputs[2];
+    int output = lbmPathIntern(&t->paths, OBJECT, strlen(OBJECT));
+    int conflict;
+    int *cycle;
+    int cycleLength;
+
+    inputs[0] = lbmPathIntern(&t->paths, SOURCE, strlen(SOURCE));
+    inputs[1] = lbmPathIntern(&t->paths, HEADER, strlen(HEADER));
+    lbmGraphInit(g);
+    lbmGraphAddRule(g, inputs, 2, &output, 1, command, &conflict);
+    lbmGraphFinalize(g, &cycle, &cycleLength);
+}
+
+// Plans g through the log the way lbm.plan does; returns rule 0's reason
+static unsigned char plan(TestState *t, lbmGraph *g, lbmBuildLog *log)
+{
+    lbmGraphPlan p;
+    unsigned char reason;
+    lbmStatCacheGetMany(&t->cache, &t->paths, g->nodePaths, g->nodeCount, t->stats, 1);
+    lbmBuildLogRefresh(log, g, &t->paths, t->stats, 1);
+    lbmGraphPlanBuild(g, NULL, 0, t->stats, lbmBuildLogCheck, log, &p);
+    reason = p.reasons[0];
+    lbmGraphPlanFree(&p);
+    return reason;
+}
+
+static void testRecord(TestState *t)
+{
+    lbmBuildLog log;
+    int rule = 0;
+    double seconds = 1.5;
+    lbmBuildLogEntry *entry;
+
+    lbmBuildLogInit(&log);
+    lbmBuildLogLoad(&log, LOG_FILE, &t->paths);
+    CHECK(!log.exists);
+    lbmBuildLogRecord(&log, &t->graph, &t->paths, &t->cache, &rule, &seconds, 1, 1);
+    CHECK(lbmBuildLogFlush(&log, &t->paths));
+    entry = lbmBuildLogFind(&log, lbmPathIntern(&t->paths, OBJECT, strlen(OBJECT)));
+    CHECK(entry && (entry->flags & LBM_BUILD_LOG_RULE));
+    CHECK(log.hashed == 2);
+    lbmBuildLogFree(&log);
+}
+
+static void testPlan(TestState *t)
+{
+    lbmBuildLog log;
+
+    lbmBuildLogInit(&log);
+    lbmBuildLogLoad(&log, LOG_FILE, &t->paths);
+    CHECK(log.exists);
+    CHECK(!log.damaged);
+    CHECK(lbmBuildLogSeconds(&log, &t->graph, 0) == 1.5);
+    CHECK(plan(t, &t->graph, &log) == LBM_GRAPH_CLEAN);
+    CHECK(plan(t, &t->changed, &log) == LBM_GRAPH_COMMAND_CHANGED);
+
+    // Touched, same bytes: newer by mtime, clean by hash
+    writeFile(t, SOURCE, "int x;\n", 80);
+    CHECK(plan(t, &t->graph, &log) == LBM_GRAPH_CLEAN);
+    CHECK(log.skipped == 1);
+    CHECK(log.hashed == 1);
+
+    // Same size, different bytes
+    writeFile(t, SOURCE, "int y;\n", 70);
+    CHECK(plan(t, &t->graph, &log) == LBM_GRAPH_INPUT_NEWER);
+    CHECK(lbmBuildLogFlush(&log, &t->paths));
+    lbmBuildLogFree(&log);
+}
+
+static void testDamage(TestState *t)
+{
+    lbmBuildLog log;
+    FILE *f = fopen(LOG_FILE, "ab");
+    if (f)
+    {
+        fputs("torn", f);
+        fclose(f);
+    }
+
+    lbmBuildLogInit(&log);
+    lbmBuildLogLoad(&log, LOG_FILE, &t->paths);
+    CHECK(log.damaged);
+    CHECK(lbmBuildLogSeconds(&log, &t->graph, 0) == 1.5);
+    CHECK(lbmBuildLogFlush(&log, &t->paths));
+    lbmBuildLogFree(&log);
+
+    lbmBuildLogInit(&log);
+    lbmBuildLogLoad(&log, LOG_FILE, &t->paths);
+    CHECK(log.exists);
+    CHECK(!log.damaged);
+    CHECK(lbmBuildLogSeconds(&log, &t->graph, 0) == 1.5);
+    lbmBuildLogFree(&log);
+}
+
+int main(int argc, char * argv[])
+{
+    TestState t;
+
+    mkdir(SCRATCH, 0777);
+    remove(LOG_FILE);
+    lbmPathTableInit(&t.paths);
+    lbmStatCacheInit(&t.cache);
+    writeFile(&t, SOURCE, "int x;\n", 100);
+    writeFile(&t, HEADER, "extern int x;\n", 100);
+    writeFile(&t, OBJECT, "object", 90);
+    makeGraph(&t, &t.graph, "cc -c in.c");
+    makeGraph(&t, &t.changed, "cc -O2 -c in.c");
+
+    testRecord(&t);
+    testPlan(&t);
+    testDamage(&t);
+
+    lbmGraphFree(&t.graph);
+    lbmGraphFree(&t.changed);
+    lbmStatCacheFree(&t.cache);
+    lbmPathTableFree(&t.paths);
+    remove(LOG_FILE);
+    remove(SOURCE);
+    remove(HEADER);
+    remove(OBJECT);
+    rmdir(SCRATCH);
+
+    return lbmTestReport("lbmBuildLog");
+}
@@ -0,0 +1,149 @@
+// Regression test of the executor: real commands through /bin/sh, checking
+// exit statuses, captured output, keep-going and stop-on-failure, weights
+// picking what starts first, and the critical path of a run.
+
+#include "lbmBuild.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rules, with made-up output path ids 1 to 4
+#define GREET  0 // prints, succeeds
+#define BROKEN 1 // exits 3
+#define AFTER  2 // needs BROKEN's output
+#define SLOW   3 // needs GREET's output, sleeps
+#define RULES  4
+
+typedef struct TestRun
+{
+    int started[RULES];  // 1-based start index, 0 if never started
+    int status[RULES];
+    char output[RULES][32];
+    int finished;
+} TestRun;
+
+static void onStarted(void *userdata, int rule, int index, int total)
+{
+    TestRun *run = (TestRun *)userdata;
+    run->started[rule] = index;
+}
+
+static void onFinished(void *userdata, lbmBuildJob *job)
+{
+    TestRun *run = (TestRun *)userdata;
+    run->status[job->rule] = job->status;
+    snprintf(run->output[job->rule], sizeof(run->output[job->rule]), "%s", job->output);
+    ++run->finished;
+}
+
+static void makeGraph(lbmGraph *g, lbmGraphPlan *plan)
+{
+    lbmFileStat missing;
+    lbmFileStat *stats[4];
+    int out[] = { 1, 2, 3, 4 };
+    int conflict;
+    int *cycle;
+    int cycleLength;
+    int i;
+
+    lbmGraphInit(g);
+    lbmGraphAddRule(g, NULL, 0, &out[0], 1, "printf hello", &conflict);
+    lbmGraphAddRule(g, NULL, 0, &out[1], 1, "echo oops >&2; exit 3", &conflict);
+    lbmGraphAddRule(g, &out[1], 1, &out[2], 1, "echo never", &conflict);
+    lbmGraphAddRule(g, &out[0], 1, &out[3], 1, "sleep 0.2", &conflict);
+    lbmGraphFinalize(g, &cycle, &cycleLength);
+
+    memset(&missing, 0, sizeof(missing));
+    missing.type = LBM_FILE_MISSING;
+    for (i = 0; i < 4; ++i)
+    {
+        stats[i] = &missing;
+    }
+    lbmGraphPlanBuild(g, NULL, 0, stats, NULL, NULL, plan);
+}
+
+static void run(lbmGraph *g, lbmGraphPlan *plan, int jobs, int keepGoing, const double *weights, TestRun *testRun, lbmBuildResult *result)
+{
+    lbmBuildOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    memset(testRun, 0, sizeof(TestRun));
+    opts.jobs = jobs;
+    opts.keepGoing = keepGoing;
+    opts.started = onStarted;
+    opts.finished = onFinished;
+    opts.userdata = testRun;
+    opts.weights = weights;
+    lbmBuildRun(g, plan, &opts, result);
+}
+
+static void testKeepGoing(void)
+{
+    lbmGraph g;
+    lbmGraphPlan plan;
+    lbmBuildResult result;
+    TestRun testRun;
+
+    makeGraph(&g, &plan);
+    CHECK(plan.count == RULES);
+    run(&g, &plan, 2, 1, NULL, &testRun, &result);
+
+    CHECK(result.ran == 3);
+    CHECK(result.failed == 1);
+    CHECK(result.skipped == 1);
+    CHECK(testRun.finished == 3);
+    CHECK(!testRun.started[AFTER]);
+    CHECK(testRun.started[GREET] < testRun.started[SLOW]);
+    CHECK(testRun.status[GREET] == 0);
+    CHECK(testRun.status[BROKEN] == 3);
+    CHECK(testRun.status[SLOW] == 0);
+    CHECK(!strcmp(testRun.output[GREET], "hello"));
+    CHECK(!strcmp(testRun.output[BROKEN], "oops\n"));
+
+    // SLOW finished last among the successes, after the GREET it needs
+    CHECK(result.criticalCount == 2);
+    if (result.criticalCount == 2)
+    {
+        CHECK(result.critical[0].rule == GREET);
+        CHECK(result.critical[1].rule == SLOW);
+        CHECK(result.critical[1].seconds >= 0.15);
+    }
+    CHECK(result.criticalSeconds >= 0.15);
+
+    lbmBuildResultFree(&result);
+    lbmGraphPlanFree(&plan);
+    lbmGraphFree(&g);
+}
+
+static void testStop(void)
+{
+    lbmGraph g;
+    lbmGraphPlan plan;
+    lbmBuildResult result;
+    TestRun testRun;
+    double weights[RULES] = { 1.0, 10.0, 10.0, 1.0 };
+
+    // One job at a time, and the weights put the BROKEN chain first, so
+    // nothing else starts before it fails
+    makeGraph(&g, &plan);
+    run(&g, &plan, 1, 0, weights, &testRun, &result);
+
+    CHECK(testRun.started[BROKEN] == 1);
+    CHECK(result.ran == 1);
+    CHECK(result.failed == 1);
+    CHECK(result.skipped == RULES - 1);
+    CHECK(result.criticalCount == 0);
+
+    lbmBuildResultFree(&result);
+    lbmGraphPlanFree(&plan);
+    lbmGraphFree(&g);
+}
+
+int main(int argc, char * argv[])
+{
+    testKeepGoing();
+    testStop();
+    return lbmTestReport("lbmBuild");
+}
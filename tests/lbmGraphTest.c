@@ -0,0 +1,223 @@
+// Regression test of the build graph: rule bookkeeping, edges and order,
+// cycles, and the reasons lbmGraphPlanBuild() gives for each rule it plans.
+// Path ids are made up; nothing touches the file system.
+
+#include "lbmGraph.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Path ids
+#define A_C  1
+#define A_O  2
+#define B_C  3
+#define B_O  4
+#define APP  5
+#define TEST 6
+
+// Rules, in the order they're added: the link first, so the finalized
+// order has to move it
+#define LINK      0
+#define COMPILE_A 1
+#define COMPILE_B 2
+#define RUN_TESTS 3
+
+static void addRules(lbmGraph *g)
+{
+    int linkInputs[] = { A_O, B_O };
+    int app = APP;
+    int a[] = { A_C, A_O };
+    int b[] = { B_C, B_O };
+    int conflict = 0;
+
+    CHECK(lbmGraphAddRule(g, linkInputs, 2, &app, 1, "link", &conflict) == LINK);
+    CHECK(lbmGraphAddRule(g, &a[0], 1, &a[1], 1, "cc a", &conflict) == COMPILE_A);
+    CHECK(lbmGraphAddRule(g, &b[0], 1, &b[1], 1, "cc b", &conflict) == COMPILE_B);
+    CHECK(lbmGraphAddRule(g, &app, 1, NULL, 0, "test", &conflict) == RUN_TESTS);
+}
+
+static int position(lbmGraph *g, int rule)
+{
+    int i;
+    for (i = 0; i < g->ruleCount; ++i)
+    {
+        if (g->order[i] == rule)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void testRules(void)
+{
+    lbmGraph g;
+    int outputs[] = { TEST, A_O };
+    int twice[] = { TEST, TEST };
+    int conflict = 0;
+    int *cycle;
+    int cycleLength;
+
+    lbmGraphInit(&g);
+    addRules(&g);
+    CHECK(g.ruleCount == 4);
+    CHECK(!strcmp(g.commands[COMPILE_A], "cc a"));
+    CHECK(lbmGraphFindNode(&g, TEST) == LBM_GRAPH_NONE);
+
+    // A second producer of a.o, or an output listed twice, is turned away
+    // without touching the graph
+    CHECK(lbmGraphAddRule(&g, NULL, 0, outputs, 2, "again", &conflict) == LBM_GRAPH_NONE);
+    CHECK(conflict == A_O);
+    CHECK(lbmGraphAddRule(&g, NULL, 0, twice, 2, "twice", &conflict) == LBM_GRAPH_NONE);
+    CHECK(conflict == TEST);
+    CHECK(g.ruleCount == 4);
+    CHECK(g.producers[lbmGraphNode(&g, TEST)] == LBM_GRAPH_NONE);
+
+    CHECK(lbmGraphFinalize(&g, &cycle, &cycleLength));
+    CHECK(cycle == NULL);
+    CHECK(g.depStart[LINK + 1] - g.depStart[LINK] == 2);
+    CHECK(g.depStart[COMPILE_A + 1] - g.depStart[COMPILE_A] == 0);
+    CHECK(g.useStart[COMPILE_A + 1] - g.useStart[COMPILE_A] == 1);
+    CHECK(g.uses[g.useStart[COMPILE_A]] == LINK);
+    CHECK(position(&g, COMPILE_A) < position(&g, LINK));
+    CHECK(position(&g, COMPILE_B) < position(&g, LINK));
+    CHECK(position(&g, LINK) < position(&g, RUN_TESTS));
+    lbmGraphFree(&g);
+}
+
+static void testCycle(void)
+{
+    lbmGraph g;
+    int x = 1;
+    int y = 2;
+    int z = 3;
+    int conflict;
+    int *cycle;
+    int cycleLength;
+
+    lbmGraphInit(&g);
+    lbmGraphAddRule(&g, &z, 1, &x, 1, "z to x", &conflict);
+    lbmGraphAddRule(&g, &x, 1, &y, 1, "x to y", &conflict);
+    lbmGraphAddRule(&g, &y, 1, NULL, 0, "y to nothing", &conflict);
+    CHECK(lbmGraphFinalize(&g, &cycle, &cycleLength));
+    lbmGraphFree(&g);
+
+    lbmGraphInit(&g);
+    lbmGraphAddRule(&g, &y, 1, &x, 1, "y to x", &conflict);
+    lbmGraphAddRule(&g, &x, 1, &y, 1, "x to y", &conflict);
+    lbmGraphAddRule(&g, &x, 1, &z, 1, "x to z", &conflict);
+    CHECK(!lbmGraphFinalize(&g, &cycle, &cycleLength));
+    CHECK(cycleLength == 2);
+    if (cycleLength == 2)
+    {
+        CHECK(cycle[0] != cycle[1]);
+        CHECK((cycle[0] == 0) || (cycle[0] == 1));
+        CHECK((cycle[1] == 0) || (cycle[1] == 1));
+    }
+    free(cycle);
+    lbmGraphFree(&g);
+}
+
+// Stats per node, from a table indexed by path id
+typedef struct TestFiles
+{
+    lbmFileStat files[7];
+    lbmFileStat *stats[7];
+} TestFiles;
+
+static void setFiles(TestFiles *t, lbmGraph *g, long long sources, long long objects, long long app)
+{
+    int path;
+    for (path = A_C; path <= APP; ++path)
+    {
+        lbmFileStat *st = &t->files[path];
+        st->type = LBM_FILE_REGULAR;
+        st->size = 1;
+        st->inode = path;
+        st->mtime = ((path == A_C) || (path == B_C)) ? sources : ((path == APP) ? app : objects);
+        t->stats[lbmGraphFindNode(g, path)] = st;
+    }
+}
+
+static unsigned char commandChanged(void *userdata, lbmGraph *g, int rule, unsigned char reason)
+{
+    return (rule == *(int *)userdata) ? LBM_GRAPH_COMMAND_CHANGED : reason;
+}
+
+static void testPlans(void)
+{
+    lbmGraph g;
+    lbmGraphPlan plan;
+    TestFiles t;
+    int *cycle;
+    int cycleLength;
+    int goal;
+    int changed = COMPILE_B;
+
+    lbmGraphInit(&g);
+    addRules(&g);
+    lbmGraphFinalize(&g, &cycle, &cycleLength);
+
+    // Up to date, except the test rule, which has no outputs to compare
+    setFiles(&t, &g, 10, 20, 30);
+    CHECK(lbmGraphPlanBuild(&g, NULL, 0, t.stats, NULL, NULL, &plan));
+    CHECK(plan.count == 1);
+    CHECK(plan.rules[0] == RUN_TESTS);
+    CHECK(plan.reasons[RUN_TESTS] == LBM_GRAPH_NO_OUTPUTS);
+    lbmGraphPlanFree(&plan);
+
+    // Asking for app alone leaves the test rule out
+    goal = lbmGraphFindNode(&g, APP);
+    CHECK(lbmGraphPlanBuild(&g, &goal, 1, t.stats, NULL, NULL, &plan));
+    CHECK(plan.count == 0);
+    lbmGraphPlanFree(&plan);
+
+    // A touched source rebuilds its object and everything downstream
+    t.files[A_C].mtime = 40;
+    CHECK(lbmGraphPlanBuild(&g, &goal, 1, t.stats, NULL, NULL, &plan));
+    CHECK(plan.count == 2);
+    CHECK(plan.rules[0] == COMPILE_A);
+    CHECK(plan.rules[1] == LINK);
+    CHECK(plan.reasons[COMPILE_A] == LBM_GRAPH_INPUT_NEWER);
+    CHECK(plan.reasons[LINK] == LBM_GRAPH_DEPENDENCY);
+    CHECK(plan.reasons[COMPILE_B] == LBM_GRAPH_CLEAN);
+    lbmGraphPlanFree(&plan);
+    t.files[A_C].mtime = 10;
+
+    // A missing output, scoped to the one goal that needs it
+    t.files[B_O].type = LBM_FILE_MISSING;
+    goal = lbmGraphFindNode(&g, B_O);
+    CHECK(lbmGraphPlanBuild(&g, &goal, 1, t.stats, NULL, NULL, &plan));
+    CHECK(plan.count == 1);
+    CHECK(plan.reasons[COMPILE_B] == LBM_GRAPH_OUTPUT_MISSING);
+    lbmGraphPlanFree(&plan);
+    t.files[B_O].type = LBM_FILE_REGULAR;
+
+    // The check callback can overrule mtimes
+    goal = lbmGraphFindNode(&g, APP);
+    CHECK(lbmGraphPlanBuild(&g, &goal, 1, t.stats, commandChanged, &changed, &plan));
+    CHECK(plan.count == 2);
+    CHECK(plan.reasons[COMPILE_B] == LBM_GRAPH_COMMAND_CHANGED);
+    CHECK(plan.reasons[LINK] == LBM_GRAPH_DEPENDENCY);
+    lbmGraphPlanFree(&plan);
+
+    // A missing source that nothing makes fails the plan
+    t.files[B_C].type = LBM_FILE_MISSING;
+    CHECK(!lbmGraphPlanBuild(&g, &goal, 1, t.stats, NULL, NULL, &plan));
+    CHECK(plan.missing == lbmGraphFindNode(&g, B_C));
+    CHECK(plan.missingRule == COMPILE_B);
+    lbmGraphPlanFree(&plan);
+
+    lbmGraphFree(&g);
+}
+
+int main(int argc, char * argv[])
+{
+    testRules();
+    testCycle();
+    testPlans();
+    return lbmTestReport("lbmGraph");
+}
@@ -0,0 +1,174 @@
+// Regression test of lbmGrep(): several hits on one line and across lines,
+// a hit at offset 0, a last line without a newline, line and column
+// counting, captures, the first option, and paths that can't be read
+// ending up in failures rather than hits.
+
+#include "lbmGrep.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCRATCH "lbmGrepTest.tmp"
+
+// The last one is never written, so it can't be read
+static const char *paths[] = { SCRATCH ".0", SCRATCH ".1", SCRATCH ".2", SCRATCH ".missing" };
+static const char *contents[] = {
+    "foo foo\nbar\n  foo",  // no trailing newline
+    "\n\nfoo\n\n\nxfoo\n",
+    "",
+};
+
+#define FILE_COUNT 4
+#define WRITTEN    3
+
+static void makeFiles(void)
+{
+    int i;
+    for (i = 0; i < WRITTEN; ++i)
+    {
+        FILE *f = fopen(paths[i], "wb");
+        if (f)
+        {
+            fwrite(contents[i], 1, strlen(contents[i]), f);
+            fclose(f);
+        }
+    }
+}
+
+static void removeFiles(void)
+{
+    int i;
+    for (i = 0; i < FILE_COUNT; ++i)
+    {
+        remove(paths[i]);
+    }
+}
+
+static int grep(const char *pattern, int first, lbmGrepResult *result)
+{
+    const char *error = NULL;
+    int errorOffset = 0;
+    lbmGrepOptions opts;
+    lbmRegex *re = lbmRegexCompile(pattern, 0, &error, &errorOffset);
+    CHECK(re != NULL);
+    if (!re)
+    {
+        memset(result, 0, sizeof(lbmGrepResult));
+        return 0;
+    }
+    opts.first = first;
+    opts.threads = 2;
+    lbmGrep(re, paths, FILE_COUNT, &opts, result);
+    lbmRegexRelease(re);
+    return 1;
+}
+
+static int hitIs(lbmGrepHit *hit, int file, int line, int col, size_t offset, const char *capture)
+{
+    return (hit->file == file)
+        && (hit->line == line)
+        && (hit->col == col)
+        && (hit->offset == offset)
+        && ((capture) ? (hit->capture && !strcmp(hit->capture, capture) && (hit->captureLen == strlen(capture))) : !hit->capture);
+}
+
+static void testHits(void)
+{
+    lbmGrepResult result;
+
+    if (!grep("foo", 0, &result))
+    {
+        return;
+    }
+    CHECK(result.count == 5);
+    if (result.count == 5)
+    {
+        CHECK(hitIs(&result.hits[0], 0, 1, 1, 0, "foo"));
+        CHECK(hitIs(&result.hits[1], 0, 1, 5, 4, "foo"));
+        CHECK(hitIs(&result.hits[2], 0, 3, 3, 14, "foo"));
+        CHECK(hitIs(&result.hits[3], 1, 3, 1, 2, "foo"));
+        CHECK(hitIs(&result.hits[4], 1, 6, 2, 9, "foo"));
+    }
+    CHECK(result.failureCount == 1);
+    if (result.failureCount == 1)
+    {
+        CHECK(result.failures[0].file == 3);
+        CHECK(result.failures[0].error == 0);
+    }
+    lbmGrepResultFree(&result);
+}
+
+static void testCaptures(void)
+{
+    lbmGrepResult result;
+
+    // The first group, not the whole match
+    if (grep("f(o+)", 0, &result))
+    {
+        CHECK(result.count == 5);
+        if (result.count)
+        {
+            CHECK(hitIs(&result.hits[0], 0, 1, 1, 0, "oo"));
+        }
+        lbmGrepResultFree(&result);
+    }
+
+    // A group that didn't take part leaves the capture unset
+    if (grep("(x)?foo", 0, &result))
+    {
+        CHECK(result.count == 5);
+        if (result.count == 5)
+        {
+            CHECK(hitIs(&result.hits[0], 0, 1, 1, 0, NULL));
+            CHECK(hitIs(&result.hits[4], 1, 6, 1, 8, "x"));
+        }
+        lbmGrepResultFree(&result);
+    }
+
+    // Empty matches are hits too: $ before the final newline and at the
+    // very end, the line after that newline included
+    if (grep("$", 0, &result))
+    {
+        CHECK(result.count == 4);
+        if (result.count == 4)
+        {
+            CHECK(hitIs(&result.hits[0], 0, 3, 6, 17, ""));
+            CHECK(hitIs(&result.hits[1], 1, 6, 5, 12, ""));
+            CHECK(hitIs(&result.hits[2], 1, 7, 1, 13, ""));
+            CHECK(hitIs(&result.hits[3], 2, 1, 1, 0, ""));
+        }
+        lbmGrepResultFree(&result);
+    }
+}
+
+static void testFirst(void)
+{
+    lbmGrepResult result;
+
+    if (!grep("foo", 1, &result))
+    {
+        return;
+    }
+    CHECK(result.count == 2);
+    if (result.count == 2)
+    {
+        CHECK(hitIs(&result.hits[0], 0, 1, 1, 0, "foo"));
+        CHECK(hitIs(&result.hits[1], 1, 3, 1, 2, "foo"));
+    }
+    CHECK(result.failureCount == 1);
+    lbmGrepResultFree(&result);
+}
+
+int main(int argc, char * argv[])
+{
+    removeFiles();
+    makeFiles();
+    testHits();
+    testCaptures();
+    testFirst();
+    removeFiles();
+    return lbmTestReport("lbmGrep");
+}
@@ -0,0 +1,112 @@
+// Regression test of the jobserver: a pool made by lbmJobserverCreate()
+// hands out exactly slots - 1 tokens, is advertised through MAKEFLAGS to a
+// second client sharing them, and MAKEFLAGS is put back afterwards.
+
+#include "lbmJobserver.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int makeflagsHas(const char *s)
+{
+    const char *makeflags = getenv("MAKEFLAGS");
+    return makeflags && strstr(makeflags, s);
+}
+
+static void testConnect(void)
+{
+    lbmJobserver js;
+
+    CHECK(!lbmJobserverConnect(&js, ""));
+    CHECK(!lbmJobserverActive(&js));
+    CHECK(!lbmJobserverConnect(&js, "-j8"));
+
+    // Descriptors that weren't passed down
+    CHECK(!lbmJobserverConnect(&js, "-j8 --jobserver-auth=997,998"));
+    CHECK(!lbmJobserverActive(&js));
+    CHECK(!lbmJobserverConnect(&js, "--jobserver-auth=fifo:lbmJobserverTest.missing"));
+    lbmJobserverFree(&js);
+}
+
+static void testPool(void)
+{
+    lbmJobserver pool;
+    lbmJobserver client;
+    const char *makeflags;
+
+    CHECK(lbmJobserverCreate(&pool, 3));
+    CHECK(lbmJobserverActive(&pool));
+    makeflags = getenv("MAKEFLAGS");
+    CHECK(makeflags && strstr(makeflags, "--jobserver-auth="));
+    CHECK(makeflags && strstr(makeflags, "-j3"));
+
+    CHECK(lbmJobserverTryAcquire(&pool));
+    CHECK(lbmJobserverTryAcquire(&pool));
+    CHECK(!lbmJobserverTryAcquire(&pool));
+    CHECK(pool.held == 2);
+
+    // A second client of the same pool only sees what the first gives back
+    CHECK(lbmJobserverConnect(&client, makeflags));
+    CHECK(!lbmJobserverTryAcquire(&client));
+    lbmJobserverRelease(&pool);
+    CHECK(lbmJobserverTryAcquire(&client));
+    CHECK(!lbmJobserverTryAcquire(&pool));
+
+    // Freeing returns held tokens to the pool
+    lbmJobserverFree(&client);
+    CHECK(lbmJobserverTryAcquire(&pool));
+    lbmJobserverFree(&pool);
+    CHECK(getenv("MAKEFLAGS") == NULL);
+}
+
+static void testLimits(void)
+{
+    lbmJobserver pool;
+    int taken = 0;
+
+    // More slots than a pipe buffer holds; filling it mustn't block
+    CHECK(lbmJobserverCreate(&pool, 70000));
+    CHECK(makeflagsHas(" -j1025 "));
+    while (lbmJobserverTryAcquire(&pool))
+    {
+        ++taken;
+    }
+    CHECK(taken == LBM_JOBSERVER_MAX_TOKENS);
+    lbmJobserverFree(&pool);
+}
+
+static void testVariables(void)
+{
+    lbmJobserver pool;
+    const char *makeflags;
+
+    // Options go before the variable section, or make reads them as values
+    setenv("MAKEFLAGS", "k --no-print-directory -- CC=gcc X=1", 1);
+    CHECK(lbmJobserverCreate(&pool, 2));
+    makeflags = getenv("MAKEFLAGS");
+    CHECK(!strncmp(makeflags, "k --no-print-directory -j2 --jobserver-auth=", 44));
+    CHECK(strstr(makeflags, " -- CC=gcc X=1") && !strstr(strstr(makeflags, " -- "), "-j2"));
+    lbmJobserverFree(&pool);
+    CHECK(!strcmp(getenv("MAKEFLAGS"), "k --no-print-directory -- CC=gcc X=1"));
+
+    setenv("MAKEFLAGS", "-- X=1", 1);
+    CHECK(lbmJobserverCreate(&pool, 2));
+    makeflags = getenv("MAKEFLAGS");
+    CHECK(!strncmp(makeflags, " -j2 --jobserver-auth=", 22));
+    CHECK(strlen(makeflags) > 7 && !strcmp(makeflags + strlen(makeflags) - 7, " -- X=1"));
+    lbmJobserverFree(&pool);
+    unsetenv("MAKEFLAGS");
+}
+
+int main(int argc, char * argv[])
+{
+    unsetenv("MAKEFLAGS");
+    testConnect();
+    testPool();
+    testLimits();
+    testVariables();
+    return lbmTestReport("lbmJobserver");
+}
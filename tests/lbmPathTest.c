@@ -0,0 +1,352 @@
+// Differential test of lbmPathCanonicalize() against the dynString
+// canonicalizer it replaced. Random paths are run through both; any
+// disagreement must be one of the known bugs of the old code, which the
+// fixed cases below pin down. Expectations are written with POSIX slashes.
+
+#include "lbmPath.h"
+
+#include "lbmTest.h"
+
+#include "dyn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_SEED 20261018u
+
+// ---------------------------------------------------------------------------
+// The old canonicalizer, as it was in main.c minus its Win32 branches. The
+// only other change is that oldSquashDotDirs() reports the ".." it used to
+// spin on forever instead.
+
+#define PROPER_CURRENT "/."
+#define PROPER_PARENT "/.."
+
+static int oldIsAbsolutePath(const char * path)
+{
+    return (path[0] == PROPER_SLASH) ? 1 : 0;
+}
+
+static void oldCleanupSlashes(char ** ds)
+{
+    char * c;
+    char * head;
+    char * tail;
+    int wasSlash = 0;
+    if (!dsLength(ds))
+    {
+        return;
+    }
+
+    // Remove all trailing slashes
+    c = *ds + (dsLength(ds) - 1);
+    for (; c >= *ds; --c)
+    {
+        if ((*c == '/') || (*c == '\\'))
+        {
+            *c = 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // Remove all duplicate slashes, fix slash direction
+    head = *ds;
+    tail = *ds;
+    for (; *tail; ++tail)
+    {
+        int isSlash = ((*tail == '/') || (*tail == '\\')) ? 1 : 0;
+        if (isSlash)
+        {
+            if (!wasSlash)
+            {
+                *head = PROPER_SLASH;
+                ++head;
+            }
+        }
+        else
+        {
+            *head = *tail;
+            ++head;
+        }
+        wasSlash = isSlash;
+    }
+    *head = 0;
+    dsCalcLength(ds);
+}
+
+// Returns 0 if the old code would have looped forever
+static int oldSquashDotDirs(char ** ds)
+{
+    char * dot;
+    char * prevSlash;
+    while ((dot = strstr(*ds, PROPER_PARENT)) != NULL)
+    {
+        if (dot == *ds)
+        {
+            // bad path
+            return 1;
+        }
+        prevSlash = dot - 1;
+        dot += strlen(PROPER_PARENT);
+        while ((prevSlash != *ds) && (*prevSlash != PROPER_SLASH))
+        {
+            --prevSlash;
+        }
+        if (prevSlash == *ds)
+        {
+            return 0;
+        }
+        memmove(prevSlash, dot, strlen(dot)+1);
+    }
+    while ((dot = strstr(*ds, PROPER_CURRENT)) != NULL)
+    {
+        if (dot == *ds)
+        {
+            // bad path
+            return 1;
+        }
+        prevSlash = dot;
+        dot += strlen(PROPER_CURRENT);
+        memmove(prevSlash, dot, strlen(dot)+1);
+    }
+    dsCalcLength(ds);
+    return 1;
+}
+
+static int oldCanonicalizePath(char ** dspath, const char * curDir)
+{
+    char * temp = NULL;
+    int finished;
+    if (!curDir || !strlen(curDir))
+    {
+        curDir = ".";
+    }
+
+    if (oldIsAbsolutePath(*dspath))
+    {
+        dsCopy(&temp, *dspath);
+    }
+    else
+    {
+        dsPrintf(&temp, "%s/%s", curDir, *dspath);
+    }
+
+    oldCleanupSlashes(&temp);
+    finished = oldSquashDotDirs(&temp);
+
+    dsCopy(dspath, temp);
+    dsDestroy(&temp);
+    return finished;
+}
+
+// ---------------------------------------------------------------------------
+// Intended differences, checked exactly
+
+typedef struct ExpectedCase
+{
+    const char *path;
+    const char *curDir;
+    const char *expected;
+} ExpectedCase;
+
+static const ExpectedCase expectedCases[] =
+{
+    // ".." reaching the first segment of a relative path hung the old code
+    { "a/../..", "", "./.." },
+    { "../..", "rel", ".." },
+    { "..", "rel", "." },
+    { "x/../../y", "a/b", "a/y" },
+
+    // "/." and "/.." were matched as substrings, mangling dotted names
+    { ".config/x", "/r", "/r/.config/x" },
+    { "..y/z", "/r", "/r/..y/z" },
+    { "a/.x/..", "/r", "/r/a" },
+
+    // "." segments were counted as something ".." could pop
+    { "a/./../b", "/r", "/r/b" },
+    { "./..", "/r/s", "/r" },
+
+    // The root became "", and "." or ".." under it was left in place
+    { "/", "", "/" },
+    { "///./", "/r", "/" },
+    { "..", "/", "/" },
+    { "/../x", "", "/x" },
+    { "/a/../../b", "", "/b" },
+
+    // Shared with the old code
+    { "b//c\\d/", "/a", "/a/b/c/d" },
+    { "/x", "/ignored", "/x" },
+    { "b", "", "./b" },
+};
+
+static void checkExpectedCases(void)
+{
+    size_t i;
+    for (i = 0; i < sizeof(expectedCases) / sizeof(expectedCases[0]); ++i)
+    {
+        const ExpectedCase *c = &expectedCases[i];
+        char out[512];
+        lbmPathCanonicalize(out, sizeof(out), c->path, strlen(c->path), c->curDir, strlen(c->curDir));
+        if (strcmp(out, c->expected) != 0)
+        {
+            printf("FAIL: \"%s\" in \"%s\": got \"%s\", expected \"%s\"\n", c->path, c->curDir, out, c->expected);
+            ++failures;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Fuzzing
+
+static unsigned int fuzzState = FUZZ_SEED;
+
+// Portable LCG, so every platform fuzzes the same paths
+static unsigned int fuzzRand(unsigned int range)
+{
+    fuzzState = fuzzState * 1103515245u + 12345u;
+    return ((fuzzState >> 16) & 0x7fff) % range;
+}
+
+static const char *plainSegments[] = { "a", "bb", "c.d", ".", "..", "" };
+static const char *dottedSegments[] = { "a", ".x", "..y", "x.", ".", "..", "" };
+static const char *separators[] = { "/", "\\", "//" };
+
+static void fuzzPath(char *out, const char **segments, unsigned int segmentCount, unsigned int maxSegments)
+{
+    unsigned int count = fuzzRand(maxSegments);
+    unsigned int i;
+    out[0] = 0;
+    if (fuzzRand(3) == 0)
+    {
+        strcat(out, "/");
+    }
+    for (i = 0; i < count; ++i)
+    {
+        if (i)
+        {
+            strcat(out, separators[fuzzRand(3)]);
+        }
+        strcat(out, segments[fuzzRand(segmentCount)]);
+    }
+    if (fuzzRand(5) == 0)
+    {
+        strcat(out, "/");
+    }
+}
+
+// Drops every "." segment but a leading one, in place
+static void dropDotSegments(char ** ds)
+{
+    char * c;
+    while (((c = strstr(*ds, "/./")) != NULL) || (((c = strstr(*ds, PROPER_CURRENT)) != NULL) && (c[2] == 0) && (c != *ds)))
+    {
+        memmove(c, c + 2, strlen(c + 2) + 1);
+    }
+    dsCalcLength(ds);
+}
+
+// Which known bug of the old code, if any, explains it disagreeing with the
+// new code. joined is curDir + path as the old code saw them, slashes tidied.
+static const char *explainDifference(char ** joined, const char *oldOut, const char *newOut)
+{
+    if (!strcmp(oldOut, ""))
+    {
+        return "root";
+    }
+    if (!strncmp(oldOut, PROPER_CURRENT, 2))
+    {
+        // Gave up on a "." or ".." right under the root
+        return "above root";
+    }
+    if (strstr(*joined, "/.x") || strstr(*joined, "/..y"))
+    {
+        return "dotted name";
+    }
+
+    // With the "." segments gone first, the old code must agree or hang
+    dropDotSegments(joined);
+    if (!oldSquashDotDirs(joined) || !strcmp(*joined, newOut))
+    {
+        return "dot popped";
+    }
+    return NULL;
+}
+
+static void fuzz(void)
+{
+    int same = 0;
+    int hung = 0;
+    int explained = 0;
+    int i;
+    char path[256];
+    char curDir[256];
+    char *old = NULL;
+    char *joined = NULL;
+    char out[1024];
+
+    for (i = 0; i < FUZZ_ITERATIONS; ++i)
+    {
+        int dotted = i & 1;
+        size_t len;
+        fuzzPath(path, dotted ? dottedSegments : plainSegments, dotted ? 7 : 6, 6);
+        fuzzPath(curDir, plainSegments, 6, 4);
+
+        len = lbmPathCanonicalize(out, sizeof(out), path, strlen(path), curDir, strlen(curDir));
+        if ((len == LBM_PATH_TOO_LONG) || (len != strlen(out)))
+        {
+            printf("FAIL: \"%s\" in \"%s\": bad length\n", path, curDir);
+            ++failures;
+            break;
+        }
+
+        dsCopy(&old, path);
+        if (!oldCanonicalizePath(&old, curDir))
+        {
+            ++hung;
+            continue;
+        }
+        if (!strcmp(old, out))
+        {
+            ++same;
+            continue;
+        }
+
+        if (oldIsAbsolutePath(path))
+        {
+            dsCopy(&joined, path);
+        }
+        else
+        {
+            dsPrintf(&joined, "%s/%s", (curDir[0]) ? curDir : ".", path);
+        }
+        oldCleanupSlashes(&joined);
+        if (explainDifference(&joined, old, out))
+        {
+            ++explained;
+            continue;
+        }
+
+        printf("FAIL: \"%s\" in \"%s\": old \"%s\", new \"%s\"\n", path, curDir, old, out);
+        ++failures;
+        break;
+    }
+    dsDestroy(&old);
+    dsDestroy(&joined);
+
+    if (i == FUZZ_ITERATIONS)
+    {
+        printf("%d paths: %d same, %d hung the old code, %d known old bugs\n", FUZZ_ITERATIONS, same, hung, explained);
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    checkExpectedCases();
+    fuzz();
+    return lbmTestReport("lbmPath");
+}
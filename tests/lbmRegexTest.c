@@ -0,0 +1,197 @@
+// Regression test of the regex layer: flag parsing, global matching over
+// empty matches, telling pattern set members apart, and the compiled
+// pattern cache's LRU order, counters and reference counting.
+
+#include "lbmRegex.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static lbmRegex *compile(const char *pattern, int flags)
+{
+    const char *error = NULL;
+    int errorOffset = 0;
+    lbmRegex *re = lbmRegexCompile(pattern, flags, &error, &errorOffset);
+    CHECK(re != NULL);
+    return re;
+}
+
+static void testFlags(void)
+{
+    int flags = 0;
+    CHECK(lbmRegexParseFlags("im", &flags));
+    CHECK(flags == (LBM_REGEX_CASELESS | LBM_REGEX_MULTILINE));
+    CHECK(lbmRegexParseFlags("", &flags));
+    CHECK(flags == 0);
+    CHECK(!lbmRegexParseFlags("iq", &flags));
+}
+
+// Steps through every match of pattern in subject; returns them as
+// "start-end" pairs joined with spaces
+static const char *matchAll(const char *pattern, const char *subject)
+{
+    static char joined[256];
+    lbmRegex *re = compile(pattern, 0);
+    lbmRegexScratch scratch;
+    size_t len = strlen(subject);
+    size_t pos = 0;
+    int afterEmpty = 0;
+    int steps = 0;
+
+    joined[0] = 0;
+    if (!re)
+    {
+        return joined;
+    }
+    lbmRegexScratchInit(&scratch);
+    while ((lbmRegexNext(re, &scratch, subject, len, &pos, &afterEmpty) > 0) && (++steps < 32))
+    {
+        char pair[32];
+        snprintf(pair, sizeof(pair), "%s%d-%d", (joined[0]) ? " " : "", scratch.ovector[0], scratch.ovector[1]);
+        strcat(joined, pair);
+    }
+    lbmRegexScratchFree(&scratch);
+    lbmRegexRelease(re);
+    return joined;
+}
+
+static void testNext(void)
+{
+    // What Perl gives for "baaac" =~ /a*/g: an empty match before b, aaa,
+    // then empty matches before c and at the end, never one twice
+    CHECK(!strcmp(matchAll("a*", "baaac"), "0-0 1-4 4-4 5-5"));
+    CHECK(!strcmp(matchAll("a*", ""), "0-0"));
+    CHECK(!strcmp(matchAll("x*", "ab"), "0-0 1-1 2-2"));
+    CHECK(!strcmp(matchAll("a", "banana"), "1-2 3-4 5-6"));
+    CHECK(!strcmp(matchAll("z", "banana"), ""));
+}
+
+static void testSet(void)
+{
+    // Members with no groups, two groups, none and a named one, so each
+    // wrapper sits at a different offset: groups 1, 2, 5 and 6
+    const char *patterns[] = { "foo", "(b)(a)r", "baz", "(?<n>q)x" };
+    const char *subjects[] = { "a foo", "a bar", "a baz", "a qx" };
+    const char *error = NULL;
+    int errorOffset = 0;
+    int errorIndex = 0;
+    lbmRegexScratch scratch;
+    lbmRegexSet *set;
+    int i;
+
+    set = lbmRegexSetCompile(patterns, 4, 0, &error, &errorOffset, &errorIndex);
+    CHECK(set != NULL);
+    if (!set)
+    {
+        return;
+    }
+    CHECK(set->groups[0] == 1);
+    CHECK(set->groups[1] == 2);
+    CHECK(set->groups[2] == 5);
+    CHECK(set->groups[3] == 6);
+    CHECK(set->captures[1] == 2);
+    CHECK(set->captures[3] == 1);
+
+    lbmRegexScratchInit(&scratch);
+    for (i = 0; i < 4; ++i)
+    {
+        int rc = lbmRegexExec(set->combined, &scratch, subjects[i], strlen(subjects[i]), 0, 0);
+        CHECK(rc > 0);
+        CHECK(lbmRegexSetWhich(set, rc) == i);
+        CHECK(scratch.ovector[0] == 2);
+    }
+
+    // The member's own groups follow its wrapper
+    CHECK(lbmRegexExec(set->combined, &scratch, "a bar", 5, 0, 0) == 5);
+    CHECK(scratch.ovector[(set->groups[1] + 1) * 2] == 2);
+    CHECK(scratch.ovector[(set->groups[1] + 2) * 2] == 3);
+
+    CHECK(lbmRegexExec(set->combined, &scratch, "nothing", 7, 0, 0) == 0);
+    lbmRegexScratchFree(&scratch);
+    lbmRegexSetDestroy(set);
+
+    // A member that doesn't compile is named; -1 only when they clash
+    set = lbmRegexSetCompile(patterns, 0, 0, &error, &errorOffset, &errorIndex);
+    CHECK(set != NULL);
+    if (set)
+    {
+        lbmRegexSetDestroy(set);
+    }
+    patterns[2] = "ba(z";
+    CHECK(lbmRegexSetCompile(patterns, 4, 0, &error, &errorOffset, &errorIndex) == NULL);
+    CHECK(errorIndex == 2);
+}
+
+static lbmRegex *cacheGet(lbmRegexCache *cache, const char *pattern)
+{
+    const char *error = NULL;
+    int errorOffset = 0;
+    return lbmRegexCacheGet(cache, pattern, strlen(pattern), 0, &error, &errorOffset);
+}
+
+static void testCache(void)
+{
+    lbmRegexCache cache;
+    lbmRegexScratch scratch;
+    lbmRegex *a;
+    lbmRegex *retained;
+
+    lbmRegexCacheInit(&cache, 2);
+
+    a = cacheGet(&cache, "a");
+    CHECK(a != NULL);
+    CHECK(cacheGet(&cache, "b") != NULL);
+    CHECK((cache.hits == 0) && (cache.misses == 2) && (cache.count == 2));
+
+    // Touching a makes b the oldest, so c pushes b out, not a
+    CHECK(cacheGet(&cache, "a") == a);
+    CHECK(cacheGet(&cache, "c") != NULL);
+    CHECK((cache.hits == 1) && (cache.misses == 3) && (cache.evictions == 1));
+    CHECK(cacheGet(&cache, "a") == a);
+    CHECK(cache.hits == 2);
+    CHECK(cacheGet(&cache, "b") != NULL);
+    CHECK((cache.misses == 4) && (cache.evictions == 2));
+    CHECK(cacheGet(&cache, "a") == a);
+    CHECK(cache.hits == 3);
+
+    // Same text, other flags: another entry
+    {
+        const char *error = NULL;
+        int errorOffset = 0;
+        lbmRegex *caseless = lbmRegexCacheGet(&cache, "a", 1, LBM_REGEX_CASELESS, &error, &errorOffset);
+        CHECK((caseless != NULL) && (caseless != a));
+        CHECK(cache.misses == 5);
+    }
+
+    // Patterns that don't compile count as misses but take no slot
+    CHECK(cacheGet(&cache, "(") == NULL);
+    CHECK((cache.misses == 6) && (cache.count == 2) && (cache.evictions == 3));
+
+    // A retained pattern outlives its eviction
+    retained = cacheGet(&cache, "x+");
+    lbmRegexRetain(retained);
+    cacheGet(&cache, "y");
+    cacheGet(&cache, "z");
+    CHECK(cache.count == 2);
+    CHECK(cacheGet(&cache, "x+") != retained);
+    lbmRegexScratchInit(&scratch);
+    CHECK(lbmRegexExec(retained, &scratch, "axxb", 4, 0, 0) == 1);
+    CHECK((scratch.ovector[0] == 1) && (scratch.ovector[1] == 3));
+    lbmRegexScratchFree(&scratch);
+    lbmRegexRelease(retained);
+
+    lbmRegexCacheFree(&cache);
+    CHECK(cache.count == 0);
+}
+
+int main(int argc, char * argv[])
+{
+    testFlags();
+    testNext();
+    testSet();
+    testCache();
+    return lbmTestReport("lbmRegex");
+}
@@ -0,0 +1,29 @@
+#ifndef LBMTEST_H
+#define LBMTEST_H
+
+// The harness every test in tests/ shares: CHECK() reports a failed
+// expectation with its file and line and carries on, and main() ends with
+// lbmTestReport(). Each test is a program of its own, so the counter is too.
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(EXPR) \
+    if (!(EXPR)) \
+    { \
+        printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #EXPR); \
+        ++failures; \
+    }
+
+// Says "<name>: all passed" if nothing failed. Returns the exit code for main().
+static int lbmTestReport(const char *name)
+{
+    if (!failures)
+    {
+        printf("%s: all passed\n", name);
+    }
+    return (failures) ? 1 : 0;
+}
+
+#endif
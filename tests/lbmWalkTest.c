@@ -0,0 +1,244 @@
+// Regression test of the walker: name and glob matching, a walk of a
+// scratch tree with ignores, globs and depth limits, and listing snapshots
+// being replayed only for directories that haven't changed and were read
+// in full.
+
+#include "lbmWalk.h"
+
+#include "lbmTest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define SCRATCH  "lbmWalkTest.tmp"
+#define SNAPSHOT "lbmWalkTest.snapshot" // outside the tree, so saving it changes no listing
+
+static const char *scratchDirs[] = { "", "/sub", "/sub/deep", "/skip" };
+static const char *scratchFiles[] = { "/a.c", "/b.h", "/.hidden", "/sub/c.c", "/sub/deep/d.c", "/skip/e.c" };
+
+#define COUNT(A) ((int)(sizeof(A) / sizeof((A)[0])))
+
+static int match(const char *pattern, const char *s)
+{
+    return lbmWalkMatch(pattern, strlen(pattern), s, strlen(s));
+}
+
+static int glob(const char *pattern, const char *path)
+{
+    return lbmGlobMatch(pattern, path, strlen(path));
+}
+
+static void testMatch(void)
+{
+    CHECK(match("*.c", "a.c"));
+    CHECK(match("*.c", ".c"));
+    CHECK(!match("*.c", "a.h"));
+    CHECK(match("a?c", "abc"));
+    CHECK(!match("a?c", "ac"));
+    CHECK(match("[ab]*", "beta"));
+    CHECK(!match("[!ab]*", "beta"));
+    CHECK(match("[a-c]x", "bx"));
+    CHECK(!match("[a-c]x", "dx"));
+    CHECK(match("*", ""));
+
+    CHECK(glob("**/*.c", "a.c"));
+    CHECK(glob("**/*.c", "x/y/a.c"));
+    CHECK(glob("src/**/*.c", "src/a.c"));
+    CHECK(glob("src/**/*.c", "src/x/a.c"));
+    CHECK(!glob("src/**/*.c", "lib/a.c"));
+    CHECK(!glob("src/*.c", "src/x/a.c"));
+    CHECK(glob("src/**", "src/x/y"));
+
+    CHECK(lbmGlobRootLength("src/**/*.c") == 3);
+    CHECK(lbmGlobRootLength("src/lib/*.c") == 7);
+    CHECK(lbmGlobRootLength("*.c") == 0);
+}
+
+// Directory mtimes are backdated past the snapshot's racy window, which
+// would otherwise refuse to replay them
+static void backdate(const char *path, int secondsAgo)
+{
+    struct utimbuf times;
+    times.actime = time(NULL) - secondsAgo;
+    times.modtime = times.actime;
+    utime(path, &times);
+}
+
+static void makeTree(void)
+{
+    char path[256];
+    int i;
+    for (i = 0; i < COUNT(scratchDirs); ++i)
+    {
+        snprintf(path, sizeof(path), SCRATCH "%s", scratchDirs[i]);
+        mkdir(path, 0777);
+    }
+    for (i = 0; i < COUNT(scratchFiles); ++i)
+    {
+        FILE *f;
+        snprintf(path, sizeof(path), SCRATCH "%s", scratchFiles[i]);
+        f = fopen(path, "wb");
+        if (f)
+        {
+            fclose(f);
+        }
+    }
+    for (i = 0; i < COUNT(scratchDirs); ++i)
+    {
+        snprintf(path, sizeof(path), SCRATCH "%s", scratchDirs[i]);
+        backdate(path, 100);
+    }
+}
+
+static void removeTree(void)
+{
+    char path[256];
+    int i;
+    for (i = 0; i < COUNT(scratchFiles); ++i)
+    {
+        snprintf(path, sizeof(path), SCRATCH "%s", scratchFiles[i]);
+        remove(path);
+    }
+    remove(SCRATCH "/sub/new.c");
+    remove(SCRATCH "/skip/new.c");
+    for (i = COUNT(scratchDirs) - 1; i >= 0; --i)
+    {
+        snprintf(path, sizeof(path), SCRATCH "%s", scratchDirs[i]);
+        rmdir(path);
+    }
+    remove(SNAPSHOT);
+}
+
+// Walks the scratch tree; returns the paths joined with spaces
+static const char *walk(lbmWalkOptions *opts, lbmWalkResult *result)
+{
+    static char joined[1024];
+    int i;
+    joined[0] = 0;
+    opts->relative = 1;
+    opts->threads = 2;
+    lbmWalk(SCRATCH, opts, result);
+    for (i = 0; i < result->count; ++i)
+    {
+        if (i)
+        {
+            strcat(joined, " ");
+        }
+        strcat(joined, result->paths[i]);
+    }
+    return joined;
+}
+
+static void testWalk(void)
+{
+    lbmWalkOptions opts;
+    lbmWalkResult result;
+    const char *ignore[] = { "skip", "*.h" };
+
+    lbmWalkOptionsInit(&opts);
+    CHECK(!strcmp(walk(&opts, &result), ".hidden a.c b.h skip/e.c sub/c.c sub/deep/d.c"));
+    lbmWalkResultFree(&result);
+
+    opts.hidden = 0;
+    opts.ignore = ignore;
+    opts.ignoreCount = 2;
+    CHECK(!strcmp(walk(&opts, &result), "a.c sub/c.c sub/deep/d.c"));
+    lbmWalkResultFree(&result);
+
+    opts.maxDepth = 1;
+    CHECK(!strcmp(walk(&opts, &result), "a.c sub/c.c"));
+    lbmWalkResultFree(&result);
+
+    lbmWalkOptionsInit(&opts);
+    opts.files = 0;
+    opts.dirs = 1;
+    CHECK(!strcmp(walk(&opts, &result), "skip sub sub/deep"));
+    lbmWalkResultFree(&result);
+
+    lbmWalkOptionsInit(&opts);
+    opts.glob = "sub/**/*.c";
+    CHECK(!strcmp(walk(&opts, &result), "sub/c.c sub/deep/d.c"));
+    lbmWalkResultFree(&result);
+}
+
+static void testSnapshot(void)
+{
+    lbmWalkOptions opts;
+    lbmWalkResult result;
+    FILE *f;
+
+    lbmWalkOptionsInit(&opts);
+    opts.snapshot = SNAPSHOT;
+    walk(&opts, &result);
+    CHECK(result.dirsRead == 4);
+    CHECK(result.dirsCached == 0);
+    lbmWalkResultFree(&result);
+
+    CHECK(!strcmp(walk(&opts, &result), ".hidden a.c b.h skip/e.c sub/c.c sub/deep/d.c"));
+    CHECK(result.dirsRead == 0);
+    CHECK(result.dirsCached == 4);
+    lbmWalkResultFree(&result);
+
+    // Only the directory that changed is read again
+    f = fopen(SCRATCH "/sub/new.c", "wb");
+    if (f)
+    {
+        fclose(f);
+    }
+    backdate(SCRATCH "/sub", 50);
+    CHECK(!strcmp(walk(&opts, &result), ".hidden a.c b.h skip/e.c sub/c.c sub/deep/d.c sub/new.c"));
+    CHECK(result.dirsRead == 1);
+    CHECK(result.dirsCached == 3);
+    lbmWalkResultFree(&result);
+}
+
+// A directory that can't be opened lists as empty, and that listing must
+// not be replayed once it can be. Root opens anything, so this only runs
+// for other users.
+static void testUnreadable(void)
+{
+    lbmWalkOptions opts;
+    lbmWalkResult result;
+    FILE *f;
+
+    if (geteuid() == 0)
+    {
+        return;
+    }
+    lbmWalkOptionsInit(&opts);
+    opts.snapshot = SNAPSHOT;
+
+    // Change skip so its snapshot listing is stale, then lock it
+    f = fopen(SCRATCH "/skip/new.c", "wb");
+    if (f)
+    {
+        fclose(f);
+    }
+    backdate(SCRATCH "/skip", 40);
+    chmod(SCRATCH "/skip", 0);
+    CHECK(!strcmp(walk(&opts, &result), ".hidden a.c b.h sub/c.c sub/deep/d.c sub/new.c"));
+    lbmWalkResultFree(&result);
+
+    chmod(SCRATCH "/skip", 0777);
+    CHECK(!strcmp(walk(&opts, &result), ".hidden a.c b.h skip/e.c skip/new.c sub/c.c sub/deep/d.c sub/new.c"));
+    CHECK(result.dirsRead == 1);
+    lbmWalkResultFree(&result);
+}
+
+int main(int argc, char * argv[])
+{
+    testMatch();
+    removeTree();
+    makeTree();
+    testWalk();
+    testSnapshot();
+    testUnreadable();
+    removeTree();
+
+    return lbmTestReport("lbmWalk");
+}